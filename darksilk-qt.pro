@@ -113,7 +113,7 @@ INCLUDEPATH += src/secp256k1/include
 LIBS += $$PWD/src/secp256k1/src/libsecp256k1_la-secp256k1.o
 !win32 {
     # we use QMAKE_CXXFLAGS_RELEASE even without RELEASE=1 because we use RELEASE to indicate linking preferences not -O preferences
-    gensecp256k1.commands = cd $$PWD/src/secp256k1 && ./autogen.sh && ./configure --disable-shared --with-pic --with-bignum=no --enable-module-recovery && CC=$$QMAKE_CC CXX=$$QMAKE_CXX $(MAKE) OPT=\"$$QMAKE_CXXFLAGS $$QMAKE_CXXFLAGS_RELEASE\"
+    gensecp256k1.commands = cd $$PWD/src/secp256k1 && ./autogen.sh && ./configure --disable-shared --with-pic --with-bignum=no --enable-module-recovery --enable-module-ecdh && CC=$$QMAKE_CC CXX=$$QMAKE_CXX $(MAKE) OPT=\"$$QMAKE_CXXFLAGS $$QMAKE_CXXFLAGS_RELEASE\"
 } else {
     #Windows ???
 }
@@ -228,6 +228,7 @@ HEADERS +=  src/qt/darksilkgui.h \
             src/chainparams.h \
             src/chainparamsseeds.h \
             src/checkpoints.h \
+            src/checkqueue.h \
             src/cleanse.h \
             src/compat.h \
             src/coincontrol.h \
@@ -456,6 +457,9 @@ SOURCES +=  src/qt/darksilk.cpp src/qt/darksilkgui.cpp \
             src/crypto/ripemd160.cpp \
             src/crypto/sha1.cpp \
             src/crypto/sha256.cpp \
+            src/crypto/sha256_avx2.cpp \
+            src/crypto/sha256_shani.cpp \
+            src/crypto/sha256_sse41.cpp \
             src/crypto/sha512.cpp \
             src/qt/stormnodemanager.cpp \
             src/qt/addeditstormnode.cpp \
@@ -279,7 +279,7 @@ bool CActiveStormnode::Register(CTxIn vin, CService service, CKey keyCollateralA
         CStormnode sn(snb);
         snodeman.Add(sn);
     } else {
-        psn->UpdateFromNewBroadcast(snb);
+        snodeman.UpdateFromNewBroadcast(psn, snb);
     }
 
     //send to all peers
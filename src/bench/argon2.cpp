@@ -0,0 +1,48 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "hash.h"
+#include "primitives/block.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Per-hash cost of each block compression on one thread, and of the
+// batch API across all cores
+static void argon2d_hashes()
+{
+    const int nHeaders = 200;
+    vector<CBlockHeader> vHeaders(nHeaders);
+    for (int i = 0; i < nHeaders; i++)
+    {
+        vHeaders[i].nVersion = 7;
+        vHeaders[i].nTime = 1450000000 + i;
+        vHeaders[i].nBits = 0x1e0fffff;
+        vHeaders[i].nNonce = i;
+    }
+
+    for (int fHardware = 0; fHardware <= 1; fHardware++)
+    {
+        string strImpl = argon2_select_impl(fHardware);
+        int64_t nStart = GetTimeMicros();
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+            header.GetPoWArgonHash();
+        int64_t nElapsed = benchmark::Elapsed(nStart);
+        benchmark::Report(strprintf("%s: %.1fus/hash", strImpl, (double)nElapsed / nHeaders));
+    }
+
+    vector<uint256> vHashes;
+    int64_t nStart = GetTimeMicros();
+    GetPoWArgonHashes(vHeaders, vHashes);
+    int64_t nElapsed = benchmark::Elapsed(nStart);
+    benchmark::Report(strprintf("batch (%d threads): %.1fus/hash", boost::thread::hardware_concurrency(),
+                                (double)nElapsed / nHeaders));
+}
+
+BENCHMARK(argon2d_hashes);
@@ -0,0 +1,54 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "util.h"
+
+#include <stdio.h>
+
+namespace benchmark {
+
+static std::string strRunning;
+
+BenchRunner::BenchmarkMap& BenchRunner::Benchmarks()
+{
+    static BenchmarkMap benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const std::string& strName, BenchFunction func)
+{
+    Benchmarks().insert(std::make_pair(strName, func));
+}
+
+int BenchRunner::RunAll(const std::string& strFilter)
+{
+    int nRun = 0;
+    for (BenchmarkMap::const_iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        if (it->first.compare(0, strFilter.size(), strFilter) != 0)
+            continue;
+        strRunning = it->first;
+        int64_t nStart = GetTimeMicros();
+        it->second();
+        printf("%s: done in %.2fms\n", strRunning.c_str(), 0.001 * (GetTimeMicros() - nStart));
+        nRun++;
+    }
+    strRunning.clear();
+    return nRun;
+}
+
+void Report(const std::string& strResult)
+{
+    printf("%s: %s\n", strRunning.c_str(), strResult.c_str());
+    fflush(stdout);
+}
+
+int64_t Elapsed(int64_t nStart)
+{
+    return std::max(GetTimeMicros() - nStart, (int64_t)1);
+}
+
+}
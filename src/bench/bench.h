@@ -0,0 +1,47 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef DARKSILK_BENCH_BENCH_H
+#define DARKSILK_BENCH_BENCH_H
+
+#include <map>
+#include <string>
+
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/**
+ * Minimal benchmark harness. Each benchmark is a function that sets up its
+ * own inputs, times the interesting part and reports the rates with
+ * benchmark::Report. Benchmarks register themselves with BENCHMARK(name)
+ * and are all run by bench_darksilk, optionally filtered by name prefix.
+ */
+namespace benchmark {
+
+typedef void (*BenchFunction)();
+
+class BenchRunner
+{
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& Benchmarks();
+
+public:
+    BenchRunner(const std::string& strName, BenchFunction func);
+
+    // Runs every benchmark whose name starts with strFilter, returns the number run
+    static int RunAll(const std::string& strFilter);
+};
+
+/** Prints one result line for the running benchmark */
+void Report(const std::string& strResult);
+
+/** Elapsed microseconds since nStart, never zero so rates can be divided out */
+int64_t Elapsed(int64_t nStart);
+
+}
+
+#define BENCHMARK(n) \
+    static benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // DARKSILK_BENCH_BENCH_H
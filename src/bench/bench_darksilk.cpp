@@ -0,0 +1,23 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "util.h"
+
+#include <stdio.h>
+
+int main(int argc, char* argv[])
+{
+    fPrintToDebugLog = false;
+
+    std::string strFilter = argc > 1 ? argv[1] : "";
+    int nRun = benchmark::BenchRunner::RunAll(strFilter);
+    if (nRun == 0)
+    {
+        fprintf(stderr, "No benchmark matches \"%s\"\n", strFilter.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "kernel.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// One kernel at a time through CheckStakeKernelHash(), as the staker used to,
+// against the midstate search on one thread and on every core
+static void kernel_search()
+{
+    const unsigned int nTime = 1450000000 & ~STAKE_TIMESTAMP_MASK;
+    CBlockIndex indexPrev;
+    indexPrev.bnStakeModifierV2 = GetRandHash();
+    const unsigned int nInterval = 60;
+    vector<CStakeKernelInput> vInputs(1000);
+    for (unsigned int i = 0; i < vInputs.size(); i++)
+    {
+        vInputs[i].prevout = COutPoint(GetRandHash(), i % 3);
+        vInputs[i].nTimeTxPrev = nTime - 100000 + i;
+        vInputs[i].nTimeBlockFrom = nTime - 100000;
+        vInputs[i].nValue = COIN * (1 + i % 5);
+    }
+    uint64_t nCandidates = vInputs.size() * nInterval;
+
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(const CStakeKernelInput& input, vInputs)
+    {
+        CTransaction txPrev;
+        txPrev.nTime = input.nTimeTxPrev;
+        txPrev.vout.resize(input.prevout.n + 1, CTxOut(input.nValue, CScript()));
+        for (unsigned int n = 0; n < nInterval; n++)
+        {
+            uint256 hashProofOfStake, targetProofOfStake;
+            CheckStakeKernelHash(&indexPrev, 0, input.nTimeBlockFrom, txPrev, input.prevout, nTime - n, hashProofOfStake, targetProofOfStake);
+        }
+    }
+    int64_t nSerial = benchmark::Elapsed(nStart);
+
+    unsigned int nTimeKernel;
+    uint64_t nHashes;
+    nStart = GetTimeMicros();
+    assert(SearchStakeKernels(&indexPrev, 0, nTime, nInterval, vInputs, nTimeKernel, nHashes, 1) == -1);
+    int64_t nSingle = benchmark::Elapsed(nStart);
+
+    nStart = GetTimeMicros();
+    assert(SearchStakeKernels(&indexPrev, 0, nTime, nInterval, vInputs, nTimeKernel, nHashes) == -1);
+    int64_t nThreaded = benchmark::Elapsed(nStart);
+
+    benchmark::Report(strprintf("%u kernels: serial %.0f/s, midstate %.0f/s, %d threads %.0f/s", nCandidates,
+                                1000000.0 * nCandidates / nSerial, 1000000.0 * nCandidates / nSingle,
+                                boost::thread::hardware_concurrency(), 1000000.0 * nCandidates / nThreaded));
+}
+
+BENCHMARK(kernel_search);
@@ -0,0 +1,38 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "key.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// The checksum-less key records of a synthetic 100k-key wallet, checked one
+// by one as LoadWallet() used to and across all cores as it does now
+static void key_verify_pairs()
+{
+    const int nKeys = 100000;
+    vector<pair<CKey, CPubKey> > vKeys(nKeys);
+    for (int i = 0; i < nKeys; i++)
+    {
+        vKeys[i].first.MakeNewKey(true);
+        vKeys[i].second = vKeys[i].first.GetPubKey();
+    }
+
+    int64_t nStart = GetTimeMicros();
+    assert(VerifyKeyPairs(vKeys, 1));
+    int64_t nSerial = benchmark::Elapsed(nStart);
+
+    nStart = GetTimeMicros();
+    assert(VerifyKeyPairs(vKeys));
+    int64_t nParallel = benchmark::Elapsed(nStart);
+
+    benchmark::Report(strprintf("%d keys: serial %.2fms, parallel (%d threads) %.2fms", nKeys,
+                                0.001 * nSerial, boost::thread::hardware_concurrency(), 0.001 * nParallel));
+}
+
+BENCHMARK(key_verify_pairs);
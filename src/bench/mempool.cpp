@@ -0,0 +1,106 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "main.h"
+#include "checkqueue.h"
+#include "keystore.h"
+#include "script.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Number of synthetic transactions and inputs per transaction used for the throughput run
+#define BENCH_TXS 200
+#define BENCH_INPUTS 8
+
+// Creates one funding transaction paying nTx * nIn outputs to fresh keys and
+// nTx transactions spending them, nIn inputs each.
+static void CreateSpends(int nTx, int nIn, CTransaction& txFrom, vector<CTransaction>& vSpends)
+{
+    CBasicKeyStore keystore;
+    txFrom.vout.resize(nTx * nIn);
+    for (int i = 0; i < nTx * nIn; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        txFrom.vout[i].nValue = COIN;
+        txFrom.vout[i].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+
+    vSpends.resize(nTx);
+    for (int t = 0; t < nTx; t++)
+    {
+        CTransaction& tx = vSpends[t];
+        tx.vin.resize(nIn);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = nIn * COIN;
+        tx.vout[0].scriptPubKey = txFrom.vout[0].scriptPubKey;
+        for (int i = 0; i < nIn; i++)
+        {
+            tx.vin[i].prevout.hash = txFrom.GetHash();
+            tx.vin[i].prevout.n = t * nIn + i;
+        }
+        for (int i = 0; i < nIn; i++)
+            SignSignature(keystore, txFrom.vout[t * nIn + i].scriptPubKey, tx, i);
+    }
+}
+
+static void AddChecks(const CTransaction& txFrom, const CTransaction& tx, vector<CScriptCheck>& vChecks)
+{
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vChecks.push_back(CScriptCheck(txFrom.vout[tx.vin[i].prevout.n], tx, i, STANDARD_SCRIPT_VERIFY_FLAGS));
+}
+
+// The script stage of mempool acceptance, which is where almost all of
+// AcceptToMemoryPool's time goes, serially and across the check queue.
+static void mempool_script_checks()
+{
+    // Separate transaction sets so the second run can't hit the signature cache
+    CTransaction txFrom, txFrom2;
+    vector<CTransaction> vSpends, vSpends2;
+    CreateSpends(BENCH_TXS, BENCH_INPUTS, txFrom, vSpends);
+    CreateSpends(BENCH_TXS, BENCH_INPUTS, txFrom2, vSpends2);
+
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTransaction& tx, vSpends)
+    {
+        vector<CScriptCheck> vChecks;
+        AddChecks(txFrom, tx, vChecks);
+        BOOST_FOREACH(const CScriptCheck& check, vChecks)
+            assert(check());
+    }
+    int64_t nSerial = benchmark::Elapsed(nStart);
+    benchmark::Report(strprintf("serial: %d tx x %d inputs in %.2fms (%.1f tx/s)", BENCH_TXS, BENCH_INPUTS,
+                                0.001 * nSerial, BENCH_TXS * 1000000.0 / nSerial));
+
+    int nThreads = std::max(2, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+    CCheckQueue<CScriptCheck> queue(128);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTransaction& tx, vSpends2)
+    {
+        vector<CScriptCheck> vChecks;
+        AddChecks(txFrom2, tx, vChecks);
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        control.Add(vChecks);
+        assert(control.Wait());
+    }
+    int64_t nQueued = benchmark::Elapsed(nStart);
+    benchmark::Report(strprintf("queued (%d threads): %d tx x %d inputs in %.2fms (%.1f tx/s)", nThreads, BENCH_TXS, BENCH_INPUTS,
+                                0.001 * nQueued, BENCH_TXS * 1000000.0 / nQueued));
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BENCHMARK(mempool_script_checks);
@@ -0,0 +1,51 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "primitives/block.h"
+#include "scrypt.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Single-lane generic and dispatched cores, the batch API on one thread, and
+// the parallel header verifier
+static void scrypt_hashes()
+{
+    const int nCount = 256;
+    vector<CBlockHeader> vHeaders(nCount);
+    vector<const void*> vInputs;
+    for (int i = 0; i < nCount; i++)
+    {
+        vHeaders[i].nVersion = 1;
+        vHeaders[i].nTime = 1450000000 + i;
+        vHeaders[i].nBits = 0x1e0fffff;
+        vHeaders[i].nNonce = i * 7919;
+        vInputs.push_back(CVOIDBEGIN(vHeaders[i].nVersion));
+    }
+    vector<uint256> vHashes(nCount);
+
+    for (int fHardware = 0; fHardware <= 1; fHardware++)
+    {
+        string strImpl = scrypt_select_impl(fHardware);
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nCount; i++)
+            vHashes[i] = scrypt_blockhash(vInputs[i]);
+        benchmark::Report(strprintf("%s single: %.1fus/hash", strImpl, (double)benchmark::Elapsed(nStart) / nCount));
+    }
+
+    int64_t nStart = GetTimeMicros();
+    scrypt_blockhash_batch(&vInputs[0], &vHashes[0], nCount);
+    benchmark::Report(strprintf("batch: %.1fus/hash", (double)benchmark::Elapsed(nStart) / nCount));
+
+    nStart = GetTimeMicros();
+    GetPoWHashes(vHeaders, vHashes);
+    benchmark::Report(strprintf("parallel (%d threads): %.1fus/hash", boost::thread::hardware_concurrency(),
+                                (double)benchmark::Elapsed(nStart) / nCount));
+}
+
+BENCHMARK(scrypt_hashes);
@@ -0,0 +1,40 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "util.h"
+
+using namespace std;
+
+// Compares the portable transform with whatever the CPU dispatch picks, for
+// both the streaming hasher and the 64-byte batch used by the merkle tree.
+static void sha256_double64()
+{
+    const int nIter = 20000;
+    vector<unsigned char> in(64 * nIter), out(32 * nIter);
+    for (unsigned int i = 0; i < in.size(); i++)
+        in[i] = i;
+
+    for (int fHardware = 0; fHardware <= 1; fHardware++)
+    {
+        string strImpl = SHA256AutoDetect(fHardware);
+
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nIter; i++)
+            CHash256().Write(&in[64 * i], 64).Finalize(&out[32 * i]);
+        int64_t nStream = benchmark::Elapsed(nStart);
+
+        nStart = GetTimeMicros();
+        SHA256D64(&out[0], &in[0], nIter);
+        int64_t nBatch = benchmark::Elapsed(nStart);
+
+        benchmark::Report(strprintf("%s: %d double-SHA256 of 64 bytes, streaming %.2fms, batched %.2fms",
+                                    strImpl, nIter, 0.001 * nStream, 0.001 * nBatch));
+    }
+}
+
+BENCHMARK(sha256_double64);
@@ -0,0 +1,55 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "smessage.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Proof of work for a batch of messages on one thread and on every core. The
+// work per message is down to luck, so rates come from the hash counts.
+static void smsg_pow()
+{
+    const int nMessages = 8;
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<uint8_t> vchPayload(300);
+    for (unsigned int i = 0; i < vchPayload.size(); i++)
+        vchPayload[i] = i * 31 + 7;
+
+    vector<int> vThreads(1, 1);
+    if (boost::thread::hardware_concurrency() > 1)
+        vThreads.push_back(boost::thread::hardware_concurrency());
+
+    BOOST_FOREACH(int nThreads, vThreads)
+    {
+        SecMsgPowStats statsBefore, statsAfter;
+        SecureMsgGetPowStats(statsBefore);
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nMessages; i++)
+        {
+            vector<uint8_t> vchHeader(SMSG_HDR_LEN, 0);
+            SecureMessage *psmsg = (SecureMessage*) &vchHeader[0];
+            psmsg->version[0] = 1;
+            psmsg->timestamp = 1450000000 + nThreads * nMessages + i;
+            psmsg->nPayload = vchPayload.size();
+            assert(SecureMsgSetHash(&vchHeader[0], &vchPayload[0], vchPayload.size(), nThreads) == 0);
+        }
+        int64_t nElapsed = benchmark::Elapsed(nStart);
+        SecureMsgGetPowStats(statsAfter);
+
+        benchmark::Report(strprintf("%d messages on %d threads: %.1fms/message, %.0f hashes/s", nMessages, nThreads,
+                                    0.001 * nElapsed / nMessages, (statsAfter.nHashes - statsBefore.nHashes) * 1000000.0 / nElapsed));
+    }
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+BENCHMARK(smsg_pow);
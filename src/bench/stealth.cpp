@@ -0,0 +1,57 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "stealth.h"
+#include "util.h"
+
+using namespace std;
+
+static ec_point MakePoint(ec_secret& secret)
+{
+    ec_point point;
+    assert(GenerateRandomSecret(secret) == 0);
+    assert(SecretToPublicKey(secret, point) == 0);
+    return point;
+}
+
+// Recipient side of FindStealthTransactions: every stealth output checked
+// against every owned stealth address, one key at a time and batched
+static void stealth_scan()
+{
+    const int nTxs = 200;
+    const int nKeys = 4;
+    ec_secret secret;
+    vector<ec_secret> vScanSecrets;
+    vector<ec_point> vSpendPubkeys, vEphemPubkeys;
+    for (int i = 0; i < nKeys; i++)
+    {
+        MakePoint(secret);
+        vScanSecrets.push_back(secret);
+        vSpendPubkeys.push_back(MakePoint(secret));
+    }
+    for (int i = 0; i < nTxs; i++)
+        vEphemPubkeys.push_back(MakePoint(secret));
+
+    ec_secret shared;
+    ec_point pkOut;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nTxs; i++)
+        for (int k = 0; k < nKeys; k++)
+            StealthSecret(vScanSecrets[k], vEphemPubkeys[i], vSpendPubkeys[k], shared, pkOut);
+    int64_t nSingle = benchmark::Elapsed(nStart);
+
+    vector<ec_secret> vShared;
+    vector<ec_point> vPkOut;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nTxs; i++)
+        StealthSecretBatch(vEphemPubkeys[i], vScanSecrets, vSpendPubkeys, vShared, vPkOut);
+    int64_t nBatch = benchmark::Elapsed(nStart);
+
+    benchmark::Report(strprintf("%d stealth txs x %d addresses: single %.1f tx/s, batched %.1f tx/s", nTxs, nKeys,
+                                nTxs * 1000000.0 / nSingle, nTxs * 1000000.0 / nBatch));
+}
+
+BENCHMARK(stealth_scan);
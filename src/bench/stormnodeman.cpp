@@ -0,0 +1,146 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "main.h"
+#include "stormnodeman.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+static CPubKey RandomPubKey()
+{
+    vector<unsigned char> vch(33);
+    GetRandBytes(&vch[0], vch.size());
+    vch[0] = 0x02;
+    return CPubKey(vch);
+}
+
+static CStormnode MakeStormnode(int n)
+{
+    CStormnode sn;
+    sn.vin = CTxIn(COutPoint(GetRandHash(), n % 2));
+    sn.pubkey = RandomPubKey();
+    sn.pubkey2 = RandomPubKey();
+    return sn;
+}
+
+// Lookups of every node in a 5,000 node list against the linear scans Find() used to do
+static void stormnode_find()
+{
+    const int nNodes = 5000;
+    CStormnodeMan snman;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nNodes; i++)
+    {
+        CStormnode sn = MakeStormnode(i);
+        snman.Add(sn);
+    }
+    int64_t nAdd = benchmark::Elapsed(nStart);
+    assert(snman.size() == nNodes);
+
+    vector<CStormnode> vNodes = snman.GetFullStormnodeVector();
+    vector<CScript> vPayees;
+    BOOST_FOREACH(CStormnode& sn, vNodes)
+        vPayees.push_back(GetScriptForDestination(sn.pubkey.GetID()));
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nNodes; i++)
+    {
+        assert(snman.Find(vNodes[i].vin) != NULL);
+        assert(snman.Find(vNodes[i].pubkey2) != NULL);
+        assert(snman.Find(vPayees[i]) != NULL);
+    }
+    int64_t nIndexed = benchmark::Elapsed(nStart);
+
+    // The old scans are quadratic over the list, time a sample of them
+    const int nSample = 100;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nSample; i++)
+    {
+        int k = (i * 7919) % nNodes;
+        int nFound = 0;
+        BOOST_FOREACH(CStormnode& sn, vNodes)
+            if (sn.vin.prevout == vNodes[k].vin.prevout) { nFound++; break; }
+        BOOST_FOREACH(CStormnode& sn, vNodes)
+            if (sn.pubkey2 == vNodes[k].pubkey2) { nFound++; break; }
+        BOOST_FOREACH(CStormnode& sn, vNodes)
+            if (GetScriptForDestination(sn.pubkey.GetID()) == vPayees[k]) { nFound++; break; }
+        assert(nFound == 3);
+    }
+    int64_t nLinear = benchmark::Elapsed(nStart);
+
+    benchmark::Report(strprintf("%d stormnodes: added in %dus, indexed lookups %.0f/s, linear lookups %.0f/s", nNodes, nAdd,
+                                3000000.0 * nNodes / nIndexed, 3000000.0 * nSample / nLinear));
+}
+
+// A chain of nBlocks headers with random hashes as the best chain, for the scores
+class CBenchChain
+{
+public:
+    vector<uint256> vHashes;
+    vector<CBlockIndex> vIndex;
+
+    CBenchChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++)
+        {
+            vHashes[i] = GetRandHash();
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].nHeight = i;
+            vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        }
+        mapCacheBlockHashes.clear();
+        pindexBest = &vIndex.back();
+    }
+
+    ~CBenchChain()
+    {
+        pindexBest = NULL;
+        mapCacheBlockHashes.clear();
+    }
+};
+
+// Payment votes check the voter's rank, one at a time as GetStormnodeRank used to
+// score every node on each call and through the cached ranking
+static void stormnode_rank()
+{
+    CBenchChain chain(20);
+    const int nNodes = 5000;
+    const int nVotes = 1000;
+    CStormnodeMan snman;
+    for (int i = 0; i < nNodes; i++)
+    {
+        CStormnode sn = MakeStormnode(i);
+        snman.Add(sn);
+    }
+    vector<CStormnode> vNodes = snman.GetFullStormnodeVector();
+
+    const int nScanVotes = 5;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nScanVotes; i++)
+    {
+        int64_t nScore = vNodes[i].CalculateScore(1, 10).GetCompact(false);
+        int nHigher = 0;
+        BOOST_FOREACH(CStormnode& sn, vNodes)
+            if (sn.CalculateScore(1, 10).GetCompact(false) > nScore)
+                nHigher++;
+        assert(nHigher < nNodes);
+    }
+    int64_t nScan = benchmark::Elapsed(nStart);
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nVotes; i++)
+        assert(snman.GetStormnodeRank(vNodes[i % nNodes].vin, 10, 0, false) > 0);
+    int64_t nCached = benchmark::Elapsed(nStart);
+
+    benchmark::Report(strprintf("%d stormnodes: scored on every vote %.0f votes/s, cached ranking %.0f votes/s", nNodes,
+                                1000000.0 * nScanVotes / nScan, 1000000.0 * nVotes / nCached));
+}
+
+BENCHMARK(stormnode_find);
+BENCHMARK(stormnode_rank);
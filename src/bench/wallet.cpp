@@ -0,0 +1,87 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "main.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <cmath>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+static CWallet wallet;
+static vector<COutput> vCoins;
+
+static void add_coin(CAmount nValue)
+{
+    static int i;
+    CTransaction tx;
+    tx.nLockTime = i++;        // so all transactions get different hashes
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    CWalletTx* wtx = new CWalletTx(&wallet, tx);
+    vCoins.push_back(COutput(wtx, 0, 6*24, true));
+}
+
+static void empty_wallet()
+{
+    BOOST_FOREACH(COutput output, vCoins)
+        delete output.tx;
+    vCoins.clear();
+}
+
+// Deterministic UTXO sets, so runs can be compared: selection latency and the
+// fee and change the chosen inputs imply
+static void wallet_coin_selection()
+{
+    const int nCoins = 10000;
+    const int nTargets = 20;
+    CAmount nDust = 3 * ::minRelayTxFee.GetFee(34 + 148);
+    const char* pszDist[] = { "uniform", "small", "denominations" };
+
+    for (int nDist = 0; nDist < 3; nDist++)
+    {
+        empty_wallet();
+        uint32_t nSeed = 12345;
+        for (int i = 0; i < nCoins; i++)
+        {
+            nSeed = nSeed * 1103515245 + 12345;
+            CAmount nValue;
+            if (nDist == 0)
+                nValue = CENT / 10 + (nSeed >> 8) % (10 * COIN);
+            else if (nDist == 1)
+                nValue = CENT / 10 + (nSeed >> 8) % (nSeed % 7 == 0 ? COIN : CENT);
+            else
+                nValue = (CENT / 10) * (CAmount)pow(10.0, (double)((nSeed >> 8) % 5)) + 1;
+            add_coin(nValue);
+        }
+
+        set<pair<const CWalletTx*,unsigned int> > setCoinsRet;
+        CAmount nValueRet, nFees = 0;
+        int nInputs = 0, nNoChange = 0;
+        int64_t nStart = GetTimeMicros();
+        for (int t = 0; t < nTargets; t++)
+        {
+            nSeed = nSeed * 1103515245 + 12345;
+            CAmount nTarget = CENT + (nSeed >> 8) % (20 * COIN);
+            assert(wallet.SelectCoinsMinConf(nTarget, GetTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
+            bool fChange = nValueRet - nTarget >= nDust;
+            unsigned int nBytes = 10 + 148 * setCoinsRet.size() + 34 * (fChange ? 2 : 1);
+            nFees += MIN_TX_FEE * (1 + nBytes / 1000);
+            nInputs += setCoinsRet.size();
+            nNoChange += !fChange;
+        }
+        int64_t nElapsed = benchmark::Elapsed(nStart);
+        benchmark::Report(strprintf("%s: %d coins, %.2fms/selection, %.1f inputs, fee %s, %d/%d without change",
+                                    pszDist[nDist], nCoins, 0.001 * nElapsed / nTargets, (double)nInputs / nTargets,
+                                    FormatMoney(nFees / nTargets), nNoChange, nTargets));
+    }
+    empty_wallet();
+}
+
+BENCHMARK(wallet_coin_selection);
@@ -0,0 +1,34 @@
+// Copyright (c) 2015-2016 Silk Network
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+
+#include "db.h"
+#include "util.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+using namespace std;
+
+// Keys for the pool made across all cores and stored in one batch, against
+// an in-memory database so only generation and serialization are timed
+static void walletdb_keypool_topup()
+{
+    const unsigned int nKeys = 2000;
+    const string strWallet = "walletdb_bench.dat";
+    if (!bitdb.IsMock())
+        bitdb.MakeMock();
+    CWalletDB(strWallet, "cr+");
+
+    CWallet wallet(strWallet);
+    LOCK(wallet.cs_wallet);
+    int64_t nStart = GetTimeMicros();
+    assert(wallet.TopUpKeyPool(nKeys));
+    int64_t nElapsed = benchmark::Elapsed(nStart);
+    assert(wallet.GetKeyPoolSize() == nKeys + 1);
+
+    benchmark::Report(strprintf("keypool top-up of %u keys: %.2fms (%.1fus/key)", nKeys, 0.001 * nElapsed, (double)nElapsed / nKeys));
+}
+
+BENCHMARK(walletdb_keypool_topup);
@@ -344,6 +344,14 @@ int verify_i(argon2_context *context, const char *hash);
  */
 const char *error_message(int error_code);
 
+/*
+ * Select the block compression used when filling memory. With hardware set,
+ * the AVX2 path is used if the CPU and OS support it; otherwise the SSE2 path.
+ * Both produce identical output.
+ * @return  The name of the selected implementation
+ */
+const char *argon2_select_impl(int hardware);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -21,6 +21,17 @@
 #include "blake2/blake2.h"
 #include "blake2/blamka-round-opt.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&         \
+    (defined(__clang__) || __GNUC__ > 4 ||                                     \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define ARGON2_USE_AVX2
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+/* Set by argon2_select_impl(); SSE2 until then */
+static int use_avx2 = 0;
+
 void fill_block(__m128i *state, const uint8_t *ref_block, uint8_t *next_block) {
     __m128i block_XY[ARGON2_OWORDS_IN_BLOCK];
     uint32_t i;
@@ -48,6 +59,144 @@ void fill_block(__m128i *state, const uint8_t *ref_block, uint8_t *next_block) {
     }
 }
 
+#ifdef ARGON2_USE_AVX2
+static AVX2_TARGET __m256i fBlaMka_avx2(__m256i x, __m256i y) {
+    const __m256i z = _mm256_mul_epu32(x, y);
+    return _mm256_add_epi64(_mm256_add_epi64(x, y), _mm256_add_epi64(z, z));
+}
+
+#define ror64_32_avx2(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ror64_24_avx2(x) _mm256_shuffle_epi8((x), r24_avx2)
+#define ror64_16_avx2(x) _mm256_shuffle_epi8((x), r16_avx2)
+#define ror64_63_avx2(x)                                                       \
+    _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+/*
+ * One BLAKE2 round over two independent 128-byte rows at once, one per
+ * 128-bit lane. v[] holds A0, A1, B0, B1, C0, C1, D0, D1 exactly as the SSE2
+ * BLAKE2_ROUND takes them; every operation used here stays within its lane.
+ */
+static AVX2_TARGET void blake2_round_avx2(__m256i *v) {
+    const __m256i r16_avx2 = _mm256_setr_epi8(
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24_avx2 = _mm256_setr_epi8(
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i t0, t1;
+    int half;
+
+    for (half = 0; half < 2; ++half) {
+        /* G1 */
+        v[0] = fBlaMka_avx2(v[0], v[2]);
+        v[1] = fBlaMka_avx2(v[1], v[3]);
+        v[6] = ror64_32_avx2(_mm256_xor_si256(v[6], v[0]));
+        v[7] = ror64_32_avx2(_mm256_xor_si256(v[7], v[1]));
+        v[4] = fBlaMka_avx2(v[4], v[6]);
+        v[5] = fBlaMka_avx2(v[5], v[7]);
+        v[2] = ror64_24_avx2(_mm256_xor_si256(v[2], v[4]));
+        v[3] = ror64_24_avx2(_mm256_xor_si256(v[3], v[5]));
+
+        /* G2 */
+        v[0] = fBlaMka_avx2(v[0], v[2]);
+        v[1] = fBlaMka_avx2(v[1], v[3]);
+        v[6] = ror64_16_avx2(_mm256_xor_si256(v[6], v[0]));
+        v[7] = ror64_16_avx2(_mm256_xor_si256(v[7], v[1]));
+        v[4] = fBlaMka_avx2(v[4], v[6]);
+        v[5] = fBlaMka_avx2(v[5], v[7]);
+        v[2] = ror64_63_avx2(_mm256_xor_si256(v[2], v[4]));
+        v[3] = ror64_63_avx2(_mm256_xor_si256(v[3], v[5]));
+
+        /* Diagonalize after the first half, undiagonalize after the second */
+        t0 = v[4];
+        v[4] = v[5];
+        v[5] = t0;
+        if (half == 0) {
+            t0 = _mm256_alignr_epi8(v[3], v[2], 8);
+            t1 = _mm256_alignr_epi8(v[2], v[3], 8);
+            v[2] = t0;
+            v[3] = t1;
+            t0 = _mm256_alignr_epi8(v[7], v[6], 8);
+            t1 = _mm256_alignr_epi8(v[6], v[7], 8);
+            v[6] = t1;
+            v[7] = t0;
+        } else {
+            t0 = _mm256_alignr_epi8(v[2], v[3], 8);
+            t1 = _mm256_alignr_epi8(v[3], v[2], 8);
+            v[2] = t0;
+            v[3] = t1;
+            t0 = _mm256_alignr_epi8(v[6], v[7], 8);
+            t1 = _mm256_alignr_epi8(v[7], v[6], 8);
+            v[6] = t1;
+            v[7] = t0;
+        }
+    }
+}
+
+/* Same permutation as fill_block, computing two rows or two columns per
+ * round */
+static AVX2_TARGET void fill_block_avx2(__m128i *state,
+                                        const uint8_t *ref_block,
+                                        uint8_t *next_block) {
+    __m256i block_XY[ARGON2_OWORDS_IN_BLOCK / 2];
+    __m256i v[8];
+    uint32_t i, k;
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK / 2; i++) {
+        block_XY[i] = _mm256_xor_si256(
+            _mm256_loadu_si256((__m256i const *)(&state[2 * i])),
+            _mm256_loadu_si256((__m256i const *)(&ref_block[32 * i])));
+        _mm256_storeu_si256((__m256i *)(&state[2 * i]), block_XY[i]);
+    }
+
+    /* Rows i and i + 4 share a round */
+    for (i = 0; i < 4; ++i) {
+        for (k = 0; k < 8; ++k) {
+            v[k] = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(state[8 * i + k]),
+                state[8 * (i + 4) + k], 1);
+        }
+        blake2_round_avx2(v);
+        for (k = 0; k < 8; ++k) {
+            state[8 * i + k] = _mm256_castsi256_si128(v[k]);
+            state[8 * (i + 4) + k] = _mm256_extracti128_si256(v[k], 1);
+        }
+    }
+
+    /* Columns 2i and 2i + 1 are adjacent in memory */
+    for (i = 0; i < 4; ++i) {
+        for (k = 0; k < 8; ++k) {
+            v[k] = _mm256_loadu_si256(
+                (__m256i const *)(&state[8 * k + 2 * i]));
+        }
+        blake2_round_avx2(v);
+        for (k = 0; k < 8; ++k) {
+            _mm256_storeu_si256((__m256i *)(&state[8 * k + 2 * i]), v[k]);
+        }
+    }
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK / 2; i++) {
+        __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256((__m256i const *)(&state[2 * i])),
+            block_XY[i]);
+        _mm256_storeu_si256((__m256i *)(&state[2 * i]), x);
+        _mm256_storeu_si256((__m256i *)(&next_block[32 * i]), x);
+    }
+}
+#endif
+
+const char *argon2_select_impl(int hardware) {
+    use_avx2 = 0;
+#ifdef ARGON2_USE_AVX2
+    __builtin_cpu_init();
+    if (hardware && __builtin_cpu_supports("avx2")) {
+        use_avx2 = 1;
+        return "avx2";
+    }
+#endif
+    return "sse2";
+}
+
 void generate_addresses(const argon2_instance_t *instance,
                         const argon2_position_t *position,
                         uint64_t *pseudo_rands) {
@@ -101,13 +250,14 @@ void fill_segment(const argon2_instance_t *instance,
 
     data_independent_addressing = (instance->type == Argon2_i);
 
-    pseudo_rands =
-        (uint64_t *)malloc(sizeof(uint64_t) * instance->segment_length);
-    if (pseudo_rands == NULL) {
-        return;
-    }
-
+    /* Argon2d takes its addresses from the previous block, so only Argon2i
+     * needs the precomputed pseudo-random values */
     if (data_independent_addressing) {
+        pseudo_rands =
+            (uint64_t *)malloc(sizeof(uint64_t) * instance->segment_length);
+        if (pseudo_rands == NULL) {
+            return;
+        }
         generate_addresses(instance, &position, pseudo_rands);
     }
 
@@ -165,6 +315,13 @@ void fill_segment(const argon2_instance_t *instance,
         ref_block =
             instance->memory + instance->lane_length * ref_lane + ref_index;
         curr_block = instance->memory + curr_offset;
+#ifdef ARGON2_USE_AVX2
+        if (use_avx2) {
+            fill_block_avx2(state, (uint8_t *)ref_block->v,
+                            (uint8_t *)curr_block->v);
+            continue;
+        }
+#endif
         fill_block(state, (uint8_t *)ref_block->v, (uint8_t *)curr_block->v);
     }
 
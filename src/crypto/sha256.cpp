@@ -8,6 +8,25 @@
 
 #include <string.h>
 
+#if defined(USE_SHA256_SIMD)
+#include <cpuid.h>
+
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -43,9 +62,10 @@ void inline Initialize(uint32_t* s)
     s[7] = 0x5be0cd19ul;
 }
 
-/** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-void Transform(uint32_t* s, const unsigned char* chunk)
+/** Perform a number of SHA-256 transformations, processing 64-byte chunks. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
 {
+    while (blocks--) {
     uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
     uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
 
@@ -125,11 +145,109 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[5] += f;
     s[6] += g;
     s[7] += h;
+    chunk += 64;
+    }
+}
+
+/** Double SHA-256 of one 64-byte input, built on whichever Transform is active. */
+void TransformD64(unsigned char* out, const unsigned char* in);
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+TransformType Transform_active = sha256::Transform;
+TransformD64Type TransformD64_4way = NULL;
+TransformD64Type TransformD64_8way = NULL;
+
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // Second block of the first hash: padding for a 64-byte message.
+    static const unsigned char padding1[64] = {
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0
+    };
+    uint32_t s[8];
+    unsigned char buf[64] = {0};
+
+    Initialize(s);
+    Transform_active(s, in, 1);
+    Transform_active(s, padding1, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+
+    // The second hash is over the 32-byte digest plus padding.
+    buf[32] = 0x80;
+    buf[62] = 1;
+    Initialize(s);
+    Transform_active(s, buf, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#if defined(USE_SHA256_SIMD)
+/** CPUID helpers; see the Intel SDM for the leaf/bit assignments. */
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __cpuid_count(leaf, subleaf, a, b, c, d);
 }
 
+/** Check whether the OS has enabled AVX registers. */
+bool inline AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+
 } // namespace sha256
 } // namespace
 
+std::string SHA256AutoDetect(bool fHardware)
+{
+    std::string ret = "standard";
+    sha256::Transform_active = sha256::Transform;
+    sha256::TransformD64_4way = NULL;
+    sha256::TransformD64_8way = NULL;
+    if (!fHardware)
+        return ret;
+
+#if defined(USE_SHA256_SIMD)
+    uint32_t eax, ebx, ecx, edx;
+    sha256::cpuid(1, 0, eax, ebx, ecx, edx);
+    bool have_sse41 = (ecx >> 19) & 1;
+    bool have_xsave = (ecx >> 27) & 1;
+    bool have_avx = (ecx >> 28) & 1;
+    bool enabled_avx = have_xsave && have_avx && sha256::AVXEnabled();
+    bool have_avx2 = false;
+    bool have_shani = false;
+    sha256::cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax >= 7) {
+        sha256::cpuid(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_shani = (ebx >> 29) & 1;
+    }
+
+    if (have_shani && have_sse41) {
+        sha256::Transform_active = sha256_shani::Transform;
+        ret = "shani(1way)";
+    }
+    // A single SHA-NI stream beats four SSE4.1 lanes, but not eight AVX2 ones.
+    if (have_sse41 && !have_shani) {
+        sha256::TransformD64_4way = sha256d64_sse41::Transform_4way;
+        ret += ",sse41(4way)";
+    }
+    if (have_avx2 && enabled_avx) {
+        sha256::TransformD64_8way = sha256d64_avx2::Transform_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+
+    return ret;
+}
+
 
 ////// SHA-256
 
@@ -147,14 +265,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        sha256::Transform_active(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        sha256::Transform_active(s, data, blocks);
+        data += 64 * blocks;
+        bytes += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +306,34 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256TransformBlocks(uint32_t* state, const unsigned char* chunk, size_t blocks)
+{
+    sha256::Transform_active(state, chunk, blocks);
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (sha256::TransformD64_8way) {
+        while (blocks >= 8) {
+            sha256::TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (sha256::TransformD64_4way) {
+        while (blocks >= 4) {
+            sha256::TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        sha256::TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
@@ -7,6 +7,14 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
+
+/** The x86 SSE4.1/AVX2/SHA-NI kernels are compiled with per-function target
+ *  attributes and only selected at runtime, so no special CFLAGS are needed. */
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SHA256_SIMD 1
+#endif
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +33,21 @@ public:
     CSHA256& Reset();
 };
 
+/** Autodetect the best available SHA256 implementation.
+ *  Returns the name of the implementation. With fHardware=false the portable
+ *  implementation is (re)selected, which is useful for benchmarks and tests.
+ *  Not thread-safe; call once at startup before hashing starts on other threads. */
+std::string SHA256AutoDetect(bool fHardware = true);
+
+/** Run the SHA-256 compression function over a number of 64-byte chunks,
+ *  updating the native-endian state words. Uses the active implementation. */
+void SHA256TransformBlocks(uint32_t* state, const unsigned char* chunk, size_t blocks);
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // DARKSILK_CRYPTO_SHA256_H
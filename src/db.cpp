@@ -14,6 +14,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/version.hpp>
 
 using namespace std;
@@ -226,7 +227,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL), fBatchTxn(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -282,6 +283,9 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
             bitdb.mapDb[strFile] = pdb;
         }
     }
+
+    activeTxn = CDBBatch::GetActiveTxn(strFile);
+    fBatchTxn = (activeTxn != NULL);
 }
 
 void CDB::Flush()
@@ -301,12 +305,15 @@ void CDB::Close()
 {
     if (!pdb)
         return;
-    if (activeTxn)
+    if (activeTxn && !fBatchTxn)
         activeTxn->abort();
     activeTxn = NULL;
     pdb = NULL;
 
-    Flush();
+    // The batch checkpoints once when it ends
+    if (!fBatchTxn)
+        Flush();
+    fBatchTxn = false;
 
     {
         LOCK(bitdb.cs_db);
@@ -314,6 +321,68 @@ void CDB::Close()
     }
 }
 
+// Batches open on the calling thread, by database file; the transaction is
+// only begun once a CDB handle inside the batch needs it
+static boost::thread_specific_ptr<map<string, DbTxn*> > ptsBatchTxns;
+
+DbTxn* CDBBatch::GetActiveTxn(const std::string& strFilename)
+{
+    if (!ptsBatchTxns.get())
+        return NULL;
+    map<string, DbTxn*>::iterator it = ptsBatchTxns->find(strFilename);
+    if (it == ptsBatchTxns->end())
+        return NULL;
+    if (!it->second)
+    {
+        it->second = bitdb.TxnBegin();
+        if (!it->second)
+            LogPrintf("CDBBatch : TxnBegin failed, %s writes will not be batched\n", strFilename);
+    }
+    return it->second;
+}
+
+CDBBatch::CDBBatch(const std::string& strFilename) : strFile(strFilename), fOwner(false)
+{
+    if (strFile.empty())
+        return;
+    if (!ptsBatchTxns.get())
+        ptsBatchTxns.reset(new map<string, DbTxn*>());
+    if (ptsBatchTxns->count(strFile))
+        return;
+
+    (*ptsBatchTxns)[strFile] = NULL;
+    fOwner = true;
+
+    // Counts as a user of the file, so ThreadFlushWalletDB won't close it
+    // under the open transaction
+    LOCK(bitdb.cs_db);
+    ++bitdb.mapFileUseCount[strFile];
+}
+
+bool CDBBatch::End(bool fCommit)
+{
+    if (!fOwner)
+        return true;
+    fOwner = false;
+
+    DbTxn* ptxn = (*ptsBatchTxns)[strFile];
+    ptsBatchTxns->erase(strFile);
+
+    int ret = 0;
+    if (ptxn)
+    {
+        ret = fCommit ? ptxn->commit(0) : ptxn->abort();
+        bitdb.dbenv.txn_checkpoint(0, 0, 0);
+    }
+    {
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+    }
+
+    if (ret != 0)
+        return error("CDBBatch : %s failed for %s (%d)", fCommit ? "commit" : "abort", strFile, ret);
+    return true;
+}
 
 void CDBEnv::CloseDb(const string& strFile)
 {
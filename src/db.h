@@ -91,6 +91,35 @@ public:
 extern CDBEnv bitdb;
 
 
+/** RAII class that groups every CDB access the calling thread makes to one
+ *  database file into a single transaction, committed when it goes out of
+ *  scope. A block connect, rescan batch or keypool refill then costs one
+ *  commit and one checkpoint rather than one per record. Nested batches on
+ *  the same file join the outermost one, and CDB handles opened inside a
+ *  batch must not outlive it or begin transactions of their own. */
+class CDBBatch
+{
+private:
+    std::string strFile;
+    bool fOwner; // outermost batch on this thread and file
+
+    CDBBatch(const CDBBatch&);
+    void operator=(const CDBBatch&);
+
+    bool End(bool fCommit);
+
+public:
+    explicit CDBBatch(const std::string& strFilename);
+    ~CDBBatch() { Commit(); }
+
+    bool Commit() { return End(true); }
+    bool Abort() { return End(false); }
+
+    /** The transaction of the batch the calling thread has open on strFilename, if any */
+    static DbTxn* GetActiveTxn(const std::string& strFilename);
+};
+
+
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
@@ -98,6 +127,7 @@ protected:
     Db* pdb;
     std::string strFile;
     DbTxn* activeTxn;
+    bool fBatchTxn; // activeTxn belongs to a CDBBatch
     bool fReadOnly;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
@@ -222,7 +252,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -268,6 +298,9 @@ protected:
 public:
     bool TxnBegin()
     {
+        // An explicit transaction must be able to roll back on its own, and a
+        // batch can only be rolled back as a whole, so callers never run in one
+        assert(!fBatchTxn);
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -279,7 +312,7 @@ public:
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fBatchTxn)
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
@@ -288,7 +321,7 @@ public:
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fBatchTxn)
             return false;
         int ret = activeTxn->abort();
         activeTxn = NULL;
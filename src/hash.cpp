@@ -1,5 +1,29 @@
 #include "hash.h"
 
+#include <boost/thread/tss.hpp>
+
+// One arena per thread; thread_specific_ptr frees it when the thread exits
+static boost::thread_specific_ptr<std::vector<uint8_t> > argon2Arena;
+
+int Argon2dArenaAllocate(uint8_t **memory, size_t bytes_to_allocate)
+{
+    std::vector<uint8_t>* pArena = argon2Arena.get();
+    if (!pArena)
+    {
+        pArena = new std::vector<uint8_t>();
+        argon2Arena.reset(pArena);
+    }
+    if (pArena->size() < bytes_to_allocate)
+        pArena->resize(bytes_to_allocate);
+    *memory = &(*pArena)[0];
+    return ARGON2_OK;
+}
+
+void Argon2dArenaFree(uint8_t *memory, size_t bytes_to_allocate)
+{
+    // The arena is reused by the next hash on this thread
+}
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
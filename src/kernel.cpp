@@ -4,10 +4,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "kernel.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "txdb.h"
 #include "txdb-leveldb.h"
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 
@@ -351,3 +354,145 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool GetKernelInput(CBlockIndex* pindexPrev, const COutPoint& prevout, CStakeKernelInput& input)
+{
+    CTxDB txdb("r");
+    CTransaction txPrev;
+    CTxIndex txindex;
+    CTransactionPoS txPoS;
+    if (!txPoS.ReadFromDisk(txPrev, txdb, prevout, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    int nDepth;
+
+    if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
+        return false;
+
+    if (prevout.n >= txPrev.vout.size())
+        return false;
+
+    input.prevout = prevout;
+    input.nTimeTxPrev = txPrev.nTime;
+    input.nTimeBlockFrom = block.GetBlockTime();
+    input.nValue = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+// State shared by the threads of one SearchStakeKernels() call
+struct CStakeKernelSearch
+{
+    const std::vector<CStakeKernelInput>* pvInputs;
+    uint256 bnStakeModifierV2;
+    CBigNum bnTargetPerCoin;
+    unsigned int nTime;
+    unsigned int nSearchInterval;
+
+    CCriticalSection cs;
+    int64_t nFound; // lowest candidate found, or -1
+    uint64_t nHashes;
+};
+
+// Candidate k is input k / nSearchInterval at nTime - k % nSearchInterval. The
+// first 64 bytes of the kernel only depend on the input, so they are hashed
+// once per input and each timestamp just finishes that SHA-256 midstate.
+// Each share is a contiguous run of candidates, so it only rebuilds the
+// midstate when it moves on to the next input.
+static void SearchStakeKernelsThread(CStakeKernelSearch* psearch, int nThread, int nThreads)
+{
+    const std::vector<CStakeKernelInput>& vInputs = *psearch->pvInputs;
+    uint64_t nCandidates = (uint64_t)vInputs.size() * psearch->nSearchInterval;
+    uint64_t nBegin = nCandidates * nThread / nThreads;
+    uint64_t nEnd = nCandidates * (nThread + 1) / nThreads;
+    int64_t nFound = -1;
+    uint64_t nHashes = 0;
+    uint64_t nInput = (uint64_t)-1;
+    const CStakeKernelInput* pinput = NULL;
+    CSHA256 midstate;
+    unsigned char tail[12];
+    uint256 hashTarget;
+    bool fAnyHash = false;
+
+    for (uint64_t k = nBegin; k < nEnd; k++)
+    {
+        uint64_t i = k / psearch->nSearchInterval;
+        if (i != nInput || (nHashes & 63) == 0)
+        {
+            // Another thread already has one
+            LOCK(psearch->cs);
+            if (psearch->nFound >= 0)
+                break;
+        }
+        if (i != nInput)
+        {
+            nInput = i;
+            pinput = &vInputs[i];
+
+            CDataStream ss(SER_GETHASH, 0);
+            ss << psearch->bnStakeModifierV2;
+            ss << pinput->nTimeTxPrev << pinput->prevout.hash << pinput->prevout.n;
+            assert(ss.size() == 72);
+            midstate.Reset().Write((const unsigned char*)&ss[0], 64);
+            memcpy(tail, &ss[64], 8);
+
+            // Weighted target, as in CheckStakeKernelHash()
+            CBigNum bnTarget = psearch->bnTargetPerCoin * CBigNum(pinput->nValue);
+            fAnyHash = bnTarget > CBigNum(~uint256(0));
+            if (!fAnyHash)
+                hashTarget = bnTarget.getuint256();
+        }
+
+        unsigned int nTimeTx = psearch->nTime - (unsigned int)(k % psearch->nSearchInterval);
+        if (nTimeTx < pinput->nTimeTxPrev)  // Transaction timestamp violation
+            continue;
+
+        unsigned char hash1[CSHA256::OUTPUT_SIZE];
+        uint256 hashProofOfStake;
+        WriteLE32(tail + 8, nTimeTx);
+        CSHA256(midstate).Write(tail, sizeof(tail)).Finalize(hash1);
+        CSHA256().Write(hash1, sizeof(hash1)).Finalize(hashProofOfStake.begin());
+        nHashes++;
+
+        if (fAnyHash || hashProofOfStake <= hashTarget)
+        {
+            nFound = k;
+            break;
+        }
+    }
+
+    LOCK(psearch->cs);
+    psearch->nHashes += nHashes;
+    if (nFound >= 0 && (psearch->nFound < 0 || nFound < psearch->nFound))
+        psearch->nFound = nFound;
+}
+
+int SearchStakeKernels(const CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTime, unsigned int nSearchInterval,
+                       const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeRet, uint64_t& nHashesRet, int nThreads)
+{
+    nHashesRet = 0;
+    uint64_t nCandidates = (uint64_t)vInputs.size() * nSearchInterval;
+    if (nCandidates == 0)
+        return -1;
+
+    CStakeKernelSearch search;
+    search.pvInputs = &vInputs;
+    search.bnStakeModifierV2 = pindexPrev->bnStakeModifierV2;
+    search.bnTargetPerCoin.SetCompact(nBits);
+    search.nTime = nTime;
+    search.nSearchInterval = nSearchInterval;
+    search.nFound = -1;
+    search.nHashes = 0;
+
+    ParallelFor(nCandidates, nThreads, boost::bind(&SearchStakeKernelsThread, &search, _1, _2));
+
+    nHashesRet = search.nHashes;
+    if (search.nFound < 0)
+        return -1;
+    nTimeRet = nTime - (unsigned int)(search.nFound % nSearchInterval);
+    return (int)(search.nFound / nSearchInterval);
+}
@@ -40,4 +40,23 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// A coin to search for a stake kernel, with what CheckKernel() reads from disk
+struct CStakeKernelInput
+{
+    COutPoint prevout;
+    unsigned int nTimeTxPrev;
+    int64_t nTimeBlockFrom;
+    CAmount nValue;
+};
+
+// Reads the kernel fields of prevout, as CheckKernel() does
+// Returns false if it cannot stake on top of pindexPrev
+bool GetKernelInput(CBlockIndex* pindexPrev, const COutPoint& prevout, CStakeKernelInput& input);
+
+// Searches every input at the times nTime, nTime - 1, ... nTime - nSearchInterval + 1
+// on nThreads threads (0 for one per core) and stops at the first kernel found
+// Returns its index in vInputs, or -1, and sets nTimeRet to its time
+int SearchStakeKernels(const CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTime, unsigned int nSearchInterval,
+                       const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeRet, uint64_t& nHashesRet, int nThreads = 0);
+
 #endif // PPCOIN_KERNEL_H
@@ -11,6 +11,8 @@
 #include <secp256k1.h>
 #include <secp256k1_recovery.h>
 
+#include <boost/bind.hpp>
+
 // anonymous namespace
 namespace {
 class CSecp256k1Init {
@@ -308,6 +310,22 @@ void CExtKey::Decode(const unsigned char code[74]) {
     key.Set(code+42, code+74, true);
 }
 
+static void VerifyKeyPairsThread(const std::vector<std::pair<CKey, CPubKey> >* pvKeys, std::vector<char>* pvfValid,
+                                 int nThread, int nThreads)
+{
+    for (size_t i = nThread; i < pvKeys->size(); i += nThreads)
+        (*pvfValid)[i] = (*pvKeys)[i].first.VerifyPubKey((*pvKeys)[i].second);
+}
+
+bool VerifyKeyPairs(const std::vector<std::pair<CKey, CPubKey> >& vKeys, int nThreads)
+{
+    // Each pair is checked into its own slot
+    std::vector<char> vfValid(vKeys.size(), false);
+    ParallelFor(vKeys.size(), nThreads, boost::bind(&VerifyKeyPairsThread, &vKeys, &vfValid, _1, _2));
+
+    return std::find(vfValid.begin(), vfValid.end(), false) == vfValid.end();
+}
+
 bool ECC_InitSanityCheck() {
     CKey key;
     key.MakeNewKey(true);
@@ -152,6 +152,9 @@ struct CExtKey {
     void SetMaster(const unsigned char *seed, unsigned int nSeedLen);
 };
 
+/** Check VerifyPubKey() for every key pair, spread over nThreads threads (0 = one per core). */
+bool VerifyKeyPairs(const std::vector<std::pair<CKey, CPubKey> >& vKeys, int nThreads = 0);
+
 /** Initialize the elliptic curve support. May not be called twice without calling ECC_Stop first. */
 void ECC_Start(void);
 
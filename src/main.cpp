@@ -9,6 +9,7 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -23,12 +24,16 @@
 #include "spork.h"
 #include "smessage.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "txdb-leveldb.h"
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -113,6 +118,9 @@ CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 unsigned int nCoinCacheSize = 5000;
+int nScriptCheckThreads = 0;
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
 // Internal stuff
 namespace {
@@ -208,6 +216,8 @@ namespace {
     struct CMainSignals {
         // Notifies listeners of updated transaction data (passing hash, transaction, and optionally the block it is found in.
         boost::signals2::signal<void (const CTransaction &, const CBlock *, bool)> SyncTransaction;
+        // Same for every transaction of a block at once.
+        boost::signals2::signal<void (const std::vector<CTransaction> &, const CBlock *, bool)> SyncTransactions;
         // Notifies listeners of an erased transaction (currently disabled, requires transaction replacement).
         boost::signals2::signal<void (const uint256 &)> EraseTransaction;
         // Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible).
@@ -223,6 +233,7 @@ namespace {
 
 void RegisterWallet(CWalletInterface* pwalletIn) {
     g_signals.SyncTransaction.connect(boost::bind(&CWalletInterface::SyncTransaction, pwalletIn, _1, _2, _3));
+    g_signals.SyncTransactions.connect(boost::bind(&CWalletInterface::SyncTransactions, pwalletIn, _1, _2, _3));
     g_signals.EraseTransaction.connect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
@@ -236,6 +247,7 @@ void UnregisterWallet(CWalletInterface* pwalletIn) {
     g_signals.SetBestChain.disconnect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.EraseTransaction.disconnect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
+    g_signals.SyncTransactions.disconnect(boost::bind(&CWalletInterface::SyncTransactions, pwalletIn, _1, _2, _3));
     g_signals.SyncTransaction.disconnect(boost::bind(&CWalletInterface::SyncTransaction, pwalletIn, _1, _2, _3));
 }
 
@@ -245,6 +257,7 @@ void UnregisterAllWallets() {
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
     g_signals.EraseTransaction.disconnect_all_slots();
+    g_signals.SyncTransactions.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
 }
 
@@ -252,6 +265,10 @@ void SyncWithWallets(const CTransaction &tx, const CBlock *pblock, bool fConnect
     g_signals.SyncTransaction(tx, pblock, fConnect);
 }
 
+void SyncWithWallets(const std::vector<CTransaction> &vtx, const CBlock *pblock, bool fConnect) {
+    g_signals.SyncTransactions(vtx, pblock, fConnect);
+}
+
 void ResendWalletTransactions(bool fForce) {
     g_signals.Broadcast(fForce);
 }
@@ -863,12 +880,153 @@ CAmount GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees)
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, 0);
+}
+
+void ThreadScriptCheck()
+{
+    RenameThread("darksilk-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+/** Verify every input script of tx against the fetched inputs. Transactions
+ *  with few inputs are checked on the calling thread; larger ones are spread
+ *  over the script check threads. Takes no locks of its own. */
+static bool CheckInputScripts(const CTransaction& tx, const MapPrevTx& mapInputs, unsigned int flags)
+{
+    std::vector<CScriptCheck> vChecks;
+    vChecks.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        MapPrevTx::const_iterator mi = mapInputs.find(prevout.hash);
+        if (mi == mapInputs.end() || prevout.n >= mi->second.second.vout.size())
+            return false;
+        vChecks.push_back(CScriptCheck(mi->second.second.vout[prevout.n], tx, i, flags));
+    }
+
+    if (nScriptCheckThreads == 0 || vChecks.size() < MIN_QUEUED_SCRIPT_CHECKS)
+    {
+        BOOST_FOREACH(const CScriptCheck& check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+/** Fetch the inputs of tx and run every contextual check of ConnectInputs
+ *  except signature verification. Requires cs_main. */
+static bool FetchMemPoolInputs(CTransaction& tx, CTxDB& txdb, MapPrevTx& mapInputs, bool* pfMissingInputs)
 {
     AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
+
+    // do all inputs exist?
+    // Note that this does not check for the presence of actual outputs (see the next check for that),
+    // only helps filling in pfMissingInputs (to determine missing vs spent).
+    BOOST_FOREACH(const CTxIn txin, tx.vin) {
+        if (!txdb.ContainsTx(txin.prevout.hash)) {
+            if (pfMissingInputs)
+                *pfMissingInputs = true;
+            return false;
+        }
+    }
+
+    mapInputs.clear();
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    CTransactionPoS txPoS;
+    if (!txPoS.FetchInputs(tx, txdb, mapUnused, false, false, mapInputs, fInvalid))
+    {
+        if (fInvalid)
+            return error("AcceptToMemoryPool : FetchInputs found invalid tx %s", hash.ToString());
+        return false;
+    }
+
+    if (!txPoS.ConnectInputs(tx, txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS, false))
+        return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
+
+    return true;
+}
+
+/** Returns true if one of tx's inputs is already spent by a transaction in the pool
+ *  or locked to a different transaction by InstantX (the latter sets reason). */
+bool HasMemPoolConflict(const CTxMemPool& pool, const CTransaction& tx, std::string& reason)
+{
+    AssertLockHeld(pool.cs);
+    BOOST_FOREACH(const CTxIn& in, tx.vin){
+        if(mapLockedInputs.count(in.prevout) && mapLockedInputs[in.prevout] != tx.GetHash()){
+            reason = "conflicts with existing transaction lock";
+            return true;
+        }
+        // Disable replacement feature for now
+        if (pool.mapNextTx.count(in.prevout))
+            return true;
+    }
+    return false;
+}
+
+bool CommitToMemoryPool(CTxMemPool& pool, CTransaction& tx, MapPrevTx& mapInputs, CBlockIndex* pindexPrepared, bool* pfMissingInputs)
+{
+    uint256 hash = tx.GetHash();
+    string reason;
+
+    LOCK(cs_main);
+
+    // The chain may have moved while the scripts were verified; the
+    // scripts themselves can't change, but finality, spentness and
+    // maturity can.
+    if (pindexBest != pindexPrepared)
+    {
+        if (!TestNet() && !IsStandardTx(tx, reason))
+            return error("AcceptToMemoryPool : nonstandard transaction: %s",
+                         reason);
+
+        CTxDB txdb("r");
+        if (!FetchMemPoolInputs(tx, txdb, mapInputs, pfMissingInputs))
+            return false;
+    }
+
+    {
+        LOCK(pool.cs);
+        if (pool.mapTx.count(hash))
+            return false;
+        if (HasMemPoolConflict(pool, tx, reason))
+            return reason.empty() ? false : tx.DoS(0, error("AcceptToMemoryPool : %s: %s", reason, hash.ToString()));
+
+        // Store transaction in memory
+        pool.addUnchecked(hash, tx);
+    }
+    setValidatedTx.insert(hash);
+
+    SyncWithWallets(tx, NULL);
+    return true;
+}
+
+// AcceptToMemoryPool runs in stages so that the expensive work does not hold
+// cs_main or pool.cs:
+//   1. context-free checks, lock-free
+//   2. standardness, input fetching and contextual checks, under cs_main
+//   3. script verification, lock-free (and spread over the -par threads)
+//   4. CommitToMemoryPool, a short critical section under cs_main and
+//      pool.cs that re-checks for conflicts, re-checks finality and
+//      re-fetches inputs only if the tip moved, and inserts.
+// Callers may still hold cs_main, in which case stage 3 only gains the
+// per-input parallelism.
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees)
+{
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
+    int64_t nTimeStart = GetTimeMicros();
+
     if (!tx.CheckTransaction(state))
         return error("AcceptToMemoryPool : CheckTransaction failed");
 
@@ -880,65 +1038,36 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction
     if (tx.IsCoinStake())
         return tx.DoS(100, error("AcceptToMemoryPool : coinstake as individual tx"));
 
-    // Rather not work on nonstandard transactions (unless -testnet)
-    string reason;
-    if (!TestNet() && !IsStandardTx(tx, reason))
-        return error("AcceptToMemoryPool : nonstandard transaction: %s",
-                     reason);
-
     // is it already in the memory pool?
     uint256 hash = tx.GetHash();
     if (pool.exists(hash))
         return false;
 
-    // ----------- instantX transaction scanning -----------
+    string reason;
+    MapPrevTx mapInputs;
+    CBlockIndex* pindexPrepared = NULL;
+    int64_t nTimePrepared;
+    {
+        LOCK(cs_main);
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return tx.DoS(0, error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason));
-            }
-        }
-    }
+        // Rather not work on nonstandard transactions (unless -testnet);
+        // finality is judged against nBestHeight, so this needs cs_main
+        if (!TestNet() && !IsStandardTx(tx, reason))
+            return error("AcceptToMemoryPool : nonstandard transaction: %s",
+                         reason);
 
-    // Check for conflicts with in-memory transactions
-    {
-    LOCK(pool.cs); // protect pool.mapNextTx
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (pool.mapNextTx.count(outpoint))
+        // ----------- instantX transaction scanning -----------
+        // Check for conflicts with in-memory transactions
         {
-            // Disable replacement feature for now
-            return false;
+            LOCK(pool.cs); // protect pool.mapNextTx
+            if (HasMemPoolConflict(pool, tx, reason))
+                return reason.empty() ? false : tx.DoS(0, error("AcceptToMemoryPool : %s: %s", reason, hash.ToString()));
         }
-    }
-    }
 
-    {
         CTxDB txdb("r");
-
-        // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
-        BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!txdb.ContainsTx(txin.prevout.hash)) {
-                if (pfMissingInputs)
-                    *pfMissingInputs = true;
-                return false;
-            }
-        }
-
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        CTransactionPoS txPoS;
-        if (!txPoS.FetchInputs(tx, txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            if (fInvalid)
-                return error("AcceptToMemoryPool : FetchInputs found invalid tx %s", hash.ToString());
+        if (!FetchMemPoolInputs(tx, txdb, mapInputs, pfMissingInputs))
             return false;
-        }
+        pindexPrepared = pindexBest;
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!TestNet() && !AreInputsStandard(tx, mapInputs))
@@ -956,6 +1085,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction
                           error("AcceptToMemoryPool : too many sigops %s, %d > %d",
                                 hash.ToString(), nSigOps, MAX_TX_SIGOPS));
 
+        CTransactionPoS txPoS;
         CAmount nFees = txPoS.GetValueIn(tx, mapInputs) - txPoS.GetValueOut(tx);
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
@@ -989,34 +1119,43 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction
             dFreeCount += nSize;
             }
         }
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!txPoS.ConnectInputs(tx, txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
-        {
-            return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
-        }
-
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!txPoS.ConnectInputs(tx, txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
-        {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
-        }
+        nTimePrepared = GetTimeMicros();
     }
 
-    // Store transaction in memory
-    pool.addUnchecked(hash, tx);
-    setValidatedTx.insert(hash);
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckInputScripts(tx, mapInputs, STANDARD_SCRIPT_VERIFY_FLAGS))
+    {
+        // Check whether the failure was caused by a non-mandatory script
+        // verification check, such as non-null dummy arguments; if so, don't
+        // trigger DoS protection to avoid splitting the network between
+        // upgraded and non-upgraded nodes.
+        if (CheckInputScripts(tx, mapInputs, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            return error("AcceptToMemoryPool : %s non-mandatory VerifySignature failed", hash.ToString());
+        return tx.DoS(100, error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString()));
+    }
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    if (!CheckInputScripts(tx, mapInputs, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
 
-    SyncWithWallets(tx, NULL);
+    int64_t nTimeScripts = GetTimeMicros();
 
+    if (!CommitToMemoryPool(pool, tx, mapInputs, pindexPrepared, pfMissingInputs))
+        return false;
+
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrint("bench", "AcceptToMemoryPool : %s prepare %.2fms, scripts %.2fms (%u inputs), commit %.2fms\n",
+             hash.ToString(), 0.001 * (nTimePrepared - nTimeStart), 0.001 * (nTimeScripts - nTimePrepared),
+             tx.vin.size(), 0.001 * (nTimeEnd - nTimeScripts));
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
            pool.mapTx.size());
@@ -1883,7 +2022,7 @@ bool static IsCanonicalBlockSignature(CBlock* pblock)
     return IsDERSignature(pblock->vchBlockSig, false);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked)
 {
     AssertLockHeld(cs_main);
 
@@ -1922,7 +2061,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Preliminary checks
     CValidationState state;
-    if (!pblock->CheckBlock(state))
+    if (!pblock->CheckBlock(state, !fPrechecked, !fPrechecked, !fPrechecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
@@ -2217,65 +2356,388 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+/** Blocks the import reader may run ahead of the connector */
+static const unsigned int MAX_IMPORT_BLOCKS_IN_FLIGHT = 1024;
+/** Blocks an import worker takes per batch; PoW headers in a batch are
+ *  scrypted together on the multi-lane core */
+static const unsigned int IMPORT_WORKER_BATCH = 8;
+
+/**
+ * Pipelined block file import. The reader (the calling thread's helper)
+ * scans the memory-mapped file for message starts; a pool of workers
+ * deserializes the blocks and runs the expensive context-free checks
+ * (proof-of-work hash, block signature, merkle root) in parallel; the
+ * calling thread connects the results strictly in file order under cs_main.
+ */
+class CBlockImporter
 {
-    int64_t nStart = GetTimeMillis();
+private:
+    struct CImportJob
+    {
+        unsigned int nIndex;
+        const unsigned char* pbegin;
+        unsigned int nSize;
+    };
 
-    int nLoaded = 0;
+    struct CImportResult
+    {
+        boost::shared_ptr<CBlock> pblock; // NULL if the block failed to deserialize or check
+        size_t nBegin;                    // file offset of the block
+        size_t nEnd;                      // file offset just past the block
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condJobs;    // workers wait for jobs
+    boost::condition_variable condResults; // connector waits for the next result
+    boost::condition_variable condSpace;   // reader waits for room in flight
+
+    const unsigned char* pbegin;
+    const unsigned char* pend;
+    std::deque<CImportJob> vJobs;
+    std::map<unsigned int, CImportResult> mapResults;
+    unsigned int nQueued;    // jobs handed out by the reader
+    unsigned int nConnected; // results consumed by the connector
+    bool fReaderDone;
+    bool fAbort;
+
+    // Finds the next message start at or after nPos, then the size field
+    // that follows it. Returns false at the end of the file.
+    bool NextBlock(size_t& nPos, unsigned int& nSize) const
+    {
+        const unsigned char* pchMessageStart = (const unsigned char*)Params().MessageStart();
+        const size_t nFileSize = pend - pbegin;
+        while (nPos + MESSAGE_START_SIZE + sizeof(nSize) <= nFileSize)
+        {
+            const unsigned char* pFind = (const unsigned char*)memchr(pbegin + nPos, pchMessageStart[0],
+                                                                   nFileSize - nPos - MESSAGE_START_SIZE + 1);
+            if (!pFind)
+                return false;
+            nPos = pFind - pbegin + 1;
+            if (memcmp(pFind, pchMessageStart, MESSAGE_START_SIZE) != 0)
+                continue;
+            nPos += MESSAGE_START_SIZE - 1;
+            if (nPos + sizeof(nSize) > nFileSize)
+                return false;
+            nSize = ReadLE32(pbegin + nPos);
+            if (nSize > 0 && nSize <= MAX_BLOCK_SIZE && nPos + sizeof(nSize) + nSize <= nFileSize)
+                return true;
+        }
+        return false;
+    }
+
+    void ThreadReader()
+    {
+        size_t nPos = 0;
+        unsigned int nSize = 0;
+        while (NextBlock(nPos, nSize))
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fAbort && nQueued - nConnected >= MAX_IMPORT_BLOCKS_IN_FLIGHT)
+                condSpace.wait(lock);
+            if (fAbort)
+                break;
+            CImportJob job;
+            job.nIndex = nQueued++;
+            job.pbegin = pbegin + nPos + sizeof(nSize);
+            job.nSize = nSize;
+            vJobs.push_back(job);
+            condJobs.notify_one();
+            // Keep scanning from just past the message start: whether this
+            // is really a block is only known once a worker has checked it,
+            // and the connector drops candidates inside a block that did
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+        condJobs.notify_all();
+        condResults.notify_all();
+    }
+
+    static bool CheckBlockContextFree(CBlock& block)
+    {
+        if (block.vtx.empty())
+            return error("LoadExternalBlockFile() : block has no transactions");
+        if (block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+            return error("LoadExternalBlockFile() : proof of work failed");
+        if (!block.CheckBlockSignature())
+            return error("LoadExternalBlockFile() : bad block signature");
+        if (block.hashMerkleRoot != block.BuildMerkleTree())
+            return error("LoadExternalBlockFile() : hashMerkleRoot mismatch");
+        return true;
+    }
+
+    void ThreadWorker()
     {
+        while (true)
+        {
+            std::vector<CImportJob> vBatch;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && vJobs.empty() && !fReaderDone)
+                    condJobs.wait(lock);
+                if (fAbort || vJobs.empty())
+                    return;
+                while (!vJobs.empty() && vBatch.size() < IMPORT_WORKER_BATCH)
+                {
+                    vBatch.push_back(vJobs.front());
+                    vJobs.pop_front();
+                }
+            }
+
+            std::vector<CImportResult> vResults(vBatch.size());
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+            {
+                vResults[i].nBegin = vBatch[i].pbegin - pbegin;
+                vResults[i].nEnd = vResults[i].nBegin + vBatch[i].nSize;
+            }
+
+            // Every job must get a result, or the connector waits for it forever
+            try {
+                std::vector<CBlockHeader> vHeaders;
+                for (unsigned int i = 0; i < vBatch.size(); i++)
+                {
+                    try {
+                        CDataStream ss((const char*)vBatch[i].pbegin, (const char*)vBatch[i].pbegin + vBatch[i].nSize, SER_DISK, CLIENT_VERSION);
+                        vResults[i].pblock.reset(new CBlock());
+                        ss >> *vResults[i].pblock;
+                        if (vResults[i].pblock->IsProofOfWork())
+                            vHeaders.push_back(*vResults[i].pblock);
+                    }
+                    catch (std::exception &e) {
+                        LogPrint("import", "LoadExternalBlockFile() : deserialize error at offset %u\n", (size_t)(vBatch[i].pbegin - pbegin));
+                        vResults[i].pblock.reset();
+                    }
+                }
+
+                // Warm the PoW hash cache for the whole batch in one multi-lane pass
+                std::vector<uint256> vHashes;
+                GetPoWHashes(vHeaders, vHashes, 1);
+                for (unsigned int i = 0; i < vBatch.size(); i++)
+                    if (vResults[i].pblock && !CheckBlockContextFree(*vResults[i].pblock))
+                        vResults[i].pblock.reset();
+            }
+            catch (std::exception &e) {
+                LogPrintf("LoadExternalBlockFile() : import worker error: %s\n", e.what());
+                for (unsigned int i = 0; i < vBatch.size(); i++)
+                    vResults[i].pblock.reset();
+            }
+            catch (...) {
+                LogPrintf("LoadExternalBlockFile() : unknown import worker error\n");
+                for (unsigned int i = 0; i < vBatch.size(); i++)
+                    vResults[i].pblock.reset();
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+                mapResults[vBatch[i].nIndex] = vResults[i];
+            condResults.notify_one();
+        }
+    }
+
+public:
+    CBlockImporter(const unsigned char* pbeginIn, const unsigned char* pendIn) :
+        pbegin(pbeginIn), pend(pendIn), nQueued(0), nConnected(0), fReaderDone(false), fAbort(false) {}
+
+    // Returns the number of blocks accepted
+    int Run()
+    {
+        int64_t nStart = GetTimeMillis();
+        int64_t nLastReport = nStart;
+        int nLoaded = 0;
+        size_t nBlockEnd = 0; // end of the last candidate that checked as a block
+        int nWorkers = std::max(1, (int)boost::thread::hardware_concurrency() - 1);
+
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadReader, this));
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadWorker, this));
+
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            while (true)
             {
                 boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
+                CImportResult result;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (!mapResults.count(nConnected) && !(fReaderDone && nConnected == nQueued))
+                        condResults.wait(lock);
+                    if (!mapResults.count(nConnected))
                         break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                    result = mapResults[nConnected];
+                    mapResults.erase(nConnected);
+                    nConnected++;
+                    condSpace.notify_one();
+                }
+
+                // A message start inside a real block is part of its data
+                if (result.pblock && result.nBegin < nBlockEnd)
+                    result.pblock.reset();
+                if (result.pblock)
                 {
-                    CBlock block;
-                    blkdat >> block;
+                    nBlockEnd = result.nEnd;
                     LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
+                    if (ProcessBlock(NULL, result.pblock.get(), true))
                         nLoaded++;
-                        nPos += 4 + nSize;
-                    }
                 }
+
+                int64_t nNow = GetTimeMillis();
+                if (nNow - nLastReport >= 5000)
+                {
+                    int nProgress = (int)(100.0 * result.nEnd / std::max((size_t)1, (size_t)(pend - pbegin)));
+                    LogPrintf("Importing blocks: %d loaded, %.1f blocks/s, %d%% of file\n", nLoaded,
+                              1000.0 * nLoaded / std::max((int64_t)1, nNow - nStart), nProgress);
+                    uiInterface.ShowProgress(_("Importing blocks..."), std::max(1, std::min(99, nProgress)));
+                    nLastReport = nNow;
+                }
+            }
+        }
+        catch (...) {
+            // Interrupted, or ProcessBlock threw; the workers must not outlive the mapping
+            Stop(threads);
+            throw;
+        }
+        Stop(threads);
+        uiInterface.ShowProgress("", 100);
+        return nLoaded;
+    }
+
+private:
+    void Stop(boost::thread_group& threads)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+            condJobs.notify_all();
+            condSpace.notify_all();
+        }
+        threads.join_all();
+    }
+};
+
+/**
+ * Sequential import for files that can't be memory-mapped, e.g. a bootstrap
+ * larger than the address space of a 32-bit build. Blocks are scanned and
+ * connected one at a time from a buffer holding at least one whole block.
+ */
+static int LoadExternalBlockFileStream(FILE* file)
+{
+    const unsigned char* pchMessageStart = (const unsigned char*)Params().MessageStart();
+    const size_t nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    const size_t nReadSize = nHeaderSize + MAX_BLOCK_SIZE;
+    std::vector<unsigned char> vBuf;
+    size_t nBegin = 0; // first byte of vBuf not scanned yet
+    bool fEof = false;
+    int nLoaded = 0;
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        if (!fEof && vBuf.size() - nBegin < nReadSize)
+        {
+            vBuf.erase(vBuf.begin(), vBuf.begin() + nBegin);
+            nBegin = 0;
+            size_t nHave = vBuf.size();
+            vBuf.resize(nHave + nReadSize);
+            size_t nRead = fread(&vBuf[nHave], 1, nReadSize, file);
+            vBuf.resize(nHave + nRead);
+            fEof = (nRead < nReadSize);
+        }
+        if (vBuf.size() - nBegin < nHeaderSize)
+            break;
+
+        const unsigned char* pFind = (const unsigned char*)memchr(&vBuf[nBegin], pchMessageStart[0],
+                                                               vBuf.size() - nBegin - nHeaderSize + 1);
+        if (!pFind)
+        {
+            nBegin = vBuf.size() - nHeaderSize + 1;
+            continue;
+        }
+        size_t nMessageStart = pFind - &vBuf[0];
+        if (memcmp(pFind, pchMessageStart, MESSAGE_START_SIZE) != 0)
+        {
+            nBegin = nMessageStart + 1;
+            continue;
+        }
+        unsigned int nSize = ReadLE32(pFind + MESSAGE_START_SIZE);
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+        {
+            nBegin = nMessageStart + MESSAGE_START_SIZE;
+            continue;
+        }
+        if (vBuf.size() - nMessageStart < nHeaderSize + nSize)
+        {
+            // Truncated at the end of the file, else read the rest of the block
+            if (fEof)
+                break;
+            nBegin = nMessageStart;
+            continue;
+        }
+
+        const char* pblockBegin = (const char*)pFind + nHeaderSize;
+        try {
+            CDataStream ss(pblockBegin, pblockBegin + nSize, SER_DISK, CLIENT_VERSION);
+            CBlock block;
+            ss >> block;
+            LOCK(cs_main);
+            if (ProcessBlock(NULL, &block))
+            {
+                nLoaded++;
+                nBegin = nMessageStart + nHeaderSize + nSize;
             }
+            else
+                nBegin = nMessageStart + MESSAGE_START_SIZE;
         }
         catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            LogPrint("import", "LoadExternalBlockFile() : deserialize error in streamed block\n");
+            nBegin = nMessageStart + MESSAGE_START_SIZE;
         }
     }
-    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded;
+}
+
+bool LoadExternalBlockFile(const boost::filesystem::path& path)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        uint64_t nFileSize = boost::filesystem::file_size(path);
+        if (nFileSize > 0)
+        {
+            boost::scoped_ptr<boost::interprocess::mapped_region> pregion;
+            if (nFileSize <= std::numeric_limits<size_t>::max())
+            {
+                try {
+                    boost::interprocess::file_mapping mapping(path.string().c_str(), boost::interprocess::read_only);
+                    pregion.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only));
+                }
+                catch (boost::interprocess::interprocess_exception &e) {
+                    LogPrintf("LoadExternalBlockFile() : unable to map %s (%s), reading it sequentially\n", path.string(), e.what());
+                }
+            }
+
+            if (pregion)
+            {
+                const unsigned char* pbegin = (const unsigned char*)pregion->get_address();
+                CBlockImporter importer(pbegin, pbegin + pregion->get_size());
+                nLoaded = importer.Run();
+            }
+            else
+            {
+                CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+                if (!filein)
+                    return error("LoadExternalBlockFile() : unable to open %s", path.string());
+                nLoaded = LoadExternalBlockFileStream(filein);
+            }
+        }
+    }
+    catch (boost::thread_interrupted&) {
+        throw;
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s() : I/O error caught during load: %s\n", __PRETTY_FUNCTION__, e.what());
+    }
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    LogPrintf("Loaded %i blocks from external file in %dms (%.1f blocks/s)\n", nLoaded, nElapsed,
+              1000.0 * nLoaded / std::max((int64_t)1, nElapsed));
     return nLoaded > 0;
 }
 
@@ -2300,20 +2762,16 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -loadblock=
     BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file)
-            LoadExternalBlockFile(file);
+        if (filesystem::exists(path))
+            LoadExternalBlockFile(path);
     }
 
     // hardcoded $DATADIR/bootstrap.dat
     filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
     if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
-        }
+        filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+        LoadExternalBlockFile(pathBootstrap);
+        RenameOver(pathBootstrap, pathBootstrapOld);
     }
 }
 
@@ -3058,14 +3516,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
         bool fMissingInputs = false;
         CValidationState state;
 
+        // Called before taking cs_main so script verification doesn't stall
+        // block creation, RPC and InstantX while this transaction is checked
+        bool fAccepted = AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, allowFree);
+
+        LOCK(cs_main);
+
         mapAlreadyAskedFor.erase(inv); 
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, allowFree))
+        if (fAccepted)
         {
             RelayTransaction(tx, inv.hash);
             vWorkQueue.push_back(inv.hash);
@@ -55,6 +55,12 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 512;
 /// The maximum number of entries in an 'inv' protocol message
 static const unsigned int MAX_INV_SZ = 50000;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Transactions with fewer inputs than this are script-checked on the accepting thread */
+static const unsigned int MIN_QUEUED_SCRIPT_CHECKS = 4;
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov 5th 00:53:20 1985 UTC
 // Target timing between Proof-of-Work blocks
@@ -120,6 +126,7 @@ extern bool fLargeWorkInvalidChainFound;
 extern std::map<uint256, int64_t> mapRejectedBlocks;
 
 extern CFeeRate minRelayTxFee;
+extern int nScriptCheckThreads;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -146,6 +153,8 @@ void UnregisterWallet(CWalletInterface* pwalletIn);
 void UnregisterAllWallets();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fConnect = true);
+/** Push all transactions of a connected or disconnected block to all registered wallets */
+void SyncWithWallets(const std::vector<CTransaction>& vtx, const CBlock* pblock, bool fConnect = true);
 /** Ask wallets to resend their transactions */
 void ResendWalletTransactions(bool fForce = false);
 
@@ -156,7 +165,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+/** Process an incoming block. fPrechecked means the caller already verified
+ *  the block's proof-of-work, signature and merkle root (see the block import
+ *  pipeline), so CheckBlock skips those. */
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked = false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 /// Unload database information
 void UnloadBlockIndex();
@@ -170,6 +182,8 @@ void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -186,6 +200,8 @@ void ThreadStakeMiner(CWallet *pwallet);
 //bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isSSTX=false);
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees = false);
 bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isSSTX=false);
+/** Returns true if tx spends an input already spent in pool, or locked by InstantX to another transaction; requires pool.cs */
+bool HasMemPoolConflict(const CTxMemPool& pool, const CTransaction& tx, std::string& reason);
 
 CAmount GetBlockValue(int nBits, int nHeight, const CAmount& nFees);
 
@@ -342,6 +358,33 @@ public:
 
 };
 
+/**
+ * Closure representing one script verification.
+ * Note that this stores a reference to the spending transaction.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+
+public:
+    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0) {}
+    CScriptCheck(const CTxOut& txoutFrom, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn) :
+        scriptPubKey(txoutFrom.scriptPubKey), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+    }
+};
+
 /** Check for standard transaction types
     @param[in] mapInputs    Map of previous transactions that have outputs we're spending
     @return True if all inputs (scriptSigs) use only standard transaction forms
@@ -349,6 +392,11 @@ public:
 */
 bool AreInputsStandard(const CTransaction& tx, const MapPrevTx& mapInputs);
 
+/** The last stage of AcceptToMemoryPool: under cs_main and pool.cs, re-checks
+ *  what may have changed since mapInputs were fetched at pindexPrepared and
+ *  inserts tx, whose scripts must already have been verified */
+bool CommitToMemoryPool(CTxMemPool& pool, CTransaction& tx, MapPrevTx& mapInputs, CBlockIndex* pindexPrepared, bool* pfMissingInputs);
+
 /** Count ECDSA signature operations the old-fashioned (pre-0.6) way
     @return number of sigops this transaction's outputs will produce when spent
     @see CTransaction::FetchInputs
@@ -552,6 +600,7 @@ public:
 class CWalletInterface {
 protected:
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock, bool fConnect) =0;
+    virtual void SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock, bool fConnect) =0;
     virtual void EraseFromWallet(const uint256 &hash) =0;
     virtual void SetBestChain(const CBlockLocator &locator) =0;
     virtual bool UpdatedTransaction(const uint256 &hash) =0;
@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "miner.h"
+#include "crypto/sha256.h"
 #include "primitives/block.h"
 #include "txdb.h"
 #include "kernel.h"
@@ -42,20 +43,18 @@ static const unsigned int pSHA256InitState[8] =
 
 void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 {
-    SHA256_CTX ctx;
     unsigned char data[64];
-
-    SHA256_Init(&ctx);
+    uint32_t state[8];
 
     for (int i = 0; i < 16; i++)
         ((uint32_t*)data)[i] = ByteReverse(((uint32_t*)pinput)[i]);
 
     for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
+        state[i] = ((uint32_t*)pinit)[i];
 
-    SHA256_Update(&ctx, data, sizeof(data));
+    SHA256TransformBlocks(state, data, 1);
     for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
+        ((uint32_t*)pstate)[i] = state[i];
 }
 
 // Some explaining would be appreciated
@@ -543,6 +542,7 @@ void ThreadStakeMiner(CWallet *pwallet)
     CReserveKey reservekey(pwallet);
 
     bool fTryToSync = true;
+    int64_t nLastSearchSlot = 0;
 
     while (true)
     {
@@ -569,6 +569,20 @@ void ThreadStakeMiner(CWallet *pwallet)
             }
         }
 
+        // Kernels only change with the stake timeslot, so there is nothing
+        // new to search for until the next one starts
+        int64_t nSearchSlot = GetAdjustedTime() & ~STAKE_TIMESTAMP_MASK;
+        if (nSearchSlot == nLastSearchSlot)
+        {
+            {
+                LOCK(pwallet->cs_wallet);
+                pwallet->stakeSearchStats.nSkipped++;
+            }
+            MilliSleep(nMinerSleep);
+            continue;
+        }
+        nLastSearchSlot = nSearchSlot;
+
         //
         // Create new block
         //
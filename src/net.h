@@ -208,6 +208,7 @@ public:
         ignoreUntil     = 0;
         nWakeCounter    = 0;
         nPeerId         = 0;
+        nVersion        = 0;
         fEnabled        = false;
     };
     
@@ -219,6 +220,7 @@ public:
     int64_t                     ignoreUntil;
     uint32_t                    nWakeCounter;
     uint32_t                    nPeerId;
+    uint32_t                    nVersion;       // smsg protocol version sent in the peer's smsgPong, 0 if none
     bool                        fEnabled;
     
 };
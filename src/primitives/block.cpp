@@ -5,7 +5,106 @@
 
 #include "primitives/block.h"
 #include "chainparams.h"
+#include "crypto/sha256.h"
+#include "sync.h"
+#include "util.h"
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <deque>
+
+// Recently computed scrypt PoW hashes, keyed by the double-SHA256 of the
+// 80-byte header. Version 1 block hashes are scrypt hashes too, so without
+// this every GetHash() on such a block redoes the scrypt.
+static const unsigned int MAX_POW_HASH_CACHE = 10000;
+static CCriticalSection cs_powHashCache;
+static std::map<uint256, uint256> mapPoWHashCache;
+static std::deque<uint256> vPoWHashCacheOrder;
+
+static void CachePoWHash(const uint256& hashHeader, const uint256& hashPoW)
+{
+    LOCK(cs_powHashCache);
+    if (!mapPoWHashCache.insert(std::make_pair(hashHeader, hashPoW)).second)
+        return;
+    vPoWHashCacheOrder.push_back(hashHeader);
+    if (vPoWHashCacheOrder.size() > MAX_POW_HASH_CACHE)
+    {
+        mapPoWHashCache.erase(vPoWHashCacheOrder.front());
+        vPoWHashCacheOrder.pop_front();
+    }
+}
+
+uint256 CBlockHeader::GetPoWHash() const
+{
+    uint256 hashHeader = Hash(BEGIN(nVersion), END(nNonce));
+    {
+        LOCK(cs_powHashCache);
+        std::map<uint256, uint256>::const_iterator mi = mapPoWHashCache.find(hashHeader);
+        if (mi != mapPoWHashCache.end())
+            return mi->second;
+    }
+    uint256 hashPoW = scrypt_blockhash(CVOIDBEGIN(nVersion));
+    CachePoWHash(hashHeader, hashPoW);
+    return hashPoW;
+}
+
+// Contiguous shares, so each thread can feed the multi-lane scrypt core
+static void GetPoWHashesThread(const std::vector<CBlockHeader>* pvHeaders, std::vector<uint256>* pvHashes,
+                               int nThread, int nThreads)
+{
+    size_t nBegin = pvHeaders->size() * nThread / nThreads;
+    size_t nEnd = pvHeaders->size() * (nThread + 1) / nThreads;
+    std::vector<const void*> vInputs;
+    for (size_t i = nBegin; i < nEnd; i++)
+        vInputs.push_back(CVOIDBEGIN((*pvHeaders)[i].nVersion));
+    if (!vInputs.empty())
+        scrypt_blockhash_batch(&vInputs[0], &(*pvHashes)[nBegin], vInputs.size());
+    for (size_t i = nBegin; i < nEnd; i++)
+        CachePoWHash(Hash(BEGIN((*pvHeaders)[i].nVersion), END((*pvHeaders)[i].nNonce)), (*pvHashes)[i]);
+}
+
+void GetPoWHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes, int nThreads)
+{
+    vHashes.resize(vHeaders.size());
+    ParallelFor(vHeaders.size(), nThreads, boost::bind(&GetPoWHashesThread, &vHeaders, &vHashes, _1, _2));
+}
+
+// Each share hashes into its own slots, using its thread's own Argon2 arena
+static void GetPoWArgonHashesThread(const std::vector<CBlockHeader>* pvHeaders, std::vector<uint256>* pvHashes,
+                                    int nThread, int nThreads)
+{
+    for (size_t i = nThread; i < pvHeaders->size(); i += nThreads)
+        (*pvHashes)[i] = (*pvHeaders)[i].GetPoWArgonHash();
+}
+
+void GetPoWArgonHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes, int nThreads)
+{
+    vHashes.resize(vHeaders.size());
+    ParallelFor(vHeaders.size(), nThreads, boost::bind(&GetPoWArgonHashesThread, &vHeaders, &vHashes, _1, _2));
+}
+
+uint256 CBlock::BuildMerkleTree() const
+{
+    vMerkleTree.clear();
+    vMerkleTree.reserve(vtx.size() * 2 + 16);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vMerkleTree.push_back(tx.GetHash());
+    std::vector<uint256> vLevel;
+    int j = 0;
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        // Each pair of adjacent hashes is one 64-byte input, so a whole level
+        // is hashed with a single batched double-SHA256; an odd last entry is
+        // paired with itself.
+        int nPairs = (nSize + 1) / 2;
+        vLevel.assign(vMerkleTree.begin() + j, vMerkleTree.begin() + j + nSize);
+        if (nSize & 1)
+            vLevel.push_back(vLevel.back());
+        vMerkleTree.resize(j + nSize + nPairs);
+        SHA256D64(vMerkleTree[j + nSize].begin(), vLevel[0].begin(), nPairs);
+        j += nSize;
+    }
+    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+}
 
 bool CBlock::CheckBlockSignature() const
 {
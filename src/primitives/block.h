@@ -84,10 +84,7 @@ public:
             return GetPoWHash();
     }
 
-    uint256 GetPoWHash() const
-    {
-        return scrypt_blockhash(CVOIDBEGIN(nVersion));
-    }
+    uint256 GetPoWHash() const;
 
     uint256 GetPoWArgonHash() const
     {
@@ -100,6 +97,16 @@ public:
     }
 };
 
+/** Compute GetPoWHash() for many headers at once, spread over nThreads threads
+ *  (0 = one per core). The results are also cached, so feeding a batch here
+ *  ahead of serial validation makes the scrypt checks in CheckBlock and
+ *  ReadFromDisk nearly free. vHashes[i] is the hash of vHeaders[i]. */
+void GetPoWHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes, int nThreads = 0);
+
+/** Compute GetPoWArgonHash() for many headers at once, spread over nThreads
+ *  threads (0 = one per core). vHashes[i] is the hash of vHeaders[i]. */
+void GetPoWArgonHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes, int nThreads = 0);
+
 class CBlock: public CBlockHeader
 {
 public:
@@ -193,24 +200,7 @@ public:
         return maxTransactionTime;
     }
 
-    uint256 BuildMerkleTree() const
-    {
-        vMerkleTree.clear();
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
-    }
+    uint256 BuildMerkleTree() const;
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
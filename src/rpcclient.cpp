@@ -164,6 +164,13 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "importaddress", 2 },
     { "checkkernel", 0 },
     { "checkkernel", 1 },
+    { "benchkernel", 0 },
+    { "benchkernel", 1 },
+    { "benchkernel", 2 },
+    { "smsgsend", 3 },
+    { "smsgsendanon", 2 },
+    { "smsgsendstatus", 0 },
+    { "smsgscanchain", 0 },
     { "submitblock", 1 },
     { "sendtostealthaddress", 1 },
     { "searchrawtransactions", 1 },
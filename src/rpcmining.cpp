@@ -17,6 +17,7 @@
 #include "stormnode-sync.h"
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 using namespace json_spirit;
 using namespace std;
@@ -144,6 +145,24 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
+    if (pwalletMain)
+    {
+        CStakeSearchStats stats;
+        {
+            LOCK(pwalletMain->cs_wallet);
+            stats = pwalletMain->stakeSearchStats;
+        }
+        Object search;
+        search.push_back(Pair("time", stats.nLastSearch));
+        search.push_back(Pair("elapsed-ms", 0.001 * stats.nLastSearchMicros));
+        search.push_back(Pair("candidates", (uint64_t)stats.nCandidates));
+        search.push_back(Pair("kernels-checked", stats.nKernelsChecked));
+        search.push_back(Pair("hashespersec", stats.nLastSearchMicros ? 1000000.0 * stats.nKernelsChecked / stats.nLastSearchMicros : 0.0));
+        search.push_back(Pair("searches", stats.nSearches));
+        search.push_back(Pair("skipped", stats.nSkipped));
+        obj.push_back(Pair("lastsearch", search));
+    }
+
     return obj;
 }
 
@@ -233,6 +252,85 @@ Value checkkernel(const Array& params, bool fHelp)
     return result;
 }
 
+Value benchkernel(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "benchkernel [coins=1000] [interval=60] [threads=0]\n"
+            "Times a stake kernel search of made-up coins on top of the best block.\n"
+            "No kernel meets the target, so every coin is hashed at every timestamp, once\n"
+            "one at a time as CheckKernel() does and once by the threaded search\n"
+            "(threads=0 uses one per core, and at most one per core is used).\n"
+            "At most 100000 coins and an interval of 3600 seconds are used.\n"
+            "Disk reads are not included.\n"
+        );
+
+    int nCoins = params.size() > 0 ? params[0].get_int() : 1000;
+    int nInterval = params.size() > 1 ? params[1].get_int() : 60;
+    int nThreads = params.size() > 2 ? params[2].get_int() : 0;
+    if (nCoins < 1 || nInterval < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, coins and interval must be positive");
+    nCoins = std::min(nCoins, 100000);
+    nInterval = std::min(nInterval, 3600);
+    int nCores = std::max(1, (int)boost::thread::hardware_concurrency());
+    if (nThreads <= 0 || nThreads > nCores)
+        nThreads = nCores;
+
+    // block indexes are never freed, only the snapshot needs the lock
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = pindexBest;
+    }
+    if (pindexPrev == NULL)
+        throw JSONRPCError(RPC_MISC_ERROR, "No best block");
+    unsigned int nBits = 0;
+    unsigned int nTime = GetAdjustedTime() & ~STAKE_TIMESTAMP_MASK;
+    vector<CStakeKernelInput> vInputs(nCoins);
+    for (int i = 0; i < nCoins; i++)
+    {
+        vInputs[i].prevout = COutPoint(GetRandHash(), i % 4);
+        vInputs[i].nTimeTxPrev = nTime - nStakeMinAge;
+        vInputs[i].nTimeBlockFrom = nTime - nStakeMinAge;
+        vInputs[i].nValue = COIN;
+    }
+    uint64_t nCandidates = (uint64_t)nCoins * nInterval;
+
+    CTransaction txPrev;
+    txPrev.vout.resize(4, CTxOut(COIN, CScript()));
+    uint256 hashProofOfStake, targetProofOfStake;
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(const CStakeKernelInput& input, vInputs)
+    {
+        txPrev.nTime = input.nTimeTxPrev;
+        for (int n = 0; n < nInterval; n++)
+            CheckStakeKernelHash(pindexPrev, nBits, input.nTimeBlockFrom, txPrev, input.prevout, nTime - n, hashProofOfStake, targetProofOfStake);
+    }
+    int64_t nSerial = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    unsigned int nTimeKernel;
+    uint64_t nHashes;
+    nStart = GetTimeMicros();
+    SearchStakeKernels(pindexPrev, nBits, nTime, nInterval, vInputs, nTimeKernel, nHashes, nThreads);
+    int64_t nThreaded = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    Object result, serial, threaded;
+    result.push_back(Pair("coins", nCoins));
+    result.push_back(Pair("interval", nInterval));
+    result.push_back(Pair("kernels", nCandidates));
+
+    serial.push_back(Pair("elapsed-ms", 0.001 * nSerial));
+    serial.push_back(Pair("kernelspersec", 1000000.0 * nCandidates / nSerial));
+    result.push_back(Pair("serial", serial));
+
+    threaded.push_back(Pair("threads", nThreads));
+    threaded.push_back(Pair("elapsed-ms", 0.001 * nThreaded));
+    threaded.push_back(Pair("kernelspersec", 1000000.0 * nHashes / nThreaded));
+    result.push_back(Pair("threaded", threaded));
+
+    return result;
+}
+
 Value getworkex(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
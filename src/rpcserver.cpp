@@ -310,9 +310,9 @@ static const CRPCCommand vRPCCommands[] =
     { "listsinceblock",         &listsinceblock,         false,     false,     true },
     { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
     { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
+    { "importprivkey",          &importprivkey,          false,     true,      true },
     { "importwallet",           &importwallet,           false,     false,     true },
-    { "importaddress",          &importaddress,          false,     false,     true },
+    { "importaddress",          &importaddress,          false,     true,      true },
     { "listunspent",            &listunspent,            false,     false,     true },
     { "settxfee",               &settxfee,               false,     false,     true },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
@@ -324,11 +324,12 @@ static const CRPCCommand vRPCCommands[] =
     { "resendtx",               &resendtx,               false,     true,      true },
     { "makekeypair",            &makekeypair,            false,     true,      false },
     { "checkkernel",            &checkkernel,            true,      false,     true },
+    { "benchkernel",            &benchkernel,            true,      false,     false },
     { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,     true},
     { "liststealthaddresses",   &liststealthaddresses,   false,     false,     true},
     { "importstealthaddress",   &importstealthaddress,   false,      false,    true},
     { "sendtostealthaddress",   &sendtostealthaddress,   false,      false,    true},
-    { "scanforalltxns",         &scanforalltxns,         false,      false,    true},
+    { "scanforalltxns",         &scanforalltxns,         false,      true,     true},
     { "smsgenable",             &smsgenable,             false,     false,     false },
     { "smsgdisable",            &smsgdisable,            false,     false,     false },
     { "smsglocalkeys",          &smsglocalkeys,          false,     false,     false },
@@ -342,6 +343,8 @@ static const CRPCCommand vRPCCommands[] =
     { "smsginbox",              &smsginbox,              false,     false,     false },
     { "smsgoutbox",             &smsgoutbox,             false,     false,     false },
     { "smsgbuckets",            &smsgbuckets,            false,     false,     false },
+    { "smsgpowstats",           &smsgpowstats,           false,     false,     false },
+    { "smsgsendstatus",         &smsgsendstatus,         false,     true,      false },
 #endif
 };
 
@@ -161,6 +161,7 @@ extern json_spirit::Value getstakesubsidy(const json_spirit::Array& params, bool
 extern json_spirit::Value getmininginfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getstakinginfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value checkkernel(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchkernel(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblocktemplate(const json_spirit::Array& params, bool fHelp);
@@ -254,5 +255,7 @@ extern json_spirit::Value smsgsendanon(const json_spirit::Array& params, bool fH
 extern json_spirit::Value smsginbox(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value smsgoutbox(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value smsgbuckets(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value smsgpowstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value smsgsendstatus(const json_spirit::Array& params, bool fHelp);
 
 #endif // DARKSILKRPC_SERVER_H
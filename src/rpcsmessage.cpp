@@ -347,16 +347,19 @@ Value smsglocalkeys(const Array& params, bool fHelp)
 
 Value smsgscanchain(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "smsgscanchain \n"
-            "Look for public keys in the block chain.");
+            "smsgscanchain [fromgenesis=false]\n"
+            "Look for public keys in the block chain.\n"
+            "Continues from the last block scanned, unless fromgenesis is true.");
     
     if (!fSecMsgEnabled)
         throw runtime_error("Secure messaging is disabled.");
     
+    bool fFromGenesis = params.size() > 0 ? params[0].get_bool() : false;
+    
     Object result;
-    if (!SecureMsgScanBlockChain())
+    if (!SecureMsgScanBlockChain(fFromGenesis))
     {
         result.push_back(Pair("result", "Scan Chain Failed."));
     } else
@@ -508,12 +511,32 @@ Value smsggetpubkey(const Array& params, bool fHelp)
     return result;
 }
 
+static Object smsgsendqueued(std::string& addrFrom, std::string& addrTo, std::string& msg)
+{
+    Object result;
+    
+    uint64_t nId;
+    std::string sError;
+    if (SecureMsgSendAsync(addrFrom, addrTo, msg, nId, sError) != 0)
+    {
+        result.push_back(Pair("result", "Send failed."));
+        result.push_back(Pair("error", sError));
+    } else
+    {
+        result.push_back(Pair("result", "Queued."));
+        result.push_back(Pair("id", nId));
+    };
+    
+    return result;
+}
+
 Value smsgsend(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 3)
+    if (fHelp || params.size() < 3 || params.size() > 4)
         throw runtime_error(
-            "smsgsend <addrFrom> <addrTo> <message>\n"
-            "Send an encrypted message from addrFrom to addrTo.");
+            "smsgsend <addrFrom> <addrTo> <message> [async=false]\n"
+            "Send an encrypted message from addrFrom to addrTo.\n"
+            "With async the message is encrypted in the background, returns an id for smsgsendstatus.");
     
     if (!fSecMsgEnabled)
         throw runtime_error("Secure messaging is disabled.");
@@ -522,6 +545,8 @@ Value smsgsend(const Array& params, bool fHelp)
     std::string addrTo    = params[1].get_str();
     std::string msg       = params[2].get_str();
     
+    if (params.size() > 3 && params[3].get_bool())
+        return smsgsendqueued(addrFrom, addrTo, msg);
     
     Object result;
     
@@ -538,10 +563,11 @@ Value smsgsend(const Array& params, bool fHelp)
 
 Value smsgsendanon(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 2)
+    if (fHelp || params.size() < 2 || params.size() > 3)
         throw runtime_error(
-            "smsgsendanon <addrTo> <message>\n"
-            "Send an anonymous encrypted message to addrTo.");
+            "smsgsendanon <addrTo> <message> [async=false]\n"
+            "Send an anonymous encrypted message to addrTo.\n"
+            "With async the message is encrypted in the background, returns an id for smsgsendstatus.");
     
     if (!fSecMsgEnabled)
         throw runtime_error("Secure messaging is disabled.");
@@ -550,6 +576,8 @@ Value smsgsendanon(const Array& params, bool fHelp)
     std::string addrTo    = params[0].get_str();
     std::string msg       = params[1].get_str();
     
+    if (params.size() > 2 && params[2].get_bool())
+        return smsgsendqueued(addrFrom, addrTo, msg);
     
     Object result;
     std::string sError;
@@ -608,7 +636,7 @@ Value smsginbox(const Array& params, bool fHelp)
         {
             dbInbox.TxnBegin();
             
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbInbox.NewIterator();
             while (dbInbox.NextSmesgKey(it, sPrefix, chKey))
             {
                 dbInbox.EraseSmesg(chKey);
@@ -630,7 +658,7 @@ Value smsginbox(const Array& params, bool fHelp)
             
             dbInbox.TxnBegin();
             
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbInbox.NewIterator();
             while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
                 if (fCheckReadStatus
@@ -718,7 +746,7 @@ Value smsgoutbox(const Array& params, bool fHelp)
         {
             dbOutbox.TxnBegin();
             
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbOutbox.NewIterator();
             while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
             {
                 dbOutbox.EraseSmesg(chKey);
@@ -735,7 +763,7 @@ Value smsgoutbox(const Array& params, bool fHelp)
         {
             SecMsgStored smsgStored;
             MessageData msg;
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+            leveldb::Iterator* it = dbOutbox.NewIterator();
             while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
@@ -801,7 +829,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
             
             for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
             {
-                std::set<SecMsgToken>& tokenSet = it->second.setTokens;
+                SecMsgTokenSet& tokenSet = it->second.setTokens;
                 
                 std::string sBucket = boost::lexical_cast<std::string>(it->first);
                 std::string sFile = sBucket + "_01.dat";
@@ -809,7 +837,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 snprintf(cbuf, sizeof(cbuf), "%"PRIszu, tokenSet.size());
                 std::string snContents(cbuf);
                 
-                std::string sHash = boost::lexical_cast<std::string>(it->second.hash);
+                std::string sHash = boost::lexical_cast<std::string>(it->second.GetHash());
                 
                 nBuckets++;
                 nMessages += tokenSet.size();
@@ -894,3 +922,71 @@ Value smsgbuckets(const Array& params, bool fHelp)
 
     return result;
 };
+
+Value smsgpowstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "smsgpowstats\n"
+            "Display proof of work statistics for sent messages.");
+    
+    SecMsgPowStats stats;
+    SecureMsgGetPowStats(stats);
+    
+    Object result, last;
+    result.push_back(Pair("threads",            stats.nThreads));
+    result.push_back(Pair("messages",           stats.nMessages));
+    result.push_back(Pair("hashes",             stats.nHashes));
+    result.push_back(Pair("hashespersec",       stats.nMillis > 0 ? 1000.0 * stats.nHashes / stats.nMillis : 0.0));
+    result.push_back(Pair("mspermessage",       stats.nMessages > 0 ? (double)stats.nMillis / stats.nMessages : 0.0));
+    
+    last.push_back(Pair("payload",              (uint64_t)stats.nLastPayload));
+    last.push_back(Pair("hashes",               stats.nLastHashes));
+    last.push_back(Pair("ms",                   stats.nLastMillis));
+    last.push_back(Pair("hashespersec",         stats.nLastMillis > 0 ? 1000.0 * stats.nLastHashes / stats.nLastMillis : 0.0));
+    result.push_back(Pair("last",               last));
+    
+    return result;
+};
+
+static Object smsgsendjobtoobject(const SecMsgSendJob& job)
+{
+    static const char* statusNames[] = {"queued", "encrypting", "pow", "sent", "failed"};
+    
+    Object obj;
+    obj.push_back(Pair("id",                job.nId));
+    obj.push_back(Pair("from",              job.sAddrFrom));
+    obj.push_back(Pair("to",                job.sAddrTo));
+    obj.push_back(Pair("status",            statusNames[job.nStatus]));
+    if (!job.sError.empty())
+        obj.push_back(Pair("error",         job.sError));
+    obj.push_back(Pair("queued",            job.nTimeQueued));
+    obj.push_back(Pair("changed",           job.nTimeChanged));
+    return obj;
+}
+
+Value smsgsendstatus(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "smsgsendstatus [id]\n"
+            "Show the progress of messages sent with async, all recent ones if no id is given.\n"
+            "status is one of queued, encrypting, pow, sent or failed.");
+    
+    if (params.size() > 0)
+    {
+        SecMsgSendJob job;
+        if (!SecureMsgGetSendJob(params[0].get_int64(), job))
+            throw runtime_error("Unknown message id.");
+        return smsgsendjobtoobject(job);
+    };
+    
+    std::vector<SecMsgSendJob> vJobs;
+    SecureMsgGetSendJobs(vJobs);
+    
+    Array result;
+    for (std::vector<SecMsgSendJob>::iterator it = vJobs.begin(); it != vJobs.end(); ++it)
+        result.push_back(smsgsendjobtoobject(*it));
+    
+    return result;
+};
@@ -200,9 +200,6 @@ Value getnewpubkey(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -239,9 +236,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -2558,6 +2552,7 @@ Value scanforalltxns(const Array& params, bool fHelp)
     
     if (nFromHeight > 0)
     {
+        LOCK(cs_main);
         pindex = mapBlockIndex[hashBestChain];
         while (pindex->nHeight > nFromHeight
             && pindex->pprev)
@@ -2567,14 +2562,11 @@ Value scanforalltxns(const Array& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
     
-    {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-        
-        pwalletMain->MarkDirty();
-        
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+    // -- not run under the RPC locks, the rescan releases them between batches
+    pwalletMain->MarkDirty();
+    
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    pwalletMain->ReacceptWalletTransactions();
     
     result.push_back(Pair("result", "Scan complete."));
     
@@ -33,7 +33,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <boost/thread/tss.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SCRYPT_SIMD
+#include <immintrin.h>
+#endif
+
 #define SCRYPT_BUFFER_SIZE (131072 + 63)
+#define SCRYPT_LANES 8
 
 #if defined (OPTIMIZED_SALSA) && ( defined (__x86_64__) || defined (__i386__) || defined(__arm__) )
 extern "C" void scrypt_core(unsigned int *X, unsigned int *V);
@@ -128,34 +137,242 @@ static inline void scrypt_core(unsigned int *X, unsigned int *V)
 
 #endif
 
+#ifdef USE_SCRYPT_SIMD
+/* Salsa20/8 on a block held in diagonal order (word i of the register set is
+   word i * 5 % 16 of the block), so every quarter-round step works on four
+   independent words at once */
+#define SALSA_STEP(a, b, c, r) \
+    T = _mm_add_epi32(b, c); \
+    a = _mm_xor_si128(a, _mm_slli_epi32(T, r)); \
+    a = _mm_xor_si128(a, _mm_srli_epi32(T, 32 - r));
+
+static inline __attribute__((target("sse2"))) void xor_salsa8_sse2(__m128i B[4], const __m128i Bx[4])
+{
+    __m128i X0, X1, X2, X3, T;
+    int i;
+
+    X0 = B[0] = _mm_xor_si128(B[0], Bx[0]);
+    X1 = B[1] = _mm_xor_si128(B[1], Bx[1]);
+    X2 = B[2] = _mm_xor_si128(B[2], Bx[2]);
+    X3 = B[3] = _mm_xor_si128(B[3], Bx[3]);
+
+    for (i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        SALSA_STEP(X1, X0, X3, 7);
+        SALSA_STEP(X2, X1, X0, 9);
+        SALSA_STEP(X3, X2, X1, 13);
+        SALSA_STEP(X0, X3, X2, 18);
+
+        X1 = _mm_shuffle_epi32(X1, 0x93);
+        X2 = _mm_shuffle_epi32(X2, 0x4E);
+        X3 = _mm_shuffle_epi32(X3, 0x39);
+
+        /* Operate on rows. */
+        SALSA_STEP(X3, X0, X1, 7);
+        SALSA_STEP(X2, X3, X0, 9);
+        SALSA_STEP(X1, X2, X3, 13);
+        SALSA_STEP(X0, X1, X2, 18);
+
+        X1 = _mm_shuffle_epi32(X1, 0x39);
+        X2 = _mm_shuffle_epi32(X2, 0x4E);
+        X3 = _mm_shuffle_epi32(X3, 0x93);
+    }
+
+    B[0] = _mm_add_epi32(B[0], X0);
+    B[1] = _mm_add_epi32(B[1], X1);
+    B[2] = _mm_add_epi32(B[2], X2);
+    B[3] = _mm_add_epi32(B[3], X3);
+}
+
+static __attribute__((target("sse2"))) void scrypt_core_sse2(unsigned int *X, unsigned int *V)
+{
+    unsigned int Y[32];
+    __m128i *Z = (__m128i *)V;
+    __m128i B[8];
+    unsigned int i, j, k;
+
+    // Into diagonal order; the scratchpad stays in that order throughout
+    for (k = 0; k < 2; k++)
+        for (i = 0; i < 16; i++)
+            Y[k * 16 + i] = X[k * 16 + (i * 5 % 16)];
+    for (i = 0; i < 8; i++)
+        B[i] = _mm_loadu_si128((const __m128i *)&Y[i * 4]);
+
+    for (i = 0; i < 1024; i++) {
+        for (k = 0; k < 8; k++)
+            Z[i * 8 + k] = B[k];
+        xor_salsa8_sse2(&B[0], &B[4]);
+        xor_salsa8_sse2(&B[4], &B[0]);
+    }
+    for (i = 0; i < 1024; i++) {
+        // Word 0 of the second half sits at position 0 in diagonal order too
+        j = 8 * (_mm_cvtsi128_si32(B[4]) & 1023);
+        for (k = 0; k < 8; k++)
+            B[k] = _mm_xor_si128(B[k], Z[j + k]);
+        xor_salsa8_sse2(&B[0], &B[4]);
+        xor_salsa8_sse2(&B[4], &B[0]);
+    }
+
+    for (i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i *)&Y[i * 4], B[i]);
+    for (k = 0; k < 2; k++)
+        for (i = 0; i < 16; i++)
+            X[k * 16 + (i * 5 % 16)] = Y[k * 16 + i];
+}
+#undef SALSA_STEP
+
+/* Salsa20/8 across eight independent blocks: register w holds word w of every
+   lane, so the scalar algorithm maps over directly */
+#define ROTL_AVX2(a, r) _mm256_or_si256(_mm256_slli_epi32(a, r), _mm256_srli_epi32(a, 32 - r))
+#define SALSA_STEP_AVX2(a, b, c, r) a = _mm256_xor_si256(a, ROTL_AVX2(_mm256_add_epi32(b, c), r))
+
+static inline __attribute__((target("avx2"))) void xor_salsa8_8way(__m256i B[16], const __m256i Bx[16])
+{
+    __m256i x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+
+    for (i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        SALSA_STEP_AVX2(x[4], x[0], x[12], 7);  SALSA_STEP_AVX2(x[9], x[5], x[1], 7);
+        SALSA_STEP_AVX2(x[14], x[10], x[6], 7); SALSA_STEP_AVX2(x[3], x[15], x[11], 7);
+
+        SALSA_STEP_AVX2(x[8], x[4], x[0], 9);   SALSA_STEP_AVX2(x[13], x[9], x[5], 9);
+        SALSA_STEP_AVX2(x[2], x[14], x[10], 9); SALSA_STEP_AVX2(x[7], x[3], x[15], 9);
+
+        SALSA_STEP_AVX2(x[12], x[8], x[4], 13); SALSA_STEP_AVX2(x[1], x[13], x[9], 13);
+        SALSA_STEP_AVX2(x[6], x[2], x[14], 13); SALSA_STEP_AVX2(x[11], x[7], x[3], 13);
+
+        SALSA_STEP_AVX2(x[0], x[12], x[8], 18); SALSA_STEP_AVX2(x[5], x[1], x[13], 18);
+        SALSA_STEP_AVX2(x[10], x[6], x[2], 18); SALSA_STEP_AVX2(x[15], x[11], x[7], 18);
+
+        /* Operate on rows. */
+        SALSA_STEP_AVX2(x[1], x[0], x[3], 7);   SALSA_STEP_AVX2(x[6], x[5], x[4], 7);
+        SALSA_STEP_AVX2(x[11], x[10], x[9], 7); SALSA_STEP_AVX2(x[12], x[15], x[14], 7);
+
+        SALSA_STEP_AVX2(x[2], x[1], x[0], 9);   SALSA_STEP_AVX2(x[7], x[6], x[5], 9);
+        SALSA_STEP_AVX2(x[8], x[11], x[10], 9); SALSA_STEP_AVX2(x[13], x[12], x[15], 9);
+
+        SALSA_STEP_AVX2(x[3], x[2], x[1], 13);  SALSA_STEP_AVX2(x[4], x[7], x[6], 13);
+        SALSA_STEP_AVX2(x[9], x[8], x[11], 13); SALSA_STEP_AVX2(x[14], x[13], x[12], 13);
+
+        SALSA_STEP_AVX2(x[0], x[3], x[2], 18);  SALSA_STEP_AVX2(x[5], x[4], x[7], 18);
+        SALSA_STEP_AVX2(x[10], x[9], x[8], 18); SALSA_STEP_AVX2(x[15], x[14], x[13], 18);
+    }
+
+    for (i = 0; i < 16; i++)
+        B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+#undef SALSA_STEP_AVX2
+#undef ROTL_AVX2
+
+/* X holds SCRYPT_LANES blocks of 32 words back to back; V needs
+   SCRYPT_LANES * 128KB */
+static __attribute__((target("avx2"))) void scrypt_core_8way(unsigned int *X, unsigned int *V)
+{
+    __m256i *Z = (__m256i *)V;
+    __m256i B[32];
+    unsigned int i, k;
+
+    for (k = 0; k < 32; k++)
+        B[k] = _mm256_setr_epi32(X[k], X[32 + k], X[64 + k], X[96 + k],
+                                 X[128 + k], X[160 + k], X[192 + k], X[224 + k]);
+
+    for (i = 0; i < 1024; i++) {
+        for (k = 0; k < 32; k++)
+            Z[i * 32 + k] = B[k];
+        xor_salsa8_8way(&B[0], &B[16]);
+        xor_salsa8_8way(&B[16], &B[0]);
+    }
+
+    // Each lane reads its own scratchpad row: element (j * 32 + k) * 8 + lane
+    const __m256i vLane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i vMask = _mm256_set1_epi32(1023);
+    for (i = 0; i < 1024; i++) {
+        __m256i vIndex = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(B[16], vMask), 8), vLane);
+        for (k = 0; k < 32; k++) {
+            B[k] = _mm256_xor_si256(B[k], _mm256_i32gather_epi32((const int *)V, vIndex, 4));
+            vIndex = _mm256_add_epi32(vIndex, _mm256_set1_epi32(8));
+        }
+        xor_salsa8_8way(&B[0], &B[16]);
+        xor_salsa8_8way(&B[16], &B[0]);
+    }
+
+    unsigned int Y[8] __attribute__((aligned(32)));
+    for (k = 0; k < 32; k++) {
+        _mm256_store_si256((__m256i *)Y, B[k]);
+        for (i = 0; i < 8; i++)
+            X[i * 32 + k] = Y[i];
+    }
+}
+#endif
+
+static void (*scrypt_core_active)(unsigned int *X, unsigned int *V) = scrypt_core;
+static bool fScrypt8Way = false;
+
+std::string scrypt_select_impl(bool fHardware)
+{
+    scrypt_core_active = scrypt_core;
+    fScrypt8Way = false;
+    std::string ret = "generic";
+#ifdef USE_SCRYPT_SIMD
+    __builtin_cpu_init();
+    if (fHardware && __builtin_cpu_supports("sse2")) {
+        scrypt_core_active = scrypt_core_sse2;
+        ret = "sse2";
+    }
+    if (fHardware && __builtin_cpu_supports("avx2")) {
+        fScrypt8Way = true;
+        ret += ",avx2(8way)";
+    }
+#endif
+    return ret;
+}
+
+// Scratchpads are reused per thread rather than taking 128KB of stack (or
+// 1MB for the eight-lane core) on every call
+static boost::thread_specific_ptr<std::vector<unsigned char> > scryptScratchpad;
+
+static unsigned int *scrypt_scratchpad(size_t nLanes)
+{
+    std::vector<unsigned char>* pScratchpad = scryptScratchpad.get();
+    if (!pScratchpad)
+    {
+        pScratchpad = new std::vector<unsigned char>();
+        scryptScratchpad.reset(pScratchpad);
+    }
+    size_t nSize = (SCRYPT_BUFFER_SIZE - 63) * nLanes + 63;
+    if (pScratchpad->size() < nSize)
+        pScratchpad->resize(nSize);
+    return (unsigned int *)(((uintptr_t)(&(*pScratchpad)[0]) + 63) & ~ (uintptr_t)(63));
+}
+
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
    scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
    r = 1, p = 1, N = 1024
  */
 
-uint256 scrypt_nosalt(const void* input, size_t inputlen, void *scratchpad)
+uint256 scrypt_nosalt(const void* input, size_t inputlen, unsigned int *V)
 {
-    unsigned int *V;
     unsigned int X[32];
     uint256 result = 0;
-    V = (unsigned int *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
     PBKDF2_SHA256((const uint8_t*)input, inputlen, (const uint8_t*)input, inputlen, 1, (uint8_t *)X, 128);
-    scrypt_core(X, V);
+    scrypt_core_active(X, V);
     PBKDF2_SHA256((const uint8_t*)input, inputlen, (uint8_t *)X, 128, 1, (uint8_t*)&result, 32);
 
     return result;
 }
 
-uint256 scrypt(const void* data, size_t datalen, const void* salt, size_t saltlen, void *scratchpad)
+uint256 scrypt(const void* data, size_t datalen, const void* salt, size_t saltlen, unsigned int *V)
 {
-    unsigned int *V;
     unsigned int X[32];
     uint256 result = 0;
-    V = (unsigned int *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
     PBKDF2_SHA256((const uint8_t*)data, datalen, (const uint8_t*)salt, saltlen, 1, (uint8_t *)X, 128);
-    scrypt_core(X, V);
+    scrypt_core_active(X, V);
     PBKDF2_SHA256((const uint8_t*)data, datalen, (uint8_t *)X, 128, 1, (uint8_t*)&result, 32);
 
     return result;
@@ -163,14 +380,12 @@ uint256 scrypt(const void* data, size_t datalen, const void* salt, size_t saltle
 
 uint256 scrypt_hash(const void* input, size_t inputlen)
 {
-    unsigned char scratchpad[SCRYPT_BUFFER_SIZE];
-    return scrypt_nosalt(input, inputlen, scratchpad);
+    return scrypt_nosalt(input, inputlen, scrypt_scratchpad(1));
 }
 
 uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt, size_t saltlen)
 {
-    unsigned char scratchpad[SCRYPT_BUFFER_SIZE];
-    return scrypt(input, inputlen, salt, saltlen, scratchpad);
+    return scrypt(input, inputlen, salt, saltlen, scrypt_scratchpad(1));
 }
 
 uint256 scrypt_salted_multiround_hash(const void* input, size_t inputlen, const void* salt, size_t saltlen, const unsigned int nRounds)
@@ -189,7 +404,38 @@ uint256 scrypt_salted_multiround_hash(const void* input, size_t inputlen, const
 
 uint256 scrypt_blockhash(const void* input)
 {
-    unsigned char scratchpad[SCRYPT_BUFFER_SIZE];
-    return scrypt_nosalt(input, 80, scratchpad);
+    return scrypt_nosalt(input, 80, scrypt_scratchpad(1));
+}
+
+void scrypt_blockhash_batch(const void* const* pinputs, uint256* phashes, size_t nCount)
+{
+    size_t i = 0;
+#ifdef USE_SCRYPT_SIMD
+    // A full eight-lane pass costs about as much as three single-lane
+    // hashes, so smaller remainders go through the single-lane core; a
+    // partial group is padded by repeating its final header
+    if (fScrypt8Way) {
+        unsigned int *V = scrypt_scratchpad(SCRYPT_LANES);
+        unsigned int X[32 * SCRYPT_LANES];
+        for (; nCount - i >= 3; i += SCRYPT_LANES) {
+            size_t nLanes = std::min((size_t)SCRYPT_LANES, nCount - i);
+            for (size_t n = 0; n < SCRYPT_LANES; n++) {
+                const uint8_t* pinput = (const uint8_t*)pinputs[i + std::min(n, nLanes - 1)];
+                PBKDF2_SHA256(pinput, 80, pinput, 80, 1, (uint8_t *)&X[32 * n], 128);
+            }
+            scrypt_core_8way(X, V);
+            for (size_t n = 0; n < nLanes; n++) {
+                phashes[i + n] = 0;
+                PBKDF2_SHA256((const uint8_t*)pinputs[i + n], 80, (uint8_t *)&X[32 * n], 128, 1, (uint8_t*)&phashes[i + n], 32);
+            }
+            if (nLanes < SCRYPT_LANES) {
+                i += nLanes;
+                break;
+            }
+        }
+    }
+#endif
+    for (; i < nCount; i++)
+        phashes[i] = scrypt_blockhash(pinputs[i]);
 }
 
@@ -12,4 +12,12 @@ uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt,
 uint256 scrypt_hash(const void* input, size_t inputlen);
 uint256 scrypt_blockhash(const void* input);
 
+/** scrypt_blockhash() over nCount 80-byte inputs, eight at a time when the
+ *  AVX2 core is selected. phashes[i] receives the hash of pinputs[i]. */
+void scrypt_blockhash_batch(const void* const* pinputs, uint256* phashes, size_t nCount);
+
+/** Pick the fastest scrypt core for this CPU (fHardware = false forces the
+ *  portable one). Returns a description of the selection. */
+std::string scrypt_select_impl(bool fHardware = true);
+
 #endif // SCRYPT_MINE_H
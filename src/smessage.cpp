@@ -38,6 +38,10 @@ Notes:
 #include "sync.h"
 #include "ecwrapper.h"
 #include "txdb-leveldb.h"
+#include "crypto/hmac_sha256.h"
+#include "crypto/sha512.h"
+#include "cleanse.h"
+#include "stealth.h"
 
 #include <stdint.h>
 #include <time.h>
@@ -56,6 +60,12 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/thread.hpp>
+
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
+#include <secp256k1.h>
 
 
 #include "lz4/lz4.c"
@@ -82,6 +92,7 @@ CCriticalSection cs_smsgDB;
 CCriticalSection cs_smsgThreads;
 
 leveldb::DB *smsgDB = NULL;
+static leveldb::Options smsgDBOptions;
 
 
 namespace fs = boost::filesystem;
@@ -161,26 +172,92 @@ bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector
     return true;
 };
 
+void SecMsgTokenSet::clear()
+{
+    vTokens.clear();
+    nChanges++;
+};
+
+SecMsgTokenSet::iterator SecMsgTokenSet::find(const SecMsgToken& token)
+{
+    iterator it = std::lower_bound(vTokens.begin(), vTokens.end(), token);
+    if (it == vTokens.end() || token < *it)
+        return vTokens.end();
+    return it;
+};
+
+SecMsgTokenSet::const_iterator SecMsgTokenSet::find(const SecMsgToken& token) const
+{
+    const_iterator it = std::lower_bound(vTokens.begin(), vTokens.end(), token);
+    if (it == vTokens.end() || token < *it)
+        return vTokens.end();
+    return it;
+};
+
+bool SecMsgTokenSet::insert(const SecMsgToken& token)
+{
+    if (vTokens.empty() || vTokens.back() < token)
+    {
+        vTokens.push_back(token);
+    } else
+    {
+        iterator it = std::lower_bound(vTokens.begin(), vTokens.end(), token);
+        if (!(token < *it))
+            return false; // already have
+        vTokens.insert(it, token);
+    };
+
+    nChanges++;
+    return true;
+};
+
+void SecMsgTokenSet::assign(std::vector<SecMsgToken>& vLoad)
+{
+    // -- bulk load, sort once, the first of any duplicates is kept
+    clear();
+    vTokens.swap(vLoad);
+    std::stable_sort(vTokens.begin(), vTokens.end());
+
+    iterator itOut = vTokens.begin();
+    for (iterator it = vTokens.begin(); it != vTokens.end(); ++it)
+    {
+        if (itOut != vTokens.begin() && !(*(itOut-1) < *it))
+            continue;
+        *itOut++ = *it;
+    };
+    vTokens.erase(itOut, vTokens.end());
+};
+
 void SecMsgBucket::hashBucket()
 {
-    if (fDebugSmsg)
-        LogPrintf("SecMsgBucket::hashBucket()\n");
-    
+    // -- record the change, the hash is computed when next needed
     timeChanged = GetTime();
-    
-    std::set<SecMsgToken>::iterator it;
-    
+};
+
+uint32_t SecMsgBucket::GetHash()
+{
+    /*  XXH32 over the samples in token order, as peers expect in smsgInv.
+        Recomputed only when the tokens have changed since it was last asked
+        for, not on every insert.
+    */
+    if (fHashed
+        && nHashChanges == setTokens.GetChanges())
+        return hash;
+
     void* state = XXH32_init(1);
     
-    for (it = setTokens.begin(); it != setTokens.end(); ++it)
+    for (SecMsgTokenSet::iterator it = setTokens.begin(); it != setTokens.end(); ++it)
     {
         XXH32_update(state, it->sample, 8);
     };
     
     hash = XXH32_digest(state);
+    nHashChanges = setTokens.GetChanges();
+    fHashed = true;
     
     if (fDebugSmsg)
         LogPrintf("Hashed %u messages, hash %u\n", setTokens.size(), hash);
+    return hash;
 };
 
 
@@ -204,13 +281,24 @@ bool SecMsgDB::Open(const char* pszMode)
         return false;
     };
 
-    leveldb::Options options;
-    options.create_if_missing = fCreate;
-    leveldb::Status s = leveldb::DB::Open(options, fullpath.string(), &smsgDB);
+    // -- opened once and shared until SecureMsgCloseDB().
+    //    Point lookups (ExistsPK, ExistsSmesg) hit the bloom filter and block cache,
+    //    bulk writes fill a larger memtable before it is written out.
+    smsgDBOptions = leveldb::Options();
+    smsgDBOptions.create_if_missing = fCreate;
+    smsgDBOptions.block_cache = leveldb::NewLRUCache(GetArg("-smsgdbcache", SMSG_DB_CACHE) * 1048576);
+    smsgDBOptions.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    smsgDBOptions.write_buffer_size = SMSG_DB_WRITE_BUFFER;
+    leveldb::Status s = leveldb::DB::Open(smsgDBOptions, fullpath.string(), &smsgDB);
 
     if (!s.ok())
     {
         LogPrintf("SecMsgDB::open() - Error opening db: %s.\n", s.ToString().c_str());
+        smsgDB = NULL;
+        delete smsgDBOptions.filter_policy;
+        smsgDBOptions.filter_policy = NULL;
+        delete smsgDBOptions.block_cache;
+        smsgDBOptions.block_cache = NULL;
         return false;
     };
 
@@ -219,61 +307,50 @@ bool SecMsgDB::Open(const char* pszMode)
     return true;
 };
 
-
-class SecMsgBatchScanner : public leveldb::WriteBatch::Handler
+void SecureMsgCloseDB()
 {
-public:
-    std::string needle;
-    bool* deleted;
-    std::string* foundValue;
-    bool foundEntry;
-
-    SecMsgBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
-    {
-        if (key.ToString() == needle)
-        {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        };
-    };
+    AssertLockHeld(cs_smsgDB);
 
-    virtual void Delete(const leveldb::Slice& key)
-    {
-        if (key.ToString() == needle)
-        {
-            foundEntry = true;
-            *deleted = true;
-        };
-    };
+    delete smsgDB;
+    smsgDB = NULL;
+    delete smsgDBOptions.filter_policy;
+    smsgDBOptions.filter_policy = NULL;
+    delete smsgDBOptions.block_cache;
+    smsgDBOptions.block_cache = NULL;
 };
 
+
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it.
+// mapBatch mirrors the batch so this is a lookup rather than a walk of every
+// write made so far, which made bulk scans quadratic.
 bool SecMsgDB::ScanBatch(const CDataStream& key, std::string* value, bool* deleted) const
 {
     if (!activeBatch)
         return false;
 
-    *deleted = false;
-    SecMsgBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status s = activeBatch->Iterate(&scanner);
-    if (!s.ok())
-    {
-        LogPrintf("SecMsgDB ScanBatch error: %s\n", s.ToString().c_str());
+    std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapBatch.find(key.str());
+    if (mi == mapBatch.end())
         return false;
-    };
 
-    return scanner.foundEntry;
-}
+    *deleted = mi->second.first;
+    if (!*deleted)
+        *value = mi->second.second;
+    return true;
+};
+
+void SecMsgDB::BatchPut(const std::string& key, const std::string& value)
+{
+    activeBatch->Put(key, value);
+    mapBatch[key] = std::make_pair(false, value);
+};
+
+void SecMsgDB::BatchDelete(const std::string& key)
+{
+    activeBatch->Delete(key);
+    mapBatch[key] = std::make_pair(true, std::string());
+};
 
 bool SecMsgDB::TxnBegin()
 {
@@ -288,11 +365,15 @@ bool SecMsgDB::TxnCommit()
     if (!activeBatch)
         return false;
 
+    if (mapBatch.empty())
+        return TxnAbort(); // -- nothing to sync
+
     leveldb::WriteOptions writeOptions;
     writeOptions.sync = true;
     leveldb::Status status = pdb->Write(writeOptions, activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatch.clear();
 
     if (!status.ok())
     {
@@ -303,13 +384,38 @@ bool SecMsgDB::TxnCommit()
     return true;
 };
 
+bool SecMsgDB::TxnCheckpoint()
+{
+    /*
+    Commit the active batch and begin another once it holds SMSG_DB_BATCH_MAX
+    writes, so long bulk operations keep batch memory and lookups bounded.
+    */
+
+    if (!activeBatch
+        || mapBatch.size() < SMSG_DB_BATCH_MAX)
+        return true;
+
+    if (!TxnCommit())
+        return false;
+    return TxnBegin();
+};
+
 bool SecMsgDB::TxnAbort()
 {
     delete activeBatch;
     activeBatch = NULL;
+    mapBatch.clear();
     return true;
 };
 
+leveldb::Iterator* SecMsgDB::NewIterator()
+{
+    // -- prefix scans read each entry once, don't let them evict the blocks point lookups use
+    leveldb::ReadOptions readOptions;
+    readOptions.fill_cache = false;
+    return pdb->NewIterator(readOptions);
+};
+
 bool SecMsgDB::ReadPK(CKeyID& addr, CPubKey& pubkey)
 {
     if (!pdb)
@@ -371,7 +477,7 @@ bool SecMsgDB::WritePK(CKeyID& addr, CPubKey& pubkey)
 
     if (activeBatch)
     {
-        activeBatch->Put(ssKey.str(), ssValue.str());
+        BatchPut(ssKey.str(), ssValue.str());
         return true;
     };
 
@@ -412,6 +518,79 @@ bool SecMsgDB::ExistsPK(CKeyID& addr)
     return s.IsNotFound() == false;
 };
 
+bool SecMsgDB::ReadChainScan(uint256& hashBlock, int& nHeight)
+{
+    // -- the last block ScanChainForPublicKeys wrote the keys of
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'c';
+    ssKey << 's';
+    std::string strValue;
+
+    bool readFromDb = true;
+    if (activeBatch)
+    {
+        bool deleted = false;
+        readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted)
+            return false;
+    };
+
+    if (readFromDb)
+    {
+        leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+        if (!s.ok())
+        {
+            if (!s.IsNotFound())
+                LogPrintf("LevelDB read failure: %s\n", s.ToString().c_str());
+            return false;
+        };
+    };
+
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> hashBlock;
+        ssValue >> nHeight;
+    } catch (std::exception& e) {
+        LogPrintf("SecMsgDB::ReadChainScan() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+
+    return true;
+};
+
+bool SecMsgDB::WriteChainScan(const uint256& hashBlock, int nHeight)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'c';
+    ssKey << 's';
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBlock;
+    ssValue << nHeight;
+
+    if (activeBatch)
+    {
+        BatchPut(ssKey.str(), ssValue.str());
+        return true;
+    };
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    if (!s.ok())
+    {
+        LogPrintf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
+
+    return true;
+};
+
 
 bool SecMsgDB::NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* chKey, SecMsgStored& smsgStored)
 {
@@ -515,7 +694,7 @@ bool SecMsgDB::WriteSmesg(uint8_t* chKey, SecMsgStored& smsgStored)
 
     if (activeBatch)
     {
-        activeBatch->Put(ssKey.str(), ssValue.str());
+        BatchPut(ssKey.str(), ssValue.str());
         return true;
     };
 
@@ -561,7 +740,7 @@ bool SecMsgDB::EraseSmesg(uint8_t* chKey)
 
     if (activeBatch)
     {
-        activeBatch->Delete(ssKey.str());
+        BatchDelete(ssKey.str());
         return true;
     };
 
@@ -575,141 +754,661 @@ bool SecMsgDB::EraseSmesg(uint8_t* chKey)
     return false;
 };
 
-void ThreadSecureMsg()
-{
-    // -- bucket management thread
-    
-    uint32_t nLoop = 0;
-    std::vector<std::pair<int64_t, NodeId> > vTimedOutLocks;
-    while (fSecMsgEnabled)
-    {
-        nLoop++;
-        int64_t now = GetTime();
-        
-        if (fDebugSmsg && nLoop % SMSG_THREAD_LOG_GAP == 0) // log every SMSG_THREAD_LOG_GAP instance, is useful source of timestamps
-            LogPrintf("SecureMsgThread %d \n", now);
-        
-        vTimedOutLocks.resize(0);
-        
-        int64_t cutoffTime = now - SMSG_RETENTION;
-        {
-            LOCK(cs_smsg);
-            
-            for (std::map<int64_t, SecMsgBucket>::iterator it(smsgBuckets.begin()); it != smsgBuckets.end(); it++)
-            {
-                //if (fDebugSmsg)
-                //    LogPrintf("Checking bucket %d", size %u \n", it->first, it->second.setTokens.size());
-                if (it->first < cutoffTime)
-                {
-                    if (fDebugSmsg)
-                        LogPrintf("Removing bucket %d \n", it->first);
+// -- message store
+//    Each bucket is a segment: <bucket>_01.dat holds the messages, appended in
+//    arrival order, and <bucket>_01.idx holds one SMSG_IDX_RECORD_LEN record per
+//    message so startup can load the tokens without reading any payloads.
+//    Segments stay open between appends and reads, the least recently used is
+//    closed when more than SMSG_MAX_OPEN_SEGMENTS are open.
 
-                    std::string fileName = boost::lexical_cast<std::string>(it->first);
+static const unsigned int SMSG_IDX_RECORD_LEN = 28; // timestamp 8, sample 8, offset 8, nPayload 4
 
-                    fs::path fullPath = GetDataDir() / "smsgStore" / (fileName + "_01.dat");
-                    if (fs::exists(fullPath))
-                    {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            LogPrintf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    } else
-                    {
-                        LogPrintf("Path %s does not exist \n", fullPath.string().c_str());
-                    };
-                    
-                    // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fullPath = GetDataDir() / "smsgStore" / (fileName + "_01_wl.dat");
-                    if (fs::exists(fullPath))
-                    {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            LogPrintf("Error removing wallet locked file %s.\n", ex.what());
-                        };
-                    };
+class SecMsgSegment
+{
+public:
+    SecMsgSegment()
+    {
+        fpData      = NULL;
+        fpIndex     = NULL;
+        nDataSize   = 0;
+        nLastUsed   = 0;
+        fDirty      = false;
+    };
 
-                    smsgBuckets.erase(it);
-                } else
-                if (it->second.nLockCount > 0) // -- tick down nLockCount, so will eventually expire if peer never sends data
-                {
-                    it->second.nLockCount--;
+    FILE*                 fpData;       // opened a+b, appends always go to the end
+    FILE*                 fpIndex;
+    int64_t               nDataSize;
+    int64_t               nLastUsed;
+    bool                  fDirty;       // written since the last SecureMsgStoreFlush
+};
 
-                    if (it->second.nLockCount == 0)     // lock timed out
-                    {
-                        vTimedOutLocks.push_back(std::make_pair(it->first, it->second.nLockPeerId)); // cs_vNodes 
-                        
-                        it->second.nLockPeerId = 0;
-                    }; // if (it->second.nLockCount == 0)
-                    
-                }; // ! if (it->first < cutoffTime)
-            };
-        } // cs_smsg
-        
-        for (std::vector<std::pair<int64_t, NodeId> >::iterator it(vTimedOutLocks.begin()); it != vTimedOutLocks.end(); it++)
-        {
-            NodeId nPeerId = it->second;
-            int64_t ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
+static std::map<int64_t, SecMsgSegment> smsgSegments; // guarded by cs_smsg
+static int64_t nSegmentUseCounter = 0;
 
-            if (fDebugSmsg)
-                LogPrintf("Lock on bucket %d for peer %d timed out.\n", it->first, nPeerId);
+static fs::path SecureMsgSegmentPath(int64_t bucket, const char* suffix)
+{
+    return GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + suffix);
+};
 
-            // -- look through the nodes for the peer that locked this bucket
-            
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                {
-                    if (pnode->id != nPeerId)
-                        continue;
-                    LOCK2(pnode->cs_vSend, pnode->smsgData.cs_smsg_net);
-                    pnode->smsgData.ignoreUntil = ignoreUntil;
-                    
-                    // -- alert peer that they are being ignored
-                    std::vector<uint8_t> vchData;
-                    vchData.resize(8);
-                    memcpy(&vchData[0], &ignoreUntil, 8);
-                    pnode->PushMessage("smsgIgnore", vchData);
+static void SecureMsgIndexRecord(const SecMsgToken& token, uint32_t nPayload, uint8_t* p)
+{
+    memcpy(p, &token.timestamp, 8);
+    memcpy(p+8, token.sample, 8);
+    memcpy(p+16, &token.offset, 8);
+    memcpy(p+24, &nPayload, 4);
+};
 
-                    if (fDebugSmsg)
-                        LogPrintf("This node will ignore peer %d until %d.\n", nPeerId, ignoreUntil);
-                    break;
-                };
-            } // cs_vNodes
-        };
-        
-        MilliSleep(SMSG_THREAD_DELAY * 1000); //  // check every SMSG_THREAD_DELAY seconds
+static void SecureMsgCloseSegment(std::map<int64_t, SecMsgSegment>::iterator it)
+{
+    SecMsgSegment& seg = it->second;
+    if (seg.fDirty)
+    {
+        fflush(seg.fpData);
+        FileCommit(seg.fpData);
+        fflush(seg.fpIndex);
+        FileCommit(seg.fpIndex);
     };
+    fclose(seg.fpData);
+    fclose(seg.fpIndex);
+    smsgSegments.erase(it);
 };
 
-void ThreadSecureMsgPow()
+static SecMsgSegment* SecureMsgOpenSegment(int64_t bucket)
 {
-    // -- proof of work thread
+    // -- has cs_smsg lock
+    std::map<int64_t, SecMsgSegment>::iterator it = smsgSegments.find(bucket);
+    if (it != smsgSegments.end())
+    {
+        it->second.nLastUsed = ++nSegmentUseCounter;
+        return &it->second;
+    };
 
-    int rv;
-    std::vector<uint8_t> vchKey;
-    SecMsgStored smsgStored;
+    if (smsgSegments.size() >= SMSG_MAX_OPEN_SEGMENTS)
+    {
+        std::map<int64_t, SecMsgSegment>::iterator itOldest = smsgSegments.begin();
+        for (it = smsgSegments.begin(); it != smsgSegments.end(); ++it)
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        SecureMsgCloseSegment(itOldest);
+    };
 
-    std::string sPrefix("qm");
-    uint8_t chKey[18];
+    fs::path pathData = SecureMsgSegmentPath(bucket, "_01.dat");
+    fs::path pathIndex = SecureMsgSegmentPath(bucket, "_01.idx");
 
+    SecMsgSegment seg;
+    errno = 0;
+    if (!(seg.fpData = fopen(pathData.string().c_str(), "a+b")))
+    {
+        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), pathData.string().c_str());
+        return NULL;
+    };
 
-    while (fSecMsgEnabled)
+    if (!(seg.fpIndex = fopen(pathIndex.string().c_str(), "ab")))
     {
-        // -- sleep at end, then fSecMsgEnabled is tested on wake
+        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), pathIndex.string().c_str());
+        fclose(seg.fpData);
+        return NULL;
+    };
 
-        SecMsgDB dbOutbox;
-        leveldb::Iterator* it;
-        {
-            LOCK(cs_smsgDB);
+    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+    if (fseek(seg.fpData, 0, SEEK_END) != 0
+        || (seg.nDataSize = ftell(seg.fpData)) < 0)
+    {
+        LogPrintf("fseek, strerror: %s.\n", strerror(errno));
+        fclose(seg.fpData);
+        fclose(seg.fpIndex);
+        return NULL;
+    };
 
-            if (!dbOutbox.Open("cr+"))
-                continue;
+    seg.nLastUsed = ++nSegmentUseCounter;
+    return &(smsgSegments[bucket] = seg);
+};
 
-            // -- fifo (smallest key first)
-            it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-        }
+void SecureMsgStoreFlush()
+{
+    /*  Make appended messages durable, one fsync per segment written since
+        the last call rather than one per message.
+    */
+    AssertLockHeld(cs_smsg);
+
+    for (std::map<int64_t, SecMsgSegment>::iterator it = smsgSegments.begin(); it != smsgSegments.end(); ++it)
+    {
+        SecMsgSegment& seg = it->second;
+        if (!seg.fDirty)
+            continue;
+        fflush(seg.fpData);
+        FileCommit(seg.fpData);
+        fflush(seg.fpIndex);
+        FileCommit(seg.fpIndex);
+        seg.fDirty = false;
+    };
+};
+
+static void SecureMsgCloseSegments()
+{
+    while (!smsgSegments.empty())
+        SecureMsgCloseSegment(smsgSegments.begin());
+};
+
+static void SecureMsgDropSegment(int64_t bucket)
+{
+    // -- expire a whole bucket: its data, index and wallet locked files
+    std::map<int64_t, SecMsgSegment>::iterator it = smsgSegments.find(bucket);
+    if (it != smsgSegments.end())
+        SecureMsgCloseSegment(it);
+
+    const char* suffixes[] = {"_01.dat", "_01.idx", "_01_wl.dat"};
+    for (unsigned int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i)
+    {
+        fs::path fullPath = SecureMsgSegmentPath(bucket, suffixes[i]);
+        try {
+            if (fs::exists(fullPath))
+                fs::remove(fullPath);
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error removing bucket file %s.\n", ex.what());
+        };
+    };
+};
+
+static void SecureMsgAbortAppend(int64_t bucket, int64_t nDataSize)
+{
+    /*  After a failed write cut the data file back to its last whole message
+        and remove the index, the next startup rebuilds it.
+    */
+    std::map<int64_t, SecMsgSegment>::iterator it = smsgSegments.find(bucket);
+    if (it != smsgSegments.end())
+        SecureMsgCloseSegment(it);
+
+    try {
+        fs::resize_file(SecureMsgSegmentPath(bucket, "_01.dat"), nDataSize);
+        fs::remove(SecureMsgSegmentPath(bucket, "_01.idx"));
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("Error resetting bucket %d, %s.\n", bucket, ex.what());
+    };
+};
+
+static bool SecureMsgReadIndex(int64_t bucket, SecMsgTokenSet& tokenSet)
+{
+    /*  Load the tokens of a bucket from its index.
+        Fails if there is no index or it doesn't end where the data file
+        does, then the caller rebuilds it from the messages.
+    */
+    fs::path pathIndex = SecureMsgSegmentPath(bucket, "_01.idx");
+    fs::path pathData = SecureMsgSegmentPath(bucket, "_01.dat");
+
+    std::vector<uint8_t> vchIndex;
+    int64_t nDataSize;
+    try {
+        if (!fs::exists(pathIndex))
+            return false;
+        vchIndex.resize(fs::file_size(pathIndex));
+        nDataSize = fs::file_size(pathData);
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("SecureMsgReadIndex() %s.\n", ex.what());
+        return false;
+    };
+
+    if (vchIndex.size() % SMSG_IDX_RECORD_LEN != 0)
+        return false;
+
+    if (vchIndex.size() > 0)
+    {
+        FILE *fp;
+        if (!(fp = fopen(pathIndex.string().c_str(), "rb")))
+            return false;
+        size_t nRead = fread(&vchIndex[0], sizeof(uint8_t), vchIndex.size(), fp);
+        fclose(fp);
+        if (nRead != vchIndex.size())
+            return false;
+    };
+
+    int64_t nEnd = 0;
+    std::vector<SecMsgToken> vIndexed;
+    vIndexed.reserve(vchIndex.size() / SMSG_IDX_RECORD_LEN);
+    for (size_t i = 0; i < vchIndex.size(); i += SMSG_IDX_RECORD_LEN)
+    {
+        SecMsgToken token;
+        uint32_t nPayload;
+        memcpy(&token.timestamp, &vchIndex[i], 8);
+        memcpy(token.sample, &vchIndex[i+8], 8);
+        memcpy(&token.offset, &vchIndex[i+16], 8);
+        memcpy(&nPayload, &vchIndex[i+24], 4);
+
+        if (token.offset != nEnd)
+            return false;
+        nEnd = token.offset + SMSG_HDR_LEN + nPayload;
+        vIndexed.push_back(token);
+    };
+
+    if (nEnd != nDataSize)
+        return false;
+
+    tokenSet.assign(vIndexed);
+    return true;
+};
+
+static bool SecureMsgRebuildIndex(int64_t bucket, SecMsgTokenSet& tokenSet)
+{
+    // -- read every message header in the data file and write a new index
+    fs::path pathData = SecureMsgSegmentPath(bucket, "_01.dat");
+    fs::path pathIndex = SecureMsgSegmentPath(bucket, "_01.idx");
+
+    int64_t nDataSize;
+    try {
+        nDataSize = fs::file_size(pathData);
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("SecureMsgRebuildIndex() %s.\n", ex.what());
+        return false;
+    };
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathData.string().c_str(), "rb")))
+    {
+        LogPrintf("Error opening file: %s\n", strerror(errno));
+        return false;
+    };
+
+    std::vector<uint8_t> vchIndex;
+    std::vector<SecMsgToken> vTokens;
+    SecureMessage smsg;
+    int64_t ofs = 0;
+    for (;;)
+    {
+        SecMsgToken token;
+        token.offset = ofs;
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+                LogPrintf("fread header failed: %s\n", strerror(errno));
+            break;
+        };
+        token.timestamp = smsg.timestamp;
+
+        if (smsg.nPayload < 8
+            || ofs + SMSG_HDR_LEN + smsg.nPayload > nDataSize)
+            break;
+
+        if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
+        {
+            LogPrintf("fread data failed: %s\n", strerror(errno));
+            break;
+        };
+
+        if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
+        {
+            LogPrintf("fseek, strerror: %s.\n", strerror(errno));
+            break;
+        };
+
+        ofs += SMSG_HDR_LEN + smsg.nPayload;
+        vTokens.push_back(token);
+
+        vchIndex.resize(vchIndex.size() + SMSG_IDX_RECORD_LEN);
+        SecureMsgIndexRecord(token, smsg.nPayload, &vchIndex[vchIndex.size() - SMSG_IDX_RECORD_LEN]);
+    };
+
+    fclose(fp);
+
+    tokenSet.assign(vTokens);
+
+    // -- drop a partly written message from the end, later appends must start after the last whole one
+    try {
+        if (nDataSize != ofs)
+        {
+            LogPrintf("Truncating %s to %d bytes.\n", pathData.filename().string().c_str(), ofs);
+            fs::resize_file(pathData, ofs);
+        };
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("Error truncating bucket file %s.\n", ex.what());
+        return false;
+    };
+
+    errno = 0;
+    if (!(fp = fopen(pathIndex.string().c_str(), "wb")))
+    {
+        LogPrintf("Error opening file: %s\n", strerror(errno));
+        return false;
+    };
+
+    if (vchIndex.size() > 0
+        && fwrite(&vchIndex[0], sizeof(uint8_t), vchIndex.size(), fp) != vchIndex.size())
+    {
+        LogPrintf("fwrite failed: %s.\n", strerror(errno));
+        fclose(fp);
+        return false;
+    };
+
+    fflush(fp);
+    FileCommit(fp);
+    fclose(fp);
+    return true;
+};
+
+void ThreadSecureMsg()
+{
+    // -- bucket management thread
+    
+    uint32_t nLoop = 0;
+    std::vector<std::pair<int64_t, NodeId> > vTimedOutLocks;
+    while (fSecMsgEnabled)
+    {
+        nLoop++;
+        int64_t now = GetTime();
+        
+        if (fDebugSmsg && nLoop % SMSG_THREAD_LOG_GAP == 0) // log every SMSG_THREAD_LOG_GAP instance, is useful source of timestamps
+            LogPrintf("SecureMsgThread %d \n", now);
+        
+        vTimedOutLocks.resize(0);
+        
+        int64_t cutoffTime = now - SMSG_RETENTION;
+        {
+            LOCK(cs_smsg);
+            
+            for (std::map<int64_t, SecMsgBucket>::iterator it(smsgBuckets.begin()); it != smsgBuckets.end(); )
+            {
+                //if (fDebugSmsg)
+                //    LogPrintf("Checking bucket %d", size %u \n", it->first, it->second.setTokens.size());
+                if (it->first < cutoffTime)
+                {
+                    if (fDebugSmsg)
+                        LogPrintf("Removing bucket %d \n", it->first);
+
+                    // -- the whole segment expires at once, no need to read it
+                    SecureMsgDropSegment(it->first);
+
+                    smsgBuckets.erase(it++);
+                    continue;
+                } else
+                if (it->second.nLockCount > 0) // -- tick down nLockCount, so will eventually expire if peer never sends data
+                {
+                    it->second.nLockCount--;
+
+                    if (it->second.nLockCount == 0)     // lock timed out
+                    {
+                        vTimedOutLocks.push_back(std::make_pair(it->first, it->second.nLockPeerId)); // cs_vNodes 
+                        
+                        it->second.nLockPeerId = 0;
+                    }; // if (it->second.nLockCount == 0)
+                    
+                }; // ! if (it->first < cutoffTime)
+                ++it;
+            };
+        } // cs_smsg
+        
+        for (std::vector<std::pair<int64_t, NodeId> >::iterator it(vTimedOutLocks.begin()); it != vTimedOutLocks.end(); it++)
+        {
+            NodeId nPeerId = it->second;
+            int64_t ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
+
+            if (fDebugSmsg)
+                LogPrintf("Lock on bucket %d for peer %d timed out.\n", it->first, nPeerId);
+
+            // -- look through the nodes for the peer that locked this bucket
+            
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->id != nPeerId)
+                        continue;
+                    LOCK2(pnode->cs_vSend, pnode->smsgData.cs_smsg_net);
+                    pnode->smsgData.ignoreUntil = ignoreUntil;
+                    
+                    // -- alert peer that they are being ignored
+                    std::vector<uint8_t> vchData;
+                    vchData.resize(8);
+                    memcpy(&vchData[0], &ignoreUntil, 8);
+                    pnode->PushMessage("smsgIgnore", vchData);
+
+                    if (fDebugSmsg)
+                        LogPrintf("This node will ignore peer %d until %d.\n", nPeerId, ignoreUntil);
+                    break;
+                };
+            } // cs_vNodes
+        };
+        
+        MilliSleep(SMSG_THREAD_DELAY * 1000); //  // check every SMSG_THREAD_DELAY seconds
+    };
+};
+
+// -- smsgsend pipeline
+//    SecureMsgSendAsync only checks the message and queues it. Send workers
+//    run SecureMsgSend, which encrypts it and writes the send queue and outbox
+//    copies, then the proof of work thread reports back by send queue key.
+//    Plaintext waiting for a worker is held in memory only, jobs still queued
+//    at shutdown fail.
+
+static boost::mutex mutexSmsgSend;
+static boost::condition_variable condSmsgSend;
+static std::deque<uint64_t> queueSmsgSend;
+static std::map<uint64_t, SecMsgSendJob> mapSmsgSendJobs;                // guarded by mutexSmsgSend
+static std::map<std::vector<uint8_t>, uint64_t> mapSmsgSendQueueKeys;    // send queue db key -> job, guarded by mutexSmsgSend
+static uint64_t nSmsgSendNextId = 1;
+
+static void SecureMsgSendSetStatus(SecMsgSendJob& job, int nStatus, const std::string& sError)
+{
+    // -- has mutexSmsgSend lock
+    job.nStatus = nStatus;
+    job.sError = sError;
+    job.nTimeChanged = GetTime();
+    if (nStatus >= SMSG_SEND_SENT && job.vchQueueKey.size() > 0)
+        mapSmsgSendQueueKeys.erase(job.vchQueueKey);
+};
+
+static void SecureMsgSendQueued(uint64_t nJobId, const uint8_t* chKey)
+{
+    // -- called by SecureMsgSend once the send queue entry is written, still
+    //    under cs_smsgDB so the proof of work thread can't take it first
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+    std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.find(nJobId);
+    if (it == mapSmsgSendJobs.end())
+        return;
+    it->second.vchQueueKey.assign(chKey, chKey + 18);
+    mapSmsgSendQueueKeys[it->second.vchQueueKey] = nJobId;
+    SecureMsgSendSetStatus(it->second, SMSG_SEND_POW, "");
+};
+
+static void SecureMsgSendPowDone(const uint8_t* chKey, bool fSent)
+{
+    // -- called by ThreadSecureMsgPow when a send queue entry leaves the db
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+    std::map<std::vector<uint8_t>, uint64_t>::iterator it = mapSmsgSendQueueKeys.find(std::vector<uint8_t>(chKey, chKey + 18));
+    if (it == mapSmsgSendQueueKeys.end())
+        return; // sent synchronously, or queued before a restart
+
+    std::map<uint64_t, SecMsgSendJob>::iterator itj = mapSmsgSendJobs.find(it->second);
+    if (itj == mapSmsgSendJobs.end())
+    {
+        mapSmsgSendQueueKeys.erase(it);
+        return;
+    };
+    SecureMsgSendSetStatus(itj->second, fSent ? SMSG_SEND_SENT : SMSG_SEND_FAILED, fSent ? "" : "Proof of work or store failed.");
+};
+
+static void ThreadSecureMsgSend()
+{
+    while (fSecMsgEnabled)
+    {
+        SecMsgSendJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+            while (queueSmsgSend.empty())
+                condSmsgSend.wait(lock); // interruption point, threadGroupSmsg.interrupt_all() ends the wait
+
+            std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.find(queueSmsgSend.front());
+            queueSmsgSend.pop_front();
+            if (it == mapSmsgSendJobs.end())
+                continue;
+
+            SecureMsgSendSetStatus(it->second, SMSG_SEND_ENCRYPTING, "");
+            job = it->second;
+            it->second.sMessage.clear();
+        }
+
+        std::string sError;
+        int rv = SecureMsgSend(job.sAddrFrom, job.sAddrTo, job.sMessage, sError, job.nId);
+
+        if (rv != 0)
+        {
+            // -- failed before reaching the send queue
+            boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+            std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.find(job.nId);
+            if (it != mapSmsgSendJobs.end()
+                && it->second.nStatus == SMSG_SEND_ENCRYPTING)
+                SecureMsgSendSetStatus(it->second, SMSG_SEND_FAILED, sError);
+        };
+    };
+};
+
+static void SecureMsgSendFailQueued()
+{
+    // -- after the send workers have stopped
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+    while (!queueSmsgSend.empty())
+    {
+        std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.find(queueSmsgSend.front());
+        queueSmsgSend.pop_front();
+        if (it == mapSmsgSendJobs.end())
+            continue;
+        it->second.sMessage.clear();
+        SecureMsgSendSetStatus(it->second, SMSG_SEND_FAILED, "Secure messaging stopped before the message was encrypted.");
+    };
+};
+
+static void SecureMsgStartSendThreads()
+{
+    for (unsigned int i = 0; i < SMSG_SEND_THREADS; ++i)
+        threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-send", &ThreadSecureMsgSend));
+};
+
+int SecureMsgSendAsync(const std::string &addressFrom, const std::string &addressTo, const std::string &message, uint64_t &nId, std::string &sError)
+{
+    /*  Queue a message for the send workers.
+        Checks what can be checked without encrypting, errors found after
+        that are reported through SecureMsgGetSendJob.
+    */
+    if (!fSecMsgEnabled)
+    {
+        sError = "Secure messaging is disabled.";
+        return 1;
+    };
+
+    if (pwalletMain->IsLocked())
+    {
+        sError = "Wallet is locked, wallet must be unlocked to send and recieve messages.";
+        return 1;
+    };
+
+    if (message.size() > SMSG_MAX_MSG_BYTES)
+    {
+        std::ostringstream oss;
+        oss << message.size() << " > " << SMSG_MAX_MSG_BYTES;
+        sError = "Message is too long, " + oss.str();
+        return 1;
+    };
+
+    CDarkSilkAddress coinAddrTo;
+    if (!coinAddrTo.SetString(addressTo))
+    {
+        sError = "Invalid addressTo.";
+        return 4;
+    };
+
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+
+    // -- forget the oldest finished jobs
+    for (std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.begin();
+        it != mapSmsgSendJobs.end() && mapSmsgSendJobs.size() >= SMSG_SEND_MAX_JOBS; )
+    {
+        if (it->second.nStatus >= SMSG_SEND_SENT)
+            mapSmsgSendJobs.erase(it++);
+        else
+            ++it;
+    };
+
+    if (mapSmsgSendJobs.size() >= SMSG_SEND_MAX_JOBS)
+    {
+        sError = "Send queue is full.";
+        return 1;
+    };
+
+    SecMsgSendJob job;
+    job.nId = nSmsgSendNextId++;
+    job.sAddrFrom = addressFrom;
+    job.sAddrTo = addressTo;
+    job.sMessage = message;
+    job.nTimeQueued = job.nTimeChanged = GetTime();
+
+    mapSmsgSendJobs[job.nId] = job;
+    queueSmsgSend.push_back(job.nId);
+    condSmsgSend.notify_one();
+
+    nId = job.nId;
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgSendAsync() queued message %d for %s.\n", nId, addressTo.c_str());
+    return 0;
+};
+
+bool SecureMsgGetSendJob(uint64_t nId, SecMsgSendJob &job)
+{
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+    std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.find(nId);
+    if (it == mapSmsgSendJobs.end())
+        return false;
+    job = it->second;
+    job.sMessage.clear();
+    return true;
+};
+
+void SecureMsgGetSendJobs(std::vector<SecMsgSendJob> &vJobs)
+{
+    boost::unique_lock<boost::mutex> lock(mutexSmsgSend);
+    vJobs.clear();
+    vJobs.reserve(mapSmsgSendJobs.size());
+    for (std::map<uint64_t, SecMsgSendJob>::iterator it = mapSmsgSendJobs.begin(); it != mapSmsgSendJobs.end(); ++it)
+    {
+        vJobs.push_back(it->second);
+        vJobs.back().sMessage.clear();
+    };
+};
+
+void ThreadSecureMsgPow()
+{
+    // -- proof of work thread
+
+    int rv;
+    std::vector<uint8_t> vchKey;
+    SecMsgStored smsgStored;
+
+    std::string sPrefix("qm");
+    uint8_t chKey[18];
+
+
+    while (fSecMsgEnabled)
+    {
+        // -- sleep at end, then fSecMsgEnabled is tested on wake
+
+        SecMsgDB dbOutbox;
+        leveldb::Iterator* it = NULL;
+        {
+            LOCK(cs_smsgDB);
+
+            // -- fifo (smallest key first)
+            if (dbOutbox.Open("cr+"))
+                it = dbOutbox.NewIterator();
+        }
+        if (!it)
+        {
+            MilliSleep(2000); // -- don't spin while the db can't be opened
+            continue;
+        };
         // -- break up lock, SecureMsgSetHash will take long
 
         for (;;)
@@ -737,6 +1436,7 @@ void ThreadSecureMsgPow()
             if (rv != 0)
             {
                 LogPrintf("SecMsgPow: Could not get proof of work hash, message removed.\n");
+                SecureMsgSendPowDone(chKey, false);
                 continue;
             };
 
@@ -746,9 +1446,11 @@ void ThreadSecureMsgPow()
                 if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
                 {
                     LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                    SecureMsgSendPowDone(chKey, false);
                     continue;
                 };
             }
+            SecureMsgSendPowDone(chKey, true);
 
             // -- test if message was sent to self
             if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
@@ -767,7 +1469,8 @@ void ThreadSecureMsgPow()
 int SecureMsgBuildBucketSet()
 {
     /*
-        Build the bucket set by scanning the files in the smsgStore dir.
+        Build the bucket set from the indexes in the smsgStore dir,
+        a bucket without a usable index is scanned and its index rewritten.
 
         smsgBuckets should be empty
     */
@@ -778,6 +1481,7 @@ int SecureMsgBuildBucketSet()
     int64_t  now            = GetTime();
     uint32_t nFiles         = 0;
     uint32_t nMessages      = 0;
+    uint32_t nRebuilt       = 0;
 
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
     fs::directory_iterator itend;
@@ -798,7 +1502,8 @@ int SecureMsgBuildBucketSet()
 
         std::string fileType = (*itd).path().extension().string();
 
-        if (fileType.compare(".dat") != 0)
+        if (fileType.compare(".dat") != 0
+            && fileType.compare(".idx") != 0)
             continue;
 
         std::string fileName = (*itd).path().filename().string();
@@ -807,8 +1512,6 @@ int SecureMsgBuildBucketSet()
         if (fDebugSmsg)
             LogPrintf("Processing file: %s.\n", fileName.c_str());
 
-        nFiles++;
-
         // TODO files must be split if > 2GB
         // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
@@ -831,6 +1534,10 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        // -- indexes are read with their data file
+        if (fileType.compare(".idx") == 0)
+            continue;
+
         if (boost::algorithm::ends_with(fileName, "_wl.dat"))
         {
             if (fDebugSmsg)
@@ -838,60 +1545,24 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        nFiles++;
+
         size_t nTokenSetSize = 0;
-        SecureMessage smsg;
         {
             LOCK(cs_smsg);
             
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
+            SecMsgTokenSet& tokenSet = smsgBuckets[fileTime].setTokens;
             
-            FILE *fp;
-
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-
-            for (;;)
+            if (!SecureMsgReadIndex(fileTime, tokenSet))
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
-                    continue;
-
-                if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-
-                tokenSet.insert(token);
+                if (fDebugSmsg)
+                    LogPrintf("Rebuilding index for %s.\n", fileName.c_str());
+                nRebuilt++;
+                tokenSet.clear();
+                if (!SecureMsgRebuildIndex(fileTime, tokenSet))
+                    LogPrintf("Could not rebuild index for %s.\n", fileName.c_str());
             };
 
-            fclose(fp);
-            
             smsgBuckets[fileTime].hashBucket();
             
             nTokenSetSize = tokenSet.size();
@@ -902,6 +1573,8 @@ int SecureMsgBuildBucketSet()
             LogPrintf("Bucket %d contains %u messages.\n", fileTime, nTokenSetSize);
     };
 
+    if (nRebuilt > 0)
+        LogPrintf("Rebuilt %u bucket indexes.\n", nRebuilt);
     LogPrintf("Processed %u files, loaded %u buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
 
     return 0;
@@ -1088,16 +1761,284 @@ int SecureMsgWriteIni()
     fclose(fp);
 
 
-    try {
-        fs::path finalpath = GetDataDir() / "smsg.ini";
-        fs::rename(fullpath, finalpath);
-    } catch (const fs::filesystem_error& ex)
+    try {
+        fs::path finalpath = GetDataDir() / "smsg.ini";
+        fs::rename(fullpath, finalpath);
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("Error renaming file %s, %s.\n", fullpath.string().c_str(), ex.what());
+    };
+    return 0;
+};
+
+
+// -- bucket reconciliation
+//    A peer that finds a bucket differs sends an invertible bloom lookup table
+//    of its tokens, sized for the expected difference, instead of asking to see
+//    the whole token list. The other side subtracts its own table and peels
+//    out the tokens only one of them has, then answers with smsgHave for its
+//    own and smsgWant for the peer's. Peers before SMSG_PROTOCOL_VERSION 2 keep
+//    the smsgShow exchange.
+
+static const unsigned int SMSG_SKETCH_CELL_LEN = 24; // nCount 4, key 16, nCheck 4
+
+class SecMsgSketchCell
+{
+public:
+    SecMsgSketchCell()
+    {
+        nCount = 0;
+        memset(key, 0, 16);
+        nCheck = 0;
+    };
+
+    bool IsPure() const
+    {
+        return (nCount == 1 || nCount == -1)
+            && XXH32(key, 16, 0) == nCheck;
+    };
+
+    bool IsEmpty() const
+    {
+        static const uint8_t zero[16] = {0};
+        return nCount == 0 && nCheck == 0 && memcmp(key, zero, 16) == 0;
+    };
+
+    int32_t               nCount;
+    uint8_t               key[16];      // timestamp and sample of the token
+    uint32_t              nCheck;
+};
+
+class SecMsgSketch
+{
+// -- four hash functions over four equal parts of the table, so a key never lands in one cell twice
+public:
+    SecMsgSketch(uint32_t nCells) : vCells(nCells) {};
+
+    uint32_t CellIndex(const uint8_t* key, uint32_t j) const
+    {
+        uint32_t nPart = vCells.size() / 4;
+        return j * nPart + XXH32(key, 16, j + 1) % nPart;
+    };
+
+    void Add(const uint8_t* key, int32_t nSign)
+    {
+        uint32_t nCheck = XXH32(key, 16, 0);
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            SecMsgSketchCell& cell = vCells[CellIndex(key, j)];
+            cell.nCount += nSign;
+            for (int k = 0; k < 16; ++k)
+                cell.key[k] ^= key[k];
+            cell.nCheck ^= nCheck;
+        };
+    };
+
+    void Add(const SecMsgTokenSet& setTokens)
+    {
+        uint8_t key[16];
+        for (SecMsgTokenSet::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
+        {
+            memcpy(key, &it->timestamp, 8);
+            memcpy(key+8, it->sample, 8);
+            Add(key, 1);
+        };
+    };
+
+    void Subtract(const SecMsgSketch& other)
+    {
+        for (uint32_t i = 0; i < vCells.size(); ++i)
+        {
+            vCells[i].nCount -= other.vCells[i].nCount;
+            for (int k = 0; k < 16; ++k)
+                vCells[i].key[k] ^= other.vCells[i].key[k];
+            vCells[i].nCheck ^= other.vCells[i].nCheck;
+        };
+    };
+
+    bool Decode(std::vector<SecMsgToken>& vAdded, std::vector<SecMsgToken>& vSubtracted)
+    {
+        // -- peel pure cells until none are left, fails if anything remains.
+        //    The sketch comes from a peer: a key must be in the cell it was found in,
+        //    may be peeled only once, and there can be no more keys than cells.
+        std::set<std::string> setPeeled;
+        bool fPeeled = true;
+        while (fPeeled)
+        {
+            fPeeled = false;
+            for (uint32_t i = 0; i < vCells.size(); ++i)
+            {
+                if (!vCells[i].IsPure())
+                    continue;
+
+                uint32_t j;
+                for (j = 0; j < 4; ++j)
+                    if (CellIndex(vCells[i].key, j) == i)
+                        break;
+                if (j == 4
+                    || setPeeled.size() >= vCells.size()
+                    || !setPeeled.insert(std::string((const char*)vCells[i].key, 16)).second)
+                    return false;
+
+                SecMsgToken token;
+                memcpy(&token.timestamp, vCells[i].key, 8);
+                memcpy(token.sample, vCells[i].key+8, 8);
+                token.offset = 0;
+
+                int32_t nSign = vCells[i].nCount;
+                if (nSign > 0)
+                    vAdded.push_back(token);
+                else
+                    vSubtracted.push_back(token);
+
+                uint8_t key[16];
+                memcpy(key, vCells[i].key, 16);
+                Add(key, -nSign);
+                fPeeled = true;
+            };
+        };
+
+        for (uint32_t i = 0; i < vCells.size(); ++i)
+            if (!vCells[i].IsEmpty())
+                return false;
+        return true;
+    };
+
+    void Serialize(uint8_t* p) const
+    {
+        for (uint32_t i = 0; i < vCells.size(); ++i, p += SMSG_SKETCH_CELL_LEN)
+        {
+            memcpy(p, &vCells[i].nCount, 4);
+            memcpy(p+4, vCells[i].key, 16);
+            memcpy(p+20, &vCells[i].nCheck, 4);
+        };
+    };
+
+    void Unserialize(const uint8_t* p)
+    {
+        for (uint32_t i = 0; i < vCells.size(); ++i, p += SMSG_SKETCH_CELL_LEN)
+        {
+            memcpy(&vCells[i].nCount, p, 4);
+            memcpy(vCells[i].key, p+4, 16);
+            memcpy(&vCells[i].nCheck, p+20, 4);
+        };
+    };
+
+    std::vector<SecMsgSketchCell> vCells;
+};
+
+int SecureMsgReconRequest(const SecMsgTokenSet& setTokens, int64_t bucket, uint32_t nPeerMessages, std::vector<uint8_t>& vchRecon)
+{
+    /*  Build the smsgRecon for a bucket: time 8, nMessages 4, nCells 4, cells.
+        returns
+            0 success
+            1 a sketch would be no smaller than the peer's token list, use smsgShow
+    */
+    uint32_t nMessages = setTokens.size();
+    uint32_t nDiff = (nMessages > nPeerMessages ? nMessages - nPeerMessages : nPeerMessages - nMessages) + SMSG_RECON_SLACK;
+    uint32_t nCells = 4 * (nDiff * 3 / 8 + 6); // about 1.5 cells per difference, small tables fail more often
+
+    if (nCells > SMSG_RECON_MAX_CELLS
+        || (uint64_t)nCells * SMSG_SKETCH_CELL_LEN >= (uint64_t)nPeerMessages * 16)
+        return 1;
+
+    SecMsgSketch sketch(nCells);
+    sketch.Add(setTokens);
+
+    vchRecon.resize(16 + nCells * SMSG_SKETCH_CELL_LEN);
+    memcpy(&vchRecon[0], &bucket, 8);
+    memcpy(&vchRecon[8], &nMessages, 4);
+    memcpy(&vchRecon[12], &nCells, 4);
+    sketch.Serialize(&vchRecon[16]);
+    return 0;
+};
+
+int SecureMsgReconReply(const SecMsgTokenSet& setTokens, const std::vector<uint8_t>& vchRecon, std::vector<uint8_t>& vchHave, std::vector<uint8_t>& vchWant)
+{
+    /*  Decode a peer's smsgRecon against this node's tokens for the bucket.
+        vchHave gets the tokens only this node has, vchWant those only the
+        peer has, both in the smsgHave/smsgWant format.
+        returns
+            0 success
+            1 malformed
+            2 the difference was too large to decode, send the whole list
+    */
+    if (vchRecon.size() < 16)
+        return 1;
+
+    int64_t bucket;
+    uint32_t nCells;
+    memcpy(&bucket, &vchRecon[0], 8);
+    memcpy(&nCells, &vchRecon[12], 4);
+
+    if (nCells < 4
+        || nCells % 4 != 0
+        || nCells > SMSG_RECON_MAX_CELLS
+        || vchRecon.size() != 16 + nCells * SMSG_SKETCH_CELL_LEN)
+        return 1;
+
+    SecMsgSketch sketchPeer(nCells);
+    sketchPeer.Unserialize(&vchRecon[16]);
+
+    SecMsgSketch sketch(nCells);
+    sketch.Add(setTokens);
+    sketch.Subtract(sketchPeer);
+
+    std::vector<SecMsgToken> vHave, vWant;
+    if (!sketch.Decode(vHave, vWant))
+        return 2;
+
+    // -- a bad decode would name tokens on the wrong side
+    for (uint32_t i = 0; i < vHave.size(); ++i)
+        if (setTokens.find(vHave[i]) == setTokens.end())
+            return 2;
+    for (uint32_t i = 0; i < vWant.size(); ++i)
+        if (setTokens.find(vWant[i]) != setTokens.end())
+            return 2;
+
+    vchHave.resize(8 + 16 * vHave.size());
+    memcpy(&vchHave[0], &bucket, 8);
+    for (uint32_t i = 0; i < vHave.size(); ++i)
+    {
+        memcpy(&vchHave[8 + 16 * i], &vHave[i].timestamp, 8);
+        memcpy(&vchHave[16 + 16 * i], vHave[i].sample, 8);
+    };
+
+    vchWant.resize(8 + 16 * vWant.size());
+    memcpy(&vchWant[0], &bucket, 8);
+    for (uint32_t i = 0; i < vWant.size(); ++i)
+    {
+        memcpy(&vchWant[8 + 16 * i], &vWant[i].timestamp, 8);
+        memcpy(&vchWant[16 + 16 * i], vWant[i].sample, 8);
+    };
+
+    return 0;
+};
+
+static void SecureMsgBucketHave(int64_t bucket, const SecMsgTokenSet& setTokens, std::vector<uint8_t>& vchHave)
+{
+    // -- the whole token list of a bucket, as smsgHave
+    vchHave.resize(8 + 16 * setTokens.size());
+    memcpy(&vchHave[0], &bucket, 8);
+
+    uint8_t* p = &vchHave[8];
+    for (SecMsgTokenSet::const_iterator it = setTokens.begin(); it != setTokens.end(); ++it)
     {
-        LogPrintf("Error renaming file %s, %s.\n", fullpath.string().c_str(), ex.what());
+        memcpy(p, &it->timestamp, 8);
+        memcpy(p+8, &it->sample, 8);
+
+        p += 16;
     };
-    return 0;
 };
 
+static void SecureMsgPushPong(CNode* pnode)
+{
+    // -- peers before protocol version 2 ignore the payload
+    uint32_t nVersion = SMSG_PROTOCOL_VERSION;
+    std::vector<uint8_t> vchVersion(4);
+    memcpy(&vchVersion[0], &nVersion, 4);
+    pnode->PushMessage("smsgPong", vchVersion);
+};
 
 /** called from AppInit2() in init.cpp */
 bool SecureMsgStart(bool fDontStart, bool fScanChain)
@@ -1136,6 +2077,7 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
     
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    SecureMsgStartSendThreads();
     
     return true;
 };
@@ -1155,12 +2097,16 @@ bool SecureMsgShutdown()
     
     threadGroupSmsg.interrupt_all();
     threadGroupSmsg.join_all();
+    SecureMsgSendFailQueued();
+
+    {
+        LOCK(cs_smsg);
+        SecureMsgCloseSegments();
+    }
 
-    if (smsgDB)
     {
         LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
+        SecureMsgCloseDB();
     };
 
     return true;
@@ -1204,6 +2150,7 @@ bool SecureMsgEnable()
     // -- start threads
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    SecureMsgStartSendThreads();
     
     /*
     if (!NewThread(ThreadSecureMsg, NULL)
@@ -1220,7 +2167,7 @@ bool SecureMsgEnable()
         BOOST_FOREACH(CNode* pnode, vNodes)
         {
             pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            SecureMsgPushPong(pnode); // Send pong as have missed initial ping sent by peer when it connected
         };
     } // cs_vNodes
     LogPrintf("Secure messaging enabled.\n");
@@ -1242,6 +2189,7 @@ bool SecureMsgDisable()
         
         threadGroupSmsg.interrupt_all();
         threadGroupSmsg.join_all();
+        SecureMsgSendFailQueued();
         
         // -- clear smsgBuckets
         std::map<int64_t, SecMsgBucket>::iterator it;
@@ -1252,6 +2200,7 @@ bool SecureMsgDisable()
         };
         smsgBuckets.clear();
         smsgAddresses.clear();
+        SecureMsgCloseSegments();
     } // cs_smsg
     
     // -- tell each smsg enabled peer that this node is disabling
@@ -1275,11 +2224,9 @@ bool SecureMsgDisable()
     MilliSleep(3000); // seconds
     // TODO be certain that threads have stopped
 
-    if (smsgDB)
     {
         LOCK(cs_smsgDB);
-        delete smsgDB;
-        smsgDB = NULL;
+        SecureMsgCloseDB();
     };
 
 
@@ -1312,6 +2259,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         };
 
         int64_t now = GetTime();
+        uint32_t nPeerVersion;
         
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
@@ -1322,6 +2270,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     LogPrintf("Node is ignoring peer %d until %d.\n", pfrom->id, pfrom->smsgData.ignoreUntil);
                 return false;
             };
+            nPeerVersion = pfrom->smsgData.nVersion;
         }
         
         uint32_t nBuckets       = smsgBuckets.size();
@@ -1351,6 +2300,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
         vchDataOut.resize(4);
         uint32_t nShowBuckets = 0;
+        std::vector<std::vector<uint8_t> > vRecon;
 
 
         uint8_t *p = &vchData[4];
@@ -1389,13 +2339,14 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 continue;
             };
 
-            if (fDebugSmsg)
-            {
-                LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
-                LogPrintf("this bucket %d %u %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
-            };
             {
             LOCK(cs_smsg);
+                if (fDebugSmsg)
+                {
+                    LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
+                    LogPrintf("this bucket %d %u %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].GetHash());
+                };
+
                 if (smsgBuckets[time].nLockCount > 0)
                 {
                     if (fDebugSmsg)
@@ -1408,8 +2359,19 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 //    if then peer node has more this node will pull fom peer
                 if (smsgBuckets[time].setTokens.size() < ncontent
                     || (smsgBuckets[time].setTokens.size() == ncontent
-                        && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
+                        && smsgBuckets[time].GetHash() != hash)) // if same amount in buckets check hash
                 {
+                    // -- peer can decode a sketch, send one if it's smaller than the token list would be
+                    std::vector<uint8_t> vchRecon;
+                    if (nPeerVersion >= 2
+                        && SecureMsgReconRequest(smsgBuckets[time].setTokens, time, ncontent, vchRecon) == 0)
+                    {
+                        if (fDebugSmsg)
+                            LogPrintf("Reconciling bucket %d.\n", time);
+                        vRecon.push_back(vchRecon);
+                        continue;
+                    };
+
                     if (fDebugSmsg)
                         LogPrintf("Requesting contents of bucket %d.\n", time);
 
@@ -1422,13 +2384,16 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             } // LOCK(cs_smsg);
         };
 
+        for (uint32_t i = 0; i < vRecon.size(); ++i)
+            pfrom->PushMessage("smsgRecon", vRecon[i]);
+
         // TODO: should include hash?
         memcpy(&vchDataOut[0], &nShowBuckets, 4);
         if (vchDataOut.size() > 4)
         {
             pfrom->PushMessage("smsgShow", vchDataOut);
         } else
-        if (nLocked < 1) // Don't report buckets as matched if any are locked
+        if (nLocked < 1 && vRecon.empty()) // Don't report buckets as matched if any are locked or being reconciled
         {
             // -- peer has no buckets we want, don't send them again until something changes
             //    peer will still request buckets from this node if needed (< ncontent)
@@ -1458,7 +2423,6 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             LogPrintf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
         
         std::map<int64_t, SecMsgBucket>::iterator itb;
-        std::set<SecMsgToken>::iterator it;
 
         std::vector<uint8_t> vchDataOut;
         int64_t time;
@@ -1477,28 +2441,79 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     continue;
                 };
 
-                std::set<SecMsgToken>& tokenSet = (*itb).second.setTokens;
-
-                try { vchDataOut.resize(8 + 16 * tokenSet.size()); } catch (std::exception& e)
+                try { SecureMsgBucketHave(time, (*itb).second.setTokens, vchDataOut); } catch (std::exception& e)
                 {
-                    LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+                    LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * (*itb).second.setTokens.size(), e.what());
                     continue;
                 };
-                memcpy(&vchDataOut[0], &time, 8);
-
-                uint8_t* p = &vchDataOut[8];
-                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-                {
-                    memcpy(p, &it->timestamp, 8);
-                    memcpy(p+8, &it->sample, 8);
-
-                    p += 16;
-                };
             }
             pfrom->PushMessage("smsgHave", vchDataOut);
         };
 
 
+    } else
+    if (strCommand == "smsgRecon")
+    {
+        // -- peer sent a sketch of a bucket, reply with the messages only one side has
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 16)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        int64_t time;
+        memcpy(&time, &vchData[0], 8);
+
+        std::vector<uint8_t> vchHave, vchWant;
+        int rv;
+        {
+            LOCK(cs_smsg);
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Don't have bucket %d.\n", time);
+                return false;
+            };
+
+            rv = SecureMsgReconReply(itb->second.setTokens, vchData, vchHave, vchWant);
+            if (rv == 2)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Could not decode sketch of bucket %d, sending all %u tokens.\n", time, itb->second.setTokens.size());
+                SecureMsgBucketHave(time, itb->second.setTokens, vchHave);
+            };
+
+            if (vchWant.size() > 8)
+            {
+                if (itb->second.nLockCount > 0)
+                {
+                    // -- waiting on another peer, this one will offer them again
+                    vchWant.clear();
+                } else
+                {
+                    if (fDebugSmsg)
+                        LogPrintf("Asking peer for %u messages, locking bucket %d for peer %d.\n", (vchWant.size() - 8) / 16, time, pfrom->id);
+                    itb->second.nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
+                    itb->second.nLockPeerId  = pfrom->id;
+                };
+            };
+        } // cs_smsg
+
+        if (rv == 1)
+        {
+            LogPrintf("smsgRecon, malformed sketch.\n");
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        if (vchHave.size() > 8)
+            pfrom->PushMessage("smsgHave", vchHave);
+        if (vchWant.size() > 8)
+            pfrom->PushMessage("smsgWant", vchWant);
     } else
     if (strCommand == "smsgHave")
     {
@@ -1547,8 +2562,8 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             vchDataOut.resize(8);
             memcpy(&vchDataOut[0], &vchData[0], 8);
 
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
-            std::set<SecMsgToken>::iterator it;
+            SecMsgTokenSet& tokenSet = smsgBuckets[time].setTokens;
+            SecMsgTokenSet::iterator it;
             SecMsgToken token;
             uint8_t* p = &vchData[8];
 
@@ -1622,8 +2637,8 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 return false;
             };
 
-            std::set<SecMsgToken>& tokenSet = itb->second.setTokens;
-            std::set<SecMsgToken>::iterator it;
+            SecMsgTokenSet& tokenSet = itb->second.setTokens;
+            SecMsgTokenSet::iterator it;
             SecMsgToken token;
             uint8_t* p = &vchData[8];
             for (int i = 0; i < n; ++i)
@@ -1720,16 +2735,27 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     if (strCommand == "smsgPing")
     {
         // -- smsgPing is the initial message, send reply
-        pfrom->PushMessage("smsgPong");
+        SecureMsgPushPong(pfrom);
     } else
     if (strCommand == "smsgPong")
     {
+        // -- peers before protocol version 2 send no version
+        uint32_t nVersion = 0;
+        if (vRecv.size() > 0)
+        {
+            std::vector<uint8_t> vchData;
+            vRecv >> vchData;
+            if (vchData.size() >= 4)
+                memcpy(&nVersion, &vchData[0], 4);
+        };
+
         if (fDebugSmsg)
-             LogPrintf("Peer replied, secure messaging enabled.\n");
+             LogPrintf("Peer replied, secure messaging enabled, version %u.\n", nVersion);
         
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
             pfrom->smsgData.fEnabled = true;
+            pfrom->smsgData.nVersion = nVersion;
         }
         
     } else
@@ -1847,7 +2873,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
                     continue;
 
 
-                uint32_t hash = bkt.hash;
+                uint32_t hash = bkt.GetHash();
 
                 try { vchData.resize(vchData.size() + 16); } catch (std::exception& e)
                 {
@@ -1934,21 +2960,22 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 };
 
 
-static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
-    uint32_t& nTransactions, uint32_t& nElements, uint32_t& nPubkeys, uint32_t& nDuplicates)
-
-
+static void SecureMsgExtractPubKeys(const CBlock& block, std::vector<CPubKey>& vPubKeys,
+    uint32_t& nTransactions, uint32_t& nElements)
 {
-    AssertLockHeld(cs_smsgDB);
-    
+    /*
+    Collect the compressed public keys of a block, touches no shared state
+    so ScanChainForPublicKeys can run it on many blocks at once.
+    */
+
     valtype vch;
     opcodetype opcode;
-    
+
     // -- only scan inputs of standard txns and coinstakes
-    
-    BOOST_FOREACH(CTransaction& tx, block.vtx)
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
     {
-    std::string sReason;
+        std::string sReason;
         // - harvest public keys from coinstake txns
         if (tx.IsCoinStake())
         {
@@ -1958,24 +2985,19 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
             {
                 if (!txout.scriptPubKey.GetOp(pc, opcode, vch))
                     break;
-                
+
                 if (vch.size() == 33) // pubkey
                 {
                     CPubKey pubKey(vch);
-                    
+
                     if (!pubKey.IsValid()
                         || !pubKey.IsCompressed())
                     {
                         LogPrintf("Public key is invalid %s.\n", HexStr(pubKey).c_str());
                         continue;
                     };
-                    
-                    CKeyID addrKey = pubKey.GetID();
-                    switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                    {
-                        case 0: nPubkeys++; break;      // added key
-                        case 4: nDuplicates++; break;   // duplicate key
-                    }
+
+                    vPubKeys.push_back(pubKey);
                     break;
                 };
             };
@@ -1985,13 +3007,10 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
         {
             for (uint32_t i = 0; i < tx.vin.size(); i++)
             {
-                CScript *script = &tx.vin[i].scriptSig;
+                const CScript *script = &tx.vin[i].scriptSig;
                 CScript::const_iterator pc = script->begin();
                 CScript::const_iterator pend = script->end();
 
-                uint256 prevoutHash;
-                CKey key;
-
                 while (pc < pend)
                 {
                     if (!script->GetOp(pc, opcode, vch))
@@ -2000,153 +3019,607 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                     if (opcode == 33)
                     {
                         CPubKey pubKey(vch);
-                        
+
                         if (!pubKey.IsValid()
                             || !pubKey.IsCompressed())
                         {
                             LogPrintf("Public key is invalid %s.\n", HexStr(pubKey).c_str());
                             continue;
                         };
-                        
-                        CKeyID addrKey = pubKey.GetID();
-                        switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                        {
-                            case 0: nPubkeys++; break;      // added key
-                            case 4: nDuplicates++; break;   // duplicate key
-                        }
+
+                        vPubKeys.push_back(pubKey);
                         break;
                     };
+                };
+                nElements++;
+            };
+        };
+        nTransactions++;
+    };
+};
+
+static void SecureMsgInsertPubKeys(std::vector<CPubKey>& vPubKeys, SecMsgDB& addrpkdb,
+    uint32_t& nPubkeys, uint32_t& nDuplicates)
+{
+    AssertLockHeld(cs_smsgDB);
+
+    BOOST_FOREACH(CPubKey& pubKey, vPubKeys)
+    {
+        CKeyID addrKey = pubKey.GetID();
+        switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
+        {
+            case 0: nPubkeys++; break;      // added key
+            case 4: nDuplicates++; break;   // duplicate key
+        }
+    };
+};
+
+
+bool SecureMsgScanBlock(CBlock& block)
+{
+    // - scan block for public key addresses
+    //   called with cs_main held
+
+    if (!smsgOptions.fScanIncoming)
+        return true;
+
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgScanBlock().\n");
+
+    uint32_t nTransactions  = 0;
+    uint32_t nElements      = 0;
+    uint32_t nPubkeys       = 0;
+    uint32_t nDuplicates    = 0;
+
+    std::vector<CPubKey> vPubKeys;
+    SecureMsgExtractPubKeys(block, vPubKeys, nTransactions, nElements);
+
+    {
+        LOCK(cs_smsgDB);
+
+        SecMsgDB addrpkdb;
+        if (!addrpkdb.Open("cw")
+            || !addrpkdb.TxnBegin())
+            return false;
+
+        SecureMsgInsertPubKeys(vPubKeys, addrpkdb, nPubkeys, nDuplicates);
+
+        // -- move the chain scan checkpoint along if this block follows it on the main chain
+        uint256 hashScanned;
+        int nHeightScanned;
+        if (addrpkdb.ReadChainScan(hashScanned, nHeightScanned)
+            && hashScanned == block.hashPrevBlock)
+        {
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+            if (mi != mapBlockIndex.end()
+                && mi->second->IsInMainChain())
+                addrpkdb.WriteChainScan(mi->first, mi->second->nHeight);
+        };
+
+        addrpkdb.TxnCommit();
+    } // cs_smsgDB
+
+    if (fDebugSmsg)
+        LogPrintf("Found %u transactions, %u elements, %u new public keys, %u duplicates.\n", nTransactions, nElements, nPubkeys, nDuplicates);
+
+    return true;
+};
+
+class SecMsgChainBlock
+{
+// -- a block read and scanned ahead by ScanChainForPublicKeys
+public:
+    CBlockIndex*            pindex;
+    bool                    fRead;
+    std::vector<CPubKey>    vPubKeys;
+    uint32_t                nTransactions;
+    uint32_t                nElements;
+};
+
+static void SecureMsgReadChainThread(std::vector<SecMsgChainBlock>* pvBlocks, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvBlocks->size(); i += nThreads)
+    {
+        SecMsgChainBlock& cb = (*pvBlocks)[i];
+        try {
+            CBlock block;
+            if (!block.ReadFromDisk(cb.pindex, true))
+                continue;
+            SecureMsgExtractPubKeys(block, cb.vPubKeys, cb.nTransactions, cb.nElements);
+            cb.fRead = true;
+        } catch (std::exception& e)
+        {
+            LogPrintf("SecureMsgReadChainThread(): Reading block %d threw: %s.\n", cb.pindex->nHeight, e.what());
+        };
+    };
+};
+
+static void SecureMsgReadChain(std::vector<SecMsgChainBlock>* pvBlocks)
+{
+    // -- read and extract the blocks across all cores
+    if (pvBlocks->empty())
+        return;
+
+    ParallelFor(pvBlocks->size(), 0, boost::bind(&SecureMsgReadChainThread, pvBlocks, _1, _2));
+};
+
+static CBlockIndex* SecureMsgNextChainBatch(CBlockIndex* pindex, std::vector<SecMsgChainBlock>& vBlocks)
+{
+    // -- returns the block after the batch
+    vBlocks.clear();
+    for (; pindex && vBlocks.size() < SMSG_SCAN_CHAIN_BATCH; pindex = pindex->pnext)
+    {
+        vBlocks.push_back(SecMsgChainBlock());
+        SecMsgChainBlock& cb = vBlocks.back();
+        cb.pindex = pindex;
+        cb.fRead = false;
+        cb.nTransactions = 0;
+        cb.nElements = 0;
+    };
+    return pindex;
+};
+
+bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
+{
+    /*
+    Blocks are read and their keys extracted in parallel, a batch of
+    SMSG_SCAN_CHAIN_BATCH ahead of the keys being written.
+    The last block written is recorded with the keys so SecureMsgScanBlockChain
+    can continue from it.
+    Called with cs_main held.
+    */
+
+    LogPrintf("Scanning block chain for public keys.\n");
+    int64_t nStart = GetTimeMillis();
+
+    if (fDebugSmsg)
+        LogPrintf("From height %u.\n", pindexStart->nHeight);
+
+    // -- public keys are in txin.scriptSig
+    //    matching addresses are in scriptPubKey of txin's referenced output
+
+    uint32_t nBlocks        = 0;
+    uint32_t nTransactions  = 0;
+    uint32_t nInputs        = 0;
+    uint32_t nPubkeys       = 0;
+    uint32_t nDuplicates    = 0;
+
+    SecMsgDB addrpkdb;
+    {
+        LOCK(cs_smsgDB);
+        if (!addrpkdb.Open("cw")
+            || !addrpkdb.TxnBegin())
+            return false;
+    }
+
+    std::vector<SecMsgChainBlock> vBlocks, vNext;
+    CBlockIndex* pindexNext = SecureMsgNextChainBatch(pindexStart, vBlocks);
+    SecureMsgReadChain(&vBlocks);
+
+    bool fOk = true;
+    while (fOk && !vBlocks.empty())
+    {
+        // -- read the next batch while this one is written
+        pindexNext = SecureMsgNextChainBatch(pindexNext, vNext);
+        boost::thread threadRead(boost::bind(&SecureMsgReadChain, &vNext));
+
+        {
+            LOCK(cs_smsgDB);
+            CBlockIndex* pindexLast = NULL;
+            BOOST_FOREACH(SecMsgChainBlock& cb, vBlocks)
+            {
+                if (!cb.fRead)
+                {
+                    LogPrintf("ScanChainForPublicKeys(): Could not read block %d.\n", cb.pindex->nHeight);
+                    fOk = false;
+                    break;
+                };
+
+                nBlocks++;
+                nTransactions += cb.nTransactions;
+                nInputs += cb.nElements;
+                SecureMsgInsertPubKeys(cb.vPubKeys, addrpkdb, nPubkeys, nDuplicates);
+                pindexLast = cb.pindex;
+
+                if (!addrpkdb.TxnCheckpoint())
+                {
+                    fOk = false;
+                    break;
+                };
+            };
+
+            if (pindexLast)
+                addrpkdb.WriteChainScan(pindexLast->GetBlockHash(), pindexLast->nHeight);
+            if (!addrpkdb.TxnCheckpoint())
+                fOk = false;
+        } // cs_smsgDB
+
+        threadRead.join();
+
+        if (fOk)
+            LogPrintf("Scanned to height %d, %u transactions.\n", vBlocks.back().pindex->nHeight, nTransactions);
+        vBlocks.swap(vNext);
+    };
+
+    {
+        LOCK(cs_smsgDB);
+        if (addrpkdb.activeBatch
+            && !addrpkdb.TxnCommit())
+            fOk = false;
+    }
+
+    LogPrintf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
+    LogPrintf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
+    LogPrintf("Took %d ms\n", GetTimeMillis() - nStart);
+
+    return fOk;
+};
+
+static CBlockIndex* SecureMsgChainScanStart(bool fFromGenesis)
+{
+    /*
+    The block to continue scanning the chain from, the first after the
+    recorded checkpoint, stepping back from it to the main chain after a reorg.
+    returns NULL when the scan is up to date.
+    */
+
+    AssertLockHeld(cs_main);
+
+    if (fFromGenesis)
+        return pindexGenesisBlock;
+
+    uint256 hashScanned;
+    int nHeightScanned;
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        if (!addrpkdb.Open("cw")
+            || !addrpkdb.ReadChainScan(hashScanned, nHeightScanned))
+            return pindexGenesisBlock;
+    }
+
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashScanned);
+    if (mi == mapBlockIndex.end())
+        return pindexGenesisBlock;
 
-                    //LogPrintf("opcode %d, %s, value %s.\n", opcode, GetOpName(opcode), ValueString(vch).c_str());
-                };
-                nElements++;
-            };
+    CBlockIndex* pindex = mi->second;
+    while (pindex && !pindex->IsInMainChain())
+        pindex = pindex->pprev;
+
+    if (!pindex)
+        return pindexGenesisBlock;
+    return pindex->pnext;
+};
+
+bool SecureMsgScanBlockChain(bool fFromGenesis)
+{
+    TRY_LOCK(cs_main, lockMain);
+    if (lockMain)
+    {
+        if (pindexGenesisBlock == NULL)
+        {
+            LogPrintf("Error: pindexGenesisBlock not set.\n");
+            return false;
         };
-        nTransactions++;
 
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
+
+        try { // -- in try to catch errors opening db,
+            CBlockIndex *pindexScan = SecureMsgChainScanStart(fFromGenesis);
+            if (pindexScan == NULL)
+            {
+                LogPrintf("Block chain already scanned for public keys.\n");
+                return true;
+            };
+
+            if (!ScanChainForPublicKeys(pindexScan))
+                return false;
+        } catch (std::exception& e)
         {
-            LogPrintf("Scanning transaction no. %u.\n", nTransactions);
+            LogPrintf("ScanChainForPublicKeys() threw: %s.\n", e.what());
+            return false;
         };
+    } else
+    {
+        LogPrintf("ScanChainForPublicKeys() Could not lock main.\n");
+        return false;
     };
+
     return true;
 };
 
+class SecMsgScanKey
+{
+// -- an owned address messages are trial-decrypted with
+public:
+    std::string sAddress;
+    bool        fReceiveAnon;
+    CKey        key;
+};
+
+static void SecureMsgGetScanKeys(std::vector<SecMsgScanKey>& vKeys)
+{
+    // -- private keys of all receiving addresses, fetched once per scan
+    vKeys.clear();
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
 
-bool SecureMsgScanBlock(CBlock& block)
+        CDarkSilkAddress coinAddress(it->sAddress);
+        CKeyID ckid;
+        SecMsgScanKey scanKey;
+        if (!coinAddress.GetKeyID(ckid)
+            || !pwalletMain->GetKey(ckid, scanKey.key))
+            continue;
+
+        scanKey.sAddress = coinAddress.ToString();
+        scanKey.fReceiveAnon = it->fReceiveAnon;
+        vKeys.push_back(scanKey);
+    };
+};
+
+static int SecureMsgMatchKey(const std::vector<SecMsgScanKey>& vKeys, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload)
 {
-    // - scan block for public key addresses
-    
-    if (!smsgOptions.fScanIncoming)
-        return true;
+    /*  Find the key a message was sent to, without decrypting it.
 
-    if (fDebugSmsg)
-        LogPrintf("SecureMsgScanBlock().\n");
+        Same derivation as SecureMsgDecrypt: P = kR, H = SHA512(P.x),
+        MAC = HMAC_SHA256(H[32..64], timestamp + payload).
+        R is parsed once and only the point multiply, two hashes and
+        the MAC are done per key.
 
-    uint32_t nTransactions  = 0;
-    uint32_t nElements      = 0;
-    uint32_t nPubkeys       = 0;
-    uint32_t nDuplicates    = 0;
+        returns
+            index of the first key the MAC matches, -1 if none
+    */
+
+    const SecureMessage* psmsg = (const SecureMessage*) pHeader;
+
+    if (psmsg->version[0] != 1)
+        return -1;
 
+    secp256k1_pubkey R;
+    if (!secp256k1_ec_pubkey_parse(secp256k1_context_stealth, &R, psmsg->cpkR, 33))
+        return -1;
+
+    int rv = -1;
+    uint8_t vchP[33];
+    uint8_t vchHashed[64];
+    uint8_t MAC[32];
+    for (unsigned int i = 0; i < vKeys.size() && rv < 0; ++i)
     {
-        LOCK(cs_smsgDB);
-        CTxDB txdb("r");
+        secp256k1_pubkey P = R;
+        size_t nP = sizeof(vchP);
+        if (!secp256k1_ec_pubkey_tweak_mul(secp256k1_context_stealth, &P, vKeys[i].key.begin())
+            || !secp256k1_ec_pubkey_serialize(secp256k1_context_stealth, vchP, &nP, &P, SECP256K1_EC_COMPRESSED))
+            continue;
 
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
-            return false;
+        CSHA512().Write(&vchP[1], 32).Finalize(vchHashed);
+        CHMAC_SHA256(&vchHashed[32], 32)
+            .Write((const uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
+            .Write(pPayload, nPayload)
+            .Finalize(MAC);
 
-        ScanBlock(block, txdb, addrpkdb,
-            nTransactions, nElements, nPubkeys, nDuplicates);
+        if (memcmp(MAC, psmsg->mac, 32) == 0)
+            rv = i;
+    };
 
-        addrpkdb.TxnCommit();
-    } // cs_smsgDB
+    memory_cleanse(vchP, sizeof(vchP));
+    memory_cleanse(vchHashed, sizeof(vchHashed));
+    return rv;
+};
 
-    if (fDebugSmsg)
-        LogPrintf("Found %u transactions, %u elements, %u new public keys, %u duplicates.\n", nTransactions, nElements, nPubkeys, nDuplicates);
+static void SecureMsgMatchKeysThread(const std::vector<SecMsgScanKey>* pvKeys, const std::vector<std::vector<uint8_t> >* pvMessages,
+    std::vector<int>* pvMatches, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvMessages->size(); i += nThreads)
+    {
+        const uint8_t* pHeader = &(*pvMessages)[i][0];
+        (*pvMatches)[i] = SecureMsgMatchKey(*pvKeys, pHeader, pHeader + SMSG_HDR_LEN, ((const SecureMessage*) pHeader)->nPayload);
+    };
+};
 
-    return true;
+static void SecureMsgMatchKeys(const std::vector<SecMsgScanKey>& vKeys, const std::vector<std::vector<uint8_t> >& vMessages, std::vector<int>& vMatches)
+{
+    // -- each message is matched into its own slot, across all cores
+    vMatches.assign(vMessages.size(), -1);
+    if (vKeys.empty())
+        return;
+
+    ParallelFor(vMessages.size(), 0, boost::bind(&SecureMsgMatchKeysThread, &vKeys, &vMessages, &vMatches, _1, _2));
 };
 
-bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
+static int SecureMsgReceiveMatched(const SecMsgScanKey* pKey, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui,
+    SecMsgDB* pdbInbox = NULL, std::vector<SecMsgStored>* pvSaved = NULL)
 {
-    LogPrintf("Scanning block chain for public keys.\n");
-    int64_t nStart = GetTimeMillis();
+    /*
+    Add a message SecureMsgMatchKey matched to pKey to the inbox.
+    Full decryption is only done here, for addresses that need to see the sender.
+    pdbInbox, if set, is an open db with a batch the caller commits; the
+    messages written to it are appended to pvSaved instead of being reported,
+    for the caller to report once the batch is committed.
 
-    if (fDebugSmsg)
-        LogPrintf("From height %u.\n", pindexStart->nHeight);
+    returns
+        0 success, or nothing to do
+        1 error
+    */
 
-    // -- public keys are in txin.scriptSig
-    //    matching addresses are in scriptPubKey of txin's referenced output
+    if (!pKey)
+        return 0;
 
-    uint32_t nBlocks        = 0;
-    uint32_t nTransactions  = 0;
-    uint32_t nInputs        = 0;
-    uint32_t nPubkeys       = 0;
-    uint32_t nDuplicates    = 0;
+    std::string addressTo = pKey->sAddress;
+    MessageData msg; // placeholder
+    bool fOwnMessage = false;
 
+    if (!pKey->fReceiveAnon)
     {
-        LOCK(cs_smsgDB);
+        // -- have to do full decrypt to see address from
+        if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+        {
+            if (fDebugSmsg)
+                LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
 
-        CTxDB txdb("r");
+            if (msg.sFromAddress.compare("anon") != 0)
+                fOwnMessage = true;
+        };
+    } else
+    {
+        if (fDebugSmsg)
+            LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
 
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
-            return false;
+        fOwnMessage = true;
+    };
 
-        CBlockIndex* pindex = pindexStart;
-        while (pindex)
-        {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
+    if (fOwnMessage)
+    {
+        // -- save to inbox
+        SecureMessage* psmsg = (SecureMessage*) pHeader;
+        std::string sPrefix("im");
+        uint8_t chKey[18];
+        memcpy(&chKey[0],  sPrefix.data(),    2);
+        memcpy(&chKey[2],  &psmsg->timestamp, 8);
+        memcpy(&chKey[10], pPayload,          8);
 
-            ScanBlock(block, txdb, addrpkdb,
-                nTransactions, nInputs, nPubkeys, nDuplicates);
+        SecMsgStored smsgInbox;
+        smsgInbox.timeReceived  = GetTime();
+        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
+        smsgInbox.sAddrTo       = addressTo;
 
-            pindex = pindex->pnext;
+        // -- data may not be contiguous
+        try {
+            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+        } catch (std::exception& e) {
+            LogPrintf("SecureMsgReceiveMatched(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+            return 1;
         };
+        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
 
-        addrpkdb.TxnCommit();
-    } // cs_smsgDB
+        {
+            LOCK(cs_smsgDB);
+            SecMsgDB dbInbox;
+            if (!pdbInbox && dbInbox.Open("cw"))
+                pdbInbox = &dbInbox;
 
-    LogPrintf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
-    LogPrintf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
-    LogPrintf("Took %d ms\n", GetTimeMillis() - nStart);
+            if (pdbInbox)
+            {
+                if (pdbInbox->ExistsSmesg(chKey))
+                {
+                    if (fDebugSmsg)
+                        LogPrintf("Message already exists in inbox db.\n");
+                } else
+                {
+                    pdbInbox->WriteSmesg(chKey, smsgInbox);
 
-    return true;
+                    if (pvSaved)
+                    {
+                        pvSaved->push_back(smsgInbox);
+                    } else
+                    {
+                        if (reportToGui)
+                            NotifySecMsgInboxChanged(smsgInbox);
+                        LogPrintf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+                    };
+                };
+            };
+        } // cs_smsgDB
+    };
+
+    return 0;
 };
 
-bool SecureMsgScanBlockChain()
+static int SecureMsgScanFile(FILE *fp, uint32_t& nMessages, uint32_t& nFoundMessages)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain)
+    /*
+    Scan the messages of a bucket file against every owned address.
+    Messages are read SMSG_SCAN_BATCH at a time, matched across all cores
+    and then received in file order.
+
+    returns
+        0 success
+        1 error
+    */
+
+    std::vector<SecMsgScanKey> vKeys;
+    SecureMsgGetScanKeys(vKeys);
+
+    std::vector<std::vector<uint8_t> > vMessages;
+    std::vector<int> vMatches;
+    uint8_t header[SMSG_HDR_LEN];
+    SecureMessage* psmsg = (SecureMessage*) &header[0];
+    bool fEnd = false;
+
+    while (!fEnd)
     {
-        CBlockIndex *pindexScan = pindexGenesisBlock;
-        if (pindexScan == NULL)
+        vMessages.clear();
+        while (vMessages.size() < SMSG_SCAN_BATCH)
         {
-            LogPrintf("Error: pindexGenesisBlock not set.\n");
-            return false;
+            errno = 0;
+            if (fread(header, sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+            {
+                if (errno != 0)
+                {
+                    LogPrintf("fread header failed: %s\n", strerror(errno));
+                } else
+                {
+                    //LogPrintf("End of file.\n");
+                };
+                fEnd = true;
+                break;
+            };
+
+            vMessages.push_back(std::vector<uint8_t>());
+            std::vector<uint8_t>& vchMessage = vMessages.back();
+            try { vchMessage.resize(SMSG_HDR_LEN + psmsg->nPayload); } catch (std::exception& e)
+            {
+                LogPrintf("SecureMsgScanFile(): Could not resize vchData, %u, %s\n", psmsg->nPayload, e.what());
+                return 1;
+            };
+            memcpy(&vchMessage[0], header, SMSG_HDR_LEN);
+
+            if (fread(&vchMessage[0] + SMSG_HDR_LEN, sizeof(uint8_t), psmsg->nPayload, fp) != psmsg->nPayload)
+            {
+                LogPrintf("fread data failed: %s\n", strerror(errno));
+                vMessages.pop_back();
+                fEnd = true;
+                break;
+            };
         };
 
+        SecureMsgMatchKeys(vKeys, vMessages, vMatches);
 
-        try { // -- in try to catch errors opening db,
-            if (!ScanChainForPublicKeys(pindexScan))
-                return false;
-        } catch (std::exception& e)
+        // -- the batch's inbox messages are written together, and only
+        //    reported once they are committed
+        std::vector<SecMsgStored> vSaved;
+        SecMsgDB dbInbox;
         {
-            LogPrintf("ScanChainForPublicKeys() threw: %s.\n", e.what());
-            return false;
+            LOCK(cs_smsgDB);
+            if (!dbInbox.Open("cw")
+                || !dbInbox.TxnBegin())
+                return 1;
+        }
+
+        for (unsigned int i = 0; i < vMessages.size(); ++i)
+        {
+            nMessages++;
+            if (vMatches[i] < 0)
+                continue;
+
+            // -- don't report to gui,
+            uint8_t* pHeader = &vMessages[i][0];
+            if (SecureMsgReceiveMatched(&vKeys[vMatches[i]], pHeader, pHeader + SMSG_HDR_LEN, ((SecureMessage*) pHeader)->nPayload, false, &dbInbox, &vSaved) == 0)
+                nFoundMessages++;
         };
-    } else
-    {
-        LogPrintf("ScanChainForPublicKeys() Could not lock main.\n");
-        return false;
+
+        {
+            LOCK(cs_smsgDB);
+            if (!dbInbox.TxnCommit())
+                return 1;
+        }
+
+        for (unsigned int i = 0; i < vSaved.size(); ++i)
+            LogPrintf("SecureMsg saved to inbox, received with %s.\n", vSaved[i].sAddrTo.c_str());
     };
 
-    return true;
+    return 0;
 };
 
 bool SecureMsgScanBuckets()
@@ -2174,9 +3647,6 @@ bool SecureMsgScanBuckets()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2207,86 +3677,37 @@ bool SecureMsgScanBuckets()
 
         if (fileTime < now - SMSG_RETENTION)
         {
-            LogPrintf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                LogPrintf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
+            // -- ThreadSecureMsg drops expired segments
             continue;
         };
 
         if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebugSmsg)
-                LogPrintf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
-
-        {
-            LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-
-            for (;;)
-            {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+        {
+            if (fDebugSmsg)
+                LogPrintf("Skipping wallet locked file: %s.\n", fileName.c_str());
+            continue;
+        };
 
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
+        {
+            LOCK(cs_smsg);
+            // -- messages still in the open segment's buffer must be in the file
+            SecureMsgStoreFlush();
 
-                nMessages ++;
+            FILE *fp;
+            errno = 0;
+            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            {
+                LogPrintf("Error opening file: %s\n", strerror(errno));
+                continue;
             };
 
-            fclose(fp);
-
-            // -- remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
+            if (SecureMsgScanFile(fp, nMessages, nFoundMessages) != 0)
             {
-                LogPrintf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
+                fclose(fp);
                 return 1;
             };
+
+            fclose(fp);
         } // cs_smsg
     };
 
@@ -2328,9 +3749,6 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2379,47 +3797,10 @@ int SecureMsgWalletUnlocked()
                 continue;
             };
 
-            for (;;)
+            if (SecureMsgScanFile(fp, nMessages, nFoundMessages) != 0)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages ++;
+                fclose(fp);
+                return 1;
             };
 
             fclose(fp);
@@ -2509,92 +3890,11 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         return 3;
     };
 
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
-
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-    {
-        if (!it->fReceiveEnabled)
-            continue;
-
-        CDarkSilkAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
-
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
-
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        } else
-        {
-
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
-
-                fOwnMessage = true;
-                break;
-            };
-        }
-    };
-
-    if (fOwnMessage)
-    {
-        // -- save to inbox
-        SecureMessage* psmsg = (SecureMessage*) pHeader;
-        std::string sPrefix("im");
-        uint8_t chKey[18];
-        memcpy(&chKey[0],  sPrefix.data(),    2);
-        memcpy(&chKey[2],  &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload,          8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived  = GetTime();
-        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
-        smsgInbox.sAddrTo       = addressTo;
-
-        // -- data may not be contiguous
-        try {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
-        } catch (std::exception& e) {
-            LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
-
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
-
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebugSmsg)
-                        LogPrintf("Message already exists in inbox db.\n");
-                } else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
-
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    LogPrintf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
-            };
-        } // cs_smsgDB
-    };
+    std::vector<SecMsgScanKey> vKeys;
+    SecureMsgGetScanKeys(vKeys);
 
-    return 0;
+    int nKey = SecureMsgMatchKey(vKeys, pHeader, pPayload, nPayload);
+    return SecureMsgReceiveMatched(nKey < 0 ? NULL : &vKeys[nKey], pHeader, pPayload, nPayload, reportToGui);
 };
 
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut)
@@ -2734,30 +4034,19 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
 
     // -- has cs_smsg lock from SecureMsgReceiveData
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-
     //LogPrintf("token.offset %d.\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    //LogPrintf("bucket %d.\n", bucket);
-    //LogPrintf("bucket d %d.\n", bucket);
-    //LogPrintf("fileName %s.\n", fileName.c_str());
 
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
-    {
-        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), fullpath.string().c_str());
+    SecMsgSegment* pseg;
+    if (!(pseg = SecureMsgOpenSegment(bucket)))
         return 1;
-    };
+
+    FILE *fp = pseg->fpData;
 
     errno = 0;
     if (fseek(fp, token.offset, SEEK_SET) != 0)
     {
         LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
         return 1;
     };
 
@@ -2766,7 +4055,6 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
     if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
     {
         LogPrintf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
         return 1;
     };
 
@@ -2782,13 +4070,9 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
     if (fread(&vchData[SMSG_HDR_LEN], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
     {
         LogPrintf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
         return 1;
     };
 
-
-    fclose(fp);
-
     return 0;
 };
 
@@ -2891,6 +4175,9 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
     
     {
         LOCK(cs_smsg);
+        // -- one fsync for the whole bunch
+        SecureMsgStoreFlush();
+
         // -- if messages have been added, bucket must exist now
         itb = smsgBuckets.find(bktTime);
         if (itb == smsgBuckets.end())
@@ -2992,7 +4279,6 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
     SecureMessage* psmsg = (SecureMessage*) pHeader;
 
 
-    long int ofs;
     fs::path pathSmsgDir;
     try {
         pathSmsgDir = GetDataDir() / "smsgStore";
@@ -3018,8 +4304,8 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
 
     SecMsgToken token(psmsg->timestamp, pPayload, nPayload, 0);
 
-    std::set<SecMsgToken>& tokenSet = smsgBuckets[bucket].setTokens;
-    std::set<SecMsgToken>::iterator it;
+    SecMsgTokenSet& tokenSet = smsgBuckets[bucket].setTokens;
+    SecMsgTokenSet::iterator it;
     it = tokenSet.find(token);
     if (it != tokenSet.end())
     {
@@ -3048,36 +4334,38 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
         return 1;
     };
 
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
+    SecMsgSegment* pseg;
+    if (!(pseg = SecureMsgOpenSegment(bucket)))
+        return errorN(1, "Could not open bucket %d.", bucket);
 
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-    {
-        return errorN(1, "fopen failed: %s.", strerror(errno));
-    };
+    token.offset = pseg->nDataSize;
 
-    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+    uint8_t record[SMSG_IDX_RECORD_LEN];
+    SecureMsgIndexRecord(token, nPayload, record);
+
+    // -- a read may have used the stream since the last write, reposition before writing
     errno = 0;
-    if (fseek(fp, 0, SEEK_END) != 0)
-    {
+    if (fseek(pseg->fpData, 0, SEEK_END) != 0)
         return errorN(1, "fseek failed: %s.", strerror(errno));
-    };
 
-
-    ofs = ftell(fp);
-
-    if (fwrite(pHeader, sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
-        || fwrite(pPayload, sizeof(uint8_t), nPayload, fp) != nPayload)
+    pseg->fDirty = true;
+    if (fwrite(pHeader, sizeof(uint8_t), SMSG_HDR_LEN, pseg->fpData) != (size_t)SMSG_HDR_LEN
+        || fwrite(pPayload, sizeof(uint8_t), nPayload, pseg->fpData) != nPayload)
     {
-        fclose(fp);
+        SecureMsgAbortAppend(bucket, token.offset);
         return errorN(1, "fwrite failed: %s.", strerror(errno));
     };
+    pseg->nDataSize += SMSG_HDR_LEN + nPayload;
 
-    fclose(fp);
+    if (fwrite(record, sizeof(uint8_t), SMSG_IDX_RECORD_LEN, pseg->fpIndex) != SMSG_IDX_RECORD_LEN)
+    {
+        // -- the message is stored, the index will be rebuilt from it
+        LogPrintf("fwrite index failed: %s.\n", strerror(errno));
+        SecureMsgAbortAppend(bucket, pseg->nDataSize);
+    };
 
-    token.offset = ofs;
+    if (fUpdateBucket)
+        SecureMsgStoreFlush();
 
     //LogPrintf("token.offset: %d\n", token.offset); // DEBUG
     tokenSet.insert(token);
@@ -3095,6 +4383,30 @@ int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket)
     return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
 };
 
+static void SecureMsgPowHash(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, uint8_t *sha256Hash)
+{
+    // -- HMAC-SHA256 keyed with the nonse repeated to 32 bytes, over the
+    //    header after the hash field and then the payload twice
+
+    const SecureMessage *psmsg = (const SecureMessage*) pHeader;
+    uint8_t civ[32];
+    for (int i = 0; i < 32; i+=4)
+        memcpy(civ+i, &psmsg->nonse[0], 4);
+
+    CHMAC_SHA256(civ, 32)
+        .Write(pHeader+4, SMSG_HDR_LEN-4)
+        .Write(pPayload, nPayload)
+        .Write(pPayload, nPayload)
+        .Finalize(sha256Hash);
+};
+
+static bool SecureMsgPowValid(const uint8_t *sha256Hash)
+{
+    return sha256Hash[31] == 0
+        && sha256Hash[30] == 0
+        && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) );
+};
+
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
 {
     /*
@@ -3114,140 +4426,142 @@ int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     if (nPayload > SMSG_MAX_MSG_WORST)
         return 5;
 
-    uint8_t civ[32];
     uint8_t sha256Hash[32];
     int rv = 2; // invalid
 
-    uint32_t nonse;
-    memcpy(&nonse, &psmsg->nonse[0], 4);
-
     if (fDebugSmsg)
+    {
+        uint32_t nonse;
+        memcpy(&nonse, &psmsg->nonse[0], 4);
         LogPrintf("SecureMsgValidate() nonse %u.\n", nonse);
+    };
 
-    for (int i = 0; i < 32; i+=4)
-        memcpy(civ+i, &nonse, 4);
-
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
+    SecureMsgPowHash(pHeader, pPayload, nPayload, sha256Hash);
 
-    uint32_t nBytes;
-    if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (uint8_t*) pHeader+4, SMSG_HDR_LEN-4)
-        || !HMAC_Update(&ctx, (uint8_t*) pPayload, nPayload)
-        || !HMAC_Update(&ctx, pPayload, nPayload)
-        || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-        || nBytes != 32)
+    if (SecureMsgPowValid(sha256Hash))
     {
         if (fDebugSmsg)
-            LogPrintf("HMAC error.\n");
-        rv = 1; // error
-    } else
-    {
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) ))
-        {
-            if (fDebugSmsg)
-                LogPrintf("Hash Valid.\n");
-            rv = 0; // smsg is valid
-        };
+            LogPrintf("Hash Valid.\n");
+        rv = 0; // smsg is valid
+    };
 
-        if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
-        {
-             if (fDebugSmsg)
-                LogPrintf("Checksum mismatch.\n");
-            rv = 3; // checksum mismatch
-        }
+    if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
+    {
+         if (fDebugSmsg)
+            LogPrintf("Checksum mismatch.\n");
+        rv = 3; // checksum mismatch
     }
-    HMAC_CTX_cleanup(&ctx);
 
     return rv;
 };
 
-int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
+static CCriticalSection cs_smsgPowStats;
+static SecMsgPowStats smsgPowStats;
+
+class SecMsgPowSearch
 {
-    /*  proof of work and checksum
+// -- shared by the threads of one SecureMsgSetHash call
+public:
+    const uint8_t *pHeader;
+    const uint8_t *pPayload;
+    uint32_t nPayload;
 
-        May run in a thread, if shutdown detected, return.
+    CCriticalSection cs;
+    bool fFound;
+    uint32_t nonse;
+    uint8_t sha256Hash[32];
+    uint64_t nHashes;
+};
 
-        returns:
-            0 success
-            1 error
-            2 stopped due to node shutdown
+static void SecureMsgPowThread(SecMsgPowSearch *psearch, int nThread, int nThreads)
+{
+    // -- try every nThreads'th nonse from nThread, on a private copy of the header
 
-    */
+    uint32_t nStride = nThreads;
 
-    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    uint8_t header[SMSG_HDR_LEN];
+    memcpy(header, psearch->pHeader, SMSG_HDR_LEN);
+    SecureMessage *psmsg = (SecureMessage*) header;
 
-    int64_t nStart = GetTimeMillis();
-    uint8_t civ[32];
     uint8_t sha256Hash[32];
-
+    uint64_t nHashes = 0;
     bool found = false;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-
-    uint32_t nonse = 0;
+    uint32_t nonse = nThread;
 
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-
-    // -- break for HMAC_CTX_cleanup
     for (;;)
     {
-        if (!fSecMsgEnabled)
-           break;
+        if ((nHashes & 255) == 0)
+        {
+            // -- stop when another thread has a match or on shutdown
+            LOCK(psearch->cs);
+            if (psearch->fFound || !fSecMsgEnabled)
+                break;
+        };
 
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
         memcpy(&psmsg->nonse[0], &nonse, 4);
+        SecureMsgPowHash(header, psearch->pPayload, psearch->nPayload, sha256Hash);
+        nHashes++;
 
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonse, 4);
-
-        uint32_t nBytes;
-        if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-            || !HMAC_Update(&ctx, (uint8_t*) pHeader+4, SMSG_HDR_LEN-4)
-            || !HMAC_Update(&ctx, (uint8_t*) pPayload, nPayload)
-            || !HMAC_Update(&ctx, pPayload, nPayload)
-            || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
+        if (SecureMsgPowValid(sha256Hash))
         {
             found = true;
-            if (fDebugSmsg)
-                LogPrintf("Match %u\n", nonse);
             break;
         };
-        */
 
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    LogPrintf("Match %u\n", nonse);
+        if (nonse > 4294967295U - nStride)
             break;
-        }
+        nonse += nStride;
+    };
 
-        //if (nonse >= UINT32_MAX)
-        if (nonse >= 4294967295U)
-        {
-            if (fDebugSmsg)
-                LogPrintf("No match %u\n", nonse);
-            break;
-            //return 1;
-        }
-        nonse++;
+    LOCK(psearch->cs);
+    psearch->nHashes += nHashes;
+    if (found && (!psearch->fFound || nonse < psearch->nonse))
+    {
+        psearch->fFound = true;
+        psearch->nonse = nonse;
+        memcpy(psearch->sha256Hash, sha256Hash, 32);
     };
+};
 
-    HMAC_CTX_cleanup(&ctx);
+int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, int nThreads)
+{
+    /*  proof of work and checksum
+
+        May run in a thread, if shutdown detected, return.
+        The nonse range is split over nThreads threads, 0 for one per core.
+
+        returns:
+            0 success
+            1 error
+            2 stopped due to node shutdown
+
+    */
+
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+    int64_t nStart = GetTimeMillis();
+
+    SecMsgPowSearch search;
+    search.pHeader = pHeader;
+    search.pPayload = pPayload;
+    search.nPayload = nPayload;
+    search.fFound = false;
+    search.nonse = 0;
+    search.nHashes = 0;
+
+    nThreads = ParallelFor((uint64_t)1 << 32, nThreads, boost::bind(&SecureMsgPowThread, &search, _1, _2));
+
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    {
+        LOCK(cs_smsgPowStats);
+        smsgPowStats.nThreads = nThreads;
+        smsgPowStats.nMessages++;
+        smsgPowStats.nHashes += search.nHashes;
+        smsgPowStats.nMillis += nElapsed;
+        smsgPowStats.nLastPayload = nPayload;
+        smsgPowStats.nLastHashes = search.nHashes;
+        smsgPowStats.nLastMillis = nElapsed;
+    }
 
     if (!fSecMsgEnabled)
     {
@@ -3256,22 +4570,28 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
         return 2;
     };
 
-    if (!found)
+    if (!search.fFound)
     {
         if (fDebugSmsg)
-            LogPrintf("SecureMsgSetHash() failed, took %d ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+            LogPrintf("SecureMsgSetHash() failed, took %d ms, %u hashes\n", nElapsed, search.nHashes);
         return 1;
     };
 
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
+    memcpy(&psmsg->nonse[0], &search.nonse, 4);
+    memcpy(psmsg->hash, search.sha256Hash, 4);
 
     if (fDebugSmsg)
-        LogPrintf("SecureMsgSetHash() took %d ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+        LogPrintf("SecureMsgSetHash() took %d ms, nonse %u, %u hashes on %d threads\n", nElapsed, search.nonse, search.nHashes, nThreads);
 
     return 0;
 };
 
+void SecureMsgGetPowStats(SecMsgPowStats& stats)
+{
+    LOCK(cs_smsgPowStats);
+    stats = smsgPowStats;
+};
+
 int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const std::string &addressTo, const std::string &message)
 {
     /* Create a secure message
@@ -3529,7 +4849,7 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
     return 0;
 };
 
-int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError)
+int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError, uint64_t nJobId)
 {
     /* Encrypt secure message, and place it on the network
         Make a copy of the message to sender's first address and place in send queue db
@@ -3588,7 +4908,7 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
     uint8_t chKey[18];
     memcpy(&chKey[0],  sPrefix.data(),  2);
     memcpy(&chKey[2],  &smsg.timestamp, 8);
-    memcpy(&chKey[10], &smsg.pPayload,  8);
+    memcpy(&chKey[10], smsg.pPayload,   8);
 
     SecMsgStored smsgSQ;
 
@@ -3608,11 +4928,17 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
     {
         LOCK(cs_smsgDB);
         SecMsgDB dbSendQueue;
-        if (dbSendQueue.Open("cw"))
+        if (!dbSendQueue.Open("cw")
+            || !dbSendQueue.WriteSmesg(chKey, smsgSQ))
         {
-            dbSendQueue.WriteSmesg(chKey, smsgSQ);
-            //NotifySecMsgSendQueueChanged(smsgOutbox);
+            LogPrintf("SecureMsgSend(), could not write to the send queue.\n");
+            sError = "Could not write to the send queue.";
+            return 1;
         };
+        //NotifySecMsgSendQueueChanged(smsgOutbox);
+
+        if (nJobId != 0)
+            SecureMsgSendQueued(nJobId, chKey);
     } // cs_smsgDB
 
     // TODO: only update outbox when proof of work thread is done.
@@ -3626,19 +4952,22 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
     std::string addressOutbox = "None";
     CDarkSilkAddress coinAddrOutbox;
 
-    BOOST_FOREACH(const PAIRTYPE(CTxDestination, std::string)& entry, pwalletMain->mapAddressBook)
     {
-        // -- get first owned address
-        if (!IsMine(*pwalletMain, entry.first))
-            continue;
+        LOCK(pwalletMain->cs_wallet); // send workers run without it
+        BOOST_FOREACH(const PAIRTYPE(CTxDestination, std::string)& entry, pwalletMain->mapAddressBook)
+        {
+            // -- get first owned address
+            if (!IsMine(*pwalletMain, entry.first))
+                continue;
 
-        const CDarkSilkAddress& address = entry.first;
+            const CDarkSilkAddress& address = entry.first;
 
-        addressOutbox = address.ToString();
-        if (!coinAddrOutbox.SetString(addressOutbox)) // test valid
-            continue;
-        break;
-    };
+            addressOutbox = address.ToString();
+            if (!coinAddrOutbox.SetString(addressOutbox)) // test valid
+                continue;
+            break;
+        };
+    }
 
     if (addressOutbox == "None")
     {
@@ -3659,7 +4988,7 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
             uint8_t chKey[18];
             memcpy(&chKey[0],  sPrefix.data(),           2);
             memcpy(&chKey[2],  &smsgForOutbox.timestamp, 8);
-            memcpy(&chKey[10], &smsgForOutbox.pPayload,  8);   // sample
+            memcpy(&chKey[10], smsgForOutbox.pPayload,   8);   // sample
 
             SecMsgStored smsgOutbox;
 
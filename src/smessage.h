@@ -27,6 +27,20 @@ const unsigned int SMSG_THREAD_LOG_GAP  = 6;
 const unsigned int SMSG_TIME_LEEWAY     = 60;
 const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
 
+const unsigned int SMSG_SCAN_BATCH      = 1024;              // messages read from a bucket file and trial-decrypted together
+const unsigned int SMSG_SCAN_CHAIN_BATCH = 512;              // blocks ScanChainForPublicKeys reads ahead while the previous ones are written
+const unsigned int SMSG_MAX_OPEN_SEGMENTS = 16;              // bucket data and index files kept open between reads and appends
+const unsigned int SMSG_SEND_THREADS      = 2;               // workers encrypting messages queued by SecureMsgSendAsync
+const unsigned int SMSG_SEND_MAX_JOBS     = 4096;            // queued and finished jobs kept for smsgsendstatus
+
+const unsigned int SMSG_PROTOCOL_VERSION  = 2;               // 2: buckets are reconciled with smsgRecon sketches
+const unsigned int SMSG_RECON_SLACK       = 8;               // differences a sketch allows for beyond the difference in message counts
+const unsigned int SMSG_RECON_MAX_CELLS   = 4 * 1024;
+
+const unsigned int SMSG_DB_CACHE          = 8;               // default -smsgdbcache, in MB
+const unsigned int SMSG_DB_WRITE_BUFFER   = 8 * 1024 * 1024; // memtable size, bulk writes reach disk as fewer, larger tables
+const unsigned int SMSG_DB_BATCH_MAX      = 4096;            // writes a bulk operation batches before TxnCheckpoint commits them
+
 
 const unsigned int SMSG_MAX_MSG_BYTES   = 4096;              // the user input part
 
@@ -141,6 +155,40 @@ public:
 };
 
 
+class SecMsgTokenSet
+{
+// -- tokens of a bucket in a sorted vector, messages mostly arrive in timestamp
+//    order so inserts are usually appends.
+//    nChanges counts every insert and removal, so a hash computed from the
+//    tokens can tell cheaply whether it is still current.
+public:
+    typedef std::vector<SecMsgToken>::iterator          iterator;
+    typedef std::vector<SecMsgToken>::const_iterator    const_iterator;
+
+    SecMsgTokenSet()
+    {
+        nChanges = 0;
+    };
+
+    iterator begin()                { return vTokens.begin(); };
+    iterator end()                  { return vTokens.end(); };
+    const_iterator begin() const    { return vTokens.begin(); };
+    const_iterator end() const      { return vTokens.end(); };
+    size_t size() const             { return vTokens.size(); };
+    uint64_t GetChanges() const     { return nChanges; };
+
+    void clear();
+    iterator find(const SecMsgToken& token);
+    const_iterator find(const SecMsgToken& token) const;
+    bool insert(const SecMsgToken& token);
+    void assign(std::vector<SecMsgToken>& vLoad);
+
+private:
+    std::vector<SecMsgToken>    vTokens;
+    uint64_t                    nChanges;
+};
+
+
 class SecMsgBucket
 {
 public:
@@ -148,18 +196,23 @@ public:
     {
         timeChanged     = 0;
         hash            = 0;
+        nHashChanges    = 0;
+        fHashed         = false;
         nLockCount      = 0;
         nLockPeerId     = 0;
     };
     ~SecMsgBucket() {};
 
     void hashBucket();
+    uint32_t GetHash();
 
     int64_t                     timeChanged;
-    uint32_t                    hash;           // token set should get ordered the same on each node
+    uint32_t                    hash;           // token set should get ordered the same on each node, read through GetHash()
+    uint64_t                    nHashChanges;   // setTokens change count when hash was computed
+    bool                        fHashed;
     uint32_t                    nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     NodeId                      nLockPeerId;    // id of peer that bucket is locked for
-    std::set<SecMsgToken>       setTokens;
+    SecMsgTokenSet              setTokens;
 
 };
 
@@ -228,6 +281,62 @@ public:
     bool fScanIncoming;
 };
 
+class SecMsgPowStats
+{
+// -- work done by SecureMsgSetHash since startup
+public:
+    SecMsgPowStats()
+    {
+        nThreads     = 0;
+        nMessages    = 0;
+        nHashes      = 0;
+        nMillis      = 0;
+        nLastPayload = 0;
+        nLastHashes  = 0;
+        nLastMillis  = 0;
+    }
+
+    int      nThreads;      // threads used for the last message
+    uint64_t nMessages;
+    uint64_t nHashes;
+    int64_t  nMillis;
+    uint32_t nLastPayload;  // payload bytes of the last message
+    uint64_t nLastHashes;
+    int64_t  nLastMillis;
+};
+
+enum SecMsgSendStatus
+{
+    SMSG_SEND_QUEUED,           // waiting for a send worker
+    SMSG_SEND_ENCRYPTING,
+    SMSG_SEND_POW,              // encrypted, in the send queue db for the proof of work thread
+    SMSG_SEND_SENT,             // in the message store, will go out with the next bucket inventory
+    SMSG_SEND_FAILED,
+};
+
+class SecMsgSendJob
+{
+// -- a message queued by SecureMsgSendAsync
+public:
+    SecMsgSendJob()
+    {
+        nId          = 0;
+        nStatus      = SMSG_SEND_QUEUED;
+        nTimeQueued  = 0;
+        nTimeChanged = 0;
+    }
+
+    uint64_t             nId;
+    std::string          sAddrFrom;
+    std::string          sAddrTo;
+    std::string          sMessage;      // cleared once encrypted
+    int                  nStatus;
+    std::string          sError;
+    int64_t              nTimeQueued;
+    int64_t              nTimeChanged;
+    std::vector<uint8_t> vchQueueKey;   // send queue db key, to follow the message through proof of work
+};
+
 
 class SecMsgCrypter
 {
@@ -293,6 +402,7 @@ class SecMsgDB
 public:
     SecMsgDB()
     {
+        pdb = NULL;
         activeBatch = NULL;
     };
 
@@ -307,15 +417,23 @@ public:
     bool Open(const char* pszMode="r+");
 
     bool ScanBatch(const CDataStream& key, std::string* value, bool* deleted) const;
+    void BatchPut(const std::string& key, const std::string& value);
+    void BatchDelete(const std::string& key);
 
     bool TxnBegin();
     bool TxnCommit();
+    bool TxnCheckpoint();
     bool TxnAbort();
 
+    leveldb::Iterator* NewIterator();
+
     bool ReadPK(CKeyID& addr, CPubKey& pubkey);
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
 
+    bool ReadChainScan(uint256& hashBlock, int& nHeight);
+    bool WriteChainScan(const uint256& hashBlock, int nHeight);
+
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey);
     bool ReadSmesg(uint8_t* chKey, SecMsgStored& smsgStored);
@@ -326,9 +444,14 @@ public:
     leveldb::DB *pdb;       // points to the global instance
     leveldb::WriteBatch *activeBatch;
 
+    // -- the writes in activeBatch by key, first is true for a delete
+    std::map<std::string, std::pair<bool, std::string> > mapBatch;
+
 };
 
 
+void SecureMsgCloseDB();
+
 int SecureMsgBuildBucketSet();
 int SecureMsgAddWalletAddresses();
 
@@ -347,7 +470,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
 bool SecureMsgScanBlock(CBlock& block);
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
-bool SecureMsgScanBlockChain();
+bool SecureMsgScanBlockChain(bool fFromGenesis=false);
 bool SecureMsgScanBuckets();
 
 
@@ -369,13 +492,21 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData);
 int SecureMsgStoreUnscanned(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
 int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool fUpdateBucket);
 int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket);
+void SecureMsgStoreFlush();
+
+int SecureMsgReconRequest(const SecMsgTokenSet& setTokens, int64_t bucket, uint32_t nPeerMessages, std::vector<uint8_t>& vchRecon);
+int SecureMsgReconReply(const SecMsgTokenSet& setTokens, const std::vector<uint8_t>& vchRecon, std::vector<uint8_t>& vchHave, std::vector<uint8_t>& vchWant);
 
 
 
-int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError);
+int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError, uint64_t nJobId = 0);
+int SecureMsgSendAsync(const std::string &addressFrom, const std::string &addressTo, const std::string &message, uint64_t &nId, std::string &sError);
+bool SecureMsgGetSendJob(uint64_t nId, SecMsgSendJob &job);
+void SecureMsgGetSendJobs(std::vector<SecMsgSendJob> &vJobs);
 
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
-int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
+int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, int nThreads = 0);
+void SecureMsgGetPowStats(SecMsgPowStats& stats);
 
 int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const std::string &addressTo, const std::string &message);
 
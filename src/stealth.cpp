@@ -7,12 +7,39 @@
 
 
 #include <openssl/rand.h>
-#include <openssl/ec.h>
-#include <openssl/ecdsa.h>
-#include <openssl/obj_mac.h>
+
+#include <secp256k1.h>
+#include <secp256k1_ecdh.h>
 
 const uint8_t stealth_version_byte = 0x4b; //Stealth addresses start with X
 
+// -- one context for all stealth arithmetic, built and blinded at startup
+//    instead of setting up the curve on every call
+secp256k1_context* secp256k1_context_stealth = NULL;
+
+namespace {
+class CStealthSecp256k1Init {
+public:
+    CStealthSecp256k1Init()
+    {
+        secp256k1_context_stealth = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+        assert(secp256k1_context_stealth != NULL);
+
+        unsigned char seed[32];
+        RAND_bytes(seed, sizeof(seed));
+        bool ret = secp256k1_context_randomize(secp256k1_context_stealth, seed);
+        assert(ret);
+        memset(seed, 0, sizeof(seed));
+    }
+    ~CStealthSecp256k1Init()
+    {
+        secp256k1_context_destroy(secp256k1_context_stealth);
+        secp256k1_context_stealth = NULL;
+    }
+};
+static CStealthSecp256k1Init instance_of_stealthsecp256k1init;
+} // anonymous namespace
+
 
 bool CStealthAddress::SetEncoded(const std::string& encodedAddress)
 {
@@ -159,55 +186,57 @@ int GenerateRandomSecret(ec_secret& out)
     return 0;
 };
 
-int SecretToPublicKey(const ec_secret& secret, ec_point& out)
+static bool ParsePoint(const ec_point& in, secp256k1_pubkey& out)
 {
-    // -- public key = private * G
-    int rv = 0;
-    
-    EC_GROUP *ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    return in.size() == ec_compressed_size
+        && secp256k1_ec_pubkey_parse(secp256k1_context_stealth, &out, &in[0], in.size());
+};
+
+static void SerializePoint(const secp256k1_pubkey& in, ec_point& out)
+{
+    size_t nSize = ec_compressed_size;
+    out.resize(ec_compressed_size);
+    secp256k1_ec_pubkey_serialize(secp256k1_context_stealth, &out[0], &nSize, &in, SECP256K1_EC_COMPRESSED);
+};
+
+// -- c = H(eQ) via constant-time ECDH, which hashes the compressed point, then R' = R + cG
+static int StealthSecretParsed(const ec_secret& secret, const secp256k1_pubkey& Q, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut)
+{
+    if (!secp256k1_ecdh(secp256k1_context_stealth, &sharedSOut.e[0], &Q, &secret.e[0]))
     {
-        printf("SecretToPublicKey(): EC_GROUP_new_by_curve_name failed.\n");
+        printf("StealthSecret(): eQ secp256k1_ecdh failed\n");
         return 1;
     };
-
-    BIGNUM* bnIn = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new());
-    if (!bnIn)
+    
+    secp256k1_pubkey R;
+    if (!ParsePoint(pkSpend, R))
     {
-        EC_GROUP_free(ecgrp);
-        printf("SecretToPublicKey(): BN_bin2bn failed\n");
+        printf("StealthSecret(): R secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    EC_POINT* pub = EC_POINT_new(ecgrp);
-    
-    
-    EC_POINT_mul(ecgrp, pub, bnIn, NULL, NULL, NULL);
-    
-    BIGNUM* bnOut = EC_POINT_point2bn(ecgrp, pub, POINT_CONVERSION_COMPRESSED, BN_new(), NULL);
-    if (!bnOut)
-    {
-        printf("SecretToPublicKey(): point2bn failed\n");
-        rv = 1;
-    } else
+    if (!secp256k1_ec_pubkey_tweak_add(secp256k1_context_stealth, &R, &sharedSOut.e[0]))
     {
-        out.resize(ec_compressed_size);
-        if (BN_num_bytes(bnOut) != (int) ec_compressed_size
-            || BN_bn2bin(bnOut, &out[0]) != (int) ec_compressed_size)
-        {
-            printf("SecretToPublicKey(): bnOut incorrect length.\n");
-            rv = 1;
-        };
-        
-        BN_free(bnOut);
+        printf("StealthSecret(): Rout secp256k1_ec_pubkey_tweak_add failed\n");
+        return 1;
     };
     
-    EC_GROUP_free(ecgrp);
-    BN_free(bnIn);
-    EC_POINT_free(pub);
+    SerializePoint(R, pkOut);
+    return 0;
+};
 
-    return rv;
+int SecretToPublicKey(const ec_secret& secret, ec_point& out)
+{
+    // -- public key = private * G
+    secp256k1_pubkey pubkey;
+    if (!secp256k1_ec_pubkey_create(secp256k1_context_stealth, &pubkey, &secret.e[0]))
+    {
+        printf("SecretToPublicKey(): secp256k1_ec_pubkey_create failed.\n");
+        return 1;
+    };
+    
+    SerializePoint(pubkey, out);
+    return 0;
 };
 
 
@@ -243,176 +272,43 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
     test 0 and infinity?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutQ;
-    
-    BN_CTX* bnCtx   = NULL;
-    BIGNUM* bnEphem = NULL;
-    BIGNUM* bnQ     = NULL;
-    EC_POINT* Q     = NULL;
-    BIGNUM* bnOutQ  = NULL;
-    BIGNUM* bnc     = NULL;
-    EC_POINT* C     = NULL;
-    BIGNUM* bnR     = NULL;
-    EC_POINT* R     = NULL;
-    EC_POINT* Rout  = NULL;
-    BIGNUM* bnOutR  = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey Q;
+    if (!ParsePoint(pubkey, Q))
     {
-        printf("StealthSecret(): EC_GROUP_new_by_curve_name failed.\n");
+        printf("StealthSecret(): Q secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        printf("StealthSecret(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnEphem = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecret(): bnEphem BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnQ = BN_bin2bn(&pubkey[0], pubkey.size(), BN_new())))
-    {
-        printf("StealthSecret(): bnQ BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Q = EC_POINT_bn2point(ecgrp, bnQ, NULL, bnCtx)))
-    {
-        printf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- eQ
-    // EC_POINT_mul(const EC_GROUP *group, EC_POINT *r, const BIGNUM *n, const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx);
-    // EC_POINT_mul calculates the value generator * n + q * m and stores the result in r. The value n may be NULL in which case the result is just q * m. 
-    if (!EC_POINT_mul(ecgrp, Q, NULL, Q, bnEphem, bnCtx))
-    {
-        printf("StealthSecret(): eQ EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutQ = EC_POINT_point2bn(ecgrp, Q, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        printf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutQ.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutQ) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutQ, &vchOutQ[0]) != (int) ec_compressed_size)
-    {
-        printf("StealthSecret(): bnOutQ incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    SHA256(&vchOutQ[0], vchOutQ.size(), &sharedSOut.e[0]);
-    
-    if (!(bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecret(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- cG
-    if (!(C = EC_POINT_new(ecgrp)))
-    {
-        printf("StealthSecret(): C EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        printf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnR = BN_bin2bn(&pkSpend[0], pkSpend.size(), BN_new())))
-    {
-        printf("StealthSecret(): bnR BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    if (!(R = EC_POINT_bn2point(ecgrp, bnR, NULL, bnCtx)))
-    {
-        printf("StealthSecret(): R EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        printf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Rout = EC_POINT_new(ecgrp)))
+    return StealthSecretParsed(secret, Q, pkSpend, sharedSOut, pkOut);
+};
+
+int StealthSecretBatch(const ec_point& ephemPubkey, const std::vector<ec_secret>& vScanSecrets, const std::vector<ec_point>& vSpendPubkeys,
+    std::vector<ec_secret>& vSharedOut, std::vector<ec_point>& vPkOut)
+{
+    // -- the ephemeral key is decompressed once and reused for every scan secret
+    if (vScanSecrets.size() != vSpendPubkeys.size())
     {
-        printf("StealthSecret(): Rout EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
+        printf("StealthSecretBatch(): key count mismatch.\n");
+        return 1;
     };
     
-    if (!EC_POINT_add(ecgrp, Rout, R, C, bnCtx))
-    {
-        printf("StealthSecret(): Rout EC_POINT_add failed\n");
-        rv = 1;
-        goto End;
-    };
+    vSharedOut.resize(vScanSecrets.size());
+    vPkOut.assign(vScanSecrets.size(), ec_point());
     
-    if (!(bnOutR = EC_POINT_point2bn(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
+    secp256k1_pubkey P;
+    if (!ParsePoint(ephemPubkey, P))
     {
-        printf("StealthSecret(): Rout EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
+        printf("StealthSecretBatch(): P secp256k1_ec_pubkey_parse failed\n");
+        return 1;
     };
     
-    
-    pkOut.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutR) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutR, &pkOut[0]) != (int) ec_compressed_size)
+    for (size_t i = 0; i < vScanSecrets.size(); ++i)
     {
-        printf("StealthSecret(): pkOut incorrect length.\n");
-        rv = 1;
-        goto End;
+        if (StealthSecretParsed(vScanSecrets[i], P, vSpendPubkeys[i], vSharedOut[i], vPkOut[i]) != 0)
+            vPkOut[i].clear();
     };
     
-    End:
-    if (bnOutR)     BN_free(bnOutR);
-    if (Rout)       EC_POINT_free(Rout);
-    if (R)          EC_POINT_free(R);
-    if (bnR)        BN_free(bnR);
-    if (C)          EC_POINT_free(C);
-    if (bnc)        BN_free(bnc);
-    if (bnOutQ)     BN_free(bnOutQ);
-    if (Q)          EC_POINT_free(Q);
-    if (bnQ)        BN_free(bnQ);
-    if (bnEphem)    BN_free(bnEphem);
-    if (bnCtx)      BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 
@@ -426,224 +322,36 @@ int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret&
          Remember: mod curve.order, pad with 0x00s where necessary?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnScanSecret    = NULL;
-    BIGNUM* bnP             = NULL;
-    EC_POINT* P             = NULL;
-    BIGNUM* bnOutP          = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey P;
+    if (!ParsePoint(ephemPubkey, P))
     {
-        printf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        printf("StealthSecretSpend(): P secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        printf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnScanSecret = BN_bin2bn(&scanSecret.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecretSpend(): bnScanSecret BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnP = BN_bin2bn(&ephemPubkey[0], ephemPubkey.size(), BN_new())))
-    {
-        printf("StealthSecretSpend(): bnP BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(P = EC_POINT_bn2point(ecgrp, bnP, NULL, bnCtx)))
-    {
-        printf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- dP
-    if (!EC_POINT_mul(ecgrp, P, NULL, P, bnScanSecret, bnCtx))
-    {
-        printf("StealthSecretSpend(): dP EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutP = EC_POINT_point2bn(ecgrp, P, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        printf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutP.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutP) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutP, &vchOutP[0]) != (int) ec_compressed_size)
-    {
-        printf("StealthSecretSpend(): bnOutP incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    uint8_t hash1[32];
-    SHA256(&vchOutP[0], vchOutP.size(), (uint8_t*)hash1);
-    
-    
-    if (!(bnc = BN_bin2bn(&hash1[0], 32, BN_new())))
-    {
-        printf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
+    // -- c = H(dP)
+    ec_secret sharedS;
+    if (!secp256k1_ecdh(secp256k1_context_stealth, &sharedS.e[0], &P, &scanSecret.e[0]))
     {
-        printf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        printf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        printf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_num_bytes(bnSpend) != (int) ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[0]) != (int) ec_secret_size)
-    {
-        printf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        printf("StealthSecretSpend(): dP secp256k1_ecdh failed\n");
+        return 1;
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnOutP)         BN_free(bnOutP);
-    if (P)              EC_POINT_free(P);
-    if (bnP)            BN_free(bnP);
-    if (bnScanSecret)   BN_free(bnScanSecret);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return StealthSharedToSecretSpend(sharedS, spendSecret, secretOut);
 };
 
 
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut)
 {
-    
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    // -- f + c mod n, fails if c overflows the order or the sum is zero
+    memcpy(&secretOut.e[0], &spendSecret.e[0], ec_secret_size);
+    if (!secp256k1_ec_privkey_tweak_add(secp256k1_context_stealth, &secretOut.e[0], &sharedS.e[0]))
     {
-        printf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        printf("StealthSharedToSecretSpend(): secp256k1_ec_privkey_tweak_add failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        printf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnc = BN_bin2bn(&sharedS.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        printf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        printf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        printf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        printf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_num_bytes(bnSpend) != (int) ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[0]) != (int) ec_secret_size)
-    {
-        printf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 bool IsStealthAddress(const std::string& encodedAddress)
@@ -25,6 +25,11 @@ typedef data_chunk ec_point;
 
 typedef uint32_t stealth_bitfield;
 
+typedef struct secp256k1_context_struct secp256k1_context;
+
+/** Context for stealth and secure message point arithmetic, read only once built */
+extern secp256k1_context* secp256k1_context_stealth;
+
 struct stealth_prefix
 {
     uint8_t number_bits;
@@ -108,6 +113,9 @@ int GenerateRandomSecret(ec_secret& out);
 int SecretToPublicKey(const ec_secret& secret, ec_point& out);
 
 int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut);
+// -- StealthSecret of one ephemeral key against many (scan secret, spend pubkey) pairs; entries that fail get an empty pkOut
+int StealthSecretBatch(const ec_point& ephemPubkey, const std::vector<ec_secret>& vScanSecrets, const std::vector<ec_point>& vSpendPubkeys,
+    std::vector<ec_secret>& vSharedOut, std::vector<ec_point>& vPkOut);
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut);
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut);
 
@@ -17,6 +17,9 @@
 map<uint256, int> mapSeenStormnodeScanningErrors;
 // cache block hashes as we calculate them
 std::map<int64_t, uint256> mapCacheBlockHashes;
+// state changes made by CStormnode::Check(), so rankings can tell they're stale
+static CCriticalSection cs_stateChanges;
+static uint64_t nStateChanges = 0;
 
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
@@ -154,13 +157,28 @@ uint256 CStormnode::CalculateScore(int mod, int64_t nBlockHeight)
     if(pindexBest == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if(!GetBlockHash(hash, nBlockHeight)) {
         LogPrintf("CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
+    return CalculateScore(hash);
+}
+
+uint256 CStormnode::CalculateScore(const uint256& hash) const
+{
+    return CalculateScore(vin.prevout, hash);
+}
+
+//
+// The score for the block with hash, touches no shared state so
+// CStormnodeMan can score many Stormnodes at once, without its lock
+//
+uint256 CStormnode::CalculateScore(const COutPoint& prevout, const uint256& hash)
+{
+    uint256 aux = prevout.hash + prevout.n;
+
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
     uint256 hash2 = ss.GetHash();
@@ -187,17 +205,17 @@ void CStormnode::Check(bool forceCheck)
     if(activeState == STORMNODE_VIN_SPENT) return;
 
     if(lastPing.sigTime - sigTime < STORMNODE_MIN_SNP_SECONDS){
-        activeState = STORMNODE_PRE_ENABLED;
+        SetActiveState(STORMNODE_PRE_ENABLED);
         return;
     }
 
     if(!IsPingedWithin(STORMNODE_REMOVAL_SECONDS)){
-        activeState = STORMNODE_REMOVE;
+        SetActiveState(STORMNODE_REMOVE);
         return;
     }
 
     if(!IsPingedWithin(STORMNODE_EXPIRATION_SECONDS)){
-        activeState = STORMNODE_EXPIRED;
+        SetActiveState(STORMNODE_EXPIRED);
         return;
     }
 
@@ -222,7 +240,22 @@ void CStormnode::Check(bool forceCheck)
         }*/
     }
 
-    activeState = STORMNODE_ENABLED; // OK
+    SetActiveState(STORMNODE_ENABLED); // OK
+}
+
+void CStormnode::SetActiveState(int nState)
+{
+    if(activeState == nState) return;
+    activeState = nState;
+
+    LOCK(cs_stateChanges);
+    nStateChanges++;
+}
+
+uint64_t CStormnode::GetStateChanges()
+{
+    LOCK(cs_stateChanges);
+    return nStateChanges;
 }
 
 int64_t CStormnode::SecondsSincePayment() {
@@ -411,7 +444,7 @@ bool CStormnodeBroadcast::CheckAndUpdate(int& nDos)
     if(psn->pubkey == pubkey && !psn->IsBroadcastedWithin(STORMNODE_MIN_SNB_SECONDS)) {
         //take the newest entry
         LogPrintf("snb - Got updated entry for %s\n", addr.ToString());
-        if(psn->UpdateFromNewBroadcast((*this))){
+        if(snodeman.UpdateFromNewBroadcast(psn, (*this))){
             psn->Check();
             if(psn->IsEnabled()) Relay();
         }
@@ -109,6 +109,8 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
+
+    void SetActiveState(int nState);
 public:
     enum state {
         STORMNODE_PRE_ENABLED,
@@ -181,6 +183,8 @@ public:
     }
 
     uint256 CalculateScore(int mod=1, int64_t nBlockHeight=0);
+    uint256 CalculateScore(const uint256& hashBlock) const;
+    static uint256 CalculateScore(const COutPoint& prevout, const uint256& hashBlock);
 
     ADD_SERIALIZE_METHODS;
 
@@ -219,6 +223,9 @@ public:
 
     void Check(bool forceCheck = false);
 
+    /// Count of the state changes Check() has made to any Stormnode
+    static uint64_t GetStateChanges();
+
     bool IsBroadcastedWithin(int seconds)
     {
         return (GetAdjustedTime() - sigTime) < seconds;
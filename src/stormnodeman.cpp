@@ -27,21 +27,12 @@ struct CompareLastPaid
     }
 };
 
-struct CompareScoreTxIn
+struct CompareScoreHighSN
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreSN
-{
-    bool operator()(const pair<int64_t, CStormnode>& t1,
-                    const pair<int64_t, CStormnode>& t2) const
+    bool operator()(const pair<int64_t, CStormnode*>& t1,
+                    const pair<int64_t, CStormnode*>& t2) const
     {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
@@ -207,6 +198,9 @@ void DumpStormnodes()
 
 CStormnodeMan::CStormnodeMan() {
     nSsqCount = 0;
+    nRankingsUsed = 0;
+    nRankingsCleared = 0;
+    nRankingsStateChanges = 0;
 }
 
 bool CStormnodeMan::Add(CStormnode &sn)
@@ -221,12 +215,67 @@ bool CStormnodeMan::Add(CStormnode &sn)
     {
         LogPrint("stormnode", "CStormnodeMan: Adding new Stormnode %s - %i now\n", sn.addr.ToString(), size() + 1);
         vStormnodes.push_back(sn);
+        AddToIndexes(vStormnodes.back());
+        ClearRankings();
         return true;
     }
 
     return false;
 }
 
+void CStormnodeMan::AddToIndexes(CStormnode& sn)
+{
+    CScript payee = GetScriptForDestination(sn.pubkey.GetID());
+    mapStormnodesByVin.insert(make_pair(sn.vin.prevout, &sn));
+    mapStormnodesByPayee.insert(make_pair(Hash(payee.begin(), payee.end()), &sn));
+    mapStormnodesByPubKey.insert(make_pair(sn.pubkey2.GetHash(), &sn));
+}
+
+void CStormnodeMan::RebuildIndexes()
+{
+    LOCK(cs);
+
+    mapStormnodesByVin.clear();
+    mapStormnodesByPayee.clear();
+    mapStormnodesByPubKey.clear();
+    ClearRankings();
+
+    std::list<CStormnode>::iterator it = vStormnodes.begin();
+    while(it != vStormnodes.end()){
+        if(mapStormnodesByVin.count((*it).vin.prevout)) {
+            it = vStormnodes.erase(it);
+            continue;
+        }
+        AddToIndexes(*it);
+        ++it;
+    }
+}
+
+void CStormnodeMan::ClearRankings()
+{
+    AssertLockHeld(cs);
+
+    mapRankings.clear();
+    nRankingsCleared++;
+}
+
+bool CStormnodeMan::UpdateFromNewBroadcast(CStormnode* psn, CStormnodeBroadcast& snb)
+{
+    // cs isn't held across the update, it checks the ping against the chain
+    CPubKey pubKeyOld;
+    {
+        LOCK(cs);
+        pubKeyOld = psn->pubkey2;
+    }
+
+    bool fUpdated = psn->UpdateFromNewBroadcast(snb);
+
+    LOCK(cs);
+    if(psn->pubkey2 != pubKeyOld) RebuildIndexes();
+    ClearRankings(); // protocolVersion may have changed
+    return fUpdated;
+}
+
 void CStormnodeMan::AskForSN(CNode* pnode, CTxIn &vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForStormnodeListEntry.find(vin.prevout);
@@ -260,7 +309,8 @@ void CStormnodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CStormnode>::iterator it = vStormnodes.begin();
+    bool fRemoved = false;
+    std::list<CStormnode>::iterator it = vStormnodes.begin();
     while(it != vStormnodes.end()){
         if((*it).activeState == CStormnode::STORMNODE_REMOVE ||
                 (*it).activeState == CStormnode::STORMNODE_VIN_SPENT ||
@@ -292,11 +342,14 @@ void CStormnodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vStormnodes.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if(fRemoved) RebuildIndexes();
+
     // check who's asked for the Stormnode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForStormnodeList.begin();
     while(it1 != mAskedUsForStormnodeList.end()){
@@ -354,6 +407,10 @@ void CStormnodeMan::Clear()
 {
     LOCK(cs);
     vStormnodes.clear();
+    mapStormnodesByVin.clear();
+    mapStormnodesByPayee.clear();
+    mapStormnodesByPubKey.clear();
+    ClearRankings();
     mAskedUsForStormnodeList.clear();
     mWeAskedForStormnodeList.clear();
     mWeAskedForStormnodeListEntry.clear();
@@ -401,27 +458,21 @@ void CStormnodeMan::SsegUpdate(CNode* pnode)
 CStormnode *CStormnodeMan::Find(const CScript &payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH(CStormnode& sn, vStormnodes)
-    {
-        payee2 = GetScriptForDestination(sn.pubkey.GetID());
-        if(payee2 == payee)
-            return &sn;
-    }
-    return NULL;
+    boost::unordered_map<uint256, CStormnode*, CStormnodeIndexHasher>::iterator it = mapStormnodesByPayee.find(Hash(payee.begin(), payee.end()));
+    if(it == mapStormnodesByPayee.end())
+        return NULL;
+    return it->second;
 }
 
 CStormnode *CStormnodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CStormnode& sn, vStormnodes)
-    {
-        if(sn.vin.prevout == vin.prevout)
-            return &sn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, CStormnode*, CStormnodeIndexHasher>::iterator it = mapStormnodesByVin.find(vin.prevout);
+    if(it == mapStormnodesByVin.end())
+        return NULL;
+    return it->second;
 }
 
 
@@ -429,12 +480,10 @@ CStormnode *CStormnodeMan::Find(const CPubKey &pubKeyStormnode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CStormnode& sn, vStormnodes)
-    {
-        if(sn.pubkey2 == pubKeyStormnode)
-            return &sn;
-    }
-    return NULL;
+    boost::unordered_map<uint256, CStormnode*, CStormnodeIndexHasher>::iterator it = mapStormnodesByPubKey.find(pubKeyStormnode.GetHash());
+    if(it == mapStormnodesByPubKey.end())
+        return NULL;
+    return it->second;
 }
 
 //
@@ -514,18 +563,14 @@ CStormnode *CStormnodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude,
 
     int rand = GetRandInt(nCountEnabled - vecToExclude.size());
     LogPrintf("CStormnodeMan::FindRandomNotInVec - rand %d\n", rand);
-    bool found;
+
+    std::set<COutPoint> setToExclude;
+    BOOST_FOREACH(CTxIn &usedVin, vecToExclude)
+        setToExclude.insert(usedVin.prevout);
 
     BOOST_FOREACH(CStormnode &sn, vStormnodes) {
         if(sn.protocolVersion < protocolVersion || !sn.IsEnabled()) continue;
-        found = false;
-        BOOST_FOREACH(CTxIn &usedVin, vecToExclude) {
-            if(sn.vin.prevout == usedVin.prevout) {
-                found = true;
-                break;
-            }
-        }
-        if(found) continue;
+        if(setToExclude.count(sn.vin.prevout)) continue;
         if(--rand < 1) {
             return &sn;
         }
@@ -534,130 +579,156 @@ CStormnode *CStormnodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude,
     return NULL;
 }
 
-CStormnode* CStormnodeMan::GetCurrentStormNode(int mod, int64_t nBlockHeight, int minProtocol)
+static void ScoreStormnodesThread(const uint256* phash, const std::vector<COutPoint>* pvPrevouts, std::vector<int64_t>* pvScores, int nThread, int nThreads)
 {
-    int64_t score = 0;
-    CStormnode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH(CStormnode& sn, vStormnodes) {
-        sn.Check();
-        if(sn.protocolVersion < minProtocol || !sn.IsEnabled()) continue;
-
-        // calculate the score for each Stormnode
-        uint256 n = sn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = &sn;
-        }
-    }
-
-    return winner;
+    for (unsigned int i = nThread; i < pvPrevouts->size(); i += nThreads)
+        (*pvScores)[i] = CStormnode::CalculateScore((*pvPrevouts)[i], *phash).GetCompact(false);
 }
 
-int CStormnodeMan::GetStormnodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+CStormnodeRanking* CStormnodeMan::GetRanking(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecStormnodeScores;
+    AssertLockHeld(cs);
 
     //make sure we know about this block
     uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    if(!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::pair<uint256, std::pair<int, bool> > key = make_pair(hash, make_pair(minProtocol, fOnlyActive));
+    std::map<std::pair<uint256, std::pair<int, bool> >, CStormnodeRanking>::iterator it;
+    std::vector<CStormnode*> vMembers;
+    std::vector<int64_t> vScores;
+    int64_t nNow;
+    while(true) {
+        // a ping or a check may have changed who is enabled, in any of them
+        uint64_t nStateChanges = CStormnode::GetStateChanges();
+        if(nRankingsStateChanges != nStateChanges) {
+            ClearRankings();
+            nRankingsStateChanges = nStateChanges;
+        }
 
-    // scan for winner
-    BOOST_FOREACH(CStormnode& sn, vStormnodes) {
-        if(sn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            sn.Check();
-            if(!sn.IsEnabled()) continue;
+        it = mapRankings.find(key);
+
+        // states are only rechecked every STORMNODE_CHECK_SECONDS, so a ranking is good for as long
+        nNow = GetTime();
+        if(it != mapRankings.end() && nNow - it->second.nTimeChecked < STORMNODE_CHECK_SECONDS) {
+            it->second.nLastUsed = ++nRankingsUsed;
+            return &it->second;
         }
-        uint256 n = sn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
 
-        vecStormnodeScores.push_back(make_pair(n2, sn.vin));
-    }
+        vMembers.clear();
+        BOOST_FOREACH(CStormnode& sn, vStormnodes) {
+            if(sn.protocolVersion < minProtocol) continue;
+            if(fOnlyActive) {
+                sn.Check();
+                if(!sn.IsEnabled()) continue;
+            }
+            vMembers.push_back(&sn);
+        }
 
-    sort(vecStormnodeScores.rbegin(), vecStormnodeScores.rend(), CompareScoreTxIn());
+        // the same Stormnodes as before score the same
+        if(it != mapRankings.end() && it->second.vMembers == vMembers) {
+            it->second.nTimeChecked = nNow;
+            it->second.nLastUsed = ++nRankingsUsed;
+            return &it->second;
+        }
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn)& s, vecStormnodeScores){
-        rank++;
-        if(s.second.prevout == vin.prevout) {
-            return rank;
+        // two hashes a Stormnode, a thread for every started 500 up to the core count,
+        // scored with cs released as they only need the collateral outpoints
+        std::vector<COutPoint> vPrevouts(vMembers.size());
+        for(unsigned int i = 0; i < vMembers.size(); i++)
+            vPrevouts[i] = vMembers[i]->vin.prevout;
+        vScores.resize(vMembers.size());
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), ((int)vMembers.size() + 499) / 500));
+        uint64_t nCleared = nRankingsCleared;
+        LEAVE_CRITICAL_SECTION(cs);
+        try {
+            ParallelFor(vPrevouts.size(), nThreads, boost::bind(&ScoreStormnodesThread, &hash, &vPrevouts, &vScores, _1, _2));
+        } catch (...) {
+            ENTER_CRITICAL_SECTION(cs);
+            throw;
         }
+        ENTER_CRITICAL_SECTION(cs);
+
+        // the list changed meanwhile and vMembers may point at removed entries, start over
+        if(nRankingsCleared == nCleared) break;
     }
 
-    return -1;
-}
+    it = mapRankings.find(key);
+    if(it == mapRankings.end()) {
+        if(mapRankings.size() >= STORMNODE_RANKINGS_CACHE) {
+            std::map<std::pair<uint256, std::pair<int, bool> >, CStormnodeRanking>::iterator itOldest = mapRankings.begin();
+            for(std::map<std::pair<uint256, std::pair<int, bool> >, CStormnodeRanking>::iterator mi = mapRankings.begin(); mi != mapRankings.end(); ++mi)
+                if(mi->second.nLastUsed < itOldest->second.nLastUsed) itOldest = mi;
+            mapRankings.erase(itOldest);
+        }
+        it = mapRankings.insert(make_pair(key, CStormnodeRanking())).first;
+    }
 
-std::vector<pair<int, CStormnode> > CStormnodeMan::GetStormnodeRanks(int64_t nBlockHeight, int minProtocol)
-{
-    std::vector<pair<int64_t, CStormnode> > vecStormnodeScores;
-    std::vector<pair<int, CStormnode> > vecStormnodeRanks;
+    CStormnodeRanking& ranking = it->second;
+    ranking.vMembers.swap(vMembers);
+    ranking.vecScores.resize(ranking.vMembers.size());
+    for(unsigned int i = 0; i < ranking.vMembers.size(); i++)
+        ranking.vecScores[i] = make_pair(vScores[i], ranking.vMembers[i]);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecStormnodeRanks;
+    stable_sort(ranking.vecScores.begin(), ranking.vecScores.end(), CompareScoreHighSN());
 
-    // scan for winner
-    BOOST_FOREACH(CStormnode& sn, vStormnodes) {
+    ranking.mapRanks.clear();
+    for(unsigned int i = 0; i < ranking.vecScores.size(); i++)
+        ranking.mapRanks.insert(make_pair(ranking.vecScores[i].second->vin.prevout, (int)i + 1));
 
-        sn.Check();
+    ranking.nTimeChecked = nNow;
+    ranking.nLastUsed = ++nRankingsUsed;
+    return &ranking;
+}
 
-        if(sn.protocolVersion < minProtocol) continue;
-        if(!sn.IsEnabled()) {
-            continue;
-        }
+CStormnode* CStormnodeMan::GetCurrentStormNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
 
-        uint256 n = sn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    CStormnodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, true);
 
-        vecStormnodeScores.push_back(make_pair(n2, sn));
-    }
+    // the best score wins, if there's one above zero
+    if(pranking == NULL || pranking->vecScores.empty() || pranking->vecScores[0].first <= 0)
+        return NULL;
 
-    sort(vecStormnodeScores.rbegin(), vecStormnodeScores.rend(), CompareScoreSN());
+    return pranking->vecScores[0].second;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CStormnode)& s, vecStormnodeScores){
-        rank++;
-        vecStormnodeRanks.push_back(make_pair(rank, s.second));
-    }
+int CStormnodeMan::GetStormnodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    return vecStormnodeRanks;
+    CStormnodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, fOnlyActive);
+    if(pranking == NULL) return -1;
+
+    boost::unordered_map<COutPoint, int, CStormnodeIndexHasher>::iterator it = pranking->mapRanks.find(vin.prevout);
+    if(it == pranking->mapRanks.end()) return -1;
+    return it->second;
 }
 
-CStormnode* CStormnodeMan::GetStormnodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+std::vector<pair<int, CStormnode> > CStormnodeMan::GetStormnodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CTxIn> > vecStormnodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CStormnode& sn, vStormnodes) {
+    std::vector<pair<int, CStormnode> > vecStormnodeRanks;
 
-        if(sn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            sn.Check();
-            if(!sn.IsEnabled()) continue;
-        }
+    CStormnodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, true);
+    if(pranking == NULL) return vecStormnodeRanks;
 
-        uint256 n = sn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    for(unsigned int i = 0; i < pranking->vecScores.size(); i++)
+        vecStormnodeRanks.push_back(make_pair((int)i + 1, *pranking->vecScores[i].second));
 
-        vecStormnodeScores.push_back(make_pair(n2, sn.vin));
-    }
+    return vecStormnodeRanks;
+}
 
-    sort(vecStormnodeScores.rbegin(), vecStormnodeScores.rend(), CompareScoreTxIn());
+CStormnode* CStormnodeMan::GetStormnodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn)& s, vecStormnodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    CStormnodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, fOnlyActive);
+    if(pranking == NULL || nRank < 1 || nRank > (int)pranking->vecScores.size()) return NULL;
 
-    return NULL;
+    return pranking->vecScores[nRank - 1].second;
 }
 
 void CStormnodeMan::ProcessStormnodeConnections()
@@ -807,11 +878,12 @@ void CStormnodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CStormnode>::iterator it = vStormnodes.begin();
+    std::list<CStormnode>::iterator it = vStormnodes.begin();
     while(it != vStormnodes.end()){
         if((*it).vin == vin){
             LogPrint("stormnode", "CStormnodeMan: Removing Stormnode %s - %i now\n", (*it).addr.ToString(), size() - 1);
             vStormnodes.erase(it);
+            RebuildIndexes();
             break;
         }
         ++it;
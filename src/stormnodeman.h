@@ -13,8 +13,13 @@
 #include "main.h"
 #include "stormnode.h"
 
+#include <list>
+
+#include <boost/unordered_map.hpp>
+
 static const unsigned int STORMNODES_DUMP_SECONDS = (15*60);// 15 Minutes
 static const unsigned int STORMNODES_SSEG_SECONDS = (1*60*60);// 1 Hour
+static const unsigned int STORMNODE_RANKINGS_CACHE = 16;      // rankings kept, most votes are for a few recent blocks
 
 using namespace std;
 
@@ -46,6 +51,40 @@ public:
     ReadResult Read(CStormnodeMan& snodemanToLoad, bool fDryRun = false);
 };
 
+/** Salted hashes for the CStormnodeMan indexes
+ */
+class CStormnodeIndexHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CStormnodeIndexHasher() : salt(GetRandHash()) {}
+
+    size_t operator()(const COutPoint& prevout) const {
+        return prevout.hash.GetHash(salt) ^ prevout.n;
+    }
+
+    size_t operator()(const uint256& key) const {
+        return key.GetHash(salt);
+    }
+};
+
+/** The Stormnodes scored for one block, best first
+ */
+class CStormnodeRanking
+{
+public:
+    // the Stormnodes that passed the filter, in list order
+    std::vector<CStormnode*> vMembers;
+    // compact scores, sorted high to low, ties in list order
+    std::vector<std::pair<int64_t, CStormnode*> > vecScores;
+    // rank from 1 by collateral outpoint
+    boost::unordered_map<COutPoint, int, CStormnodeIndexHasher> mapRanks;
+    int64_t nTimeChecked;
+    int64_t nLastUsed;
+};
+
 class CStormnodeMan
 {
 private:
@@ -55,8 +94,19 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all SNs
-    std::vector<CStormnode> vStormnodes;
+    // all SNs, a list so pointers returned by Find() stay valid while others are added or removed
+    std::list<CStormnode> vStormnodes;
+    // SNs by collateral outpoint, by Hash() of their payee script and by pubkey2.GetHash()
+    boost::unordered_map<COutPoint, CStormnode*, CStormnodeIndexHasher> mapStormnodesByVin;
+    boost::unordered_map<uint256, CStormnode*, CStormnodeIndexHasher> mapStormnodesByPayee;
+    boost::unordered_map<uint256, CStormnode*, CStormnodeIndexHasher> mapStormnodesByPubKey;
+    // rankings by block hash, min protocol and fOnlyActive, cleared whenever the list or a state changes
+    std::map<std::pair<uint256, std::pair<int, bool> >, CStormnodeRanking> mapRankings;
+    int64_t nRankingsUsed;
+    // times mapRankings was cleared, so GetRanking can tell the list changed while it scored
+    uint64_t nRankingsCleared;
+    // CStormnode::GetStateChanges() when mapRankings was last cleared for it
+    uint64_t nRankingsStateChanges;
     // who's asked for the Stormnode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForStormnodeList;
     // who we asked for the Stormnode list and the last time
@@ -78,7 +128,15 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         LOCK(cs);
-        READWRITE(vStormnodes);
+        if (ser_action.ForRead()) {
+            std::vector<CStormnode> vTmp;
+            READWRITE(vTmp);
+            vStormnodes.assign(vTmp.begin(), vTmp.end());
+            RebuildIndexes();
+        } else {
+            std::vector<CStormnode> vTmp(vStormnodes.begin(), vStormnodes.end());
+            READWRITE(vTmp);
+        }
         READWRITE(mAskedUsForStormnodeList);
         READWRITE(mWeAskedForStormnodeList);
         READWRITE(mWeAskedForStormnodeListEntry);
@@ -124,7 +182,7 @@ public:
     /// Get the current winner for this block
     CStormnode* GetCurrentStormNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CStormnode> GetFullStormnodeVector() { Check(); return vStormnodes; }
+    std::vector<CStormnode> GetFullStormnodeVector() { Check(); LOCK(cs); return std::vector<CStormnode>(vStormnodes.begin(), vStormnodes.end()); }
 
     std::vector<pair<int, CStormnode> > GetStormnodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetStormnodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
@@ -135,12 +193,28 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Stormnodes
-    int size() { return vStormnodes.size(); }
+    int size() { return mapStormnodesByVin.size(); }
 
     std::string ToString() const;
 
     void Remove(CTxIn vin);
 
+    /// Update an entry from a newer broadcast, keeping the indexes in step
+    bool UpdateFromNewBroadcast(CStormnode* psn, CStormnodeBroadcast& snb);
+
+private:
+    /// Add an entry to the indexes, the first entry added for a key keeps it
+    void AddToIndexes(CStormnode& sn);
+
+    /// Index every entry again, dropping any duplicate vins
+    void RebuildIndexes();
+
+    /// Drop every ranking, the Stormnodes they point to may be gone
+    void ClearRankings();
+
+    /// Score and sort the Stormnodes for a block, or reuse the ranking from an earlier call.
+    /// cs is released while scoring, the ranking returned is valid while it is held again.
+    CStormnodeRanking* GetRanking(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
 };
 
 #endif
@@ -0,0 +1,59 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "primitives/block.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(argon2_tests)
+
+static string Argon2dHex(const unsigned char* pin)
+{
+    unsigned char hash[32];
+    BOOST_CHECK_EQUAL(Argon2d_Hash(hash, 32, pin, 80, pin, 80, 2, 1024), ARGON2_OK);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+BOOST_AUTO_TEST_CASE(argon2d_implementations)
+{
+    unsigned char in[80];
+    for (int i = 0; i < 80; i++)
+        in[i] = i;
+
+    // Both block compressions must reproduce the original SSE2 output
+    BOOST_CHECK_EQUAL(string(argon2_select_impl(0)), "sse2");
+    BOOST_CHECK_EQUAL(Argon2dHex(in), "f6481dc9baf990a03db1aeaf88f2c15637505ad9b5f12d700773b16e426a059b");
+
+    BOOST_TEST_MESSAGE(argon2_select_impl(1));
+    BOOST_CHECK_EQUAL(Argon2dHex(in), "f6481dc9baf990a03db1aeaf88f2c15637505ad9b5f12d700773b16e426a059b");
+}
+
+static vector<CBlockHeader> MakeHeaders(int nCount)
+{
+    vector<CBlockHeader> vHeaders(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        vHeaders[i].nVersion = 7;
+        vHeaders[i].nTime = 1450000000 + i;
+        vHeaders[i].nBits = 0x1e0fffff;
+        vHeaders[i].nNonce = i;
+    }
+    return vHeaders;
+}
+
+BOOST_AUTO_TEST_CASE(argon2d_batch)
+{
+    argon2_select_impl(1);
+    vector<CBlockHeader> vHeaders = MakeHeaders(17);
+    vector<uint256> vHashes;
+    GetPoWArgonHashes(vHeaders, vHashes, 4);
+    BOOST_CHECK_EQUAL(vHashes.size(), vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHashes[i] == vHeaders[i].GetPoWArgonHash());
+
+    GetPoWArgonHashes(vector<CBlockHeader>(), vHashes);
+    BOOST_CHECK(vHashes.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
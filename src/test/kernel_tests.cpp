@@ -0,0 +1,81 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+static const unsigned int nTime = 1450000000 & ~STAKE_TIMESTAMP_MASK;
+
+static vector<CStakeKernelInput> MakeInputs(int nCount)
+{
+    vector<CStakeKernelInput> vInputs(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        vInputs[i].prevout = COutPoint(GetRandHash(), i % 3);
+        vInputs[i].nTimeTxPrev = nTime - 100000 + i;
+        vInputs[i].nTimeBlockFrom = nTime - 100000;
+        vInputs[i].nValue = COIN * (1 + i % 5);
+    }
+    return vInputs;
+}
+
+static bool CheckKernelInput(CBlockIndex* pindexPrev, unsigned int nBits, const CStakeKernelInput& input, unsigned int nTimeTx)
+{
+    CTransaction txPrev;
+    txPrev.nTime = input.nTimeTxPrev;
+    txPrev.vout.resize(input.prevout.n + 1, CTxOut(input.nValue, CScript()));
+    uint256 hashProofOfStake, targetProofOfStake;
+    return CheckStakeKernelHash(pindexPrev, nBits, input.nTimeBlockFrom, txPrev, input.prevout, nTimeTx, hashProofOfStake, targetProofOfStake);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search)
+{
+    CBlockIndex indexPrev;
+    indexPrev.bnStakeModifierV2 = GetRandHash();
+
+    // About one kernel in 2000 meets a one-coin target
+    CBigNum bnTarget = CBigNum(~uint256(0)) / (2000 * COIN);
+    unsigned int nBits = bnTarget.GetCompact();
+    const unsigned int nInterval = 16;
+    vector<CStakeKernelInput> vInputs = MakeInputs(500);
+
+    // One thread finds the same kernel as checking each coin in turn
+    int nExpected = -1;
+    unsigned int nExpectedTime = 0;
+    for (unsigned int i = 0; i < vInputs.size() && nExpected < 0; i++)
+        for (unsigned int n = 0; n < nInterval; n++)
+            if (CheckKernelInput(&indexPrev, nBits, vInputs[i], nTime - n))
+            {
+                nExpected = i;
+                nExpectedTime = nTime - n;
+                break;
+            }
+    BOOST_REQUIRE(nExpected >= 0);
+
+    unsigned int nTimeKernel;
+    uint64_t nHashes;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(&indexPrev, nBits, nTime, nInterval, vInputs, nTimeKernel, nHashes, 1), nExpected);
+    BOOST_CHECK_EQUAL(nTimeKernel, nExpectedTime);
+    BOOST_CHECK_EQUAL(nHashes, (uint64_t)nExpected * nInterval + (nTime - nExpectedTime) + 1);
+
+    // More threads may stop at another kernel, but it must be a valid one
+    int nKernel = SearchStakeKernels(&indexPrev, nBits, nTime, nInterval, vInputs, nTimeKernel, nHashes, 4);
+    BOOST_REQUIRE(nKernel >= 0);
+    BOOST_CHECK(CheckKernelInput(&indexPrev, nBits, vInputs[nKernel], nTimeKernel));
+
+    // Nothing meets a zero target, so everything is searched
+    BOOST_CHECK_EQUAL(SearchStakeKernels(&indexPrev, 0, nTime, nInterval, vInputs, nTimeKernel, nHashes, 4), -1);
+    BOOST_CHECK_EQUAL(nHashes, vInputs.size() * nInterval);
+
+    // Timestamps before the coin's own are skipped
+    vInputs.resize(1);
+    vInputs[0].nTimeTxPrev = nTime - 3;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(&indexPrev, 0, nTime, nInterval, vInputs, nTimeKernel, nHashes), -1);
+    BOOST_CHECK_EQUAL(nHashes, 4U);
+    BOOST_CHECK_EQUAL(SearchStakeKernels(&indexPrev, nBits, nTime, 0, vInputs, nTimeKernel, nHashes), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
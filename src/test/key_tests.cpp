@@ -138,4 +138,31 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+static vector<pair<CKey, CPubKey> > MakeKeyPairs(int nCount)
+{
+    vector<pair<CKey, CPubKey> > vKeys(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        vKeys[i].first.MakeNewKey(true);
+        vKeys[i].second = vKeys[i].first.GetPubKey();
+    }
+    return vKeys;
+}
+
+BOOST_AUTO_TEST_CASE(verify_key_pairs)
+{
+    vector<pair<CKey, CPubKey> > vKeys = MakeKeyPairs(9);
+    BOOST_CHECK(VerifyKeyPairs(vKeys, 4));
+    BOOST_CHECK(VerifyKeyPairs(vKeys));
+    BOOST_CHECK(VerifyKeyPairs(vector<pair<CKey, CPubKey> >()));
+
+    // One mismatched pair fails the lot, whichever thread it lands on
+    for (int i = 0; i < 4; i++)
+    {
+        vector<pair<CKey, CPubKey> > vBad = vKeys;
+        vBad[i].second = vKeys[i + 1].second;
+        BOOST_CHECK(!VerifyKeyPairs(vBad, 4));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,250 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "checkqueue.h"
+#include "instantx.h"
+#include "keystore.h"
+#include "script.h"
+#include "txdb-leveldb.h"
+#include "util.h"
+
+using namespace std;
+
+// Inputs per transaction for the check queue run
+#define CHECK_INPUTS 8
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// Creates one funding transaction paying nTx * nIn outputs to fresh keys and
+// nTx transactions spending them, nIn inputs each.
+static void CreateSpends(int nTx, int nIn, CTransaction& txFrom, vector<CTransaction>& vSpends)
+{
+    CBasicKeyStore keystore;
+    txFrom.vout.resize(nTx * nIn);
+    for (int i = 0; i < nTx * nIn; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        txFrom.vout[i].nValue = COIN;
+        txFrom.vout[i].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+
+    vSpends.resize(nTx);
+    for (int t = 0; t < nTx; t++)
+    {
+        CTransaction& tx = vSpends[t];
+        tx.vin.resize(nIn);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = nIn * COIN;
+        tx.vout[0].scriptPubKey = txFrom.vout[0].scriptPubKey;
+        for (int i = 0; i < nIn; i++)
+        {
+            tx.vin[i].prevout.hash = txFrom.GetHash();
+            tx.vin[i].prevout.n = t * nIn + i;
+        }
+        for (int i = 0; i < nIn; i++)
+            BOOST_CHECK(SignSignature(keystore, txFrom.vout[t * nIn + i].scriptPubKey, tx, i));
+    }
+}
+
+static void AddChecks(const CTransaction& txFrom, const CTransaction& tx, vector<CScriptCheck>& vChecks)
+{
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vChecks.push_back(CScriptCheck(txFrom.vout[tx.vin[i].prevout.n], tx, i, STANDARD_SCRIPT_VERIFY_FLAGS));
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_queue)
+{
+    CTransaction txFrom;
+    vector<CTransaction> vSpends;
+    CreateSpends(4, CHECK_INPUTS, txFrom, vSpends);
+
+    CCheckQueue<CScriptCheck> queue(128);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    BOOST_FOREACH(const CTransaction& tx, vSpends)
+    {
+        vector<CScriptCheck> vChecks;
+        AddChecks(txFrom, tx, vChecks);
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    // A spend with one corrupted signature must fail as a whole
+    CTransaction txBad = vSpends[0];
+    txBad.vin[CHECK_INPUTS / 2].scriptSig = vSpends[1].vin[0].scriptSig;
+    {
+        vector<CScriptCheck> vChecks;
+        AddChecks(txFrom, txBad, vChecks);
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+// The index of a temporary data directory and a funding transaction in the
+// pool, enough for AcceptToMemoryPool to fetch the inputs of nTx spends
+struct CMemPoolInputs
+{
+    boost::filesystem::path pathTemp;
+    CTransaction txFrom;
+    vector<CTransaction> vSpends;
+
+    CMemPoolInputs(int nTx)
+    {
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_mempool_%d_%d", GetTime(), GetRand(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+
+        CreateSpends(nTx, 1, txFrom, vSpends);
+        CTxDB txdb("cr+");
+        BOOST_REQUIRE(txdb.UpdateTxIndex(txFrom.GetHash(), CTxIndex(CDiskTxPos(1,1,1), txFrom.vout.size())));
+        mempool.addUnchecked(txFrom.GetHash(), txFrom);
+    }
+
+    ~CMemPoolInputs()
+    {
+        mempool.clear();
+        mapLockedInputs.clear();
+        CTxDB("r").Close();
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+
+    // Marks output n of the funding transaction spent, as a block spending it would
+    void SpendInTxIndex(unsigned int n)
+    {
+        CTxDB txdb("r+");
+        CTxIndex txindex;
+        BOOST_REQUIRE(txdb.ReadTxIndex(txFrom.GetHash(), txindex));
+        txindex.vSpent[n] = CDiskTxPos(1, 2, 3);
+        BOOST_REQUIRE(txdb.UpdateTxIndex(txFrom.GetHash(), txindex));
+    }
+};
+
+static bool AcceptSpend(CTransaction& tx)
+{
+    CValidationState state;
+    bool fMissingInputs = false;
+    return AcceptToMemoryPool(mempool, state, tx, false, &fMissingInputs, true);
+}
+
+// The last stage of AcceptToMemoryPool for a spend whose scripts were
+// verified with its inputs fetched at pindexPrepared
+static bool CommitSpend(CTransaction& tx, CBlockIndex* pindexPrepared)
+{
+    MapPrevTx mapInputs;
+    bool fMissingInputs = false;
+    return CommitToMemoryPool(mempool, tx, mapInputs, pindexPrepared, &fMissingInputs);
+}
+
+// A copy of tx spending the same inputs under a different hash
+static CTransaction Conflicting(const CTransaction& tx)
+{
+    CTransaction txConflict = tx;
+    txConflict.vout[0].nValue -= 1;
+    return txConflict;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_conflict)
+{
+    CMemPoolInputs inputs(2);
+    CTransaction& tx = inputs.vSpends[0];
+    CTransaction txConflict = Conflicting(tx);
+    string reason;
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK(!HasMemPoolConflict(mempool, tx, reason));
+    }
+
+    // Spent by another pool transaction: a conflict without a reason
+    mempool.addUnchecked(txConflict.GetHash(), txConflict);
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK(HasMemPoolConflict(mempool, tx, reason));
+        BOOST_CHECK(reason.empty());
+        BOOST_CHECK(!HasMemPoolConflict(mempool, inputs.vSpends[1], reason));
+    }
+    mempool.remove(txConflict);
+
+    // Locked by InstantX: a conflict unless the lock is tx's own
+    mapLockedInputs[tx.vin[0].prevout] = txConflict.GetHash();
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK(HasMemPoolConflict(mempool, tx, reason));
+        BOOST_CHECK(!reason.empty());
+    }
+    mapLockedInputs[tx.vin[0].prevout] = tx.GetHash();
+    reason.clear();
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK(!HasMemPoolConflict(mempool, tx, reason));
+        BOOST_CHECK(reason.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_races)
+{
+    CMemPoolInputs inputs(6);
+    vector<CTransaction>& vSpends = inputs.vSpends;
+
+    // Undisturbed, and again as a duplicate
+    BOOST_CHECK(AcceptSpend(vSpends[0]));
+    BOOST_CHECK(mempool.exists(vSpends[0].GetHash()));
+    BOOST_CHECK(!AcceptSpend(vSpends[0]));
+
+    // What changes while the scripts are verified, with no locks held, is
+    // caught by the commit stage. A conflicting spend enters the pool:
+    CBlockIndex* pindexPrepared = pindexBest;
+    CTransaction txConflict = Conflicting(vSpends[1]);
+    mempool.addUnchecked(txConflict.GetHash(), txConflict);
+    BOOST_CHECK(!CommitSpend(vSpends[1], pindexPrepared));
+    BOOST_CHECK(!mempool.exists(vSpends[1].GetHash()));
+    BOOST_CHECK(mempool.exists(txConflict.GetHash()));
+
+    // An InstantX lock to another transaction is taken
+    mapLockedInputs[vSpends[2].vin[0].prevout] = Conflicting(vSpends[2]).GetHash();
+    BOOST_CHECK(!CommitSpend(vSpends[2], pindexPrepared));
+    BOOST_CHECK(!mempool.exists(vSpends[2].GetHash()));
+
+    // ...but a lock to the transaction itself lets it in
+    mapLockedInputs[vSpends[3].vin[0].prevout] = vSpends[3].GetHash();
+    BOOST_CHECK(CommitSpend(vSpends[3], pindexPrepared));
+    BOOST_CHECK(mempool.exists(vSpends[3].GetHash()));
+
+    // The tip moves and the new block spends the input: the re-fetch catches it
+    CBlockIndex indexMoved, indexMoved2;
+    {
+        LOCK(cs_main);
+        pindexBest = &indexMoved;
+    }
+    inputs.SpendInTxIndex(vSpends[4].vin[0].prevout.n);
+    BOOST_CHECK(!CommitSpend(vSpends[4], pindexPrepared));
+    BOOST_CHECK(!mempool.exists(vSpends[4].GetHash()));
+
+    // The tip moves without touching the input: still accepted
+    {
+        LOCK(cs_main);
+        pindexBest = &indexMoved2;
+    }
+    BOOST_CHECK(CommitSpend(vSpends[5], &indexMoved));
+    BOOST_CHECK(mempool.exists(vSpends[5].GetHash()));
+
+    LOCK(cs_main);
+    pindexBest = NULL;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,59 @@
+#include <boost/test/unit_test.hpp>
+
+#include "primitives/block.h"
+#include "scrypt.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+static vector<CBlockHeader> MakeHeaders(int nCount)
+{
+    vector<CBlockHeader> vHeaders(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        vHeaders[i].nVersion = 1;
+        vHeaders[i].nTime = 1450000000 + i;
+        vHeaders[i].nBits = 0x1e0fffff;
+        vHeaders[i].nNonce = i * 7919;
+    }
+    return vHeaders;
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_implementations)
+{
+    const int nCount = 20;
+    vector<CBlockHeader> vHeaders = MakeHeaders(nCount);
+    vector<const void*> vInputs;
+    for (int i = 0; i < nCount; i++)
+        vInputs.push_back(CVOIDBEGIN(vHeaders[i].nVersion));
+
+    BOOST_CHECK_EQUAL(scrypt_select_impl(false), "generic");
+    vector<uint256> vExpected;
+    for (int i = 0; i < nCount; i++)
+        vExpected.push_back(scrypt_blockhash(vInputs[i]));
+
+    BOOST_TEST_MESSAGE(scrypt_select_impl());
+    for (int i = 0; i < nCount; i++)
+        BOOST_CHECK(scrypt_blockhash(vInputs[i]) == vExpected[i]);
+
+    // Every batch size, so full and padded multi-lane groups are both covered
+    for (int n = 1; n <= nCount; n++)
+    {
+        vector<uint256> vHashes(n);
+        scrypt_blockhash_batch(&vInputs[0], &vHashes[0], n);
+        for (int i = 0; i < n; i++)
+            BOOST_CHECK(vHashes[i] == vExpected[i]);
+    }
+
+    vector<uint256> vHashes;
+    GetPoWHashes(vHeaders, vHashes, 3);
+    for (int i = 0; i < nCount; i++)
+    {
+        BOOST_CHECK(vHashes[i] == vExpected[i]);
+        BOOST_CHECK(vHeaders[i].GetPoWHash() == vExpected[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,85 @@
+#include <boost/test/unit_test.hpp>
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+static string SHA256Hex(const string& in)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)in.data(), in.size()).Finalize(hash);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+static void CheckVectors()
+{
+    BOOST_CHECK_EQUAL(SHA256Hex(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    BOOST_CHECK_EQUAL(SHA256Hex("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    BOOST_CHECK_EQUAL(SHA256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+                      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    BOOST_CHECK_EQUAL(SHA256Hex(string(1000000, 'a')), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    // SHA256D64 must agree with CHash256 for every batch size the dispatcher splits on
+    vector<unsigned char> in(64 * 32), out(32 * 32);
+    for (unsigned int i = 0; i < in.size(); i++)
+        in[i] = i * 7 + 3;
+    for (int nBlocks = 0; nBlocks <= 32; nBlocks++)
+    {
+        SHA256D64(&out[0], &in[0], nBlocks);
+        for (int i = 0; i < nBlocks; i++)
+        {
+            unsigned char hash[CHash256::OUTPUT_SIZE];
+            CHash256().Write(&in[64 * i], 64).Finalize(hash);
+            BOOST_CHECK(memcmp(hash, &out[32 * i], 32) == 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_implementations)
+{
+    BOOST_TEST_MESSAGE("scalar");
+    SHA256AutoDetect(false);
+    CheckVectors();
+
+    string strImpl = SHA256AutoDetect();
+    BOOST_TEST_MESSAGE(strImpl);
+    CheckVectors();
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle)
+{
+    SHA256AutoDetect();
+    for (int nTx = 1; nTx <= 33; nTx++)
+    {
+        CBlock block;
+        block.vtx.resize(nTx);
+        for (int i = 0; i < nTx; i++)
+            block.vtx[i].nLockTime = i;
+
+        vector<uint256> vLevel;
+        for (int i = 0; i < nTx; i++)
+            vLevel.push_back(block.vtx[i].GetHash());
+        while (vLevel.size() > 1)
+        {
+            vector<uint256> vNext;
+            for (unsigned int i = 0; i < vLevel.size(); i += 2)
+            {
+                unsigned int i2 = min(i + 1, (unsigned int)vLevel.size() - 1);
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(vLevel[i2]), END(vLevel[i2])));
+            }
+            vLevel.swap(vNext);
+        }
+        BOOST_CHECK(block.BuildMerkleTree() == vLevel[0]);
+
+        // Branches still index into the per-level layout
+        for (int i = 0; i < nTx; i++)
+            BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[i].GetHash(), block.GetMerkleBranch(i), i) == vLevel[0]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,627 @@
+#include <boost/test/unit_test.hpp>
+
+#include "base58.h"
+#include "init.h"
+#include "smessage.h"
+#include "util.h"
+#include "wallet.h"
+#include "xxhash/xxhash.h"
+
+#include <openssl/hmac.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(smessage_tests)
+
+// The hash as SecureMsgSetHash computed it with OpenSSL
+static void OpenSSLPowHash(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, uint8_t *sha256Hash)
+{
+    const SecureMessage *psmsg = (const SecureMessage*) pHeader;
+    uint8_t civ[32];
+    for (int i = 0; i < 32; i+=4)
+        memcpy(civ+i, &psmsg->nonse[0], 4);
+
+    vector<uint8_t> vchData(pHeader+4, pHeader+SMSG_HDR_LEN);
+    vchData.insert(vchData.end(), pPayload, pPayload+nPayload);
+    vchData.insert(vchData.end(), pPayload, pPayload+nPayload);
+    unsigned int nBytes;
+    BOOST_CHECK(HMAC(EVP_sha256(), civ, 32, &vchData[0], vchData.size(), sha256Hash, &nBytes) != NULL);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_pow)
+{
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<uint8_t> vchPayload(300);
+    for (unsigned int i = 0; i < vchPayload.size(); i++)
+        vchPayload[i] = i * 31 + 7;
+
+    for (int nThreads = 1; nThreads <= 4; nThreads += 3)
+    {
+        vector<uint8_t> vchHeader(SMSG_HDR_LEN, 0);
+        SecureMessage *psmsg = (SecureMessage*) &vchHeader[0];
+        psmsg->version[0] = 1;
+        psmsg->timestamp = 1450000000 + nThreads;
+        psmsg->nPayload = vchPayload.size();
+
+        BOOST_CHECK_EQUAL(SecureMsgSetHash(&vchHeader[0], &vchPayload[0], vchPayload.size(), nThreads), 0);
+        BOOST_CHECK_EQUAL(SecureMsgValidate(&vchHeader[0], &vchPayload[0], vchPayload.size()), 0);
+
+        // Peers still running the OpenSSL code accept it
+        uint8_t sha256Hash[32];
+        OpenSSLPowHash(&vchHeader[0], &vchPayload[0], vchPayload.size(), sha256Hash);
+        BOOST_CHECK(memcmp(psmsg->hash, sha256Hash, 4) == 0);
+        BOOST_CHECK(sha256Hash[31] == 0 && sha256Hash[30] == 0);
+
+        vchPayload[0] ^= 1;
+        BOOST_CHECK(SecureMsgValidate(&vchHeader[0], &vchPayload[0], vchPayload.size()) != 0);
+        vchPayload[0] ^= 1;
+    }
+
+    SecMsgPowStats stats;
+    SecureMsgGetPowStats(stats);
+    BOOST_CHECK(stats.nMessages >= 2);
+    BOOST_CHECK_EQUAL(stats.nThreads, 4);
+    BOOST_CHECK(stats.nLastHashes > 0);
+
+    fSecMsgEnabled = fWasEnabled;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_bucket_hash)
+{
+    vector<SecMsgToken> vTokens(200);
+    for (unsigned int i = 0; i < vTokens.size(); i++)
+    {
+        vTokens[i].timestamp = 1450000000 + i / 3;
+        uint256 sample = GetRandHash();
+        memcpy(vTokens[i].sample, sample.begin(), 8);
+        vTokens[i].offset = i;
+    }
+
+    // Sorted order, the order the old std::set kept
+    vector<SecMsgToken> vSorted(vTokens);
+    std::sort(vSorted.begin(), vSorted.end());
+    void* state = XXH32_init(1);
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+        XXH32_update(state, vSorted[i].sample, 8);
+    uint32_t nExpected = XXH32_digest(state);
+
+    // Same tokens arriving in any order give the same set and smsgInv hash
+    SecMsgBucket bucketInOrder, bucketShuffled;
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+        BOOST_CHECK(bucketInOrder.setTokens.insert(vSorted[i]));
+    std::random_shuffle(vTokens.begin(), vTokens.end());
+    for (unsigned int i = 0; i < vTokens.size(); i++)
+        BOOST_CHECK(bucketShuffled.setTokens.insert(vTokens[i]));
+    BOOST_CHECK(!bucketShuffled.setTokens.insert(vTokens[0]));
+
+    BOOST_CHECK_EQUAL(bucketShuffled.setTokens.size(), vSorted.size());
+    BOOST_CHECK_EQUAL(bucketInOrder.GetHash(), nExpected);
+    BOOST_CHECK_EQUAL(bucketShuffled.GetHash(), nExpected);
+
+    SecMsgTokenSet::iterator it = bucketShuffled.setTokens.find(vSorted[7]);
+    BOOST_REQUIRE(it != bucketShuffled.setTokens.end());
+    BOOST_CHECK_EQUAL(it->offset, vSorted[7].offset);
+
+    // A new token changes the hash, a bulk load of the same tokens matches
+    SecMsgToken token = vSorted[0];
+    token.sample[0] ^= 1;
+    uint64_t nChanges = bucketShuffled.setTokens.GetChanges();
+    BOOST_CHECK(bucketShuffled.setTokens.insert(token));
+    BOOST_CHECK(bucketShuffled.setTokens.GetChanges() != nChanges);
+    BOOST_CHECK(bucketShuffled.GetHash() != nExpected);
+    nChanges = bucketShuffled.setTokens.GetChanges();
+    bucketShuffled.setTokens.assign(vTokens);
+    BOOST_CHECK(bucketShuffled.setTokens.GetChanges() != nChanges);
+    BOOST_CHECK_EQUAL(bucketShuffled.GetHash(), nExpected);
+}
+
+// Fixed samples, so whether a sketch decodes doesn't vary from run to run
+static SecMsgToken TestToken(int64_t nTime, uint64_t n)
+{
+    uint64_t z = (n + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+
+    SecMsgToken token;
+    token.timestamp = nTime;
+    memcpy(token.sample, &z, 8);
+    token.offset = 0;
+    return token;
+}
+
+static set<vector<uint8_t> > ListedTokens(const vector<uint8_t>& vchList)
+{
+    set<vector<uint8_t> > setListed;
+    for (unsigned int i = 8; i + 16 <= vchList.size(); i += 16)
+        setListed.insert(vector<uint8_t>(vchList.begin() + i, vchList.begin() + i + 16));
+    return setListed;
+}
+
+static set<vector<uint8_t> > TokenKeys(const vector<SecMsgToken>& vTokens)
+{
+    set<vector<uint8_t> > setKeys;
+    for (unsigned int i = 0; i < vTokens.size(); i++)
+    {
+        vector<uint8_t> vchKey(16);
+        memcpy(&vchKey[0], &vTokens[i].timestamp, 8);
+        memcpy(&vchKey[8], vTokens[i].sample, 8);
+        setKeys.insert(vchKey);
+    }
+    return setKeys;
+}
+
+// Two nodes sharing most of a bucket, each with a few messages the other lacks
+BOOST_AUTO_TEST_CASE(smsg_recon)
+{
+    const int64_t bucket = 1450000200;
+    SecMsgTokenSet setA, setB;
+    vector<SecMsgToken> vOnlyA, vOnlyB;
+    for (int i = 0; i < 400; i++)
+    {
+        SecMsgToken token = TestToken(bucket + i % SMSG_BUCKET_LEN, i);
+        setA.insert(token);
+        setB.insert(token);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        vOnlyA.push_back(TestToken(bucket + i, 1000 + i));
+        setA.insert(vOnlyA.back());
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        vOnlyB.push_back(TestToken(bucket + 100 + i, 2000 + i));
+        setB.insert(vOnlyB.back());
+    }
+
+    // Version 1: A sends smsgShow, B answers with its whole token list
+    size_t nShowBytes = (4 + 8) + (8 + 16 * setB.size());
+
+    // Version 2: A sends a sketch, B answers with only the differences, both ways
+    vector<uint8_t> vchRecon, vchHave, vchWant;
+    BOOST_REQUIRE_EQUAL(SecureMsgReconRequest(setA, bucket, setB.size(), vchRecon), 0);
+    BOOST_REQUIRE_EQUAL(SecureMsgReconReply(setB, vchRecon, vchHave, vchWant), 0);
+    size_t nReconBytes = vchRecon.size() + vchHave.size() + vchWant.size();
+    BOOST_TEST_MESSAGE(strprintf("bucket of %u, %u + %u different: smsgShow %u bytes, smsgRecon %u bytes",
+                                 setB.size(), vOnlyA.size(), vOnlyB.size(), nShowBytes, nReconBytes));
+    BOOST_CHECK(nReconBytes * 5 < nShowBytes);
+
+    BOOST_CHECK(ListedTokens(vchHave) == TokenKeys(vOnlyB));
+    BOOST_CHECK(ListedTokens(vchWant) == TokenKeys(vOnlyA));
+
+    // Identical buckets decode to nothing
+    BOOST_REQUIRE_EQUAL(SecureMsgReconRequest(setB, bucket, setB.size(), vchRecon), 0);
+    BOOST_CHECK_EQUAL(SecureMsgReconReply(setB, vchRecon, vchHave, vchWant), 0);
+    BOOST_CHECK_EQUAL(vchHave.size(), 8U);
+    BOOST_CHECK_EQUAL(vchWant.size(), 8U);
+
+    // More differences than the sketch was sized for, the reply falls back to the whole list
+    SecMsgTokenSet setC, setD;
+    for (int i = 0; i < 300; i++)
+    {
+        setC.insert(TestToken(bucket + i, 3000 + i));
+        setD.insert(TestToken(bucket + i, 4000 + i));
+    }
+    BOOST_REQUIRE_EQUAL(SecureMsgReconRequest(setC, bucket, setD.size(), vchRecon), 0);
+    BOOST_CHECK_EQUAL(SecureMsgReconReply(setD, vchRecon, vchHave, vchWant), 2);
+
+    // Small buckets are cheaper to list, malformed sketches are rejected
+    BOOST_CHECK_EQUAL(SecureMsgReconRequest(setA, bucket, 10, vchRecon), 1);
+    BOOST_REQUIRE_EQUAL(SecureMsgReconRequest(setA, bucket, setB.size(), vchRecon), 0);
+    vchRecon.resize(vchRecon.size() - 1);
+    BOOST_CHECK_EQUAL(SecureMsgReconReply(setB, vchRecon, vchHave, vchWant), 1);
+
+    // A crafted sketch, one pure cell whose key hashes elsewhere, must not peel forever
+    const uint32_t nCells = 16;
+    vchRecon.assign(16 + nCells * 24, 0);
+    memcpy(&vchRecon[0], &bucket, 8);
+    memcpy(&vchRecon[12], &nCells, 4);
+    uint8_t key[16];
+    for (int i = 0; i < 16; i++)
+        key[i] = i + 1;
+    int32_t nCount = -1;
+    uint32_t nCheck = XXH32(key, 16, 0);
+    for (uint32_t nCell = 0; nCell < nCells; nCell++)
+    {
+        uint8_t* p = &vchRecon[16 + nCell * 24];
+        memset(p, 0, 24);
+        memcpy(p, &nCount, 4);
+        memcpy(p+4, key, 16);
+        memcpy(p+20, &nCheck, 4);
+        BOOST_CHECK_EQUAL(SecureMsgReconReply(SecMsgTokenSet(), vchRecon, vchHave, vchWant), 2);
+        memset(p, 0, 24);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smsg_store_index)
+{
+    namespace fs = boost::filesystem;
+
+    fs::path pathTemp = fs::temp_directory_path() / strprintf("test_smsgstore_%d_%d", GetTime(), GetRand(100000));
+    fs::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    fs::create_directories(GetDataDir() / "smsgStore");
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    int64_t now = GetTime();
+    int64_t bucket = now - (now % SMSG_BUCKET_LEN);
+    vector<vector<uint8_t> > vMessages;
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.clear();
+        for (int i = 0; i < 5; i++)
+        {
+            vector<uint8_t> vchMsg(SMSG_HDR_LEN + 40 + i * 7, 0);
+            SecureMessage *psmsg = (SecureMessage*) &vchMsg[0];
+            psmsg->version[0] = 1;
+            psmsg->timestamp = bucket + i;
+            psmsg->nPayload = vchMsg.size() - SMSG_HDR_LEN;
+            for (unsigned int k = SMSG_HDR_LEN; k < vchMsg.size(); k++)
+                vchMsg[k] = k * 13 + i;
+            BOOST_CHECK_EQUAL(SecureMsgStore(&vchMsg[0], &vchMsg[SMSG_HDR_LEN], psmsg->nPayload, false), 0);
+            vMessages.push_back(vchMsg);
+        }
+        // Already stored
+        BOOST_CHECK(SecureMsgStore(&vMessages[0][0], &vMessages[0][SMSG_HDR_LEN], vMessages[0].size() - SMSG_HDR_LEN, false) != 0);
+        SecureMsgStoreFlush();
+    }
+
+    // Messages read back from the open segment, and the same tokens from the index or a rescan after a restart
+    for (int nPass = 0; nPass < 3; nPass++)
+    {
+        LOCK(cs_smsg);
+        BOOST_REQUIRE_EQUAL(smsgBuckets[bucket].setTokens.size(), vMessages.size());
+        SecMsgTokenSet::iterator it = smsgBuckets[bucket].setTokens.begin();
+        for (unsigned int i = 0; i < vMessages.size(); i++, it++)
+        {
+            SecMsgToken token = *it;
+            vector<uint8_t> vchData;
+            BOOST_CHECK_EQUAL(SecureMsgRetrieve(token, vchData), 0);
+            BOOST_CHECK(vchData == vMessages[i]);
+        }
+
+        smsgBuckets.clear();
+        if (nPass == 1)
+            fs::remove(GetDataDir() / "smsgStore" / strprintf("%d_01.idx", bucket));
+        BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    }
+    BOOST_CHECK(fs::exists(GetDataDir() / "smsgStore" / strprintf("%d_01.idx", bucket)));
+
+    // Recovery after a crash, with the segments closed as at startup
+    fs::path pathData = GetDataDir() / "smsgStore" / strprintf("%d_01.dat", bucket);
+    fs::path pathIndex = GetDataDir() / "smsgStore" / strprintf("%d_01.idx", bucket);
+    SecureMsgShutdown();
+    fSecMsgEnabled = true;
+    uint64_t nDataSize = fs::file_size(pathData);
+    uint64_t nIndexSize = fs::file_size(pathIndex);
+    uint32_t nHash;
+    {
+        LOCK(cs_smsg);
+        nHash = smsgBuckets[bucket].GetHash();
+    }
+
+    vector<uint8_t> vchNext(SMSG_HDR_LEN + 48, 0);
+    SecureMessage *psmsgNext = (SecureMessage*) &vchNext[0];
+    psmsgNext->version[0] = 1;
+    psmsgNext->timestamp = bucket + 10;
+    psmsgNext->nPayload = vchNext.size() - SMSG_HDR_LEN;
+    for (unsigned int k = SMSG_HDR_LEN; k < vchNext.size(); k++)
+        vchNext[k] = k * 7;
+
+    // A message torn off part way: the rebuild keeps the whole ones and cuts the data file back
+    {
+        fs::ofstream ofs(pathData, ios::binary | ios::app);
+        ofs.write((const char*)&vchNext[0], SMSG_HDR_LEN + 10);
+    }
+    BOOST_CHECK_EQUAL(fs::file_size(pathData), nDataSize + SMSG_HDR_LEN + 10);
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.clear();
+    }
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    {
+        LOCK(cs_smsg);
+        BOOST_CHECK_EQUAL(smsgBuckets[bucket].setTokens.size(), vMessages.size());
+        BOOST_CHECK_EQUAL(smsgBuckets[bucket].GetHash(), nHash);
+    }
+    BOOST_CHECK_EQUAL(fs::file_size(pathData), nDataSize);
+    BOOST_CHECK_EQUAL(fs::file_size(pathIndex), nIndexSize);
+
+    // A whole message the stale index ends short of: it is indexed by the rebuild
+    {
+        fs::ofstream ofs(pathData, ios::binary | ios::app);
+        ofs.write((const char*)&vchNext[0], vchNext.size());
+    }
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.clear();
+    }
+    BOOST_CHECK_EQUAL(SecureMsgBuildBucketSet(), 0);
+    vMessages.push_back(vchNext);
+    {
+        LOCK(cs_smsg);
+        BOOST_REQUIRE_EQUAL(smsgBuckets[bucket].setTokens.size(), vMessages.size());
+        SecMsgToken token = *(smsgBuckets[bucket].setTokens.end() - 1);
+        BOOST_CHECK_EQUAL(token.timestamp, bucket + 10);
+        BOOST_CHECK_EQUAL(token.offset, (int64_t)nDataSize);
+        vector<uint8_t> vchData;
+        BOOST_CHECK_EQUAL(SecureMsgRetrieve(token, vchData), 0);
+        BOOST_CHECK(vchData == vchNext);
+    }
+    BOOST_CHECK_EQUAL(fs::file_size(pathData), nDataSize + vchNext.size());
+    BOOST_CHECK_EQUAL(fs::file_size(pathIndex), nIndexSize / (vMessages.size() - 1) * vMessages.size());
+
+    SecureMsgShutdown();
+    smsgBuckets.clear();
+    fSecMsgEnabled = fWasEnabled;
+
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    fs::remove_all(pathTemp);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_db_batch)
+{
+    namespace fs = boost::filesystem;
+
+    fs::path pathTemp = fs::temp_directory_path() / strprintf("test_smsgdb_%d_%d", GetTime(), GetRand(100000));
+    fs::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB db;
+        BOOST_REQUIRE(db.Open("cw"));
+        BOOST_REQUIRE(db.TxnBegin());
+
+        // Reads inside a batch see its writes and deletes
+        uint8_t chKey[18] = {'i', 'm'};
+        SecMsgStored smsgStored;
+        smsgStored.sAddrTo = "test";
+        BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+        BOOST_CHECK(db.ExistsSmesg(chKey));
+        BOOST_CHECK(db.EraseSmesg(chKey));
+        BOOST_CHECK(!db.ExistsSmesg(chKey));
+        BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+
+        // A checkpoint commits once the batch is full, and a new one is begun
+        vector<CKeyID> vKeys;
+        CPubKey pubkey;
+        for (unsigned int i = 0; i < SMSG_DB_BATCH_MAX + 10; i++)
+        {
+            CKeyID keyId;
+            GetRandBytes((unsigned char*)&keyId, sizeof(keyId));
+            vKeys.push_back(keyId);
+            BOOST_CHECK(db.WritePK(keyId, pubkey));
+            BOOST_CHECK(db.TxnCheckpoint());
+        }
+        BOOST_CHECK(db.activeBatch != NULL);
+        BOOST_CHECK(db.mapBatch.size() < 20);
+        BOOST_CHECK(db.TxnCommit());
+        BOOST_FOREACH(CKeyID& keyId, vKeys)
+            BOOST_CHECK(db.ExistsPK(keyId));
+
+        // The chain scan checkpoint, read back through a batch and after its commit
+        uint256 hashBlock = GetRandHash(), hashRead;
+        int nHeight = 0;
+        BOOST_CHECK(!db.ReadChainScan(hashRead, nHeight));
+        BOOST_REQUIRE(db.TxnBegin());
+        BOOST_CHECK(db.WriteChainScan(hashBlock, 1234));
+        BOOST_CHECK(db.ReadChainScan(hashRead, nHeight));
+        BOOST_CHECK(db.TxnCommit());
+        BOOST_CHECK(db.ReadChainScan(hashRead, nHeight));
+        BOOST_CHECK(hashRead == hashBlock);
+        BOOST_CHECK_EQUAL(nHeight, 1234);
+
+        // Scans stay within their prefix
+        int nMessages = 0;
+        SecMsgStored smsgRead;
+        std::string sPrefix("im");
+        leveldb::Iterator* it = db.NewIterator();
+        while (db.NextSmesg(it, sPrefix, chKey, smsgRead))
+        {
+            BOOST_CHECK_EQUAL(smsgRead.sAddrTo, "test");
+            nMessages++;
+        }
+        delete it;
+        BOOST_CHECK_EQUAL(nMessages, 1);
+
+        SecureMsgCloseDB();
+    }
+
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    fs::remove_all(pathTemp);
+}
+
+// The messages in the inbox db
+static void ReadInbox(vector<vector<uint8_t> >& vInbox)
+{
+    vInbox.clear();
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cr+"));
+    uint8_t chKey[18];
+    SecMsgStored smsgStored;
+    std::string sPrefix("im");
+    leveldb::Iterator* it = db.NewIterator();
+    while (db.NextSmesg(it, sPrefix, chKey, smsgStored))
+        vInbox.push_back(smsgStored.vchMessage);
+    delete it;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_match_keys)
+{
+    namespace fs = boost::filesystem;
+    BOOST_REQUIRE(pwalletMain);
+
+    fs::path pathTemp = fs::temp_directory_path() / strprintf("test_smsgmatch_%d_%d", GetTime(), GetRand(100000));
+    fs::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    fs::create_directories(GetDataDir() / "smsgStore");
+
+    // An owned address receiving messages, and a foreign one only its public key is known for
+    CKey keyOwned, keyForeign;
+    keyOwned.MakeNewKey(true);
+    keyForeign.MakeNewKey(true);
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_REQUIRE(pwalletMain->AddKeyPubKey(keyOwned, keyOwned.GetPubKey()));
+    }
+    string sOwned = CDarkSilkAddress(keyOwned.GetPubKey().GetID()).ToString();
+    string sForeign = CDarkSilkAddress(keyForeign.GetPubKey().GetID()).ToString();
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB db;
+        BOOST_REQUIRE(db.Open("cw"));
+        CKeyID keyId = keyForeign.GetPubKey().GetID();
+        CPubKey pubkey = keyForeign.GetPubKey();
+        BOOST_REQUIRE(db.WritePK(keyId, pubkey));
+    }
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+    vector<SecMsgAddress> vAddressesWas;
+    {
+        LOCK(cs_smsg);
+        vAddressesWas.swap(smsgAddresses);
+        smsgAddresses.push_back(SecMsgAddress(sOwned, true, false));
+        smsgBuckets.clear();
+    }
+
+    // Alternately to the owned and the foreign address; only the owned ones decrypt
+    vector<vector<uint8_t> > vMessages, vOwned;
+    for (int i = 0; i < 24; i++)
+    {
+        bool fOwned = (i % 3) != 1;
+        SecureMessage smsg;
+        BOOST_REQUIRE_EQUAL(SecureMsgEncrypt(smsg, sOwned, fOwned ? sOwned : sForeign, strprintf("message %d", i)), 0);
+        vector<uint8_t> vchMessage(SMSG_HDR_LEN + smsg.nPayload);
+        memcpy(&vchMessage[0], &smsg.hash[0], SMSG_HDR_LEN);
+        memcpy(&vchMessage[SMSG_HDR_LEN], smsg.pPayload, smsg.nPayload);
+
+        MessageData msg;
+        string sAddress = sOwned;
+        BOOST_CHECK_EQUAL(SecureMsgDecrypt(true, sAddress, &vchMessage[0], &vchMessage[SMSG_HDR_LEN], smsg.nPayload, msg) == 0, fOwned);
+
+        vMessages.push_back(vchMessage);
+        if (fOwned)
+            vOwned.push_back(vchMessage);
+    }
+
+    // One at a time through SecureMsgMatchKey
+    vector<vector<uint8_t> > vInbox;
+    BOOST_CHECK_EQUAL(SecureMsgScanMessage(&vMessages[1][0], &vMessages[1][SMSG_HDR_LEN], vMessages[1].size() - SMSG_HDR_LEN, false), 0);
+    ReadInbox(vInbox);
+    BOOST_CHECK(vInbox.empty());
+    BOOST_CHECK_EQUAL(SecureMsgScanMessage(&vMessages[0][0], &vMessages[0][SMSG_HDR_LEN], vMessages[0].size() - SMSG_HDR_LEN, false), 0);
+    ReadInbox(vInbox);
+    BOOST_REQUIRE_EQUAL(vInbox.size(), 1);
+    BOOST_CHECK(vInbox[0] == vMessages[0]);
+
+    // The whole store in batches through SecureMsgScanFile and SecureMsgMatchKeys
+    {
+        LOCK(cs_smsg);
+        for (unsigned int i = 0; i < vMessages.size(); i++)
+            BOOST_CHECK_EQUAL(SecureMsgStore(&vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], vMessages[i].size() - SMSG_HDR_LEN, false), 0);
+    }
+    BOOST_CHECK(SecureMsgScanBuckets());
+    ReadInbox(vInbox);
+    BOOST_CHECK_EQUAL(vInbox.size(), vOwned.size());
+    sort(vInbox.begin(), vInbox.end());
+    sort(vOwned.begin(), vOwned.end());
+    BOOST_CHECK(vInbox == vOwned);
+
+    SecureMsgShutdown();
+    {
+        LOCK(cs_smsg);
+        smsgBuckets.clear();
+        smsgAddresses.swap(vAddressesWas);
+    }
+    fSecMsgEnabled = fWasEnabled;
+
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    fs::remove_all(pathTemp);
+}
+
+// Waits for a send job to be sent or fail, the proof of work thread polls every two seconds
+static bool WaitForSendJob(uint64_t nId, SecMsgSendJob& job)
+{
+    for (int i = 0; i < 1200; i++)
+    {
+        if (!SecureMsgGetSendJob(nId, job))
+            return false;
+        if (job.nStatus >= SMSG_SEND_SENT)
+            return true;
+        MilliSleep(100);
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_send_async)
+{
+    namespace fs = boost::filesystem;
+    BOOST_REQUIRE(pwalletMain);
+
+    fs::path pathTemp = fs::temp_directory_path() / strprintf("test_smsgsend_%d_%d", GetTime(), GetRand(100000));
+    fs::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    fs::create_directories(GetDataDir() / "smsgStore");
+
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_REQUIRE(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    }
+    string sAddr = CDarkSilkAddress(key.GetPubKey().GetID()).ToString();
+
+    bool fWasEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = false;
+    BOOST_REQUIRE(SecureMsgEnable());
+
+    // Queued, encrypted by a send worker, then through the send queue and proof of work into the store
+    uint64_t nId = 0;
+    string sError;
+    SecMsgSendJob job;
+    BOOST_REQUIRE_EQUAL(SecureMsgSendAsync(sAddr, sAddr, "async send test", nId, sError), 0);
+    BOOST_CHECK(WaitForSendJob(nId, job));
+    BOOST_CHECK_EQUAL(job.nStatus, SMSG_SEND_SENT);
+    {
+        LOCK(cs_smsg);
+        int64_t bucket = job.nTimeQueued - (job.nTimeQueued % SMSG_BUCKET_LEN);
+        BOOST_CHECK(smsgBuckets[bucket].setTokens.size() + smsgBuckets[bucket + SMSG_BUCKET_LEN].setTokens.size() == 1);
+    }
+
+    // A send queue that can't be written fails the job rather than leaving it waiting for proof of work
+    BOOST_REQUIRE(SecureMsgDisable());
+    fs::rename(GetDataDir() / "smsgDB", GetDataDir() / "smsgDB.moved");
+    fs::ofstream(GetDataDir() / "smsgDB") << "not a database";
+    BOOST_REQUIRE(SecureMsgEnable());
+    BOOST_REQUIRE_EQUAL(SecureMsgSendAsync(sAddr, sAddr, "async send test", nId, sError), 0);
+    BOOST_CHECK(WaitForSendJob(nId, job));
+    BOOST_CHECK_EQUAL(job.nStatus, SMSG_SEND_FAILED);
+    BOOST_CHECK(!job.sError.empty());
+    BOOST_REQUIRE(SecureMsgDisable());
+    fs::remove(GetDataDir() / "smsgDB");
+    fs::rename(GetDataDir() / "smsgDB.moved", GetDataDir() / "smsgDB");
+
+    fSecMsgEnabled = fWasEnabled;
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    fs::remove_all(pathTemp);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
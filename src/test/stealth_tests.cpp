@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stealth.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+static ec_secret MakeSecret()
+{
+    ec_secret secret;
+    BOOST_CHECK_EQUAL(GenerateRandomSecret(secret), 0);
+    return secret;
+}
+
+static ec_point MakePoint(const ec_secret& secret)
+{
+    ec_point point;
+    BOOST_CHECK_EQUAL(SecretToPublicKey(secret, point), 0);
+    return point;
+}
+
+BOOST_AUTO_TEST_CASE(stealth_secret)
+{
+    // secp256k1 generator
+    ec_secret one;
+    memset(&one.e[0], 0, ec_secret_size);
+    one.e[31] = 1;
+    BOOST_CHECK_EQUAL(HexStr(MakePoint(one)), "0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798");
+
+    for (int i = 0; i < 16; i++)
+    {
+        ec_secret scanSecret = MakeSecret(), spendSecret = MakeSecret(), ephemSecret = MakeSecret();
+        ec_point scanPubkey = MakePoint(scanSecret), spendPubkey = MakePoint(spendSecret), ephemPubkey = MakePoint(ephemSecret);
+
+        // Sender and recipient derive the same shared secret and destination
+        ec_secret sharedSend, sharedRecv;
+        ec_point pkSend, pkRecv;
+        BOOST_CHECK_EQUAL(StealthSecret(ephemSecret, scanPubkey, spendPubkey, sharedSend, pkSend), 0);
+        BOOST_CHECK_EQUAL(StealthSecret(scanSecret, ephemPubkey, spendPubkey, sharedRecv, pkRecv), 0);
+        BOOST_CHECK(memcmp(&sharedSend.e[0], &sharedRecv.e[0], ec_secret_size) == 0);
+        BOOST_CHECK(pkSend == pkRecv);
+        BOOST_CHECK_EQUAL(pkSend.size(), ec_compressed_size);
+
+        // The spend key recovered either way signs for that destination
+        ec_secret secretSpend, secretShared;
+        BOOST_CHECK_EQUAL(StealthSecretSpend(scanSecret, ephemPubkey, spendSecret, secretSpend), 0);
+        BOOST_CHECK_EQUAL(StealthSharedToSecretSpend(sharedRecv, spendSecret, secretShared), 0);
+        BOOST_CHECK(memcmp(&secretSpend.e[0], &secretShared.e[0], ec_secret_size) == 0);
+        BOOST_CHECK(MakePoint(secretSpend) == pkSend);
+    }
+
+    ec_secret secret = MakeSecret(), shared;
+    ec_point bad(ec_compressed_size, 0xff), pkOut;
+    BOOST_CHECK(StealthSecret(secret, bad, MakePoint(secret), shared, pkOut) != 0);
+}
+
+BOOST_AUTO_TEST_CASE(stealth_secret_batch)
+{
+    const int nKeys = 5;
+    vector<ec_secret> vScanSecrets;
+    vector<ec_point> vSpendPubkeys;
+    for (int i = 0; i < nKeys; i++)
+    {
+        vScanSecrets.push_back(MakeSecret());
+        vSpendPubkeys.push_back(MakePoint(MakeSecret()));
+    }
+    vSpendPubkeys[3] = ec_point(ec_compressed_size, 0xff);
+
+    ec_point ephemPubkey = MakePoint(MakeSecret());
+    vector<ec_secret> vShared;
+    vector<ec_point> vPkOut;
+    BOOST_CHECK_EQUAL(StealthSecretBatch(ephemPubkey, vScanSecrets, vSpendPubkeys, vShared, vPkOut), 0);
+    BOOST_CHECK_EQUAL(vPkOut.size(), (size_t)nKeys);
+
+    for (int i = 0; i < nKeys; i++)
+    {
+        if (i == 3)
+        {
+            BOOST_CHECK(vPkOut[i].empty());
+            continue;
+        }
+        ec_secret shared;
+        ec_point pkOut;
+        BOOST_CHECK_EQUAL(StealthSecret(vScanSecrets[i], ephemPubkey, vSpendPubkeys[i], shared, pkOut), 0);
+        BOOST_CHECK(memcmp(&shared.e[0], &vShared[i].e[0], ec_secret_size) == 0);
+        BOOST_CHECK(pkOut == vPkOut[i]);
+    }
+
+    ec_point bad(ec_compressed_size, 0xff);
+    BOOST_CHECK(StealthSecretBatch(bad, vScanSecrets, vSpendPubkeys, vShared, vPkOut) != 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
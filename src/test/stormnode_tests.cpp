@@ -0,0 +1,188 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stormnodeman.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stormnode_tests)
+
+static CPubKey RandomPubKey()
+{
+    vector<unsigned char> vch(33);
+    GetRandBytes(&vch[0], vch.size());
+    vch[0] = 0x02;
+    return CPubKey(vch);
+}
+
+static CStormnode MakeStormnode(int n)
+{
+    CStormnode sn;
+    sn.vin = CTxIn(COutPoint(GetRandHash(), n % 2));
+    sn.pubkey = RandomPubKey();
+    sn.pubkey2 = RandomPubKey();
+    return sn;
+}
+
+BOOST_AUTO_TEST_CASE(stormnode_find)
+{
+    CStormnodeMan snman;
+    vector<CStormnode> vNodes;
+    for (int i = 0; i < 100; i++)
+    {
+        vNodes.push_back(MakeStormnode(i));
+        BOOST_CHECK(snman.Add(vNodes.back()));
+    }
+    BOOST_CHECK(!snman.Add(vNodes[0]));
+    BOOST_CHECK_EQUAL(snman.size(), 100);
+
+    // Pointers stay valid as the list grows
+    CStormnode* psnFirst = snman.Find(vNodes[0].vin);
+    BOOST_REQUIRE(psnFirst);
+    for (int i = 0; i < 1000; i++)
+    {
+        CStormnode sn = MakeStormnode(i);
+        snman.Add(sn);
+    }
+    BOOST_CHECK(snman.Find(vNodes[0].vin) == psnFirst);
+
+    BOOST_FOREACH(CStormnode& sn, vNodes)
+    {
+        CStormnode* psn = snman.Find(sn.vin);
+        BOOST_REQUIRE(psn);
+        BOOST_CHECK(psn->pubkey2 == sn.pubkey2);
+        BOOST_CHECK(snman.Find(sn.pubkey2) == psn);
+        BOOST_CHECK(snman.Find(GetScriptForDestination(sn.pubkey.GetID())) == psn);
+    }
+    BOOST_CHECK(snman.Find(CTxIn(COutPoint(GetRandHash(), 0))) == NULL);
+    BOOST_CHECK(snman.Find(RandomPubKey()) == NULL);
+
+    // Removed entries leave every index, the rest are still found
+    snman.Remove(vNodes[1].vin);
+    BOOST_CHECK(snman.Find(vNodes[1].vin) == NULL);
+    BOOST_CHECK(snman.Find(vNodes[1].pubkey2) == NULL);
+    BOOST_CHECK(snman.Find(GetScriptForDestination(vNodes[1].pubkey.GetID())) == NULL);
+    BOOST_CHECK(snman.Find(vNodes[0].vin) == psnFirst);
+    BOOST_CHECK(snman.Find(vNodes[2].pubkey2) != NULL);
+    BOOST_CHECK_EQUAL(snman.size(), 1099);
+
+    // Indexes are rebuilt when the list is read back
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << snman;
+    CStormnodeMan snmanRead;
+    ss >> snmanRead;
+    BOOST_CHECK_EQUAL(snmanRead.size(), 1099);
+    BOOST_CHECK(snmanRead.Find(vNodes[2].pubkey2) != NULL);
+    BOOST_CHECK(snmanRead.Find(vNodes[1].vin) == NULL);
+}
+
+// A chain of nBlocks headers with random hashes as the best chain, for the scores
+class CTestChain
+{
+public:
+    vector<uint256> vHashes;
+    vector<CBlockIndex> vIndex;
+
+    CTestChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++)
+        {
+            vHashes[i] = GetRandHash();
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].nHeight = i;
+            vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        }
+        mapCacheBlockHashes.clear();
+        pindexBest = &vIndex.back();
+    }
+
+    ~CTestChain()
+    {
+        pindexBest = NULL;
+        mapCacheBlockHashes.clear();
+    }
+};
+
+// The ranks GetStormnodeRank could give vin when it scored every node on each call,
+// a range as nodes with equal compact scores may be in either order
+static pair<int, int> ScanStormnodeRank(vector<CStormnode>& vNodes, const CTxIn& vin, int nBlockHeight)
+{
+    int64_t nScore = 0;
+    BOOST_FOREACH(CStormnode& sn, vNodes)
+        if (sn.vin == vin)
+            nScore = sn.CalculateScore(1, nBlockHeight).GetCompact(false);
+    int nHigher = 0, nEqual = 0;
+    BOOST_FOREACH(CStormnode& sn, vNodes)
+    {
+        int64_t n = sn.CalculateScore(1, nBlockHeight).GetCompact(false);
+        if (n > nScore) nHigher++;
+        if (n == nScore) nEqual++;
+    }
+    return make_pair(nHigher + 1, nHigher + nEqual);
+}
+
+BOOST_AUTO_TEST_CASE(stormnode_rank)
+{
+    CTestChain chain(20);
+    CStormnodeMan snman;
+    for (int i = 0; i < 300; i++)
+    {
+        CStormnode sn = MakeStormnode(i);
+        sn.protocolVersion = i < 100 ? 1 : PROTOCOL_VERSION;
+        snman.Add(sn);
+    }
+    vector<CStormnode> vNodes = snman.GetFullStormnodeVector();
+
+    for (int nHeight = 10; nHeight < 13; nHeight++)
+        for (int i = 0; i < 300; i += 37)
+        {
+            int nRank = snman.GetStormnodeRank(vNodes[i].vin, nHeight, 0, false);
+            pair<int, int> range = ScanStormnodeRank(vNodes, vNodes[i].vin, nHeight);
+            BOOST_CHECK(nRank >= range.first && nRank <= range.second);
+            BOOST_CHECK(snman.GetStormnodeByRank(nRank, nHeight, 0, false)->vin == vNodes[i].vin);
+            BOOST_CHECK(snman.GetStormnodeRank(vNodes[i].vin, nHeight, 0, false) == nRank);
+        }
+
+    // Stormnodes below the protocol are left out, ranks are from 1 with no gaps
+    BOOST_CHECK_EQUAL(snman.GetStormnodeRank(vNodes[0].vin, 15, PROTOCOL_VERSION, false), -1);
+    BOOST_CHECK(snman.GetStormnodeRank(vNodes[150].vin, 15, PROTOCOL_VERSION, false) > 0);
+    BOOST_CHECK(snman.GetStormnodeByRank(200, 15, PROTOCOL_VERSION, false) != NULL);
+    BOOST_CHECK(snman.GetStormnodeByRank(201, 15, PROTOCOL_VERSION, false) == NULL);
+
+    // A change to the list is seen by the next lookup
+    CStormnode* psnFirst = snman.GetStormnodeByRank(1, 15, 0, false);
+    BOOST_REQUIRE(psnFirst);
+    CTxIn vinFirst = psnFirst->vin;
+    snman.Remove(vinFirst);
+    BOOST_CHECK_EQUAL(snman.GetStormnodeRank(vinFirst, 15, 0, false), -1);
+    BOOST_CHECK(snman.GetStormnodeByRank(1, 15, 0, false)->vin != vinFirst);
+
+    // Unknown blocks have no ranking
+    BOOST_CHECK_EQUAL(snman.GetStormnodeRank(vNodes[150].vin, 100, 0, false), -1);
+}
+
+// A state forced by a ping shows at once, not only once the ranking is due a recheck
+BOOST_AUTO_TEST_CASE(stormnode_rank_state)
+{
+    CTestChain chain(20);
+    CStormnodeMan snman;
+    for (int i = 0; i < 50; i++)
+    {
+        CStormnode sn = MakeStormnode(i);
+        sn.lastPing.sigTime = sn.sigTime + STORMNODE_MIN_SNP_SECONDS;
+        snman.Add(sn);
+    }
+    vector<CStormnode> vNodes = snman.GetFullStormnodeVector();
+
+    BOOST_CHECK(snman.GetStormnodeRank(vNodes[7].vin, 15, 0, true) > 0);
+    CStormnode* psn = snman.Find(vNodes[7].vin);
+    BOOST_REQUIRE(psn);
+    psn->lastPing.sigTime = psn->sigTime;
+    psn->Check(true);
+    BOOST_CHECK(!psn->IsEnabled());
+    BOOST_CHECK_EQUAL(snman.GetStormnodeRank(vNodes[7].vin, 15, 0, true), -1);
+    BOOST_CHECK(snman.GetStormnodeByRank(49, 15, 0, true) != NULL);
+    BOOST_CHECK(snman.GetStormnodeByRank(50, 15, 0, true) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
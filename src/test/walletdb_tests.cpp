@@ -0,0 +1,117 @@
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "key.h"
+#include "util.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+using namespace std;
+
+static const string strTestWallet = "walletdb_test.dat";
+
+struct WalletDBSetup
+{
+    WalletDBSetup()
+    {
+        if (!bitdb.IsMock())
+            bitdb.MakeMock();
+        CWalletDB(strTestWallet, "cr+");
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(walletdb_tests, WalletDBSetup)
+
+static CPubKey MakePubKey()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    return key.GetPubKey();
+}
+
+static bool HasPool(int64_t nPool)
+{
+    CKeyPool keypool;
+    return CWalletDB(strTestWallet).ReadPool(nPool, keypool);
+}
+
+BOOST_AUTO_TEST_CASE(batch_commit)
+{
+    CPubKey pubkey = MakePubKey();
+    {
+        CDBBatch batch(strTestWallet);
+        for (int i = 1; i <= 10; i++)
+        {
+            // A new handle per record, as the wallet's own writers do
+            BOOST_CHECK(CWalletDB(strTestWallet).WritePool(i, CKeyPool(pubkey)));
+        }
+
+        // Visible inside the batch, and the batch's transaction is not the
+        // handle's to end
+        BOOST_CHECK(HasPool(5));
+        CWalletDB walletdb(strTestWallet);
+        BOOST_CHECK(walletdb.WritePool(11, CKeyPool(pubkey)));
+        BOOST_CHECK(!walletdb.TxnCommit());
+        BOOST_CHECK(!walletdb.TxnAbort());
+    }
+    for (int i = 1; i <= 11; i++)
+        BOOST_CHECK(HasPool(i));
+}
+
+// A batch that never commits, as when the node dies halfway through a block,
+// must leave nothing of itself behind and not disturb earlier records
+BOOST_AUTO_TEST_CASE(batch_crash_safety)
+{
+    CPubKey pubkey = MakePubKey();
+    BOOST_CHECK(CWalletDB(strTestWallet).WritePool(100, CKeyPool(pubkey)));
+    {
+        CDBBatch batch(strTestWallet);
+        BOOST_CHECK(CWalletDB(strTestWallet).ErasePool(100));
+        {
+            // Nested batches join the outer one, so their commit is not final
+            CDBBatch inner(strTestWallet);
+            for (int i = 101; i <= 110; i++)
+                BOOST_CHECK(CWalletDB(strTestWallet).WritePool(i, CKeyPool(pubkey)));
+        }
+        BOOST_CHECK(!HasPool(100));
+        BOOST_CHECK(HasPool(105));
+        BOOST_CHECK(batch.Abort());
+    }
+    BOOST_CHECK(HasPool(100));
+    for (int i = 101; i <= 110; i++)
+        BOOST_CHECK(!HasPool(i));
+
+    // Outside any batch, writes commit one by one again
+    BOOST_CHECK(CWalletDB(strTestWallet).WritePool(111, CKeyPool(pubkey)));
+    BOOST_CHECK(HasPool(111));
+}
+
+// Keys for the pool are made across all cores and stored in one batch
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    const unsigned int nKeys = 20;
+    CWallet wallet(strTestWallet);
+    LOCK(wallet.cs_wallet);
+
+    BOOST_CHECK(wallet.TopUpKeyPool(nKeys));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), nKeys + 1);
+
+    // Already full: nothing to do
+    BOOST_CHECK(wallet.TopUpKeyPool(nKeys));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), nKeys + 1);
+
+    CWalletDB walletdb(strTestWallet);
+    set<CKeyID> setIDs;
+    for (int64_t i = 1; i <= nKeys + 1; i++)
+    {
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(i, keypool));
+        CKey key;
+        BOOST_CHECK(wallet.GetKey(keypool.vchPubKey.GetID(), key));
+        BOOST_CHECK(key.GetPubKey() == keypool.vchPubKey);
+        setIDs.insert(keypool.vchPubKey.GetID());
+    }
+    BOOST_CHECK_EQUAL(setIDs.size(), nKeys + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -335,6 +335,20 @@ CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+// Scrypt the proof-of-work headers of the next stretch of blocks below
+// pindex across all cores, so the block checks that follow find their hashes
+// already cached. Returns the first block not covered.
+static CBlockIndex* PrecomputePoWHashes(CBlockIndex* pindex, int nMinHeight)
+{
+    vector<CBlockHeader> vHeaders;
+    for (; pindex && pindex->pprev && pindex->nHeight >= nMinHeight && vHeaders.size() < 1000; pindex = pindex->pprev)
+        if (pindex->IsProofOfWork())
+            vHeaders.push_back(pindex->GetBlockHeader());
+    vector<uint256> vHashes;
+    GetPoWHashes(vHeaders, vHashes);
+    return pindex;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -455,12 +469,15 @@ bool CTxDB::LoadBlockIndex()
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CBlockIndex* pindexFork = NULL;
+    CBlockIndex* pindexUnhashed = pindexBest;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        if (pindex == pindexUnhashed)
+            pindexUnhashed = PrecomputePoWHashes(pindex, nBestHeight-nCheckDepth);
         CValidationState state;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
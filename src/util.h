@@ -23,6 +23,7 @@
 #include <vector>
 #include <string>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/path.hpp>
@@ -239,6 +240,7 @@ void FileCommit(FILE *fileout);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 boost::filesystem::path GetDefaultDataDir();
 const boost::filesystem::path &GetDataDir(bool fNetSpecific = true);
+void ClearDatadirCache();
 boost::filesystem::path GetConfigFile();
 boost::filesystem::path GetPidFile();
 #ifndef WIN32
@@ -644,4 +646,34 @@ template <typename Callable> void TraceThread(const char* name,  Callable func)
     }
 }
 
+// Splits work over nThreads threads: calls func(nThread, nThreads) for every
+// nThread below nThreads, share 0 on the calling thread, and returns the
+// number of shares once all of them are done. Each share typically takes
+// items nThread, nThread + nThreads, ... or a contiguous run of them.
+// nThreads <= 0 means one per core, and there are never more shares than
+// nCount items. The workers may use the caller's stack frame, so they are
+// joined even if the caller is interrupted or share 0 throws.
+template <typename Callable> int ParallelFor(uint64_t nCount, int nThreads, Callable func)
+{
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = (int)std::max((uint64_t)1, std::min((uint64_t)nThreads, nCount));
+
+    boost::this_thread::disable_interruption di;
+    boost::thread_group threads;
+    try
+    {
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(func, i, nThreads));
+        func(0, nThreads);
+    }
+    catch (...)
+    {
+        threads.join_all();
+        throw;
+    }
+    threads.join_all();
+    return nThreads;
+}
+
 #endif
@@ -31,6 +31,7 @@
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
 #include <boost/thread.hpp>
 
@@ -46,6 +47,24 @@ CAmount gcd(CAmount n,CAmount m) { return m == 0 ? n : gcd(m, n % m); }
 static CAmount GetStakeCombineThreshold() {return 500 * COIN; }
 static CAmount GetStakeSplitThreshold() { return 2 * GetStakeCombineThreshold(); }
 
+// Keys into CWallet::mapBalanceCache
+enum BalanceType
+{
+    BALANCE_TRUSTED,
+    BALANCE_UNCONFIRMED,
+    BALANCE_IMMATURE,
+    BALANCE_WATCH_ONLY,
+    BALANCE_UNCONFIRMED_WATCH_ONLY,
+    BALANCE_IMMATURE_WATCH_ONLY,
+    BALANCE_WATCH_ONLY_STAKE,
+    BALANCE_STAKE,
+    BALANCE_NEW_MINT,
+    BALANCE_ANONYMIZED,
+    BALANCE_NORMALIZED_ANONYMIZED,
+    BALANCE_ANONYMIZABLE,                           // +1 to include already anonymized
+    BALANCE_DENOMINATED = BALANCE_ANONYMIZABLE + 2, // +1 denominated, +2 unconfirmed, +4 include anonymized
+};
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapWallet
@@ -186,6 +205,7 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    RebuildUnspentIndex();
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -475,6 +495,74 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+// Keep wtx in mapUnspentTx while any output of ours is either not marked
+// spent or not yet spent by a transaction in the wallet; the balance loops
+// still apply their own spent checks to each output.
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    const uint256 hash = wtx.GetHash();
+    nUnspentVersion++;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        if (!wtx.IsSpent(i) || !mapTxSpends.count(COutPoint(hash, i)))
+        {
+            mapUnspentTx[hash] = &wtx;
+            return;
+        }
+    }
+    mapUnspentTx.erase(hash);
+}
+
+void CWallet::UpdateUnspentInputs(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi != mapWallet.end())
+            UpdateUnspent(mi->second);
+    }
+}
+
+void CWallet::RebuildUnspentIndex()
+{
+    LOCK(cs_wallet);
+    mapUnspentTx.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspent(it->second);
+    LogPrint("wallet", "RebuildUnspentIndex() : %u of %u transactions have unspent outputs\n", mapUnspentTx.size(), mapWallet.size());
+}
+
+bool CWallet::GetCachedBalance(int nType, CAmount& nBalanceRet) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (pindexBalanceCache != pindexBest || nBalanceCacheMempool != nMempoolUpdated ||
+        nBalanceCacheVersion != nUnspentVersion || nBalanceCacheRounds != nSandstormRounds)
+    {
+        mapBalanceCache.clear();
+        pindexBalanceCache = pindexBest;
+        nBalanceCacheMempool = nMempoolUpdated;
+        nBalanceCacheVersion = nUnspentVersion;
+        nBalanceCacheRounds = nSandstormRounds;
+        return false;
+    }
+    map<int, CAmount>::const_iterator it = mapBalanceCache.find(nType);
+    if (it == mapBalanceCache.end())
+        return false;
+    nBalanceRet = it->second;
+    return true;
+}
+
+void CWallet::SetCachedBalance(int nType, CAmount nBalance) const
+{
+    mapBalanceCache[nType] = nBalance;
+}
+
 
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
@@ -638,19 +726,22 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        nUnspentVersion++;
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
+// LoadWallet() deserializes each transaction in place and has already checked
+// its hash, so this only binds it; no copy and no second GetHash()
+void CWallet::LoadToWallet(const uint256& hash)
+{
+    mapWallet[hash].BindWallet(this);
+    AddToSpends(hash);
+    // mapUnspentTx is built once keys are loaded, see LoadWallet()
+}
+
+bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
-    if (fFromLoadWallet)
-    {
-        mapWallet[hash] = wtxIn;
-        mapWallet[hash].BindWallet(this);
-        AddToSpends(hash);
-    }
-    else    
     {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -733,6 +824,26 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
 
+        // Record what it spends and refresh the spendable-output index for
+        // it and the transactions it spends from
+        if (fInsertedNew)
+            AddToSpends(hash);
+        UpdateUnspent(wtx);
+        UpdateUnspentInputs(wtx);
+
+        // Anything already in the wallet that spends a new transaction had
+        // its rounds computed without it
+        if (fInsertedNew)
+        {
+            InvalidateSandstormRounds(hash);
+            if (!fLiteMode)
+            {
+                const std::vector<signed char>& vRounds = GetSandstormRounds(ret.first);
+                if (fFileBacked && GetBoolArg("-persistsandstormrounds", true))
+                    CWalletDB(strWalletFile).WriteSandstormRounds(hash, vRounds);
+            }
+        }
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -815,12 +926,24 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
     }
 }
 
+void CWallet::SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock, bool fConnect)
+{
+    // One wallet file transaction for the whole block
+    LOCK2(cs_main, cs_wallet);
+    CDBBatch batch(strWalletFile);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        SyncTransaction(tx, pblock, fConnect);
+}
+
 void CWallet::EraseFromWallet(const uint256 &hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
+        mapUnspentTx.erase(hash);
+        nUnspentVersion++;
+        InvalidateSandstormRounds(hash);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1121,32 +1244,140 @@ bool CWalletTx::WriteToDisk()
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// Blocks handed to the reader threads at a time during a rescan
+static const unsigned int RESCAN_BATCH_BLOCKS = 256;
+
+// A block read and matched against the wallet's keys by a rescan reader thread
+struct CRescanBlock
 {
-    int ret = 0;
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<char> vfMatch; // per transaction: may pay us or carry a stealth payment
+};
 
-    CBlockIndex* pindex = pindexStart;
+// Whether tx has an output of ours, or an OP_RETURN output that
+// FindStealthTransactions needs to look at
+static bool RescanMatch(const CWallet* pwallet, const CTransaction& tx)
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
-        LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        if (!txout.scriptPubKey.empty() && txout.scriptPubKey[0] == OP_RETURN)
+            return true;
+        if (pwallet->IsMine(txout) != ISMINE_NO)
+            return true;
+    }
+    return false;
+}
+
+static void ThreadRescanRead(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvBlocks->size(); i += nThreads)
+    {
+        CRescanBlock& entry = (*pvBlocks)[i];
+        if (!entry.block.ReadFromDisk(entry.pindex, true))
+            continue; // vfMatch left empty, every transaction gets the full check
+        entry.vfMatch.resize(entry.block.vtx.size());
+        for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+            entry.vfMatch[j] = RescanMatch(pwallet, entry.block.vtx[j]);
+    }
+}
+
+static void ReadRescanBatch(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks)
+{
+    ParallelFor(pvBlocks->size(), 0, boost::bind(&ThreadRescanRead, pwallet, pvBlocks, _1, _2));
+}
+
+// Queue the next batch of main chain blocks from pindex on, skipping those from
+// before the wallet birthday, and start reading them. Returns where the
+// following batch starts.
+static CBlockIndex* StartRescanBatch(const CWallet* pwallet, CBlockIndex* pindex, int64_t nTimeFirstKey,
+                                     std::vector<CRescanBlock>& vBlocks, boost::thread_group& readers)
+{
+    vBlocks.clear();
+    {
+        LOCK(cs_main);
+        while (pindex && vBlocks.size() < RESCAN_BATCH_BLOCKS)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
+            if (!nTimeFirstKey || pindex->nTime >= nTimeFirstKey - 7200)
+            {
+                vBlocks.push_back(CRescanBlock());
+                vBlocks.back().pindex = pindex;
             }
+            pindex = pindex->pnext;
+        }
+    }
+
+    // Read across all cores in the background while the caller applies the last batch
+    if (!vBlocks.empty())
+        readers.create_thread(boost::bind(&ReadRescanBatch, pwallet, &vBlocks));
+    return pindex;
+}
+
+// Reader threads load and pre-match one batch of blocks while the previous
+// batch is applied in chain order under cs_main and cs_wallet. The locks are
+// released between batches.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    int ret = 0;
+    int64_t nStart = GetTimeMillis();
+    int nStartHeight, nEndHeight;
+    {
+        LOCK(cs_main);
+        nStartHeight = pindexStart ? pindexStart->nHeight : 0;
+        nEndHeight = std::max(nBestHeight, nStartHeight + 1);
+    }
+    ShowProgress(_("Rescanning..."), 0);
+
+    std::vector<CRescanBlock> vBatch, vNext;
+    boost::scoped_ptr<boost::thread_group> readers(new boost::thread_group());
+    unsigned int nFoundStealthNext = nFoundStealth;
+    CBlockIndex* pindex = StartRescanBatch(this, pindexStart, nTimeFirstKey, vNext, *readers);
+    int nBlocks = 0;
+    while (!vNext.empty())
+    {
+        readers->join_all();
+        vBatch.swap(vNext);
+        unsigned int nFoundStealthBatch = nFoundStealthNext;
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        readers.reset(new boost::thread_group());
+        nFoundStealthNext = nFoundStealth;
+        pindex = StartRescanBatch(this, pindex, nTimeFirstKey, vNext, *readers);
+
+        {
+            LOCK2(cs_main, cs_wallet);
+            CDBBatch batch(strWalletFile);
+            BOOST_FOREACH(CRescanBlock& entry, vBatch)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = entry.block.vtx[j];
+
+                    // The readers only matched outputs against the keys known when
+                    // they ran; spends of our coins are found here, and stealth
+                    // keys added since then force a second look
+                    bool fMatch = j >= entry.vfMatch.size() || entry.vfMatch[j] || mapWallet.count(tx.GetHash());
+                    for (unsigned int k = 0; k < tx.vin.size() && !fMatch; k++)
+                        fMatch = mapWallet.count(tx.vin[k].prevout.hash);
+                    if (!fMatch && nFoundStealth != nFoundStealthBatch)
+                        fMatch = RescanMatch(this, tx);
+
+                    if (fMatch && AddToWalletIfInvolvingMe(tx, &entry.block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = pindex->pnext;
         }
+
+        nBlocks += vBatch.size();
+        int nHeight = vBatch.back().pindex->nHeight;
+        ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((nHeight - nStartHeight) * 100LL / (nEndHeight - nStartHeight)))));
     }
+    readers->join_all();
+    ShowProgress(_("Rescanning..."), 100);
+
+    LogPrint("wallet", "ScanForWalletTransactions() : %d blocks from height %d, %d transactions in %dms\n",
+             nBlocks, nStartHeight, ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -1159,6 +1390,7 @@ void CWallet::ReacceptWalletTransactions()
         LOCK2(cs_main, cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
+        boost::scoped_ptr<CDBBatch> batch(new CDBBatch(strWalletFile));
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
             const uint256& wtxid = item.first;
@@ -1204,6 +1436,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %s DRKSLK %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                 }
             }
             else
@@ -1213,6 +1446,7 @@ void CWallet::ReacceptWalletTransactions()
                     wtx.AcceptWalletTransaction(txdb);
             }
         }
+        batch.reset();
         if (!vMissingTx.empty())
         {
             // TODO: optimize this to scan just part of the block chain?
@@ -1320,12 +1554,15 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_TRUSTED, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_TRUSTED, nTotal);
     }
 
     return nTotal;
@@ -1338,9 +1575,11 @@ CAmount CWallet::GetAnonymizableBalance(bool includeAlreadyAnonymized) const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_ANONYMIZABLE + includeAlreadyAnonymized, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (pcoin->IsTrusted())
             {
@@ -1360,6 +1599,7 @@ CAmount CWallet::GetAnonymizableBalance(bool includeAlreadyAnonymized) const
                 }
             }
         }
+        SetCachedBalance(BALANCE_ANONYMIZABLE + includeAlreadyAnonymized, nTotal);
     }
 
     return nTotal;
@@ -1371,10 +1611,12 @@ CAmount CWallet::GetAnonymizedBalance() const
 
     CAmount nTotal = 0;
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_ANONYMIZED, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (pcoin->IsTrusted())
             {
@@ -1396,6 +1638,7 @@ CAmount CWallet::GetAnonymizedBalance() const
                 }
             }
         }
+        SetCachedBalance(BALANCE_ANONYMIZED, nTotal);
     }
 
     return nTotal;
@@ -1410,98 +1653,120 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
-// Recursively determine the rounds of a given input (How deep is the Sandstorm chain for a given input)
-int CWallet::GetRealInputSandstormRounds(CTxIn in, int rounds) const
+// Determine the rounds of every output of a wallet transaction (how deep the
+// Sandstorm chain behind it is). An explicit stack makes sure wallet ancestors
+// are filled in first without recursing down long mixing chains.
+const std::vector<signed char>& CWallet::GetSandstormRounds(std::map<uint256, CWalletTx>::const_iterator mi) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
-
-    if(rounds >= 100) return 99; // 100 rounds max
-
-    uint256 hash = in.prevout.hash;
-    unsigned int nout = in.prevout.n;
+    AssertLockHeld(cs_wallet);
 
-    const CWalletTx* wtx = GetWalletTx(hash);
-    if(wtx != NULL)
+    std::vector<std::map<uint256, CWalletTx>::const_iterator> vStack(1, mi);
+    while (!vStack.empty())
     {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if(mdwi == mDenomWtxes.end())
-        {
-            LogPrint("sandstorm", "GetInputSandstormRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        }
-        // found and it's not an initial value, just return it
-        else if(mDenomWtxes[hash].vout[nout].nRounds != -10)
-        {
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        // bounds check
-        if(nout >= wtx->vout.size())
-        {
-            // should never actually hit this
-            LogPrint("sandstorm", "GetInputSandstormRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, -4);
-            return -4;
-        }
-
-        if(pwalletMain->IsCollateralAmount(wtx->vout[nout].nValue))
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("sandstorm", "GetInputSandstormRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+        const uint256& hash = vStack.back()->first;
+        const CWalletTx& wtx = vStack.back()->second;
 
-        //make sure the final output is non-denominate
-        if(/*rounds == 0 && */!IsDenominatedAmount(wtx->vout[nout].nValue)) //NOT DENOM
+        SandstormRoundsMap::const_iterator ri = mapSandstormRounds.find(hash);
+        if (ri != mapSandstormRounds.end() && ri->second.size() == wtx.vout.size())
         {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("sandstorm", "GetInputSandstormRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+            vStack.pop_back();
+            continue;
         }
 
         bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx->vout)
-        {
+        BOOST_FOREACH(const CTxOut& out, wtx.vout)
             fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
-        }
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if(!fAllDenoms)
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("sandstorm", "GetInputSandstormRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
 
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn in2, wtx->vin)
+        // only denoms here so let's look up the shortest chain among our inputs,
+        // pushing any input transaction that hasn't been computed yet
+        int nShortest = -1;
+        bool fReady = true;
+        if (fAllDenoms)
         {
-            if(IsMine(in2))
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
             {
-                int n = GetRealInputSandstormRounds(in2, rounds+1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10))
+                std::map<uint256, CWalletTx>::const_iterator mprev = mapWallet.find(txin.prevout.hash);
+                if (mprev == mapWallet.end() || txin.prevout.n >= mprev->second.vout.size()
+                    || !IsMine(mprev->second.vout[txin.prevout.n]))
+                    continue;
+
+                SandstormRoundsMap::const_iterator rprev = mapSandstormRounds.find(mprev->first);
+                if (rprev == mapSandstormRounds.end() || rprev->second.size() != mprev->second.vout.size())
                 {
-                    nShortest = n;
-                    fDenomFound = true;
+                    vStack.push_back(mprev);
+                    fReady = false;
+                    continue;
                 }
+
+                int n = rprev->second[txin.prevout.n];
+                if (n >= 0 && (nShortest == -1 || n < nShortest))
+                    nShortest = n;
             }
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? (nShortest >= 99 ? 100 : nShortest + 1) // good, we a +1 to the shortest one but only 100 rounds max allowed
-                : 0;            // too bad, we are the fist one in that chain
-        LogPrint("sandstorm", "GetInputSandstormRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
+        if (!fReady)
+            continue;
+
+        std::vector<signed char> vRounds(wtx.vout.size());
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (IsCollateralAmount(wtx.vout[i].nValue))
+                vRounds[i] = -3;
+            else if (!IsDenominatedAmount(wtx.vout[i].nValue))
+                vRounds[i] = -2;
+            else if (!fAllDenoms)
+                vRounds[i] = 0; // denominated but there is another non-denominated output found in the same tx
+            else
+                vRounds[i] = nShortest >= 0 ? std::min(nShortest + 1, 100) : 0; // 100 rounds max, 0 if we are the first one in the chain
+        }
+        LogPrint("sandstorm", "GetSandstormRounds() : %s %d outputs, shortest input chain %d\n", hash.ToString(), vRounds.size(), nShortest);
+
+        mapSandstormRounds[hash].swap(vRounds);
+        vStack.pop_back();
     }
 
-    return rounds-1;
+    return mapSandstormRounds[mi->first];
+}
+
+// Forget the rounds of a wallet transaction and of every wallet transaction
+// built on it, they are recomputed on the next lookup
+void CWallet::InvalidateSandstormRounds(const uint256& hashIn)
+{
+    AssertLockHeld(cs_wallet);
+
+    std::vector<uint256> vStack(1, hashIn);
+    std::set<uint256> setDone;
+    while (!vStack.empty())
+    {
+        uint256 hash = vStack.back();
+        vStack.pop_back();
+        if (!setDone.insert(hash).second)
+            continue;
+
+        if (mapSandstormRounds.erase(hash) && fFileBacked)
+            CWalletDB(strWalletFile).EraseSandstormRounds(hash);
+
+        for (TxSpends::const_iterator it = mapTxSpends.lower_bound(COutPoint(hash, 0)); it != mapTxSpends.end() && it->first.hash == hash; ++it)
+            vStack.push_back(it->second);
+    }
+}
+
+int CWallet::GetRealInputSandstormRounds(const COutPoint& outpoint) const
+{
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi == mapWallet.end())
+        return -1;
+
+    const std::vector<signed char>& vRounds = GetSandstormRounds(mi);
+    // bounds check, should never actually hit this
+    if (outpoint.n >= vRounds.size())
+        return -4;
+    return vRounds[outpoint.n];
 }
 
 // respect current settings
 int CWallet::GetInputSandstormRounds(CTxIn in) const {
     LOCK(cs_wallet);
-    int realSandstormRounds = GetRealInputSandstormRounds(in, 0);
+    int realSandstormRounds = GetRealInputSandstormRounds(in.prevout);
     return realSandstormRounds > nSandstormRounds ? nSandstormRounds : realSandstormRounds;
 }
 
@@ -1514,9 +1779,9 @@ double CWallet::GetAverageAnonymizedRounds() const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (pcoin->IsTrusted())
             {
@@ -1552,10 +1817,12 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
     CAmount nTotal = 0;
 
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_NORMALIZED_ANONYMIZED, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (pcoin->IsTrusted())
             {
@@ -1576,6 +1843,7 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
                 }
             }
         }
+        SetCachedBalance(BALANCE_NORMALIZED_ANONYMIZED, nTotal);
     }
 
     return nTotal;
@@ -1586,11 +1854,14 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed, boo
     if(fLiteMode) return 0;
     
     CAmount nTotal = 0;
+    int nType = BALANCE_DENOMINATED + onlyDenom + 2 * onlyUnconfirmed + 4 * includeAlreadyAnonymized;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(nType, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             int nDepth = pcoin->GetDepthInMainChain(false);
 
@@ -1614,6 +1885,7 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed, boo
                 nTotal += pcoin->vout[i].nValue;
             }
         }
+        SetCachedBalance(nType, nTotal);
     }
 
     return nTotal;
@@ -1625,12 +1897,15 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_UNCONFIRMED, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_UNCONFIRMED, nTotal);
     }
     return nTotal;
 }
@@ -1640,11 +1915,14 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_IMMATURE, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
+        SetCachedBalance(BALANCE_IMMATURE, nTotal);
     }
     return nTotal;
 }
@@ -1654,12 +1932,15 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_WATCH_ONLY, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_WATCH_ONLY, nTotal);
     }
 
     return nTotal;
@@ -1669,12 +1950,15 @@ CAmount CWallet::GetWatchOnlyStake() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    if (GetCachedBalance(BALANCE_WATCH_ONLY_STAKE, nTotal))
+        return nTotal;
+    for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
     }
+    SetCachedBalance(BALANCE_WATCH_ONLY_STAKE, nTotal);
     return nTotal;
 }
 
@@ -1683,12 +1967,15 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_UNCONFIRMED_WATCH_ONLY, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_UNCONFIRMED_WATCH_ONLY, nTotal);
     }
     return nTotal;
 }
@@ -1698,11 +1985,14 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (GetCachedBalance(BALANCE_IMMATURE_WATCH_ONLY, nTotal))
+            return nTotal;
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_IMMATURE_WATCH_ONLY, nTotal);
     }
     return nTotal;
 }
@@ -1714,9 +2004,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1767,66 +2057,92 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
         }
 }
 
-void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
+void CWallet::UpdateStakeCandidates() const
 {
-    vCoins.clear();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (pindexStakeCache == pindexBest && nStakeCacheVersion == nUnspentVersion && nStakeCacheMinInput == nMinimumInputValue)
+        return;
 
+    vStakeCandidates.clear();
+    for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 1)
-                continue;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (nDepth < 1)
+            continue;
 
-            if (nDepth < nStakeMinConfirmations)
-            {
-                continue;
+        if (nDepth < nStakeMinConfirmations)
+            continue;
+
+        if (pcoin->GetBlocksToMaturity() > 0)
+            continue;
+
+        bool found = false;
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++){
+            if (IsDenominatedAmount(pcoin->vout[i].nValue)){
+
+                //LogPrintf("CWallet::AvailableCoinsForStaking - Found denominated amounts.\n");
+                found = true;
+                break;
             }
-            else
-            {
-            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
-            if (pcoin->nTime + nStakeMinAge > nSpendTime)
-               continue;
+            if (pcoin->vout[i].nValue == 10000*COIN){
+
+                //LogPrintf("CWallet::AvailableCoinsForStaking - Found Stormnode collateral.\n");
+                found = true;
+                break;
             }
+            if (IsCollateralAmount(pcoin->vout[i].nValue)){
 
-            if (pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                //LogPrintf("CWallet::AvailableCoinsForStaking - Found Collateral amount.\n");
+                found = true;
+                break;
+            }
+        }
 
-            bool found = false;
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++){
-                if (IsDenominatedAmount(pcoin->vout[i].nValue)){
+        if(found) continue;
 
-                    //LogPrintf("CWallet::AvailableCoinsForStaking - Found denominated amounts.\n");
-                    found = true;
-                    break;
-                }
-                if (pcoin->vout[i].nValue == 10000*COIN){
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+            if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
+                vStakeCandidates.push_back(CStakeCandidate(pcoin, i, nDepth));
+    }
 
-                    //LogPrintf("CWallet::AvailableCoinsForStaking - Found Stormnode collateral.\n");
-                    found = true;
-                    break;
-                }
-                if (IsCollateralAmount(pcoin->vout[i].nValue)){
+    pindexStakeCache = pindexBest;
+    nStakeCacheVersion = nUnspentVersion;
+    nStakeCacheMinInput = nMinimumInputValue;
+    nStakeWeightExpiry = 0;
+    LogPrint("stake", "UpdateStakeCandidates() : %u outputs from %u transactions\n", vStakeCandidates.size(), mapUnspentTx.size());
+}
 
-                    //LogPrintf("CWallet::AvailableCoinsForStaking - Found Collateral amount.\n");
-                    found = true;
-                    break;
-                }
-            }
+void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
+{
+    vCoins.clear();
 
-            if(found) continue;
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateStakeCandidates();
+        BOOST_FOREACH(const CStakeCandidate& candidate, vStakeCandidates)
+        {
+            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+            if (candidate.tx->nTime + nStakeMinAge > nSpendTime)
+               continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, nDepth, true));
+            vCoins.push_back(COutput(candidate.tx, candidate.i, candidate.nDepth, true));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+// Coin selection only needs the insecure generator seeded once, not from
+// GetRandBytes on every call
+static boost::once_flag insecureRandSeedFlag = BOOST_ONCE_INIT;
+
+static void SeedInsecureRand()
+{
+    seed_insecure_rand();
+}
+
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1834,8 +2150,6 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
-    seed_insecure_rand();
-
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
         vfIncluded.assign(vValue.size(), false);
@@ -1872,17 +2186,83 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+// Depth-first search over vValue (sorted largest first) for the input set worth
+// between nTargetValue and nTargetValue + nCostOfChange that overshoots least,
+// i.e. one that needs no change output. A branch is cut as soon as the coins
+// left can't reach the target or the selection has overshot the window, and
+// a coin equal to the one just left out is skipped since it leads to the same
+// sums.
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower,
+                           const CAmount& nTargetValue, const CAmount& nCostOfChange, vector<char>& vfBest, CAmount& nBest)
+{
+    vector<char> vfSelected(vValue.size(), false);
+    CAmount nSelected = 0;
+    CAmount nRemaining = nTotalLower; // value of the coins not decided on yet
+    nBest = std::numeric_limits<CAmount>::max();
+
+    size_t i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nSelected + nRemaining < nTargetValue || nSelected > nTargetValue + nCostOfChange)
+            fBacktrack = true;
+        else if (nSelected >= nTargetValue)
+        {
+            if (nSelected < nBest)
+            {
+                nBest = nSelected;
+                vfBest = vfSelected;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Undo the trailing left-out coins, then leave out the last included one instead
+            while (i > 0 && !vfSelected[i - 1])
+                nRemaining += vValue[--i].first;
+            if (i == 0)
+                break; // searched the whole tree
+            vfSelected[--i] = false;
+            nSelected -= vValue[i].first;
+            i++;
+        }
+        else
+        {
+            nRemaining -= vValue[i].first;
+            if (i == 0 || vfSelected[i - 1] || vValue[i].first != vValue[i - 1].first)
+            {
+                vfSelected[i] = true;
+                nSelected += vValue[i].first;
+            }
+            i++;
+        }
+    }
+
+    return nBest != std::numeric_limits<CAmount>::max();
+}
+
+static int InsecureRandRange(int nMax)
+{
+    return insecure_rand() % nMax;
+}
+
 // ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    if (GetCachedBalance(BALANCE_STAKE, nTotal))
+        return nTotal;
+    for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
     }
+    SetCachedBalance(BALANCE_STAKE, nTotal);
     return nTotal;
 }
 
@@ -1890,16 +2270,19 @@ CAmount CWallet::GetNewMint() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    if (GetCachedBalance(BALANCE_NEW_MINT, nTotal))
+        return nTotal;
+    for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
     }
+    SetCachedBalance(BALANCE_NEW_MINT, nTotal);
     return nTotal;
 }
 
-bool CWallet::SelectCoinsMinConfByCoinAge(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConfByCoinAge(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -2140,22 +2523,7 @@ bool CWallet::SelectCoinsMinConfByCoinAge(const CAmount& nTargetValue, unsigned
     return true;
 }
 
-bool less_then_denom (const COutput& out1, const COutput& out2)
-{
-    const CWalletTx *pcoin1 = out1.tx;
-    const CWalletTx *pcoin2 = out2.tx;
-
-    bool found1 = false;
-    bool found2 = false;
-    BOOST_FOREACH(CAmount d, sandStormDenominations) // loop through predefined denoms
-    {
-        if(pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if(pcoin2->vout[out2.i].nValue == d) found2 = true;
-    }
-    return (!found1 && found2);
-}
-
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -2167,10 +2535,9 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpen
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
+    // vCoins is walked in place rather than copied and shuffled; ties between
+    // equal coins are broken at random below instead
+    boost::call_once(&SeedInsecureRand, insecureRandSeedFlag);
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++)
@@ -2179,6 +2546,10 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpen
             vValue.clear();
 
         nTotalLower = 0;
+        coinLowestLarger.first = std::numeric_limits<CAmount>::max();
+        coinLowestLarger.second.first = NULL;
+        pair<const CWalletTx*,unsigned int> coinExact(NULL, 0);
+        int nExact = 0, nLowestLarger = 0;
 
         BOOST_FOREACH(const COutput &output, vCoins)
         {
@@ -2199,9 +2570,8 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpen
 
             if (n == nTargetValue)
             {
-                setCoinsRet.insert(coin.second);
-                nValueRet += coin.first;
-                return true;
+                if (InsecureRandRange(++nExact) == 0)
+                    coinExact = coin.second;
             }
             else if (n < nTargetValue + CENT)
             {
@@ -2209,11 +2579,23 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpen
                 nTotalLower += n;
             }
             else if (n < coinLowestLarger.first)
+            {
+                coinLowestLarger = coin;
+                nLowestLarger = 1;
+            }
+            else if (n == coinLowestLarger.first && InsecureRandRange(++nLowestLarger) == 0)
             {
                 coinLowestLarger = coin;
             }
         }
 
+        if (coinExact.first)
+        {
+            setCoinsRet.insert(coinExact);
+            nValueRet += nTargetValue;
+            return true;
+        }
+
         if (nTotalLower == nTargetValue)
         {
             for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -2246,14 +2628,34 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpen
 
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Largest first, equal values in random order
+    random_shuffle(vValue.begin(), vValue.end(), InsecureRandRange);
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // An input set that leaves less than a dust output over needs no change at all
+    CAmount nCostOfChange = 3 * ::minRelayTxFee.GetFee(34 + 148);
+    if (SelectCoinsBnB(vValue, nTotalLower, nTargetValue, nCostOfChange, vfBest, nBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+        {
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        }
+        LogPrint("selectcoins", "SelectCoinsMinConf() : branch and bound picked %u of %u coins, total %s\n",
+                 setCoinsRet.size(), vValue.size(), FormatMoney(nValueRet));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation
+    int nIterations = std::max(10, std::min(1000, KNAPSACK_MAX_STEPS / (int)vValue.size()));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -2335,7 +2737,7 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, unsigned int nSpendTime,
         return (nValueRet >= nTargetValue);
     }
 
-    boost::function<bool (const CWallet*, const CAmount&, unsigned int, int, int, std::vector<COutput>, std::set<std::pair<const CWalletTx*,unsigned int> >&, CAmount&)> f;
+    boost::function<bool (const CWallet*, const CAmount&, unsigned int, int, int, const std::vector<COutput>&, std::set<std::pair<const CWalletTx*,unsigned int> >&, CAmount&)> f;
     // f uses SelectCoinsMinConfByCoinAge for the first 250 blocks then without it.
     if (pindexBest->nHeight <= 250)
         f = fMinimizeCoinAge ? &CWallet::SelectCoinsMinConfByCoinAge : &CWallet::SelectCoinsMinConf;
@@ -2563,9 +2965,9 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (UnspentTxMap::const_iterator it = mapUnspentTx.begin(); it != mapUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted()){
                 int nDepth = pcoin->GetDepthInMainChain();
 
@@ -3087,6 +3489,36 @@ bool CWallet::AddStealthAddress(CStealthAddress& sxAddr)
     return rv;
 }
 
+// A locked key received at a stealth address, with the owned address whose
+// secrets recover it
+struct CStealthKeyExpansion
+{
+    CKeyID ckid;
+    CPubKey pubKey;
+    const CStealthAddress* psxAddr;
+    ec_point pkEphem;
+    CKey key; // valid once recovered and matched against pubKey
+};
+
+static void ExpandStealthKeysThread(std::vector<CStealthKeyExpansion>* pvExpand, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvExpand->size(); i += nThreads)
+    {
+        CStealthKeyExpansion& expand = (*pvExpand)[i];
+        ec_secret sScan, sSpend, sSpendR;
+        memcpy(&sScan.e[0], &expand.psxAddr->scan_secret[0], ec_secret_size);
+        memcpy(&sSpend.e[0], &expand.psxAddr->spend_secret[0], ec_secret_size);
+
+        if (StealthSecretSpend(sScan, expand.pkEphem, sSpend, sSpendR) != 0)
+            continue;
+
+        CKey ckey;
+        ckey.Set(&sSpendR.e[0], &sSpendR.e[0] + ec_secret_size, true);
+        if (ckey.IsValid() && ckey.GetPubKey() == expand.pubKey)
+            expand.key = ckey;
+    }
+}
+
 bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
 {
     // -- decrypt spend_secret of stealth addresses
@@ -3126,6 +3558,8 @@ bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
         memcpy(&sxAddr.spend_secret[0], &vchSecret[0], 32);
     };
 
+    // -- collect the keys received at stealth addresses while locked
+    std::vector<CStealthKeyExpansion> vExpand;
     CryptedKeyMap::iterator mi = mapCryptedKeys.begin();
     for (; mi != mapCryptedKeys.end(); ++mi)
     {
@@ -3156,84 +3590,53 @@ bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
             continue;
         };
 
-        if (fDebug)
-            printf("Expanding secret for %s\n", addr.ToString().c_str());
-
-        ec_secret sSpendR;
-        ec_secret sSpend;
-        ec_secret sScan;
-
         if (si->spend_secret.size() != ec_secret_size
             || si->scan_secret.size() != ec_secret_size)
         {
             printf("Stealth address has no secret key for %s\n", addr.ToString().c_str());
             continue;
         }
-        memcpy(&sScan.e[0], &si->scan_secret[0], ec_secret_size);
-        memcpy(&sSpend.e[0], &si->spend_secret[0], ec_secret_size);
-
-        ec_point pkEphem = sxKeyMeta.pkEphem.Raw();
-        if (StealthSecretSpend(sScan, pkEphem, sSpend, sSpendR) != 0)
-        {
-            printf("StealthSecretSpend() failed.\n");
-            continue;
-        };
-
-        ec_point pkTestSpendR;
-        if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-        {
-            printf("SecretToPublicKey() failed.\n");
-            continue;
-        };
 
-        CSecret vchSecret;
-        vchSecret.resize(ec_secret_size);
-
-        memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-        CKey ckey;
-
-        try {
-        ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-            //ckey.SetSecret(vchSecret, true);
-        } catch (std::exception& e) {
-            printf("ckey.SetSecret() threw: %s.\n", e.what());
-            continue;
-        };
+        if (fDebug)
+            printf("Expanding secret for %s\n", addr.ToString().c_str());
 
-        CPubKey cpkT = ckey.GetPubKey();
+        CStealthKeyExpansion expand;
+        expand.ckid = ckid;
+        expand.pubKey = pubKey;
+        expand.psxAddr = &(*si);
+        expand.pkEphem = sxKeyMeta.pkEphem.Raw();
+        vExpand.push_back(expand);
+    };
 
-        if (!cpkT.IsValid())
-        {
-            printf("cpkT is invalid.\n");
-            continue;
-        };
+    if (vExpand.empty())
+        return true;
 
-        if (cpkT != pubKey)
-        {
-            printf("Error: Generated secret does not match.\n");
-            continue;
-        };
+    // -- recover the private keys across all cores
+    int64_t nStart = GetTimeMillis();
+    int nThreads = ParallelFor(vExpand.size(), 0, boost::bind(&ExpandStealthKeysThread, &vExpand, _1, _2));
+    LogPrint("wallet", "UnlockStealthAddresses() : expanded %u keys on %d threads in %dms\n", vExpand.size(), nThreads, GetTimeMillis() - nStart);
 
-        if (!ckey.IsValid())
+    // -- re-encrypt and store them, which touches the wallet file and so stays serial
+    CWalletDB walletdb(strWalletFile);
+    BOOST_FOREACH(const CStealthKeyExpansion& expand, vExpand)
+    {
+        CDarkSilkAddress addr(expand.ckid);
+        if (!expand.key.IsValid())
         {
-            printf("Reconstructed key is invalid.\n");
+            printf("Error: Generated secret does not match for %s\n", addr.ToString().c_str());
             continue;
         };
 
         if (fDebug)
-        {
-            CKeyID keyID = cpkT.GetID();
-            CDarkSilkAddress coinAddress(keyID);
-            printf("Adding secret to key %s.\n", coinAddress.ToString().c_str());
-        };
+            printf("Adding secret to key %s.\n", addr.ToString().c_str());
 
-        if (!AddKey(ckey))
+        if (!AddKey(expand.key))
         {
             printf("AddKey failed.\n");
             continue;
         };
 
-        if (!CWalletDB(strWalletFile).EraseStealthKeyMeta(ckid))
+        if (!walletdb.EraseStealthKeyMeta(expand.ckid))
             printf("EraseStealthKeyMeta failed for %s\n", addr.ToString().c_str());
     };
     return true;
@@ -3477,10 +3880,27 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     LOCK(cs_wallet);
     ec_secret sSpendR;
     ec_secret sSpend;
-    ec_secret sScan;
     ec_secret sShared;
 
-    ec_point pkExtracted;
+    // -- owned stealth addresses, gathered once so each ephemeral key costs one batch of ECDH
+    std::vector<std::set<CStealthAddress>::iterator> vStealthOwned;
+    std::vector<ec_secret> vScanSecrets;
+    std::vector<ec_point> vSpendPubkeys;
+    for (std::set<CStealthAddress>::iterator it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+    {
+        if (it->scan_secret.size() != ec_secret_size)
+            continue; // stealth address is not owned
+
+        ec_secret sScan;
+        memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+        vStealthOwned.push_back(it);
+        vScanSecrets.push_back(sScan);
+        vSpendPubkeys.push_back(it->spend_pubkey);
+    };
+
+    std::vector<ec_secret> vShared;
+    std::vector<ec_point> vPkExtracted;
+    std::vector<CKeyID> vKeyIdExtracted;
 
     std::vector<uint8_t> vchEphemPK;
     std::vector<uint8_t> vchDataB;
@@ -3527,8 +3947,25 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             continue;
         }
 
-        int32_t nOutputId = -1;
         nStealth++;
+        if (vStealthOwned.empty())
+            continue;
+
+        if (StealthSecretBatch(vchEphemPK, vScanSecrets, vSpendPubkeys, vShared, vPkExtracted) != 0)
+        {
+            printf("StealthSecretBatch failed.\n");
+            continue;
+        };
+
+        vKeyIdExtracted.assign(vStealthOwned.size(), CKeyID());
+        for (size_t i = 0; i < vStealthOwned.size(); ++i)
+        {
+            CPubKey cpkE(vPkExtracted[i]);
+            if (cpkE.IsValid())
+                vKeyIdExtracted[i] = cpkE.GetID();
+        };
+
+        int32_t nOutputId = -1;
         BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
         {
             nOutputId++;
@@ -3551,30 +3988,14 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             if (HaveKey(ckidMatch)) // no point checking if already have key
                 continue;
 
-            std::set<CStealthAddress>::iterator it;
-            for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+            for (size_t i = 0; i < vStealthOwned.size(); ++i)
             {
-                if (it->scan_secret.size() != ec_secret_size)
-                    continue; // stealth address is not owned
-
-                //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
-
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
-                {
-                    printf("StealthSecret failed.\n");
-                    continue;
-                };
-                //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
-
-                CPubKey cpkE(pkExtracted);
-
-                if (!cpkE.IsValid())
+                if (vPkExtracted[i].empty() || ckidMatch != vKeyIdExtracted[i])
                     continue;
-                CKeyID ckidE = cpkE.GetID();
 
-                if (ckidMatch != ckidE)
-                    continue;
+                std::set<CStealthAddress>::iterator it = vStealthOwned[i];
+                CPubKey cpkE(vPkExtracted[i]);
+                sShared = vShared[i];
 
                 if (fDebug)
                     printf("Found stealth txn to address %s\n", it->Encoded().c_str());
@@ -3704,27 +4125,36 @@ uint64_t CWallet::GetStakeWeight() const
     if (nBalance <= nReserveBalance)
         return 0;
 
-    vector<const CWalletTx*> vwtxPrev;
+    LOCK2(cs_main, cs_wallet);
+    int64_t nNow = GetTime();
+    UpdateStakeCandidates();
+    if (nStakeWeightTarget == nBalance - nReserveBalance && nNow < nStakeWeightExpiry)
+        return nStakeWeightCache;
 
     set<pair<const CWalletTx*,unsigned int> > setCoins;
     CAmount nValueIn = 0;
 
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return 0;
-
-    if (setCoins.empty())
-        return 0;
-
     uint64_t nWeight = 0;
+    if (SelectCoinsForStaking(nBalance - nReserveBalance, nNow, setCoins, nValueIn))
+    {
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            if (pcoin.first->GetDepthInMainChain() >= nStakeMinConfirmations)
+                nWeight += pcoin.first->vout[pcoin.second].nValue;
+        }
+    }
 
-    CTxDB txdb("r");
-
-    LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // Nothing changes until a new block or wallet transaction arrives, or
+    // another candidate becomes old enough to stake
+    nStakeWeightExpiry = std::numeric_limits<int64_t>::max();
+    BOOST_FOREACH(const CStakeCandidate& candidate, vStakeCandidates)
     {
-        if (pcoin.first->GetDepthInMainChain() >= nStakeMinConfirmations)
-            nWeight += pcoin.first->vout[pcoin.second].nValue;
+        int64_t nMatureTime = (int64_t)candidate.tx->nTime + nStakeMinAge;
+        if (nMatureTime > nNow)
+            nStakeWeightExpiry = std::min(nStakeWeightExpiry, nMatureTime);
     }
+    nStakeWeightTarget = nBalance - nReserveBalance;
+    nStakeWeightCache = nWeight;
 
     return nWeight;
 }
@@ -3765,80 +4195,107 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
+    int64_t nSearchStart = GetTimeMicros();
+    uint64_t nKernelsChecked = 0;
+
+    // Read each coin's kernel fields once, then search all coins and
+    // timestamps together across every core
+    vector<PAIRTYPE(const CWalletTx*, unsigned int)> vKernelCoins;
+    vector<CStakeKernelInput> vKernelInputs;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        CStakeKernelInput input;
+        if (GetKernelInput(pindexPrev, COutPoint(pcoin.first->GetHash(), pcoin.second), input))
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+            vKernelCoins.push_back(pcoin);
+            vKernelInputs.push_back(input);
+        }
+    }
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+    // Search nSearchInterval seconds back from the txNew timestamp, up to nMaxStakeSearchInterval
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nStakeSearchInterval = max((int64_t)0, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+    bool fKernelFound = false;
+    while (!fKernelFound && !vKernelInputs.empty() && pindexPrev == pindexBest)
+    {
+        boost::this_thread::interruption_point();
+        unsigned int nTimeKernel;
+        uint64_t nHashes;
+        int nKernel = SearchStakeKernels(pindexPrev, nBits, txNew.nTime, nStakeSearchInterval, vKernelInputs, nTimeKernel, nHashes);
+        nKernelsChecked += nHashes;
+        if (nKernel < 0)
+            break;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (nCredit >= GetStakeSplitThreshold()) //TODO (AA): Remove this.  Test if affects PoS
-                    txNew.vout.push_back(CTxOut(0, txNew.vout[1].scriptPubKey)); //split stake
+        // Whether or not it can be used, this coin has been tried
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vKernelCoins[nKernel];
+        vKernelCoins.erase(vKernelCoins.begin() + nKernel);
+        vKernelInputs.erase(vKernelInputs.begin() + nKernel);
+
+        // Found a kernel
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (nCredit >= GetStakeSplitThreshold()) //TODO (AA): Remove this.  Test if affects PoS
+            txNew.vout.push_back(CTxOut(0, txNew.vout[1].scriptPubKey)); //split stake
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        fKernelFound = true;
+    }
+
+    {
+        LOCK(cs_wallet);
+        stakeSearchStats.nLastSearch = GetTime();
+        stakeSearchStats.nLastSearchMicros = GetTimeMicros() - nSearchStart;
+        stakeSearchStats.nCandidates = setCoins.size();
+        stakeSearchStats.nKernelsChecked = nKernelsChecked;
+        stakeSearchStats.nSearches++;
+        LogPrint("stake", "CreateCoinStake : %u kernels from %u coins checked in %dus\n", nKernelsChecked, setCoins.size(), stakeSearchStats.nLastSearchMicros);
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -3991,6 +4448,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -4239,6 +4697,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
 
+    RebuildUnspentIndex();
+
     return DB_LOAD_OK;
 }
 
@@ -4317,49 +4777,164 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
-        for (int i = 0; i < nKeys; i++)
+        if (!TopUpKeyPool(nKeys))
+            return false;
+        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", setKeyPool.size());
+    }
+    return true;
+}
+
+// A key pool key made off the wallet lock
+struct CPoolKey
+{
+    CKey key;
+    CPubKey pubkey;
+    std::vector<unsigned char> vchCryptedSecret;
+};
+
+static void GenerateKeysThread(std::vector<CPoolKey>* pvKeys, const CKeyingMaterial* pvMasterKey, bool fCompressed,
+                               int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvKeys->size(); i += nThreads)
+    {
+        CPoolKey& poolkey = (*pvKeys)[i];
+        poolkey.key.MakeNewKey(fCompressed);
+        poolkey.pubkey = poolkey.key.GetPubKey();
+        assert(poolkey.key.VerifyPubKey(poolkey.pubkey));
+
+        if (pvMasterKey)
         {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            CKeyingMaterial vchSecret(poolkey.key.begin(), poolkey.key.end());
+            if (!EncryptSecret(*pvMasterKey, vchSecret, poolkey.pubkey.GetHash(), poolkey.vchCryptedSecret))
+                poolkey.vchCryptedSecret.clear();
         }
-        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
-    return true;
 }
 
 bool CWallet::TopUpKeyPool(unsigned int nSize)
 {
+    unsigned int nTargetSize;
+    if (nSize > 0)
+        nTargetSize = nSize;
+    else
+        nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+
+    while (true)
     {
-        LOCK(cs_wallet);
+        // See how many keys are missing, and take a copy of the master key
+        // so they can be encrypted without holding the wallet lock
+        unsigned int nMissing;
+        bool fCompressed, fCrypted;
+        CKeyingMaterial vMasterKeyCopy;
+        {
+            LOCK(cs_wallet);
 
-        if (IsLocked())
-            return false;
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                return true;
 
-        CWalletDB walletdb(strWalletFile);
+            nMissing = nTargetSize + 1 - setKeyPool.size();
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+            fCrypted = IsCrypted();
+            if (fCrypted)
+            {
+                LOCK(cs_KeyStore);
+                vMasterKeyCopy = vMasterKey;
+            }
+        }
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (nSize > 0)
-            nTargetSize = nSize;
-        else
-            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+        // Generate, check and encrypt across all cores
+        int64_t nStart = GetTimeMillis();
+        std::vector<CPoolKey> vKeys(nMissing);
+        int nThreads = ParallelFor(nMissing, 0, boost::bind(&GenerateKeysThread, &vKeys, fCrypted ? &vMasterKeyCopy : NULL, fCompressed, _1, _2));
+        int64_t nGenerated = GetTimeMillis();
+
+        {
+            LOCK(cs_wallet);
+
+            // Locked or re-keyed meanwhile: start over
+            if (IsLocked() || IsCrypted() != fCrypted)
+                continue;
+            if (fCrypted)
+            {
+                LOCK(cs_KeyStore);
+                if (vMasterKey != vMasterKeyCopy)
+                    continue;
+            }
+
+            if (fCompressed)
+                SetMinVersion(FEATURE_COMPRPUBKEY);
+
+            // One wallet file transaction for the whole refill
+            CDBBatch batch(strWalletFile);
+            CWalletDB walletdb(strWalletFile);
+            unsigned int nAdded = 0;
+            BOOST_FOREACH(const CPoolKey& poolkey, vKeys)
+            {
+                // Another thread may have topped up while we generated
+                if (setKeyPool.size() >= nTargetSize + 1)
+                    break;
+
+                int64_t nCreationTime = GetTime();
+                mapKeyMetadata[poolkey.pubkey.GetID()] = CKeyMetadata(nCreationTime);
+                if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+                    nTimeFirstKey = nCreationTime;
+
+                if (fCrypted && poolkey.vchCryptedSecret.empty())
+                    throw runtime_error("TopUpKeyPool() : encrypting generated key failed");
+                if (fCrypted ? !AddCryptedKey(poolkey.pubkey, poolkey.vchCryptedSecret) : !AddKeyPubKey(poolkey.key, poolkey.pubkey))
+                    throw runtime_error("TopUpKeyPool() : AddKey failed");
+
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(poolkey.pubkey)))
+                    throw runtime_error("TopUpKeyPool() : writing generated key failed");
+                setKeyPool.insert(nEnd);
+                nAdded++;
+            }
+            LogPrintf("keypool added %u keys, size=%u, generated on %d threads in %dms, stored in %dms\n",
+                      nAdded, setKeyPool.size(), nThreads, nGenerated - nStart, GetTimeMillis() - nGenerated);
+        }
+        return true;
+    }
+}
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+void ThreadTopUpKeyPool(CWallet* pwallet)
+{
+    // Make this thread recognisable as the key pool thread
+    RenameThread("darksilk-keypool");
+
+    while (true)
+    {
+        MilliSleep(1000);
+
+        uint64_t nTarget = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0) + 1;
+        uint64_t nSize;
+        {
+            LOCK(pwallet->cs_wallet);
+            if (pwallet->IsLocked())
+                continue;
+            nSize = pwallet->GetKeyPoolSize();
+        }
+        if (nSize * 100 < nTarget * KEYPOOL_LOW_WATER_PERCENT)
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
-            std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
-            uiInterface.InitMessage(strMsg);
+            // A failed refill is retried on the next round rather than
+            // taking the node down
+            try {
+                pwallet->TopUpKeyPool();
+            }
+            catch (boost::thread_interrupted) {
+                throw;
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadTopUpKeyPool()");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "ThreadTopUpKeyPool()");
+            }
         }
     }
-    return true;
 }
 
 
@@ -4367,11 +4942,20 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
     keypool.vchPubKey = CPubKey();
+
+    // ThreadTopUpKeyPool keeps the pool filled; only generate keys here if
+    // it has run dry, and before taking the wallet lock, which TopUpKeyPool
+    // only needs to insert them
+    bool fDry;
     {
         LOCK(cs_wallet);
+        fDry = !IsLocked() && setKeyPool.empty();
+    }
+    if (fDry)
+        TopUpKeyPool();
 
-        if (!IsLocked())
-            TopUpKeyPool();
+    {
+        LOCK(cs_wallet);
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -4430,18 +5014,16 @@ bool CWallet::GetKeyFromPool(CPubKey& result)
 {
     int64_t nIndex = 0;
     CKeyPool keypool;
+    ReserveKeyFromKeyPool(nIndex, keypool); // may refill the pool, so not under cs_wallet
+    if (nIndex == -1)
     {
         LOCK(cs_wallet);
-        ReserveKeyFromKeyPool(nIndex, keypool);
-        if (nIndex == -1)
-        {
-            if (IsLocked()) return false;
-            result = GenerateNewKey();
-            return true;
-        }
-        KeepKey(nIndex);
-        result = keypool.vchPubKey;
+        if (IsLocked()) return false;
+        result = GenerateNewKey();
+        return true;
     }
+    KeepKey(nIndex);
+    result = keypool.vchPubKey;
     return true;
 }
 
@@ -4599,6 +5181,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, CAmount& nBalanceInQuestion, bo
     nBalanceInQuestion = 0;
 
     LOCK(cs_wallet);
+    CDBBatch batch(strWalletFile);
     vector<CWalletTx*> vCoins;
     vCoins.reserve(mapWallet.size());
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
@@ -4623,6 +5206,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, CAmount& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -4635,6 +5219,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, CAmount& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
         }
@@ -4658,6 +5243,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(prev);
             }
         }
     }
@@ -4727,6 +5313,7 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            nUnspentVersion++;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -4837,4 +5424,4 @@ bool DecodeHexBlk(CBlock& block, const std::string& strHexBlk)
     }
 
     return true;
-}
\ No newline at end of file
+}
\ No newline at end of file
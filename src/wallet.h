@@ -29,6 +29,12 @@ const CAmount MIN_TX_FEE = 10000; // 0.00001 DRKSLK Minimum Transaction Fee
 const CAmount MIN_RELAY_TX_FEE = MIN_TX_FEE;
 //! -keypool default
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 1000;
+//! The top-up thread refills the key pool once it drops below this share of -keypool
+static const unsigned int KEYPOOL_LOW_WATER_PERCENT = 90;
+//! Coin selection: branch-and-bound gives up after this many steps and leaves it to the knapsack
+static const int BNB_MAX_TRIES = 100000;
+//! Coin selection: work cap for the stochastic knapsack, in coin visits, spread over at most 1000 iterations
+static const int KNAPSACK_MAX_STEPS = 5000000;
 // Settings
 extern CAmount nTransactionFee;
 extern CAmount nReserveBalance;
@@ -43,6 +49,9 @@ class CReserveKey;
 class COutput;
 class CWalletDB;
 
+/** Keeps the key pool of pwallet topped up in the background */
+void ThreadTopUpKeyPool(CWallet* pwallet);
+
 typedef std::map<CKeyID, CStealthKeyMetadata> StealthKeyMetaMap;
 typedef std::map<std::string, std::string> mapValue_t;
 
@@ -65,6 +74,29 @@ enum AvailableCoinsType
     ONLY_NONDENOMINATED_NOTSN = 4 // ONLY_NONDENOMINATED and not 1000 DRKSLK at the same time
 };
 
+/** An output that passes every staking filter except coin age */
+struct CStakeCandidate
+{
+    const CWalletTx* tx;
+    unsigned int i;
+    int nDepth;
+
+    CStakeCandidate(const CWalletTx* txIn, unsigned int iIn, int nDepthIn) : tx(txIn), i(iIn), nDepth(nDepthIn) {}
+};
+
+/** Work done by the proof-of-stake kernel search */
+struct CStakeSearchStats
+{
+    int64_t nLastSearch;        // time of the last search
+    int64_t nLastSearchMicros;  // how long it took
+    unsigned int nCandidates;   // coins old enough to stake
+    uint64_t nKernelsChecked;   // kernel hashes tried
+    uint64_t nSearches;         // searches since startup
+    uint64_t nSkipped;          // staker wakeups with no new timeslot to search
+
+    CStakeSearchStats() : nLastSearch(0), nLastSearchMicros(0), nCandidates(0), nKernelsChecked(0), nSearches(0), nSkipped(0) {}
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -120,7 +152,45 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
-    int GetRealInputSandstormRounds(CTxIn in, int rounds) const;
+    // Wallet transactions that still have an output of ours which is not
+    // both marked spent and spent by another wallet transaction. Balances
+    // and coin selection walk this instead of the whole of mapWallet.
+    typedef std::map<uint256, const CWalletTx*> UnspentTxMap;
+    UnspentTxMap mapUnspentTx;
+    int64_t nUnspentVersion; // bumped whenever the index or a tx's state changes
+    void UpdateUnspent(const CWalletTx& wtx);
+    void UpdateUnspentInputs(const CTransaction& tx);
+
+    // Balance totals computed from mapUnspentTx, valid until the best block,
+    // the mempool, the index or the Sandstorm round target changes
+    mutable std::map<int, CAmount> mapBalanceCache;
+    mutable const CBlockIndex* pindexBalanceCache;
+    mutable unsigned int nBalanceCacheMempool;
+    mutable int64_t nBalanceCacheVersion;
+    mutable int nBalanceCacheRounds;
+    bool GetCachedBalance(int nType, CAmount& nBalanceRet) const;
+    void SetCachedBalance(int nType, CAmount nBalance) const;
+
+    // Outputs that could stake once old enough, valid until the best block,
+    // the index or -mininput changes, and the stake weight last computed
+    // from them, valid until the next of them comes of age
+    mutable std::vector<CStakeCandidate> vStakeCandidates;
+    mutable const CBlockIndex* pindexStakeCache;
+    mutable int64_t nStakeCacheVersion;
+    mutable CAmount nStakeCacheMinInput;
+    mutable uint64_t nStakeWeightCache;
+    mutable CAmount nStakeWeightTarget;
+    mutable int64_t nStakeWeightExpiry;
+    void UpdateStakeCandidates() const;
+
+    // Sandstorm rounds of each output of a wallet transaction (-4..100),
+    // filled in ancestors first and kept in the wallet file
+    typedef std::map<uint256, std::vector<signed char> > SandstormRoundsMap;
+    mutable SandstormRoundsMap mapSandstormRounds;
+    const std::vector<signed char>& GetSandstormRounds(std::map<uint256, CWalletTx>::const_iterator mi) const;
+    void InvalidateSandstormRounds(const uint256& hash);
+
+    int GetRealInputSandstormRounds(const COutPoint& outpoint) const;
 
 public:
     /// Main wallet lock.
@@ -163,6 +233,7 @@ public:
     unsigned int nMasterKeyMaxID;
 
     int GetInputSandstormRounds(CTxIn in) const;
+    void LoadSandstormRounds(const uint256& hash, const std::vector<signed char>& vRounds) { mapSandstormRounds[hash] = vRounds; }
 
     CWallet()
     {
@@ -187,6 +258,17 @@ public:
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        nUnspentVersion = 0;
+        pindexBalanceCache = NULL;
+        nBalanceCacheMempool = 0;
+        nBalanceCacheVersion = -1;
+        nBalanceCacheRounds = 0;
+        pindexStakeCache = NULL;
+        nStakeCacheVersion = -1;
+        nStakeCacheMinInput = 0;
+        nStakeWeightCache = 0;
+        nStakeWeightTarget = 0;
+        nStakeWeightExpiry = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -201,13 +283,15 @@ public:
 
     int64_t nTimeFirstKey;
 
+    CStakeSearchStats stakeSearchStats;
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;    
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
-    bool SelectCoinsMinConfByCoinAge(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConfByCoinAge(const CAmount& nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -267,10 +351,13 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
+    bool AddToWallet(const CWalletTx& wtxIn);
+    void LoadToWallet(const uint256& hash);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
+    void SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    void RebuildUnspentIndex();
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
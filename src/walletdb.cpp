@@ -76,6 +76,18 @@ bool CWalletDB::ReadStealthAddress(CStealthAddress& sxAddr)
     return Read(std::make_pair(std::string("sxAddr"), sxAddr.scan_pubkey), sxAddr);
 }
 
+bool CWalletDB::WriteSandstormRounds(const uint256& hash, const std::vector<signed char>& vRounds)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("ssrounds"), hash), vRounds);
+}
+
+bool CWalletDB::EraseSandstormRounds(const uint256& hash)
+{
+    nWalletDBUpdated++;
+    return Erase(std::make_pair(std::string("ssrounds"), hash));
+}
+
 bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta)
 {
     nWalletDBUpdated++;
@@ -342,13 +354,16 @@ public:
     unsigned int nKeyMeta;
     bool fIsEncrypted;
     bool fAnyUnordered;
+    bool fDeferKeyChecks;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    vector<pair<CKey, CPubKey> > vKeysToVerify;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = 0;
         fIsEncrypted = false;
         fAnyUnordered = false;
+        fDeferKeyChecks = false;
         nFileVersion = 0;
     }
 };
@@ -401,7 +416,7 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
 
-            pwallet->AddToWallet(wtx, true);
+            pwallet->LoadToWallet(hash);
 
             //// debug print
             //LogPrintf("LoadWallet  %s\n", wtx.GetHash().ToString());
@@ -421,6 +436,15 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             
             pwallet->stealthAddresses.insert(sxAddr);
         } 
+        else if (strType == "ssrounds")
+        {
+            uint256 hash;
+            ssKey >> hash;
+            std::vector<signed char> vRounds;
+            ssValue >> vRounds;
+
+            pwallet->LoadSandstormRounds(hash, vRounds);
+        }
         else if (strType == "acentry")
         {
             string strAccount;
@@ -486,6 +510,7 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             catch(...){}
 
             bool fSkipCheck = false;
+            bool fDeferCheck = false;
 
             if (hash != 0)
             {
@@ -503,12 +528,19 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
                 fSkipCheck = true;
             }
+            else if (wss.fDeferKeyChecks)
+            {
+                // Checked in parallel once the cursor is done, see LoadWallet()
+                fSkipCheck = fDeferCheck = true;
+            }
 
             if (!key.Load(pkey, vchPubKey, fSkipCheck))
             {
                 strErr = "Error reading wallet database: CPrivKey corrupt";
                 return false;
             }
+            if (fDeferCheck)
+                wss.vKeysToVerify.push_back(make_pair(key, vchPubKey));
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -630,8 +662,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
+    wss.fDeferKeyChecks = true;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    int64_t nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
 
     try {
         LOCK(pwallet->cs_wallet);
@@ -664,6 +699,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
+            nRecords++;
 
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
@@ -686,6 +722,18 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+
+        // Keys stored without a pubkey/privkey checksum
+        if (!wss.vKeysToVerify.empty())
+        {
+            int64_t nVerifyStart = GetTimeMillis();
+            if (!VerifyKeyPairs(wss.vKeysToVerify))
+            {
+                LogPrintf("Error reading wallet database: CPrivKey corrupt\n");
+                result = DB_CORRUPT;
+            }
+            LogPrint("db", "LoadWallet() : verified %u keys in %dms\n", wss.vKeysToVerify.size(), GetTimeMillis() - nVerifyStart);
+        }
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -693,6 +741,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     catch (...) {
         result = DB_CORRUPT;
     }
+    LogPrintf("LoadWallet() : %u records, %u transactions in %dms\n", nRecords, pwallet->mapWallet.size(), GetTimeMillis() - nStart);
 
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;